@@ -0,0 +1,16 @@
+#ifndef BASE_H
+#define BASE_H
+
+#define u8 unsigned char
+#define u16 unsigned short
+#define u32 unsigned int
+#define u64 unsigned long long
+#define s16 short
+#define s32 int
+#define s64 long long
+
+#define function static
+#define Assert(e) {if(!(e)) {*((void**)(0)) = 0;}}
+#define ArrayCount(arr) (sizeof(arr)/sizeof(arr[0]))
+
+#endif
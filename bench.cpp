@@ -0,0 +1,807 @@
+/*
+
+  Benchmarks for the image kernels and the frame pipeline stages, built
+  with optimizations next to headless (build.sh / build.bat) so a
+  performance change can be measured before it goes in.
+
+  usage: bench [-size 720p|1080p|1440p|4k|8k|all|WxH] [-threads N] [-time seconds]
+               [-filter text] [-out path]
+
+  -size    resolution(s) to run, default all of 720p .. 8K
+  -threads worker threads for the kernels that take a WorkQueue, 0 = one per core
+  -time    minimum measuring time per case (default 0.25 s, at least 3 runs)
+  -filter  only cases whose "bench/variant" contains text
+  -out     write the results to a file instead of stdout
+
+  Output is JSON lines, one object per case:
+
+    {"bench":"convert","variant":"swizzle","size":"1080p","width":1920,"height":1080,
+     "threads":8,"iterations":412,"median_ms":0.61,"min_ms":0.58,"gb_per_s":27.2,"frames_per_s":1639.3}
+
+  gb_per_s counts the bytes a case reads plus writes per run, frames_per_s
+  is runs per second (one run = one frame for every case). Both come from
+  the median run. The first line describes the machine.
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+
+#include "platform.cpp"
+#include "profiler.cpp"
+#include "work_queue.cpp"
+#include "image_processing.cpp"
+#include "frame_buffer_pool.cpp"
+#include "tile_diff.cpp"
+#include "frame_handoff.cpp"
+#include "tile_codec.cpp"
+#include "frame_recording.cpp"
+#include "frame_pacing.cpp"
+#include "frame_stats.cpp"
+#include "frame_ring.cpp"
+#include "image_export.cpp"
+#include "tile_pyramid.cpp"
+#include "frame_pipeline.cpp"
+#include "compositor.cpp"
+
+#define BENCH_MAX_RUNS 4096
+#define BENCH_STRIDE_PADDING 256 // like a D3D staging texture RowPitch
+
+struct BenchSize {
+    const char *name;
+    u32 width;
+    u32 height;
+};
+
+static BenchSize bench_sizes[] = {
+    { "720p",  1280,  720 },
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4k",    3840, 2160 },
+    { "8k",    7680, 4320 },
+};
+
+struct Bench {
+    FILE *out;
+    double min_time;
+    const char *filter;
+    WorkQueue *queue;
+    u32 threads;
+    BenchSize size;
+
+    // frame sized buffers, src has a padded stride
+    u8 *src;
+    u32 src_stride;
+    u8 *dst;
+    u64 frame_bytes; // width * height * 4
+
+    u32 flags;  // CONVERT_* for the convert cases, YUV_* or a stats step for others
+    void *data; // case specific
+    double runs[BENCH_MAX_RUNS];
+};
+
+typedef void BenchProc(Bench *bench);
+
+function int bench_compare_doubles(const void *a, const void *b)
+{
+    double x = *(double*)a, y = *(double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// time proc until min_time has passed and print one result line
+function void bench_run(Bench *bench, const char *name, const char *variant, u64 bytes_per_run, BenchProc *proc)
+{
+    if (bench->filter)
+    {
+        char full_name[128];
+        snprintf(full_name, sizeof(full_name), "%s/%s", name, variant);
+        if (!strstr(full_name, bench->filter))
+            return;
+    }
+
+    proc(bench); // warm up caches, page in buffers
+
+    u32 count = 0;
+    double total = 0;
+    while (count < BENCH_MAX_RUNS && (count < 3 || total < bench->min_time))
+    {
+        u64 begin = platform_time_ns();
+        proc(bench);
+        double seconds = (double)(platform_time_ns() - begin) * 1e-9;
+        bench->runs[count++] = seconds;
+        total += seconds;
+    }
+
+    qsort(bench->runs, count, sizeof(double), bench_compare_doubles);
+    double median = bench->runs[count / 2];
+    double fastest = bench->runs[0];
+
+    fprintf(bench->out,
+            "{\"bench\":\"%s\",\"variant\":\"%s\",\"size\":\"%s\",\"width\":%u,\"height\":%u,\"threads\":%u,"
+            "\"iterations\":%u,\"median_ms\":%.4f,\"min_ms\":%.4f,\"gb_per_s\":%.3f,\"frames_per_s\":%.1f}\n",
+            name, variant, bench->size.name, bench->size.width, bench->size.height, bench->threads,
+            count, median * 1000.0, fastest * 1000.0,
+            median > 0 ? (double)bytes_per_run / median * 1e-9 : 0.0,
+            median > 0 ? 1.0 / median : 0.0);
+    fflush(bench->out);
+}
+
+//
+// NOTE: kernels
+//
+
+function void bench_interpolated_image(Bench *bench)
+{
+    RGBA start = { 0xFF, 0x00, 0x00, 0xFF };
+    RGBA end = { 0x00, 0x00, 0xFF, 0xFF };
+    generate_interpolated_image(bench->size.width, bench->size.height, start, end, (RGBA*)bench->dst);
+}
+
+function void bench_gradient(Bench *bench)
+{
+    RGBA start = { 0xFF, 0x00, 0x00, 0xFF };
+    RGBA end = { 0x00, 0x00, 0xFF, 0xFF };
+    generate_gradient(bench->dst, bench->size.width, bench->size.height, bench->size.width * 4, start, end, bench->queue);
+}
+
+function void bench_test_pattern(Bench *bench)
+{
+    generate_test_pattern(bench->dst, bench->size.width, bench->size.height, bench->size.width * 4, 0, bench->queue);
+}
+
+function void bench_stbi_vertical_flip(Bench *bench)
+{
+    stbi__vertical_flip(bench->dst, bench->size.width, bench->size.height, 4);
+}
+
+function void bench_flip_in_place(Bench *bench)
+{
+    u32 stride = bench->size.width * 4;
+    convert_pixels(bench->dst, stride, bench->dst, stride, bench->size.width, bench->size.height, CONVERT_FLIP_Y);
+}
+
+function void bench_memcpy(Bench *bench)
+{
+    memcpy(bench->dst, bench->src, bench->frame_bytes);
+}
+
+function void bench_strided_copy(Bench *bench)
+{
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    FrameView dst = frame_view(bench->dst, bench->size.width, bench->size.height, bench->size.width * 4, PIXEL_FORMAT_BGRA8);
+    frame_view_copy(&dst, &src, 0);
+}
+
+// out of place from the padded source, like the copy out of a staging texture
+function void bench_convert(Bench *bench)
+{
+    convert_pixels(bench->dst, bench->size.width * 4, bench->src, bench->src_stride,
+                   bench->size.width, bench->size.height, bench->flags);
+}
+
+struct BenchTileDiff {
+    TileDiff diff;
+    u8 *frames[2];
+    u32 next;
+};
+
+function void bench_tile_diff(Bench *bench)
+{
+    BenchTileDiff *data = (BenchTileDiff*)bench->data;
+    u8 *frame = data->frames[data->next];
+    data->next ^= data->frames[0] != data->frames[1];
+    tile_diff_update(&data->diff, frame, bench->size.width, bench->size.height, bench->src_stride);
+}
+
+//
+// NOTE: the work queue itself, rows of the frame without any work in them
+//
+
+function void bench_work_rows(void *data, u32 begin, u32 end)
+{
+}
+
+// splitting the rows across the queue and waiting for them
+function void bench_work_overhead(Bench *bench)
+{
+    u32 rows = bench->size.height;
+    parallel_for(bench->queue, rows, parallel_row_grain(bench->queue, rows), bench_work_rows, 0);
+}
+
+// four passes that each wait for the one before, submitted up front
+function void bench_work_chain(Bench *bench)
+{
+    u32 rows = bench->size.height;
+    WorkJob jobs[4];
+    for (u32 i = 0; i < ArrayCount(jobs); ++i)
+    {
+        WorkJob *before = i ? &jobs[i - 1] : 0;
+        work_submit(bench->queue, &jobs[i], rows, parallel_row_grain(bench->queue, rows), bench_work_rows, 0, &before, 1);
+    }
+    work_wait(bench->queue, &jobs[ArrayCount(jobs) - 1]);
+}
+
+struct BenchDownscale {
+    FrameView dst;
+    u8 *scratch;
+    u32 flags;
+};
+
+// the padded source fitted to a smaller window
+function void bench_downscale(Bench *bench)
+{
+    BenchDownscale *data = (BenchDownscale*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    downscale(&data->dst, &src, data->scratch, data->flags, bench->queue);
+}
+
+struct BenchFilterGraph {
+    FrameRect crop;
+    FrameView dst;
+    u32 flags;   // CONVERT_*
+    FrameView scaled; // separate passes: the downscaled frame before the conversion
+    u8 *scratch;
+    FilterGraph graph;
+};
+
+// crop, downscale, then convert in its own pass, as the pipeline did before the graph
+function void bench_filter_separate(Bench *bench)
+{
+    BenchFilterGraph *data = (BenchFilterGraph*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    src = frame_view_sub(src, data->crop);
+    downscale(&data->scaled, &src, data->scratch, 0, bench->queue);
+    frame_view_copy(&data->dst, &data->scaled, data->flags);
+}
+
+function void bench_filter_fused(Bench *bench)
+{
+    BenchFilterGraph *data = (BenchFilterGraph*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    filter_graph_run(&data->graph, &data->dst, &src, bench->queue);
+}
+
+struct BenchBlur {
+    FrameView dst;
+    u8 *scratch;
+    u32 radius;
+    u32 flags;   // BLUR_*
+    u32 amount;  // sharpen instead of blur when set
+    FrameRect rects[4];
+    u32 rect_count; // in place on dst instead when set
+};
+
+function void bench_blur(Bench *bench)
+{
+    BenchBlur *data = (BenchBlur*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    if (data->rect_count)
+        blur_rects(&data->dst, data->rects, data->rect_count, data->scratch, data->radius, data->flags, bench->queue);
+    else if (data->amount)
+        sharpen(&data->dst, &src, data->radius, data->amount, 2, bench->queue);
+    else
+        blur(&data->dst, &src, data->scratch, data->radius, data->flags, bench->queue);
+}
+
+// histograms + fingerprint of the padded source, every bench->flags-th pixel and row
+function void bench_frame_stats(Bench *bench)
+{
+    FrameStats *stats = (FrameStats*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    frame_stats_compute(stats, &src, bench->flags, bench->queue);
+}
+
+// the padded source into planar YUV, bench->flags are YUV_*
+function void bench_yuv(Bench *bench)
+{
+    YuvImage *image = (YuvImage*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    yuv_convert(image, &src, bench->flags, bench->queue);
+}
+
+// the padded source into the next slot of a shared frame ring, nobody reading
+function void bench_frame_ring(Bench *bench)
+{
+    FrameRing *ring = (FrameRing*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    frame_ring_publish(ring, &src, false, 0);
+}
+
+// the padded source to an in-memory image file, bench->flags are IMAGE_EXPORT_*
+function void bench_image_export(Bench *bench)
+{
+    ImageFileFormat format = *(ImageFileFormat*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    ImageEncoding encoding = {};
+    image_encode(&encoding, format, &src, bench->flags, bench->queue);
+    image_encoding_free(&encoding);
+}
+
+struct BenchPyramid {
+    TilePyramid pyramid;
+    FrameRect rects[16]; // dirty, 0 rects = the whole image
+    u32 rect_count;
+};
+
+// the padded source into the viewer's tile pyramid (top-down already)
+function void bench_tile_pyramid(Bench *bench)
+{
+    BenchPyramid *pyramid = (BenchPyramid*)bench->data;
+    FrameView src = frame_view(bench->src, bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    tile_pyramid_update(&pyramid->pyramid, &src, true, pyramid->rect_count ? pyramid->rects : 0, pyramid->rect_count, bench->queue);
+}
+
+// every row of the padded source to 16 bit linear light and back, single thread
+function void bench_srgb_round_trip(Bench *bench)
+{
+    u16 *linear = (u16*)bench->data;
+    for (u32 y = 0; y < bench->size.height; ++y)
+    {
+        srgb_to_linear_row(linear, bench->src + (u64)y * bench->src_stride, bench->size.width);
+        linear_to_srgb_row(bench->dst + (u64)y * bench->size.width * 4, linear, bench->size.width);
+    }
+}
+
+struct BenchTileCodec {
+    TileEncoder encoder;
+    TileDecoder decoder;
+    u8 *frames[2];
+    u32 next;
+    u8 *encoded; // a keyframe of frames[0] for the decode case
+    u64 encoded_size;
+};
+
+function void bench_tile_encode(Bench *bench)
+{
+    BenchTileCodec *data = (BenchTileCodec*)bench->data;
+    FrameView view = frame_view(data->frames[data->next], bench->size.width, bench->size.height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    data->next ^= data->frames[0] != data->frames[1];
+    tile_encoder_encode(&data->encoder, &view, false);
+}
+
+function void bench_tile_decode(Bench *bench)
+{
+    BenchTileCodec *data = (BenchTileCodec*)bench->data;
+    tile_decoder_decode(&data->decoder, data->encoded, data->encoded_size);
+}
+
+//
+// NOTE: the whole frame loop, synthetic source -> offscreen sink like headless
+//
+
+struct BenchPipeline {
+    SyntheticSource synth;
+    FrameSource source;
+    OffscreenSink offscreen;
+    FrameSink sink;
+    FrameBufferPool pool;
+    FramePipeline pipeline;
+};
+
+function void bench_pipeline_step(Bench *bench)
+{
+    BenchPipeline *data = (BenchPipeline*)bench->data;
+    frame_pipeline_step(&data->pipeline);
+}
+
+function void bench_pipeline(Bench *bench, const char *variant, bool zero_copy, bool diff, bool mostly_static, u32 convert_flags)
+{
+    BenchPipeline *data = new BenchPipeline();
+    data->sink = offscreen_sink(&data->offscreen);
+    data->synth.queue = bench->queue;
+    data->synth.mostly_static = mostly_static;
+    data->source = synthetic_source(&data->synth, bench->size.width, bench->size.height);
+
+    frame_pipeline_init(&data->pipeline, &data->sink, &data->pool);
+    data->pipeline.zero_copy = zero_copy;
+    data->pipeline.tile_diff_enabled = diff;
+    data->pipeline.convert_flags = convert_flags;
+    data->pipeline.sources[TEST_IMAGE_CAPTURE_DX] = &data->source;
+    frame_pipeline_set_source(&data->pipeline, TEST_IMAGE_CAPTURE_DX);
+
+    // generate + read + upload of a full frame; with diff only what the
+    // frame loop really moves is known afterwards, count the full frame
+    bench->data = data;
+    bench_run(bench, "pipeline", variant, bench->frame_bytes * 3, bench_pipeline_step);
+
+    frame_pipeline_destroy(&data->pipeline);
+    frame_buffer_pool_destroy(&data->pool);
+    free(data->offscreen.pixels);
+    delete data;
+}
+
+struct BenchCompositor {
+    SyntheticSource synths[COMPOSITOR_MAX_LAYERS];
+    FrameSource sources[COMPOSITOR_MAX_LAYERS];
+    Compositor compositor;
+    FrameSource source;
+};
+
+function void bench_compositor_acquire(Bench *bench)
+{
+    BenchCompositor *data = (BenchCompositor*)bench->data;
+    Frame frame = {};
+    data->source.allow_borrow = true;
+    data->source.acquire(&data->source, &frame, 0, 0);
+}
+
+// columns x rows layers tiling a canvas of the bench size, like that many
+// monitors; pip adds a quarter size layer on top of the first
+function void bench_compositor(Bench *bench, const char *variant, u32 columns, u32 rows, bool pip)
+{
+    BenchCompositor *data = new BenchCompositor();
+    u32 width = bench->size.width / columns, height = bench->size.height / rows;
+    for (u32 i = 0; i < columns * rows; ++i)
+    {
+        data->sources[i] = synthetic_source(&data->synths[i], width, height);
+        compositor_add_layer(&data->compositor, &data->sources[i], (s32)((i % columns) * width), (s32)((i / columns) * height), width, height);
+    }
+    if (pip)
+    {
+        u32 i = columns * rows;
+        data->sources[i] = synthetic_source(&data->synths[i], width / 4, height / 4);
+        compositor_add_layer(&data->compositor, &data->sources[i], (s32)(width / 32), (s32)(height / 32), width / 4, height / 4);
+    }
+    data->source = compositor_source(&data->compositor);
+
+    // every layer generates its frame and blits it into the canvas
+    bench->data = data;
+    bench_run(bench, "compositor", variant, bench->frame_bytes * 2, bench_compositor_acquire);
+
+    if (data->source.end)
+        data->source.end(&data->source);
+    compositor_destroy(&data->compositor);
+    delete data;
+}
+
+function void bench_size(Bench *bench)
+{
+    u32 width = bench->size.width, height = bench->size.height;
+    u64 frame = (u64)width * height * 4;
+    bench->frame_bytes = frame;
+    bench->src_stride = width * 4 + BENCH_STRIDE_PADDING;
+
+    u64 src_size = 0, dst_size = 0, other_size = 0;
+    bench->src = (u8*)platform_alloc_pages((u64)bench->src_stride * height, false, &src_size);
+    bench->dst = (u8*)platform_alloc_pages(frame, false, &dst_size);
+    u8 *other = (u8*)platform_alloc_pages((u64)bench->src_stride * height, false, &other_size);
+    if (!bench->src || !bench->dst || !other)
+    {
+        printf("Error: not enough memory for %s.\n", bench->size.name);
+        platform_free_pages(bench->src, src_size);
+        platform_free_pages(bench->dst, dst_size);
+        platform_free_pages(other, other_size);
+        return;
+    }
+    generate_test_pattern(bench->src, width, height, bench->src_stride, 0, bench->queue);
+    generate_test_pattern(other, width, height, bench->src_stride, 1, bench->queue);
+    generate_test_pattern(bench->dst, width, height, width * 4, 0, bench->queue);
+
+    bench_run(bench, "generate_interpolated_image", "single_thread", frame, bench_interpolated_image);
+    bench_run(bench, "gradient", "parallel", frame, bench_gradient);
+    bench_run(bench, "test_pattern", "parallel", frame, bench_test_pattern);
+
+    bench_run(bench, "vertical_flip", "stbi", frame * 2, bench_stbi_vertical_flip);
+    bench_run(bench, "vertical_flip", "convert_in_place", frame * 2, bench_flip_in_place);
+
+    bench_run(bench, "copy", "memcpy", frame * 2, bench_memcpy);
+    bench_run(bench, "copy", "strided", frame * 2, bench_strided_copy);
+
+    struct { const char *variant; u32 flags; } converts[] = {
+        { "swizzle", CONVERT_SWIZZLE_RB },
+        { "opaque", CONVERT_FORCE_OPAQUE },
+        { "flip", CONVERT_FLIP_Y },
+        { "swizzle_flip_opaque", CONVERT_SWIZZLE_RB | CONVERT_FLIP_Y | CONVERT_FORCE_OPAQUE },
+    };
+    for (u32 i = 0; i < ArrayCount(converts); ++i)
+    {
+        bench->flags = converts[i].flags;
+        bench_run(bench, "convert", converts[i].variant, frame * 2, bench_convert);
+    }
+
+    // unchanged frames read both copies, changing frames also copy every tile
+    BenchTileDiff diff = {};
+    diff.diff.queue = bench->queue;
+    diff.frames[0] = bench->src;
+    diff.frames[1] = bench->src;
+    bench->data = &diff;
+    bench_run(bench, "tile_diff", "static", frame * 2, bench_tile_diff);
+    diff.frames[1] = other;
+    bench_run(bench, "tile_diff", "changing", frame * 3, bench_tile_diff);
+    tile_diff_destroy(&diff.diff);
+
+    bench_run(bench, "work_queue", "overhead", 0, bench_work_overhead);
+    bench_run(bench, "work_queue", "chain4", 0, bench_work_chain);
+
+    // half size is a 2x2 box, a third 3x3, 1080x780 (the default window) box + bilinear
+    struct { const char *variant; u32 width, height, flags; } scales[] = {
+        { "area_half", width / 2, height / 2, 0 },
+        { "area_third", width / 3, height / 3, 0 },
+        { "bilinear_window", 1080, 780, 0 },
+        { "area_half_linear", width / 2, height / 2, DOWNSCALE_LINEAR },
+        { "bilinear_window_linear", 1080, 780, DOWNSCALE_LINEAR },
+    };
+    for (u32 i = 0; i < ArrayCount(scales); ++i)
+    {
+        if (scales[i].width > width || scales[i].height > height || !scales[i].width || !scales[i].height)
+            continue;
+        BenchDownscale scale = {};
+        scale.flags = scales[i].flags;
+        scale.dst = frame_view(bench->dst, scales[i].width, scales[i].height, scales[i].width * 4, PIXEL_FORMAT_BGRA8);
+        FrameView src = frame_view(bench->src, width, height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+        scale.scratch = (u8*)malloc(downscale_scratch_size(&scale.dst, &src, scale.flags) + 1);
+        bench->data = &scale;
+        bench_run(bench, "downscale", scales[i].variant, frame + (u64)scales[i].width * scales[i].height * 4, bench_downscale);
+        free(scale.scratch);
+    }
+
+    // downscale + convert as two passes and as one banded filter graph pass
+    struct { const char *variant; FrameRect crop; u32 width, height, flags; } filters[] = {
+        { "half_swizzle_flip", {}, width / 2, height / 2, CONVERT_SWIZZLE_RB | CONVERT_FLIP_Y },
+        { "window_swizzle_flip", {}, 1080, 780, CONVERT_SWIZZLE_RB | CONVERT_FLIP_Y },
+        { "crop_window_swizzle", { width / 8, height / 8, width * 3 / 4, height * 3 / 4 }, 1080, 780, CONVERT_SWIZZLE_RB },
+    };
+    for (u32 i = 0; i < ArrayCount(filters); ++i)
+    {
+        FrameView src = frame_view(bench->src, width, height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+        FrameView cropped = frame_view_sub(src, filters[i].crop);
+        u32 out_width = filters[i].width, out_height = filters[i].height;
+        if (out_width > cropped.width || out_height > cropped.height || !out_width || !out_height)
+            continue;
+
+        BenchFilterGraph filter = {};
+        filter.crop = filters[i].crop;
+        filter.flags = filters[i].flags;
+        filter.dst = frame_view(bench->dst, out_width, out_height, out_width * 4, PIXEL_FORMAT_BGRA8);
+        filter.scaled = frame_view((u8*)malloc((u64)out_width * out_height * 4), out_width, out_height, out_width * 4, PIXEL_FORMAT_BGRA8);
+        filter.scratch = (u8*)malloc(downscale_scratch_size(&filter.scaled, &cropped, 0) + 1);
+        filter_graph_begin(&filter.graph, width, height, PIXEL_FORMAT_BGRA8);
+        filter_graph_crop(&filter.graph, filter.crop);
+        filter_graph_scale(&filter.graph, out_width, out_height);
+        filter_graph_convert(&filter.graph, filter.flags);
+
+        char variant[64];
+        u64 bytes = (u64)cropped.width * cropped.height * 4 + (u64)out_width * out_height * 4;
+        bench->data = &filter;
+        snprintf(variant, sizeof(variant), "%s_separate", filters[i].variant);
+        bench_run(bench, "filter_graph", variant, bytes, bench_filter_separate);
+        snprintf(variant, sizeof(variant), "%s_fused", filters[i].variant);
+        bench_run(bench, "filter_graph", variant, bytes, bench_filter_fused);
+
+        filter_graph_destroy(&filter.graph);
+        free(filter.scaled.pixels);
+        free(filter.scratch);
+    }
+
+    // Gaussian taps grow with the radius, box passes do not
+    struct { const char *variant; u32 radius, flags, amount, rects; } blurs[] = {
+        { "gaussian_r2", 2, 0, 0, 0 },
+        { "gaussian_r8", 8, 0, 0, 0 },
+        { "gaussian_r16_boxes", 16, 0, 0, 0 },
+        { "gaussian_r48_boxes", 48, 0, 0, 0 },
+        { "box_r32", 32, BLUR_BOX, 0, 0 },
+        { "sharpen_r2", 2, 0, 384, 0 },
+        { "rects_r8", 8, 0, 0, 4 },
+    };
+    for (u32 i = 0; i < ArrayCount(blurs); ++i)
+    {
+        BenchBlur blurring = {};
+        blurring.radius = blurs[i].radius;
+        blurring.flags = blurs[i].flags;
+        blurring.amount = blurs[i].amount;
+        blurring.dst = frame_view(bench->dst, width, height, width * 4, PIXEL_FORMAT_BGRA8);
+        FrameView src = frame_view(bench->src, width, height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+        u64 scratch = blur_scratch_size(&src, blurring.radius, blurring.flags);
+        u64 bytes = frame * 2;
+        if (blurs[i].rects)
+        {
+            // four windows of a 4x4 grid, a quarter of the frame
+            blurring.rect_count = blurs[i].rects;
+            for (u32 r = 0; r < blurring.rect_count; ++r)
+            {
+                FrameRect rect = { (r % 2) * width / 2 + width / 8, (r / 2) * height / 2 + height / 8, width / 4, height / 4 };
+                blurring.rects[r] = rect;
+            }
+            scratch = blur_rects_scratch_size(&blurring.dst, blurring.rects, blurring.rect_count, blurring.radius, blurring.flags);
+            frame_view_copy(&blurring.dst, &src, 0);
+            bytes = frame / 2;
+        }
+        blurring.scratch = (u8*)malloc(scratch + 1);
+        bench->data = &blurring;
+        bench_run(bench, "blur", blurs[i].variant, bytes, bench_blur);
+        free(blurring.scratch);
+    }
+
+    // health stats on every pixel, and on the 1/16 sample main.exe uses
+    FrameStats *stats = (FrameStats*)malloc(sizeof(FrameStats));
+    bench->data = stats;
+    bench->flags = 1;
+    bench_run(bench, "frame_stats", "full", frame, bench_frame_stats);
+    bench->flags = 4;
+    bench_run(bench, "frame_stats", "step4", frame / 16, bench_frame_stats);
+    free(stats);
+
+    // the one copy per frame that hands it to other processes, few slots so they stay faulted in
+    FrameRing ring;
+    if (frame_ring_create(&ring, "opengl_template_bench", 3, frame))
+    {
+        ring.queue = bench->queue;
+        bench->data = &ring;
+        bench_run(bench, "frame_ring", "publish", frame * 2, bench_frame_ring);
+        frame_ring_close(&ring);
+    }
+
+    // snapshots as F8 writes them, without the disk
+    ImageFileFormat formats[] = { IMAGE_FILE_QOI, IMAGE_FILE_PNG };
+    const char *format_names[] = { "qoi", "png" };
+    for (u32 i = 0; i < ArrayCount(formats); ++i)
+    {
+        bench->data = &formats[i];
+        bench->flags = IMAGE_EXPORT_OPAQUE;
+        bench_run(bench, "image_export", format_names[i], frame, bench_image_export);
+    }
+
+    // the large image viewer: every level of a new image, then a few changed tiles
+    BenchPyramid *pyramid = (BenchPyramid*)calloc(1, sizeof(BenchPyramid));
+    bench->data = pyramid;
+    bench_run(bench, "tile_pyramid", "build", frame + frame / 3, bench_tile_pyramid);
+    for (u32 i = 0; i < ArrayCount(pyramid->rects); ++i)
+    {
+        FrameRect rect = { (i * 613) % (width - 64), (i * 347) % (height - 64), 64, 64 };
+        pyramid->rects[i] = rect;
+    }
+    pyramid->rect_count = ArrayCount(pyramid->rects);
+    bench_run(bench, "tile_pyramid", "dirty16", (u64)pyramid->rect_count * 64 * 64 * 4, bench_tile_pyramid);
+    tile_pyramid_destroy(&pyramid->pyramid);
+    free(pyramid);
+
+    u16 *linear_row = (u16*)malloc((u64)width * 4 * sizeof(u16));
+    bench->data = linear_row;
+    bench_run(bench, "srgb", "round_trip", frame * 2, bench_srgb_round_trip);
+    free(linear_row);
+
+    // encoder feeds: reads the frame once, writes 1.5 bytes per pixel
+    struct { const char *variant; YuvLayout layout; u32 flags; } yuvs[] = {
+        { "nv12_bt601", YUV_NV12, 0 },
+        { "i420_bt709_full_flip", YUV_I420, YUV_BT709 | YUV_FULL_RANGE | YUV_FLIP_Y },
+    };
+    for (u32 i = 0; i < ArrayCount(yuvs); ++i)
+    {
+        YuvImage image = yuv_image(bench->dst, yuvs[i].layout, width, height);
+        bench->data = &image;
+        bench->flags = yuvs[i].flags;
+        bench_run(bench, "yuv", yuvs[i].variant, frame + yuv_image_size(width, height), bench_yuv);
+    }
+
+    // the recording codec on the same frames, keyframes only on the first run
+    BenchTileCodec codec = {};
+    codec.encoder.keyframe_interval = ~0u;
+    codec.encoder.queue = bench->queue;
+    codec.decoder.queue = bench->queue;
+    codec.frames[0] = bench->src;
+    codec.frames[1] = bench->src;
+    bench->data = &codec;
+    bench_run(bench, "tile_codec", "encode_static", frame * 2, bench_tile_encode);
+    codec.frames[1] = other;
+    bench_run(bench, "tile_codec", "encode_changing", frame * 3, bench_tile_encode);
+
+    FrameView key = frame_view(bench->src, width, height, bench->src_stride, PIXEL_FORMAT_BGRA8);
+    if (tile_encoder_encode(&codec.encoder, &key, true))
+    {
+        codec.encoded_size = codec.encoder.output_size;
+        codec.encoded = (u8*)malloc(codec.encoded_size);
+        memcpy(codec.encoded, codec.encoder.output, codec.encoded_size);
+        bench_run(bench, "tile_codec", "decode_keyframe", frame + codec.encoded_size, bench_tile_decode);
+        free(codec.encoded);
+    }
+    tile_encoder_destroy(&codec.encoder);
+    tile_decoder_destroy(&codec.decoder);
+
+    bench_pipeline(bench, "zero_copy", true, false, false, 0);
+    bench_pipeline(bench, "copy", false, false, false, 0);
+    bench_pipeline(bench, "copy_swizzle_flip", false, false, false, CONVERT_SWIZZLE_RB | CONVERT_FLIP_Y);
+    bench_pipeline(bench, "diff_static", true, true, true, 0);
+
+    bench_compositor(bench, "side_by_side_2", 2, 1, false);
+    bench_compositor(bench, "grid_4", 2, 2, false);
+    bench_compositor(bench, "grid_6", 3, 2, false);
+    bench_compositor(bench, "pip", 1, 1, true);
+
+    platform_free_pages(bench->src, src_size);
+    platform_free_pages(bench->dst, dst_size);
+    platform_free_pages(other, other_size);
+    bench->src = 0;
+    bench->dst = 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *size = "all";
+    const char *out_path = 0;
+    Bench *bench = (Bench*)calloc(1, sizeof(Bench));
+    bench->min_time = 0.25;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        char *arg = argv[i];
+        char *value = (i + 1 < argc) ? argv[i + 1] : 0;
+        if (!value)
+        {
+            printf("Error: missing value for %s.\n", arg);
+            return 1;
+        }
+
+        if (strcmp(arg, "-size") == 0)
+            size = value;
+        else if (strcmp(arg, "-threads") == 0)
+            bench->threads = (u32)atoi(value);
+        else if (strcmp(arg, "-time") == 0)
+            bench->min_time = atof(value);
+        else if (strcmp(arg, "-filter") == 0)
+            bench->filter = value;
+        else if (strcmp(arg, "-out") == 0)
+            out_path = value;
+        else
+        {
+            printf("Error: unknown option %s.\n", arg);
+            printf("usage: bench [-size 720p|1080p|1440p|4k|8k|all|WxH] [-threads N] [-time seconds] [-filter text] [-out path]\n");
+            return 1;
+        }
+        ++i;
+    }
+
+    bench->out = stdout;
+    if (out_path)
+    {
+        bench->out = fopen(out_path, "wb");
+        if (!bench->out)
+        {
+            printf("Error: failed to open %s.\n", out_path);
+            return 1;
+        }
+    }
+
+    WorkQueue queue;
+    work_queue_init(&queue, bench->threads);
+    bench->queue = &queue;
+    bench->threads = queue.thread_count + 1;
+
+#if IMAGE_AVX2
+    const char *simd = "avx2";
+#elif IMAGE_SSE2
+    const char *simd = "sse2";
+#else
+    const char *simd = "scalar";
+#endif
+    fprintf(bench->out, "{\"bench\":\"system\",\"cpus\":%u,\"threads\":%u,\"simd\":\"%s\"}\n",
+            platform_cpu_count(), bench->threads, simd);
+
+    BenchSize custom = { "custom" };
+    if (sscanf(size, "%ux%u", &custom.width, &custom.height) == 2)
+    {
+        bench->size = custom;
+        bench_size(bench);
+    }
+    else
+    {
+        bool found = false;
+        for (u32 i = 0; i < ArrayCount(bench_sizes); ++i)
+        {
+            if (strcmp(size, "all") != 0 && strcmp(size, bench_sizes[i].name) != 0)
+                continue;
+            found = true;
+            bench->size = bench_sizes[i];
+            bench_size(bench);
+        }
+        if (!found)
+            printf("Error: unknown size %s.\n", size);
+    }
+
+    work_queue_destroy(&queue);
+    if (bench->out != stdout)
+        fclose(bench->out);
+    free(bench);
+    return 0;
+}
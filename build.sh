@@ -0,0 +1,21 @@
+#!/bin/sh
+
+COMMON_FLAGS="-O2 -g -Wall -Wno-unused-function -Wno-unused-variable -Wno-unused-but-set-variable -std=c++11"
+# ./build.sh tsan builds with ThreadSanitizer (e.g. for headless -stress_handoff)
+if [ "$1" = "tsan" ]; then
+    COMMON_FLAGS="$COMMON_FLAGS -fsanitize=thread"
+fi
+# ./build.sh avx2 enables the AVX2 kernel paths (e.g. to compare them in bench)
+if [ "$1" = "avx2" ]; then
+    COMMON_FLAGS="$COMMON_FLAGS -mavx2"
+fi
+
+BUILD_FLAGS="$COMMON_FLAGS -lpthread"
+HEADLESS_FLAGS="$BUILD_FLAGS"
+# ./build.sh gl adds headless -sink gl (opengl_sink.cpp on EGL, needs the Mesa EGL/GL dev packages)
+if [ "$1" = "gl" ]; then
+    HEADLESS_FLAGS="$HEADLESS_FLAGS -DHEADLESS_GL=1 -lEGL -lGL"
+fi
+
+g++ headless.cpp -o headless $HEADLESS_FLAGS
+g++ bench.cpp -o bench $BUILD_FLAGS
@@ -0,0 +1,543 @@
+/*
+
+  Compositor
+  ----------
+  N frame sources assembled into one canvas: the monitors of a multi
+  monitor desktop side by side, or a picture-in-picture layer on top of
+  another source. Layers are placed in desktop coordinates (the
+  DXGI_OUTPUT_DESC::DesktopCoordinates of a monitor, may be negative);
+  the canvas is their bounding box, uncovered parts stay black.
+
+  Every layer has its own worker thread that acquires from its source and
+  copies the frame into its rectangle of the canvas, so the captures and
+  blits of all layers run in parallel. Layers that overlap one drawn
+  before them (a picture-in-picture) wait for that blit first, later
+  layers are on top. Such a layer keeps a copy of its last frame and blits
+  it again whenever a layer below it drew, so a still picture stays on top
+  of a live one. A source bigger than its rectangle is downscaled to
+  fit, a smaller one is drawn at the top-left. Like on the capture
+  thread, a layer's source begin/end run on its worker too.
+
+  A composition does not wait for the slowest layer: an idle monitor's
+  acquire blocks until its timeout. Once a layer had a new frame, the
+  layers whose acquire began with this composition get COMPOSITOR_GRACE_MS
+  more (monitors refresh at about the same time), the ones still inside
+  an acquire of an earlier composition none. Those are late; what
+  they last drew stays (blitted again from the retained copy by the
+  compositor if a layer below covered it) and the frame they come back
+  with waits for the next composition.
+
+  The compositor itself is a FrameSource. A composition without any new
+  layer frame is no new frame; layers without a new frame keep what they
+  last drew.
+
+ */
+
+#define COMPOSITOR_MAX_LAYERS 8
+#define COMPOSITOR_PITCH_ALIGN 64
+#define COMPOSITOR_GRACE_MS 4 // ms the other layers get after the first new frame
+
+struct Compositor;
+
+struct CompositorLayer {
+    FrameSource *source;
+    s32 x; // placement in desktop coordinates
+    s32 y;
+    u32 width;
+    u32 height;
+
+    Compositor *compositor;
+    u32 index;
+    char name[16]; // worker thread name for the profiler
+    PlatformThread thread;
+
+    FrameRect rect; // placement in the canvas
+    u8 *buffer;     // the source copies here when it does not lend
+    u64 buffer_size;
+    u8 *scaled;     // a frame bigger than rect, fitted
+    u64 scaled_size;
+    bool overlapped; // a layer below overlaps, the last frame is retained
+    u8 *retained;    // overlapped: the last blit, canvas format, top-down
+    u64 retained_size;
+    u32 retained_width; // 0 = nothing retained yet
+    u32 retained_height;
+
+    Frame frame;    // acquired, waiting for its blit
+    FrameView view; // of frame, fitted
+    bool pending;   // frame is there
+
+    // under the compositor mutex
+    u64 acquiring; // generation whose acquire the layer is inside, 0 = none
+    u64 claimed;   // generation the layer blits in, it came back from acquire in time
+    u64 drawn;     // generation whose blit is done
+    bool painted;  // blitted in generation drawn
+    bool updated;  // had a new frame in the last generation
+
+    u64 frames;
+    u64 late;            // frames that came back after their composition closed
+    double acquire_time; // summed, acquire + fit + blit seconds
+};
+
+struct Compositor {
+    CompositorLayer layers[COMPOSITOR_MAX_LAYERS];
+    u32 layer_count;
+
+    PixelFormat format; // of the canvas, layers of the other format are swizzled
+    s32 origin_x;       // desktop coordinates of the canvas' top-left
+    s32 origin_y;
+    u8 *canvas;         // top-down
+    u32 width;
+    u32 height;
+    u32 stride;
+
+    std::mutex mutex;
+    std::condition_variable wake; // a new generation, a layer drawn, or quit
+    std::condition_variable done; // all layers finished the generation
+    u64 generation;
+    u64 closed;  // generation whose late layers were given up on
+    u32 finished;
+    bool fresh;  // a layer had a new frame in this generation
+    bool quit;
+    bool running;
+
+    u64 compositions;
+};
+
+// add a layer on top of the others, before the compositor source begins
+function bool compositor_add_layer(Compositor *compositor, FrameSource *source, s32 x, s32 y, u32 width, u32 height)
+{
+    if (compositor->layer_count >= COMPOSITOR_MAX_LAYERS || !width || !height)
+    {
+        printf("Error: compositor layer %u not added (at most %u, sizes must not be 0).\n",
+               compositor->layer_count, COMPOSITOR_MAX_LAYERS);
+        return false;
+    }
+    CompositorLayer *layer = &compositor->layers[compositor->layer_count];
+    layer->source = source;
+    layer->x = x;
+    layer->y = y;
+    layer->width = width;
+    layer->height = height;
+    layer->compositor = compositor;
+    layer->index = compositor->layer_count++;
+    snprintf(layer->name, sizeof(layer->name), "layer %u", layer->index);
+    return true;
+}
+
+function bool compositor_rects_overlap(FrameRect a, FrameRect b)
+{
+    return a.x < b.x + b.width && b.x < a.x + a.width &&
+           a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+// canvas = bounding box of the placements
+function bool compositor_layout(Compositor *compositor)
+{
+    s32 left = 0, top = 0;
+    s64 right = 0, bottom = 0;
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+    {
+        CompositorLayer *layer = &compositor->layers[i];
+        if (i == 0 || layer->x < left)
+            left = layer->x;
+        if (i == 0 || layer->y < top)
+            top = layer->y;
+        if (i == 0 || (s64)layer->x + layer->width > right)
+            right = (s64)layer->x + layer->width;
+        if (i == 0 || (s64)layer->y + layer->height > bottom)
+            bottom = (s64)layer->y + layer->height;
+    }
+    if (!compositor->layer_count)
+        return false;
+
+    compositor->origin_x = left;
+    compositor->origin_y = top;
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+    {
+        CompositorLayer *layer = &compositor->layers[i];
+        layer->rect.x = (u32)(layer->x - left);
+        layer->rect.y = (u32)(layer->y - top);
+        layer->rect.width = layer->width;
+        layer->rect.height = layer->height;
+        layer->overlapped = false;
+        for (u32 j = 0; j < i; ++j)
+            layer->overlapped |= compositor_rects_overlap(compositor->layers[j].rect, layer->rect);
+    }
+
+    u32 width = (u32)(right - left), height = (u32)(bottom - top);
+    u32 stride = (width * 4 + COMPOSITOR_PITCH_ALIGN - 1) & ~(COMPOSITOR_PITCH_ALIGN - 1);
+    if (!compositor->canvas || compositor->width != width || compositor->height != height)
+    {
+        free(compositor->canvas);
+        compositor->canvas = (u8*)malloc((u64)stride * height);
+        if (!compositor->canvas)
+        {
+            printf("Error: out of memory for the %ux%u compositor canvas.\n", width, height);
+            return false;
+        }
+        compositor->width = width;
+        compositor->height = height;
+        compositor->stride = stride;
+    }
+
+    // opaque black where no layer draws
+    for (u32 y = 0; y < height; ++y)
+    {
+        u32 *row = (u32*)(compositor->canvas + (u64)y * stride);
+        for (u32 x = 0; x < width; ++x)
+            row[x] = 0xFF000000;
+    }
+    return true;
+}
+
+function bool compositor_layer_grow(u8 **memory, u64 *size, u64 required)
+{
+    if (*size >= required)
+        return true;
+    free(*memory);
+    *memory = (u8*)malloc(required);
+    *size = *memory ? required : 0;
+    return *memory != 0;
+}
+
+// acquire and fit one layer's next frame, on its worker
+function void compositor_layer_acquire(CompositorLayer *layer)
+{
+    FrameSource *source = layer->source;
+
+    PerfCounter perf = {};
+    perf.begin();
+
+    source->allow_borrow = true;
+    source->convert_flags = 0;
+    Frame frame = {};
+    bool acquired;
+    {
+        PROFILE_SCOPE(PROFILE_ACQUIRE);
+        acquired = source->acquire(source, &frame, layer->buffer, layer->buffer_size);
+        if (!acquired && frame.required_size &&
+            compositor_layer_grow(&layer->buffer, &layer->buffer_size, frame.required_size))
+        {
+            frame = Frame();
+            acquired = source->acquire(source, &frame, layer->buffer, layer->buffer_size);
+        }
+    }
+
+    FrameView view = frame.view;
+    if (acquired && (view.width > layer->rect.width || view.height > layer->rect.height) &&
+        view.width >= layer->rect.width && view.height >= layer->rect.height)
+    {
+        // fit into the placement, channels are scaled alike so the format does not matter
+        PROFILE_SCOPE(PROFILE_SCALE);
+        FrameView fitted = frame_view(0, layer->rect.width, layer->rect.height, layer->rect.width * 4, view.format);
+        u64 fitted_size = (u64)fitted.stride * fitted.height;
+        u64 scratch_size = downscale_scratch_size(&fitted, &view, 0);
+        if (compositor_layer_grow(&layer->scaled, &layer->scaled_size, fitted_size + scratch_size))
+        {
+            fitted.pixels = layer->scaled;
+            downscale(&fitted, &view, scratch_size ? layer->scaled + fitted_size : 0, 0, 0);
+            view = fitted;
+        }
+    }
+    layer->frame = frame;
+    layer->view = view;
+    layer->pending = acquired;
+    layer->acquire_time += perf.end();
+}
+
+// Blit the pending frame (fresh) or, when a layer below drew over ours, the
+// retained copy of the last one; true if it drew into the canvas. Runs on the
+// layer's worker, or for a late layer on the thread that closed the generation.
+function bool compositor_layer_blit(CompositorLayer *layer, u64 generation, bool fresh)
+{
+    Compositor *compositor = layer->compositor;
+    FrameSource *source = layer->source;
+
+    PerfCounter perf = {};
+    perf.begin();
+
+    // the overlapping layers below are drawn first, a blit of theirs covers ours
+    bool covered = false;
+    for (u32 i = 0; i < layer->index; ++i)
+    {
+        CompositorLayer *below = &compositor->layers[i];
+        if (!compositor_rects_overlap(below->rect, layer->rect))
+            continue;
+        std::unique_lock<std::mutex> lock(compositor->mutex);
+        compositor->wake.wait(lock, [&] { return compositor->quit || below->drawn >= generation; });
+        covered |= below->painted;
+    }
+
+    FrameView canvas = frame_view(compositor->canvas, compositor->width, compositor->height, compositor->stride, compositor->format);
+    bool painted = false;
+    if (fresh)
+    {
+        Frame *frame = &layer->frame;
+        FrameView view = layer->view;
+        u32 flags = frame->flip_vertical ? 0 : CONVERT_FLIP_Y;
+        if (view.format != compositor->format)
+            flags |= CONVERT_SWIZZLE_RB;
+
+        u32 width = view.width < layer->rect.width ? view.width : layer->rect.width;
+        u32 height = view.height < layer->rect.height ? view.height : layer->rect.height;
+        FrameRect src_rect = { 0, frame->flip_vertical ? 0 : view.height - height, width, height };
+        FrameRect dst_rect = { layer->rect.x, layer->rect.y, width, height };
+        FrameView src = frame_view_sub(view, src_rect);
+        FrameView dst = frame_view_sub(canvas, dst_rect);
+        layer->retained_width = 0;
+        if (layer->overlapped &&
+            compositor_layer_grow(&layer->retained, &layer->retained_size, (u64)width * height * 4))
+        {
+            // kept for the next blit of a layer below, then blitted from there
+            FrameView retained = frame_view(layer->retained, width, height, width * 4, compositor->format);
+            frame_view_copy(&retained, &src, flags);
+            layer->retained_width = width;
+            layer->retained_height = height;
+            src = retained;
+            flags = 0;
+        }
+        frame_view_copy(&dst, &src, flags);
+        painted = true;
+
+        if (frame->borrowed && source->release)
+            source->release(source, frame);
+        layer->pending = false;
+        layer->frames++;
+        layer->acquire_time += perf.end();
+    }
+    else if (covered && layer->retained_width)
+    {
+        FrameRect dst_rect = { layer->rect.x, layer->rect.y, layer->retained_width, layer->retained_height };
+        FrameView src = frame_view(layer->retained, layer->retained_width, layer->retained_height,
+                                   layer->retained_width * 4, compositor->format);
+        FrameView dst = frame_view_sub(canvas, dst_rect);
+        frame_view_copy(&dst, &src, 0);
+        painted = true;
+    }
+    return painted;
+}
+
+function void compositor_layer_proc(void *data)
+{
+    CompositorLayer *layer = (CompositorLayer*)data;
+    Compositor *compositor = layer->compositor;
+    FrameSource *source = layer->source;
+
+    profile_thread_name(layer->name);
+
+    if (source->begin)
+        source->begin(source);
+
+    u64 seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(compositor->mutex);
+            compositor->wake.wait(lock, [&] { return compositor->quit || compositor->generation != seen; });
+            if (compositor->quit)
+                break;
+            seen = compositor->generation;
+            if (!layer->pending)
+                layer->acquiring = seen;
+        }
+
+        // a frame that missed its composition is blitted in this one
+        if (!layer->pending)
+            compositor_layer_acquire(layer);
+
+        {
+            std::lock_guard<std::mutex> lock(compositor->mutex);
+            layer->acquiring = 0;
+            if (compositor->closed >= seen)
+            {
+                // given up on, the compositor finished this generation for us
+                if (layer->pending)
+                    layer->late++;
+                continue;
+            }
+            layer->claimed = seen;
+        }
+
+        bool fresh = layer->pending;
+        bool painted = compositor_layer_blit(layer, seen, fresh);
+
+        {
+            std::lock_guard<std::mutex> lock(compositor->mutex);
+            layer->drawn = seen;
+            layer->painted = painted;
+            layer->updated = fresh;
+            compositor->fresh |= fresh;
+            if (++compositor->finished == compositor->layer_count || fresh)
+                compositor->done.notify_one();
+        }
+        // layers on top may wait for this blit
+        compositor->wake.notify_all();
+    }
+
+    if (layer->pending && layer->frame.borrowed && source->release)
+        source->release(source, &layer->frame);
+    layer->pending = false;
+    if (source->end)
+        source->end(source);
+}
+
+function bool compositor_begin(FrameSource *source)
+{
+    Compositor *compositor = (Compositor*)source->user;
+    if (compositor->running)
+        return true;
+    if (!compositor_layout(compositor))
+        return false;
+
+    compositor->quit = false;
+    compositor->generation = 0;
+    compositor->closed = 0;
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+    {
+        CompositorLayer *layer = &compositor->layers[i];
+        layer->acquiring = 0;
+        layer->claimed = 0;
+        layer->drawn = 0;
+        layer->painted = false;
+        layer->pending = false;
+        layer->retained_width = 0;
+        platform_thread_start(&layer->thread, compositor_layer_proc, layer);
+    }
+    compositor->running = true;
+    return true;
+}
+
+function void compositor_end(FrameSource *source)
+{
+    Compositor *compositor = (Compositor*)source->user;
+    if (!compositor->running)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(compositor->mutex);
+        compositor->quit = true;
+    }
+    compositor->wake.notify_all();
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+        platform_thread_join(&compositor->layers[i].thread);
+    compositor->running = false;
+}
+
+// finish the generation without the layers still inside acquire, bottom up
+// since their retained copies go over the layers below them
+function void compositor_close(Compositor *compositor, std::unique_lock<std::mutex> &lock)
+{
+    u64 generation = compositor->generation;
+    compositor->closed = generation;
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+    {
+        CompositorLayer *layer = &compositor->layers[i];
+        if (layer->claimed == generation)
+            continue;
+
+        // the worker only touches the canvas and the retained copy after claiming
+        lock.unlock();
+        bool painted = compositor_layer_blit(layer, generation, false);
+        lock.lock();
+        layer->drawn = generation;
+        layer->painted = painted;
+        layer->updated = false;
+        compositor->finished++;
+        compositor->wake.notify_all();
+    }
+    compositor->done.wait(lock, [&] { return compositor->finished == compositor->layer_count; });
+}
+
+function bool compositor_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    Compositor *compositor = (Compositor*)source->user;
+    if (!compositor->running && !compositor_begin(source))
+        return false;
+
+    FrameRect roi = frame_rect_clip(source->roi, compositor->width, compositor->height);
+    bool borrow = source->allow_borrow && !source->convert_flags;
+    u64 copy_size = (u64)roi.width * roi.height * 4;
+    if (!borrow && buffer_size < copy_size)
+    {
+        frame->required_size = copy_size;
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(compositor->mutex);
+        compositor->generation++;
+        compositor->finished = 0;
+        compositor->fresh = false;
+        compositor->wake.notify_all();
+
+        u64 generation = compositor->generation;
+        auto finished = [&] { return compositor->finished == compositor->layer_count; };
+        auto in_time = [&] {
+            // nothing left to wait for but layers stuck in an older acquire
+            for (u32 i = 0; i < compositor->layer_count; ++i)
+            {
+                CompositorLayer *layer = &compositor->layers[i];
+                if (layer->claimed != generation && !(layer->acquiring && layer->acquiring < generation))
+                    return false;
+            }
+            return true;
+        };
+        compositor->done.wait(lock, [&] { return finished() || compositor->fresh; });
+        compositor->done.wait_for(lock, std::chrono::milliseconds(COMPOSITOR_GRACE_MS), [&] { return finished() || in_time(); });
+        if (!finished())
+            compositor_close(compositor, lock);
+    }
+    compositor->compositions++;
+
+    bool updated = false;
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+        updated |= compositor->layers[i].updated;
+    if (!updated)
+        return false;
+
+    FrameView canvas = frame_view(compositor->canvas, compositor->width, compositor->height, compositor->stride, compositor->format);
+    FrameView view = frame_view_sub(canvas, roi);
+    if (borrow)
+    {
+        // valid until the next acquire, which is after the pipeline released it
+        frame->view = view;
+        frame->borrowed = true;
+    }
+    else
+    {
+        frame->view = frame_view(buffer, view.width, view.height, view.width * 4, view.format);
+        frame_view_copy(&frame->view, &view, source->convert_flags);
+        frame->applied_flags = source->convert_flags;
+    }
+    frame->flip_vertical = true;
+    return true;
+}
+
+function void compositor_destroy(Compositor *compositor)
+{
+    for (u32 i = 0; i < compositor->layer_count; ++i)
+    {
+        CompositorLayer *layer = &compositor->layers[i];
+        free(layer->buffer);
+        free(layer->scaled);
+        free(layer->retained);
+        layer->buffer = layer->scaled = layer->retained = 0;
+        layer->buffer_size = layer->scaled_size = layer->retained_size = 0;
+        layer->retained_width = layer->retained_height = 0;
+    }
+    free(compositor->canvas);
+    compositor->canvas = 0;
+    compositor->width = compositor->height = 0;
+}
+
+function FrameSource compositor_source(Compositor *compositor)
+{
+    compositor->format = PIXEL_FORMAT_BGRA8;
+
+    FrameSource source = {};
+    source.name = "composite";
+    source.user = compositor;
+    source.begin = compositor_begin;
+    source.acquire = compositor_acquire;
+    source.end = compositor_end;
+    return source;
+}
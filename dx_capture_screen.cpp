@@ -54,8 +54,13 @@ struct CaptureContext {
     
     IDXGIOutput* output;
     IDXGIOutput* outputs[32]; /* Needs to be Released(). */
+    u32 output_adapters[32]; /* Index into adapters, duplication needs a device on the output's adapter. */
     u32 outputs_count;
     
+    u32 monitor; /* Index into outputs (attached to the desktop) to duplicate, kept by dx_init. */
+    u32 acquire_timeout_ms; /* How long AcquireNextFrame waits for a desktop change, 0 = 500. Kept by dx_init. */
+    RECT desktop; /* DesktopCoordinates of that output. */
+    
     ID3D11Device* d3d_device; /* Needs to be released. */
     ID3D11DeviceContext* d3d_context; /* Needs to be released. */
     IDXGIAdapter1* d3d_adapter;
@@ -66,6 +71,17 @@ struct CaptureContext {
     ID3D11Texture2D* staging_tex;
     
     D3D11_TEXTURE2D_DESC tex_desc;
+    
+    /* Between dx_map_frame and dx_unmap_frame. */
+    bool frame_acquired; /* ReleaseFrame() pending. */
+    bool desktop_mapped; /* UnMapDesktopSurface() pending. */
+    bool staging_mapped; /* Unmap(staging_tex) pending. */
+    
+    /* DXGI_ERROR_ACCESS_LOST (mode change, secure desktop, a full screen app):
+       the duplication is dead until dx_map_frame recreates it. */
+    bool access_lost;
+    u32 access_lost_count;
+    u64 recreate_after_ns; /* platform_time_ns of the next DuplicateOutput attempt. */
 };
 
 bool dx_destroy(CaptureContext *context)
@@ -120,9 +136,42 @@ bool dx_destroy(CaptureContext *context)
     return true;
 }
 
+/* 
+   DesktopCoordinates of the outputs attached to the desktop, in the order
+   dx_init indexes them with CaptureContext::monitor. Returns the count.
+*/
+u32 dx_enumerate_outputs(RECT *rects, u32 max_count) {
+    IDXGIFactory1* factory = NULL;
+    if (S_OK != CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)(&factory))) {
+        printf("Error: failed to retrieve the IDXGIFactory.\n");
+        return 0;
+    }
+    
+    u32 count = 0;
+    IDXGIAdapter1* adapter = NULL;
+    for (UINT a = 0; DXGI_ERROR_NOT_FOUND != factory->EnumAdapters1(a, &adapter); ++a) {
+        IDXGIOutput* output = NULL;
+        for (UINT o = 0; DXGI_ERROR_NOT_FOUND != adapter->EnumOutputs(o, &output); ++o) {
+            DXGI_OUTPUT_DESC desc;
+            output->GetDesc(&desc);
+            if (desc.AttachedToDesktop && count < max_count) {
+                rects[count++] = desc.DesktopCoordinates;
+            }
+            output->Release();
+        }
+        adapter->Release();
+    }
+    factory->Release();
+    return count;
+}
+
 bool dx_init(CaptureContext *context)
 {
+    u32 monitor = context->monitor;
+    u32 acquire_timeout_ms = context->acquire_timeout_ms;
     memset(context, 0, sizeof(CaptureContext));
+    context->monitor = monitor;
+    context->acquire_timeout_ms = acquire_timeout_ms;
     
     /* Retrieve a IDXGIFactory that can enumerate the adapters. */
     HRESULT hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)(&context->factory));
@@ -149,8 +198,9 @@ bool dx_init(CaptureContext *context)
             
             DXGI_OUTPUT_DESC desc;
             context->output->GetDesc(&desc);
-            if (desc.AttachedToDesktop)
+            if (desc.AttachedToDesktop && context->outputs_count < 32)
             {
+                context->output_adapters[context->outputs_count] = i;
                 context->outputs[context->outputs_count++] = context->output;
             }
             
@@ -187,7 +237,7 @@ bool dx_init(CaptureContext *context)
                   probably using NULL here. 
          */
         
-        u32 use_adapter = 0;
+        u32 use_adapter = context->monitor < context->outputs_count ? context->output_adapters[context->monitor] : 0;
         context->d3d_adapter = context->adapters[use_adapter];
         if (NULL == context->d3d_adapter) {
             printf("Error: the stored adapter is NULL.\n");
@@ -226,8 +276,8 @@ bool dx_init(CaptureContext *context)
     
     { /* Start IDGIOutputDuplication init. */
         
-        u32 use_monitor = 0;
-        context->output = context->outputs[use_monitor];
+        u32 use_monitor = context->monitor;
+        context->output = use_monitor < context->outputs_count ? context->outputs[use_monitor] : NULL;
         if (use_monitor >= context->outputs_count || NULL == context->output) {
             printf("No valid output found. The output is NULL.\n");
             exit(EXIT_FAILURE);
@@ -278,16 +328,18 @@ bool dx_init(CaptureContext *context)
                );
     }
     
-    if (0 == output_desc.DesktopCoordinates.right
-        || 0 == output_desc.DesktopCoordinates.bottom)
+    if (output_desc.DesktopCoordinates.right <= output_desc.DesktopCoordinates.left
+        || output_desc.DesktopCoordinates.bottom <= output_desc.DesktopCoordinates.top)
     {
         printf("The output desktop coordinates are invalid.\n");
         exit(EXIT_FAILURE);
     }
+    context->desktop = output_desc.DesktopCoordinates;
     
-    /* Create the staging texture that we need to download the pixels from gpu. */
-    context->tex_desc.Width = output_desc.DesktopCoordinates.right;
-    context->tex_desc.Height = output_desc.DesktopCoordinates.bottom;
+    /* Create the staging texture that we need to download the pixels from gpu. 
+       Only the primary monitor starts at 0, 0; the others are placed around it. */
+    context->tex_desc.Width = output_desc.DesktopCoordinates.right - output_desc.DesktopCoordinates.left;
+    context->tex_desc.Height = output_desc.DesktopCoordinates.bottom - output_desc.DesktopCoordinates.top;
     context->tex_desc.MipLevels = 1;
     context->tex_desc.ArraySize = 1; /* When using a texture array. */
     context->tex_desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM; 
@@ -323,162 +375,286 @@ bool dx_init(CaptureContext *context)
     return true;
 }
 
-int dx_capture(CaptureContext *context, u8 *image_data, u32 size, u32 *width, u32 *height) {
-    /* Access a couple of frames. */
+#define DX_RECREATE_INTERVAL_NS 250000000ull
+
+/* The duplication reported DXGI_ERROR_ACCESS_LOST, only the first time is printed. */
+void dx_mark_access_lost(CaptureContext *context, const char *where) {
+    if (!context->access_lost) {
+        printf("%s returned DXGI_ERROR_ACCESS_LOST, recreating the duplication.\n", where);
+        context->access_lost_count++;
+    }
+    context->access_lost = true;
+}
+
+/*
+  Recreate the duplication after DXGI_ERROR_ACCESS_LOST, at most every
+  DX_RECREATE_INTERVAL_NS (DuplicateOutput keeps failing while the secure
+  desktop is up). A mode change can resize the output, the staging texture
+  follows. Returns true once the duplication works again.
+ */
+bool dx_recreate_duplication(CaptureContext *context) {
+    u64 now = platform_time_ns();
+    if (now < context->recreate_after_ns) {
+        return false;
+    }
+    context->recreate_after_ns = now + DX_RECREATE_INTERVAL_NS;
+    
+    if (NULL != context->duplication) {
+        context->duplication->Release();
+        context->duplication = NULL;
+    }
+    
+    HRESULT hr = context->output1->DuplicateOutput(context->d3d_device, &context->duplication);
+    if (S_OK != hr) {
+        context->duplication = NULL;
+        return false;
+    }
+    
+    DXGI_OUTDUPL_DESC duplication_desc;
+    context->duplication->GetDesc(&duplication_desc);
+    if (duplication_desc.ModeDesc.Width != context->tex_desc.Width || duplication_desc.ModeDesc.Height != context->tex_desc.Height) {
+        D3D11_TEXTURE2D_DESC tex_desc = context->tex_desc;
+        tex_desc.Width = duplication_desc.ModeDesc.Width;
+        tex_desc.Height = duplication_desc.ModeDesc.Height;
+        
+        ID3D11Texture2D* staging_tex = NULL;
+        hr = context->d3d_device->CreateTexture2D(&tex_desc, NULL, &staging_tex);
+        if (S_OK != hr) {
+            printf("Error: failed to recreate the staging texture at %ux%u, error: %d.\n", tex_desc.Width, tex_desc.Height, hr);
+            context->duplication->Release();
+            context->duplication = NULL;
+            return false;
+        }
+        
+        context->staging_tex->Release();
+        context->staging_tex = staging_tex;
+        context->tex_desc = tex_desc;
+    }
+    
+    printf("Recreated the duplication (%ux%u) after DXGI_ERROR_ACCESS_LOST.\n", context->tex_desc.Width, context->tex_desc.Height);
+    context->access_lost = false;
+    return true;
+}
+
+/* Give back what dx_map_frame mapped/acquired, safe to call when nothing is. */
+void dx_unmap_frame(CaptureContext *context) {
+    if (context->staging_mapped) {
+        context->d3d_context->Unmap(context->staging_tex, 0);
+        context->staging_mapped = false;
+    }
+    
+    if (context->desktop_mapped) {
+        HRESULT hr = context->duplication->UnMapDesktopSurface();
+        if (S_OK != hr) {
+            printf("Error: failed to unmap the desktop surface after successfully mapping it.\n");
+        }
+        context->desktop_mapped = false;
+    }
+    
+    /* We must release the frame. */
+    if (context->frame_acquired) {
+        HRESULT hr = context->duplication->ReleaseFrame();
+        if (S_OK != hr) {
+            printf("Failed to release the duplication frame.\n");
+        }
+        context->frame_acquired = false;
+    }
+}
+
+/*
+  Map the next desktop frame for reading. On success view points at the roi
+  (clipped, width 0 = the whole output) inside the mapped memory, rows are
+  top-down and map.RowPitch apart. The view stays valid until
+  dx_unmap_frame, which must be called before the next dx_map_frame.
+ */
+bool dx_map_frame(CaptureContext *context, FrameRect roi, FrameView *view) {
     DXGI_OUTDUPL_FRAME_INFO frame_info;
     IDXGIResource* desktop_resource = NULL;
     ID3D11Texture2D* tex = NULL;
     DXGI_MAPPED_RECT mapped_rect;
+    bool mapped = false;
+    
+    Assert(!context->frame_acquired && !context->desktop_mapped && !context->staging_mapped);
+    
+    if (context->access_lost && !dx_recreate_duplication(context)) {
+        return false;
+    }
+    
+    roi = frame_rect_clip(roi, context->tex_desc.Width, context->tex_desc.Height);
+    if (0 == roi.width || 0 == roi.height) {
+        return false;
+    }
+    
+    UINT timeout = context->acquire_timeout_ms ? context->acquire_timeout_ms : 500;
+    HRESULT hr = context->duplication->AcquireNextFrame(timeout, &frame_info, &desktop_resource);
+    if (DXGI_ERROR_ACCESS_LOST == hr) {
+        dx_mark_access_lost(context, "AcquireNextFrame");
+        return false;
+    }
+    else if (DXGI_ERROR_WAIT_TIMEOUT == hr) {
+        /* The desktop did not change, not an error. */
+        return false;
+    }
+    else if (DXGI_ERROR_INVALID_CALL == hr) {
+        printf("Received a DXGI_ERROR_INVALID_CALL.\n");
+        return false;
+    }
+    else if (S_OK != hr) {
+        return false;
+    }
+    context->frame_acquired = true;
+    
+    /* Print some info. */
+    //printf("frame_info.TotalMetadataBufferSize: %u\n", frame_info.TotalMetadataBufferSize);
+    //printf("frame_info.AccumulatedFrames: %u\n", frame_info.AccumulatedFrames);
     
-    for (int i = 0; i < 1; ++i) {
-        //  printf("%02d - ", i);
+    /* Map the desktop surface, the frame has to stay acquired while it is mapped. */
+    hr = context->duplication->MapDesktopSurface(&mapped_rect);
+    if (S_OK == hr) {
+        *view = frame_view_sub(frame_view(mapped_rect.pBits, context->tex_desc.Width, context->tex_desc.Height,
+                                          mapped_rect.Pitch, PIXEL_FORMAT_BGRA8), roi);
+        context->desktop_mapped = true;
+        mapped = true;
+    }
+    else if (DXGI_ERROR_UNSUPPORTED == hr) {
+        //printf("MapDesktopSurface returned DXGI_ERROR_UNSUPPORTED.\n");
+        /* 
+           According to the docs, when we receive this error we need
+           to transfer the image to a staging surface and then lock the 
+           image by calling IDXGISurface::Map().
+           
+           To get the data from GPU to the CPU, we do:
+           
+               - copy the roi of the frame into our staging texture
+                 (CopySubresourceRegion, at the same position so the
+                 staging texture keeps the size of the output)
+               - release the frame, the copy is already queued
+               - map the texture, the caller reads it in place
+               - unmap in dx_unmap_frame.
+         */
         
-        HRESULT hr = context->duplication->AcquireNextFrame(500, &frame_info, &desktop_resource);
-        if (DXGI_ERROR_ACCESS_LOST == hr) {
-            printf("Received a DXGI_ERROR_ACCESS_LOST.\n");
-        }
-        else if (DXGI_ERROR_WAIT_TIMEOUT == hr) {
-            printf("Received a DXGI_ERROR_WAIT_TIMEOUT.\n");
-        }
-        else if (DXGI_ERROR_INVALID_CALL == hr) {
-            printf("Received a DXGI_ERROR_INVALID_CALL.\n");
+        /* Get the texture interface .. */
+        hr = desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), (void**)&tex);
+        if (S_OK != hr) {
+            printf("Error: failed to query the ID3D11Texture2D interface on the IDXGIResource we got.\n");
+            exit(EXIT_FAILURE);
         }
-        else if (S_OK == hr) {
-            //printf("Yay we got a frame.\n");
-            
-            /* Print some info. */
-            //printf("frame_info.TotalMetadataBufferSize: %u\n", frame_info.TotalMetadataBufferSize);
-            //printf("frame_info.AccumulatedFrames: %u\n", frame_info.AccumulatedFrames);
-            
-            /* Get the texture interface .. */
-#if 1      
-            hr = desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), (void**)&tex);
-            if (S_OK != hr) {
-                printf("Error: failed to query the ID3D11Texture2D interface on the IDXGIResource we got.\n");
-                exit(EXIT_FAILURE);
-            }
-#endif      
-            
-            /* Map the desktop surface */
-            hr = context->duplication->MapDesktopSurface(&mapped_rect);
-            if (S_OK == hr) {
-                printf("We got acess to the desktop surface\n");
-                hr = context->duplication->UnMapDesktopSurface();
-                if (S_OK != hr) {
-                    printf("Error: failed to unmap the desktop surface after successfully mapping it.\n");
-                }
-            }
-            else if (DXGI_ERROR_UNSUPPORTED == hr) {
-                //printf("MapDesktopSurface returned DXGI_ERROR_UNSUPPORTED.\n");
-                /* 
-                   According to the docs, when we receive this error we need
-                   to transfer the image to a staging surface and then lock the 
-                    image by calling IDXGISurface::Map().
         
-                   To get the data from GPU to the CPU, we do:
+        D3D11_BOX box;
+        box.left = roi.x;
+        box.top = roi.y;
+        box.front = 0;
+        box.right = roi.x + roi.width;
+        box.bottom = roi.y + roi.height;
+        box.back = 1;
+        context->d3d_context->CopySubresourceRegion(context->staging_tex, 0, roi.x, roi.y, 0, tex, 0, &box);
         
-                       - copy the frame into our staging texture
-                       - map the texture 
-                       - ... do something 
-                       - unmap.
+        tex->Release();
+        tex = NULL;
         
-                   @TODO figure out what solution is faster:
+        hr = context->duplication->ReleaseFrame();
+        if (S_OK != hr) {
+            printf("Failed to release the duplication frame.\n");
+        }
+        context->frame_acquired = false;
         
-                   There are multiple solutions to copy a texture. I have 
-                   to look into what solution is better. 
-                   -  d3d_context->CopySubresourceRegion();
-                   -  d3d_context->CopyResource(dest, src)
+        D3D11_MAPPED_SUBRESOURCE map;
+        HRESULT map_result = context->d3d_context->Map(context->staging_tex,          /* Resource */
+                                                       0,                    /* Subresource */ 
+                                                       D3D11_MAP_READ,       /* Map type. */
+                                                       0,                    /* Map flags. */
+                                                       &map);
         
-                   @TODO we need to make sure that the width/height are valid. 
-         
-                */
-                
-                context->d3d_context->CopyResource(context->staging_tex, tex);
-                
-                D3D11_MAPPED_SUBRESOURCE map;
-                HRESULT map_result = context->d3d_context->Map(context->staging_tex,          /* Resource */
-                                                               0,                    /* Subresource */ 
-                                                               D3D11_MAP_READ,       /* Map type. */
-                                                               0,                    /* Map flags. */
-                                                               &map);
-                
-                if (S_OK == map_result) {
-                    unsigned char* data = (unsigned char*)map.pData;
-                    //printf("Mapped the staging tex; we can access the data now.\n");
-                    printf("RowPitch: %u, DepthPitch: %u, %02X, %02X, %02X\n", map.RowPitch, map.DepthPitch, data[0], data[1], data[2]);
-                    
-                    *width = context->tex_desc.Width;
-                    *height = context->tex_desc.Height;
-                    
-                    u32 copy_size = context->tex_desc.Width * context->tex_desc.Height * 4;
-                    if (size >= copy_size /*&& data[0] == 0xFF*/)
-                    {
-                        memcpy(image_data, data, copy_size);
-                    }
-#if 0
-                    if (i < 25) {
-                        char fname[512];
-                        
-                        /* We have to make the image opaque. */
-                        
-                        for (int k = 0; k < tex_desc.Width; ++k) {
-                            for (int l = 0; l < tex_desc.Height; ++l) {
-                                int dx = l * tex_desc.Width * 4 + k * 4;
-                                data[dx + 3] = 0xFF;
-                            }
-                        }
-                        sprintf(fname, "capture_%03d.png", i);
-                        save_png(fname,
-                                 tex_desc.Width, tex_desc.Height, 8, PNG_COLOR_TYPE_RGBA,
-                                 (unsigned char*)map.pData, map.RowPitch, PNG_TRANSFORM_BGR);
-                    }
-#endif
-                }
-                else {
-                    printf("Error: failed to map the staging tex. Cannot access the pixels.\n");
-                }
-                
-                context->d3d_context->Unmap(context->staging_tex, 0);
-            }
-            else if (DXGI_ERROR_INVALID_CALL == hr) {
-                printf("MapDesktopSurface returned DXGI_ERROR_INVALID_CALL.\n");
-            }
-            else if (DXGI_ERROR_ACCESS_LOST == hr) {
-                printf("MapDesktopSurface returned DXGI_ERROR_ACCESS_LOST.\n");
-            }
-            else if (E_INVALIDARG == hr) {
-                printf("MapDesktopSurface returned E_INVALIDARG.\n");
-            }
-            else {
-                printf("MapDesktopSurface returned an unknown error.\n");
-            }
+        if (S_OK == map_result) {
+            //printf("RowPitch: %u, DepthPitch: %u\n", map.RowPitch, map.DepthPitch);
+            *view = frame_view_sub(frame_view((u8*)map.pData, context->tex_desc.Width, context->tex_desc.Height,
+                                              map.RowPitch, PIXEL_FORMAT_BGRA8), roi);
+            context->staging_mapped = true;
+            mapped = true;
         }
-        
-        /* Clean up */
-        {
-            
-            if (NULL != tex) {
-                tex->Release();
-                tex = NULL;
-            }
-            
-            if (NULL != desktop_resource) {
-                desktop_resource->Release();
-                desktop_resource = NULL;
-            }
-            
-            /* We must release the frame. */
-            hr = context->duplication->ReleaseFrame();
-            if (S_OK != hr) {
-                printf("Failed to release the duplication frame.\n");
-            }
+        else {
+            printf("Error: failed to map the staging tex. Cannot access the pixels.\n");
         }
     }
+    else if (DXGI_ERROR_INVALID_CALL == hr) {
+        printf("MapDesktopSurface returned DXGI_ERROR_INVALID_CALL.\n");
+    }
+    else if (DXGI_ERROR_ACCESS_LOST == hr) {
+        dx_mark_access_lost(context, "MapDesktopSurface");
+    }
+    else if (E_INVALIDARG == hr) {
+        printf("MapDesktopSurface returned E_INVALIDARG.\n");
+    }
+    else {
+        printf("MapDesktopSurface returned an unknown error.\n");
+    }
     
-    //printf("Monitors connected to adapter: %lu\n", i);
+    /* The resource is only needed for the copy; the frame itself is released in dx_unmap_frame. */
+    if (NULL != desktop_resource) {
+        desktop_resource->Release();
+        desktop_resource = NULL;
+    }
     
+    if (!mapped) {
+        dx_unmap_frame(context);
+    }
     
-    return 0;
+    return mapped;
 }
 
+/*
+  Copy the roi of the next desktop frame into image_data (tightly packed),
+  convert_flags (CONVERT_*) are applied in the same pass. frame receives the
+  view of image_data. Returns false when there is no new frame or
+  image_data is smaller than the roi.
+ */
+bool dx_capture(CaptureContext *context, FrameRect roi, u8 *image_data, u64 size, FrameView *frame, u32 convert_flags) {
+    FrameView mapped;
+    if (!dx_map_frame(context, roi, &mapped)) {
+        return false;
+    }
+    
+    bool result = (u64)mapped.width * mapped.height * 4 <= size;
+    if (result) {
+        /* Single pass: read the mapped rows once, flip/swizzle/force alpha while writing. */
+        *frame = frame_view(image_data, mapped.width, mapped.height, mapped.width * 4, mapped.format);
+        frame_view_copy(frame, &mapped, convert_flags);
+    }
+    
+    dx_unmap_frame(context);
+    return result;
+}
 
+// Capture roi (width 0 = the whole virtual screen) as a bottom-up DIB,
+// returns false with width/height set when image_data is too small for it
+function bool blt_capture_screen(u8* image_data, u32 size, FrameRect roi, u32* width, u32* height)
+{
+    roi = frame_rect_clip(roi, GetSystemMetrics(SM_CXVIRTUALSCREEN), GetSystemMetrics(SM_CYVIRTUALSCREEN));
+    u32 w = roi.width;
+    u32 h = roi.height;
+    
+    *width = w;
+    *height = h;
+    if (w == 0 || h == 0 || size < w * h * 4)
+        return false;
+    
+    HDC hdc = GetDC(NULL);
+    
+    HDC hDest = CreateCompatibleDC(hdc); // create a dc to use for capture 
+    
+    HBITMAP hbCapture = CreateCompatibleBitmap(hdc, w, h);  
+    SelectObject(hDest, hbCapture); 
+    
+    // the following line effectively copies the screen into the capture bitamp 
+    BitBlt(hDest, 0,0, w, h, hdc, roi.x, roi.y, SRCCOPY);  
+    
+    BITMAPINFOHEADER bmpInfoHeader = { sizeof(BITMAPINFOHEADER), (long)w, (long)h, 1, 32 };
+    GetDIBits(hdc, hbCapture, 0, h, image_data, (BITMAPINFO*)&bmpInfoHeader, DIB_RGB_COLORS);
+    
+    // clean up - release unused resources! 
+    ReleaseDC(NULL, hdc);  
+    DeleteDC(hDest);
+    DeleteObject(hbCapture);
+    
+    return true;
+}
@@ -0,0 +1,135 @@
+/*
+
+  Frame buffer pool
+  -----------------
+  Page aligned (so also cache line / SIMD aligned) pixel buffers handed out
+  by size class and recycled instead of freed. Whoever acquires a
+  FrameBuffer owns it until it is released back to the pool; buffers grow
+  by releasing the small one and acquiring the size that is needed.
+
+  Size classes start at 64KB and grow by 1.25x (rounded to pages), so a
+  buffer is at most 25% larger than requested and a resize between similar
+  capture sizes reuses the same buffer. Buffers of a 4K frame or more can
+  be backed by huge pages (use_huge_pages).
+
+  The pool is shared by the render and the capture thread, a mutex guards
+  the free lists; acquire/release only happen on size changes.
+
+ */
+#include <mutex>
+
+#define FRAME_BUFFER_MIN_CLASS_SIZE (64 * 1024)
+#define FRAME_BUFFER_CLASS_COUNT 64
+#define FRAME_BUFFER_HUGE_PAGE_THRESHOLD ((u64)3840 * 2160 * 4)
+
+struct FrameBuffer {
+    u8 *data;
+    u64 size;           // usable size, the size class
+    u64 allocated_size; // for platform_free_pages
+    u32 size_class;
+    FrameBuffer *next_free;
+};
+
+struct FrameBufferPool {
+    std::mutex mutex;
+    FrameBuffer *free_lists[FRAME_BUFFER_CLASS_COUNT];
+    bool use_huge_pages;
+
+    u64 bytes_allocated;
+    u64 allocations;
+    u64 reuses;
+};
+
+function u64 frame_buffer_class_size(u32 size_class)
+{
+    u64 size = FRAME_BUFFER_MIN_CLASS_SIZE;
+    for (u32 i = 0; i < size_class; ++i)
+        size = ((size + size / 4) + PLATFORM_PAGE_SIZE - 1) & ~((u64)PLATFORM_PAGE_SIZE - 1);
+    return size;
+}
+
+function u32 frame_buffer_size_class(u64 size)
+{
+    u32 size_class = 0;
+    while (size_class + 1 < FRAME_BUFFER_CLASS_COUNT && frame_buffer_class_size(size_class) < size)
+        ++size_class;
+    return size_class;
+}
+
+// returns 0 only if the OS is out of memory
+function FrameBuffer *frame_buffer_acquire(FrameBufferPool *pool, u64 size)
+{
+    u32 size_class = frame_buffer_size_class(size);
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        FrameBuffer *buffer = pool->free_lists[size_class];
+        if (buffer)
+        {
+            pool->free_lists[size_class] = buffer->next_free;
+            buffer->next_free = 0;
+            pool->reuses++;
+            return buffer;
+        }
+    }
+
+    u64 class_size = frame_buffer_class_size(size_class);
+    Assert(class_size >= size);
+
+    FrameBuffer *buffer = (FrameBuffer*)calloc(1, sizeof(FrameBuffer));
+    bool huge_pages = pool->use_huge_pages && class_size >= FRAME_BUFFER_HUGE_PAGE_THRESHOLD;
+    buffer->data = (u8*)platform_alloc_pages(class_size, huge_pages, &buffer->allocated_size);
+    if (!buffer->data)
+    {
+        printf("Error: failed to allocate a %llu byte frame buffer.\n", class_size);
+        free(buffer);
+        return 0;
+    }
+    buffer->size = class_size;
+    buffer->size_class = size_class;
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->bytes_allocated += buffer->allocated_size;
+    pool->allocations++;
+    return buffer;
+}
+
+function void frame_buffer_release(FrameBufferPool *pool, FrameBuffer *buffer)
+{
+    if (!buffer)
+        return;
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    buffer->next_free = pool->free_lists[buffer->size_class];
+    pool->free_lists[buffer->size_class] = buffer;
+}
+
+// make *buffer at least size bytes, keeping it when it is already big enough
+function bool frame_buffer_ensure(FrameBufferPool *pool, FrameBuffer **buffer, u64 size)
+{
+    if (*buffer && (*buffer)->size >= size)
+        return true;
+
+    frame_buffer_release(pool, *buffer);
+    *buffer = frame_buffer_acquire(pool, size);
+    return *buffer != 0;
+}
+
+// frees everything on the free lists, buffers still acquired are not tracked
+function void frame_buffer_pool_destroy(FrameBufferPool *pool)
+{
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    for (u32 i = 0; i < FRAME_BUFFER_CLASS_COUNT; ++i)
+    {
+        FrameBuffer *buffer = pool->free_lists[i];
+        while (buffer)
+        {
+            FrameBuffer *next = buffer->next_free;
+            platform_free_pages(buffer->data, buffer->allocated_size);
+            pool->bytes_allocated -= buffer->allocated_size;
+            free(buffer);
+            buffer = next;
+        }
+        pool->free_lists[i] = 0;
+    }
+}
@@ -0,0 +1,83 @@
+/*
+
+  Triple buffer
+  -------------
+  Lock-free single producer / single consumer hand-off of the latest frame.
+
+  There are three slots. The producer always owns one (back) and the
+  consumer always owns one (front); the third (middle) is swapped through a
+  single atomic word that holds its index plus a "fresh" bit:
+
+    publish: middle <- back | FRESH, back <- old middle
+             if the old middle was still fresh the consumer never saw it,
+             it is counted as dropped (latest frame wins)
+    consume: only if middle is fresh: middle <- front, front <- old middle
+
+  Neither side ever waits for the other, so a slow capture cannot block the
+  renderer and a renderer blocked in vsync cannot block capture.
+
+  The slot contents (pixels, frame info) live with the user; this only
+  tells each side which slot index it may touch.
+
+ */
+#include <atomic>
+
+#define TRIPLE_BUFFER_INDEX_MASK 0x3
+#define TRIPLE_BUFFER_FRESH      0x4
+
+struct TripleBuffer {
+    std::atomic<u32> middle;
+
+    u32 back;  // producer only
+    u32 front; // consumer only
+
+    std::atomic<u64> published;
+    std::atomic<u64> consumed;
+    std::atomic<u64> dropped;
+};
+
+function void triple_buffer_init(TripleBuffer *buffer)
+{
+    buffer->back = 0;
+    buffer->middle.store(1);
+    buffer->front = 2;
+    buffer->published.store(0);
+    buffer->consumed.store(0);
+    buffer->dropped.store(0);
+}
+
+// producer: the slot that may be written
+function u32 triple_buffer_back(TripleBuffer *buffer)
+{
+    return buffer->back;
+}
+
+// producer: hand the back slot to the consumer, get a new back slot
+function void triple_buffer_publish(TripleBuffer *buffer)
+{
+    u32 old = buffer->middle.exchange(buffer->back | TRIPLE_BUFFER_FRESH, std::memory_order_acq_rel);
+    buffer->back = old & TRIPLE_BUFFER_INDEX_MASK;
+
+    buffer->published.fetch_add(1, std::memory_order_relaxed);
+    if (old & TRIPLE_BUFFER_FRESH)
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// consumer: if a newer slot was published, make it the front slot and return true
+function bool triple_buffer_consume(TripleBuffer *buffer)
+{
+    if (!(buffer->middle.load(std::memory_order_acquire) & TRIPLE_BUFFER_FRESH))
+        return false;
+
+    u32 old = buffer->middle.exchange(buffer->front, std::memory_order_acq_rel);
+    buffer->front = old & TRIPLE_BUFFER_INDEX_MASK;
+
+    buffer->consumed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// consumer: the slot that may be read
+function u32 triple_buffer_front(TripleBuffer *buffer)
+{
+    return buffer->front;
+}
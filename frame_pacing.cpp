@@ -0,0 +1,89 @@
+/*
+
+  Frame pacing
+  ------------
+  A FramePacer ticks at a fixed rate. frame_pacer_wait sleeps to the next
+  deadline with platform_sleep_until instead of polling, so capturing at
+  30 fps costs 30 captures a second and nothing in between.
+
+  Deadlines advance by whole intervals from the first tick, the rate does
+  not drift with how long the work after a tick takes. A tick more than
+  one interval late counts the deadlines it missed and starts over from
+  now rather than bursting to catch up; a late wake-up within the
+  interval (the sleep overshooting) is measured as lateness.
+
+  Rate 0 is not paced: frame_pacer_wait returns right away. Only the
+  pacing thread writes the stats, they are atomics so another thread can
+  read them while it runs.
+
+ */
+
+struct FramePacer {
+    u64 interval_ns; // 0 = not paced
+    u64 deadline;    // platform_time_ns of the next tick, 0 before the first
+    PlatformTimer timer;
+
+    std::atomic<u64> ticks;
+    std::atomic<u64> missed;  // deadlines that passed while the previous work still ran
+    std::atomic<u64> late_ns; // summed time woken up past the deadline
+    std::atomic<u64> max_late_ns;
+    std::atomic<u64> slept_ns;
+};
+
+function void frame_pacer_add(std::atomic<u64> *stat, u64 value)
+{
+    stat->store(stat->load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+function void frame_pacer_init(FramePacer *pacer)
+{
+    memset((void*)pacer, 0, sizeof(FramePacer));
+    platform_timer_init(&pacer->timer);
+}
+
+function void frame_pacer_destroy(FramePacer *pacer)
+{
+    platform_timer_destroy(&pacer->timer);
+}
+
+// ticks per second, 0 = not paced; restarts the deadlines
+function void frame_pacer_set_rate(FramePacer *pacer, double rate)
+{
+    pacer->interval_ns = rate > 0 ? (u64)(1e9 / rate) : 0;
+    pacer->deadline = 0;
+}
+
+// sleep to the next tick
+function void frame_pacer_wait(FramePacer *pacer)
+{
+    u64 interval = pacer->interval_ns;
+    if (!interval)
+        return;
+
+    u64 now = platform_time_ns();
+    if (!pacer->deadline)
+    {
+        pacer->deadline = now;
+    }
+    else if (now >= pacer->deadline + interval)
+    {
+        frame_pacer_add(&pacer->missed, (now - pacer->deadline) / interval);
+        pacer->deadline = now;
+    }
+    else if (now < pacer->deadline)
+    {
+        u64 begin = profile_begin(PROFILE_PACE);
+        platform_sleep_until(&pacer->timer, pacer->deadline);
+        profile_end(PROFILE_PACE, begin);
+
+        u64 woken = platform_time_ns();
+        u64 late = woken > pacer->deadline ? woken - pacer->deadline : 0;
+        frame_pacer_add(&pacer->late_ns, late);
+        if (late > pacer->max_late_ns.load(std::memory_order_relaxed))
+            pacer->max_late_ns.store(late, std::memory_order_relaxed);
+        frame_pacer_add(&pacer->slept_ns, woken - now);
+    }
+
+    frame_pacer_add(&pacer->ticks, 1);
+    pacer->deadline += interval;
+}
@@ -0,0 +1,1187 @@
+/*
+
+  Frame pipeline
+  --------------
+  The per-frame work that used to live inline in WinMain:
+
+      source (acquire) -> convert -> sink (upload) -> sink (present)
+
+  Sources and sinks are plain structs of function pointers so the same
+  loop runs against DXGI/GDI capture and the OpenGL window on Windows
+  (see main.cpp) and against synthetic/file sources and a null or
+  offscreen sink without any window (see headless.cpp).
+
+  With frame_pipeline_enable_capture_thread, acquire + convert run on a
+  dedicated capture thread and reach the render side through a triple
+  buffer (frame_handoff.cpp): the render loop takes the latest frame if
+  there is one and never waits for capture.
+
+  Frames are FrameViews (image_processing.cpp) with their own row pitch.
+  In the synchronous pipeline a source may lend a view of its own memory
+  (a mapped staging texture, a region of interest inside it) that is read
+  in place by the diff and the sink and handed back with release after the
+  upload, so a capture needs no copy at all. When the source copies instead
+  (threaded capture, CONVERT_* requested, no borrowing) it copies only the
+  region of interest and fuses the conversion into that copy.
+
+  With downscale_enabled a frame bigger than the viewport
+  (frame_pipeline_set_viewport, the window's client size) is scaled down
+  to it right after acquire, before the diff, recording and upload, which
+  then all touch only the smaller frame. The conversion is fused into the
+  scaling pass (a filter graph, image_processing.cpp).
+
+  frame_pipeline_set_capture_rate paces acquire to a fixed rate
+  (frame_pacing.cpp) wherever it runs, rate 0 takes frames as the source
+  delivers them (DXGI only returns on a desktop change). With
+  present_on_demand a step only uploads and presents when something
+  changed or frame_pipeline_invalidate asked for a redraw (a resize), and
+  a threaded render loop can sleep in frame_pipeline_wait until the
+  capture thread publishes, so an idle desktop costs next to no CPU.
+
+  With stats_enabled every new frame gets its FrameStats (frame_stats.cpp)
+  right after the conversion, wherever capture runs, and the render side
+  keeps a FrameHealth from them: black, blank, frozen and lost captures.
+
+  New frames go to the recorder and the shared frame ring (frame_ring.cpp)
+  when those are set, on the render side right after the hand-off. A
+  requested snapshot (image_export.cpp) copies the frame shown and is
+  encoded and written on the snapshot thread.
+
+  frame_pipeline_set_sink swaps the sink, e.g. the window for the large
+  image viewer (opengl_tiles.cpp), and starts the source over so the new
+  sink gets a whole frame.
+
+  Nothing in this file may depend on Win32 or GL.
+
+ */
+
+enum TestImageType {
+    TEST_IMAGE_COLOR_GEN,
+    TEST_IMAGE_FILE,
+    TEST_IMAGE_CAPTURE_BLT,
+    TEST_IMAGE_CAPTURE_DX,
+    TEST_IMAGE_REPLAY,
+    TEST_IMAGE_COMPOSITE, // several sources on one canvas (compositor.cpp)
+
+    TEST_IMAGE_TYPE_COUNT, // count value
+};
+
+struct Frame {
+    FrameView view;
+
+    u64 timestamp;      // platform_time_ns right after acquire
+    bool flip_vertical; // rows are top-down, the sink flips when drawing
+    bool borrowed;      // view points into source memory, valid until source->release
+    u32 applied_flags;  // CONVERT_* the source already applied while copying
+
+    // what changed since the frame the sink last received, 0 = the whole frame
+    FrameRect *dirty_rects;
+    u32 dirty_count;
+
+    // set by acquire when the buffer is too small, the pipeline grows it and retries
+    u64 required_size;
+
+    FrameStats *stats; // of this frame when stats_enabled, else 0
+};
+
+struct FrameSource {
+    const char *name;
+    void *user;
+
+    // called when the source becomes active, optional
+    bool (*begin)(FrameSource *source);
+    // fill frame with pixels written to buffer (pool memory owned by the
+    // pipeline, 0 before the first frame), or with a borrowed view when
+    // allow_borrow is set. Return false when there is no new frame, with
+    // frame->required_size set if buffer_size was too small.
+    bool (*acquire)(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size);
+    // give a borrowed frame back, optional for sources that never lend
+    void (*release)(FrameSource *source, Frame *frame);
+    // called when the source is switched away from, optional
+    void (*end)(FrameSource *source);
+
+    FrameRect roi; // capture only this part, width 0 = everything (capture sources)
+
+    // set by the pipeline before every acquire
+    bool allow_borrow; // frame may point into source memory until release
+    u32 convert_flags; // CONVERT_* to apply when copying into buffer
+
+    bool lost; // set by acquire while the capture device is gone (DXGI access lost)
+};
+
+struct FrameSink {
+    const char *name;
+    void *user;
+
+    bool (*upload)(FrameSink *sink, Frame *frame);
+    void (*present)(FrameSink *sink); // optional
+};
+
+struct FrameTimings {
+    double acquire;
+    double scale;
+    double convert;
+    double stats;
+    double diff;
+    double upload;
+    double present;
+    double total;
+};
+
+struct FramePipeline;
+
+struct CaptureSlot {
+    Frame frame;
+    FrameTimings timings; // acquire/convert measured on the capture thread
+    FrameBuffer *buffer;  // grown by the capture thread only
+    FrameBuffer *scaled;  // the downscaled frame, also capture thread only
+    FrameStats stats;     // frame.stats points here
+};
+
+struct CaptureThread {
+    PlatformThread thread;
+    std::atomic<bool> running;
+
+    FramePipeline *pipeline;
+    FrameSource *source;
+
+    TripleBuffer handoff;
+    CaptureSlot slots[3];
+    PlatformEvent frame_ready; // signaled on every publish, see frame_pipeline_wait
+};
+
+struct FramePipeline {
+    FrameSource *sources[TEST_IMAGE_TYPE_COUNT];
+    FrameSink *sink;
+
+    TestImageType test_image_type;
+    bool test_init;
+
+    u32 convert_flags; // CONVERT_* applied to every new frame, fused into the source copy
+    bool zero_copy;    // let sources lend their memory (synchronous capture only)
+
+    bool downscale_enabled;    // fit frames bigger than the viewport to it
+    bool downscale_linear;     // average linear light (DOWNSCALE_LINEAR), for sRGB output
+    std::atomic<u64> viewport; // width << 32 | height, 0 = unknown
+    FrameBuffer *scaled_buffer; // downscaled frame when not threaded
+    FrameBuffer *scale_scratch; // two step linear downscale, capture side only
+
+    WorkQueue *queue; // parallel stages (downscale), may be 0
+
+    FrameBufferPool *pool;
+    FrameBuffer *image_buffer; // capture buffer when not threaded
+
+    Frame frame;
+    bool has_frame;
+    bool upload_pending; // frame has not reached the sink yet
+
+    bool tile_diff_enabled; // only upload tiles that changed, skip unchanged frames
+    TileDiff tile_diff;
+
+    bool capture_threaded; // acquire + convert on the capture thread
+    CaptureThread capture;
+    FramePacer capture_pacer; // acquire rate, frame_pipeline_set_capture_rate
+
+    bool present_on_demand; // skip upload + present when nothing changed
+    bool redraw;            // present on the next step anyway, frame_pipeline_invalidate
+
+    FrameRecorder *recorder; // every new frame is appended when set (frame_recording.cpp)
+    FrameRing *ring;         // every new frame is shared with other processes when set (frame_ring.cpp)
+    SnapshotWriter *snapshot; // gets the current frame when a snapshot was requested (image_export.cpp)
+
+    bool stats_enabled;  // FrameStats for every new frame, health from them
+    u32 stats_step;      // count every stats_step-th pixel and row, 0 = all
+    FrameStats stats;    // of the last frame when not threaded
+    FrameHealth health;  // render side
+    std::atomic<bool> source_lost; // the source's lost flag, from wherever it runs
+
+    u64 frame_number;
+    u64 bytes_uploaded;
+    u64 tiles_dirty;
+    u64 uploads_skipped;
+    u64 uploads_failed;
+    u64 presents_skipped;
+    double latency_sum; // acquire to uploaded, seconds, over latency_count new frames
+    double latency_max;
+    u64 latency_count;
+    FrameTimings last;
+    FrameTimings sum; // accumulated since frame_pipeline_reset_stats
+    u64 sum_frame_count;
+};
+
+// capture buffers come from pool and grow to whatever the source needs
+function void frame_pipeline_init(FramePipeline *pipeline, FrameSink *sink, FrameBufferPool *pool)
+{
+    memset((void*)pipeline, 0, sizeof(FramePipeline));
+    pipeline->sink = sink;
+    pipeline->pool = pool;
+    pipeline->zero_copy = true;
+    frame_health_init(&pipeline->health);
+    frame_pacer_init(&pipeline->capture_pacer);
+}
+
+// acquire at most rate times a second (0 = whenever the source has a
+// frame), before the source starts
+function void frame_pipeline_set_capture_rate(FramePipeline *pipeline, double rate)
+{
+    frame_pacer_set_rate(&pipeline->capture_pacer, rate);
+}
+
+// present on the next step even if nothing changed (resize, expose)
+function void frame_pipeline_invalidate(FramePipeline *pipeline)
+{
+    pipeline->redraw = true;
+}
+
+function void frame_pipeline_release(FrameSource *source, Frame *frame)
+{
+    if (frame->borrowed && source->release)
+        source->release(source, frame);
+    frame->borrowed = false;
+}
+
+// size the frames are drawn at, from any thread (WM_SIZE)
+function void frame_pipeline_set_viewport(FramePipeline *pipeline, u32 width, u32 height)
+{
+    pipeline->viewport.store(((u64)width << 32) | height, std::memory_order_relaxed);
+}
+
+// scale frame down into *scaled when it is clearly bigger than the viewport
+function void frame_pipeline_downscale(FramePipeline *pipeline, FrameSource *source, FrameBuffer **scaled, Frame *frame)
+{
+    u64 viewport = pipeline->viewport.load(std::memory_order_relaxed);
+    u32 width = (u32)(viewport >> 32), height = (u32)viewport;
+    FrameView *view = &frame->view;
+    if (!pipeline->downscale_enabled || !width || !height)
+        return;
+
+    if (width > view->width)
+        width = view->width;
+    if (height > view->height)
+        height = view->height;
+    // a small reduction costs more to compute than it saves on the upload
+    if ((u64)width * height * 4 > (u64)view->width * view->height * 3)
+        return;
+
+    FrameView dst = frame_view(0, width, height, width * 4, view->format);
+    if (!frame_buffer_ensure(pipeline->pool, scaled, (u64)width * height * 4))
+        return;
+    dst.pixels = (*scaled)->data;
+
+    if (pipeline->downscale_linear)
+    {
+        u64 scratch_size = downscale_scratch_size(&dst, view, DOWNSCALE_LINEAR);
+        if (scratch_size && !frame_buffer_ensure(pipeline->pool, &pipeline->scale_scratch, scratch_size))
+            return;
+        downscale(&dst, view, scratch_size ? pipeline->scale_scratch->data : 0, DOWNSCALE_LINEAR, pipeline->queue);
+    }
+    else
+    {
+        // the scaling steps and the conversion still to do in one banded
+        // pass, the conversion step then has nothing left
+        u32 flags = pipeline->convert_flags & ~frame->applied_flags;
+        FilterGraph graph;
+        filter_graph_begin(&graph, view->width, view->height, view->format);
+        filter_graph_scale(&graph, width, height);
+        filter_graph_convert(&graph, flags);
+        bool done = filter_graph_run(&graph, &dst, view, pipeline->queue);
+        filter_graph_destroy(&graph);
+        if (!done)
+            return;
+        dst.format = view->format; // the swizzle is accounted for with applied_flags
+        frame->applied_flags |= flags;
+    }
+    frame_pipeline_release(source, frame);
+    *view = dst;
+}
+
+// acquire + convert, the part of a frame that can run on the capture thread
+function bool frame_pipeline_capture(FramePipeline *pipeline, FrameSource *source, FrameBuffer **buffer,
+                                     FrameBuffer **scaled, FrameStats *stats, Frame *frame, FrameTimings *t)
+{
+    // the capture thread publishes frames that outlive the next acquire, it
+    // always copies
+    source->allow_borrow = pipeline->zero_copy && !pipeline->capture_threaded;
+    source->convert_flags = pipeline->convert_flags;
+
+    frame_pacer_wait(&pipeline->capture_pacer);
+
+    u64 begin = profile_begin(PROFILE_ACQUIRE);
+    bool new_frame = source->acquire(source, frame, *buffer ? (*buffer)->data : 0, *buffer ? (*buffer)->size : 0);
+    if (!new_frame && frame->required_size && frame_buffer_ensure(pipeline->pool, buffer, frame->required_size))
+    {
+        memset(frame, 0, sizeof(Frame));
+        new_frame = source->acquire(source, frame, (*buffer)->data, (*buffer)->size);
+    }
+    t->acquire = profile_end(PROFILE_ACQUIRE, begin);
+    if (source->lost != pipeline->source_lost.load(std::memory_order_relaxed))
+        pipeline->source_lost.store(source->lost, std::memory_order_relaxed);
+
+    if (!new_frame)
+        return false;
+    frame->timestamp = platform_time_ns();
+
+    begin = profile_begin(PROFILE_SCALE);
+    frame_pipeline_downscale(pipeline, source, scaled, frame);
+    t->scale = profile_end(PROFILE_SCALE, begin);
+
+    // the orientation is left to the sink (a texcoord flip), pixels are only
+    // touched for what the source did not already do while copying
+    begin = profile_begin(PROFILE_CONVERT);
+    u32 flags = pipeline->convert_flags & ~frame->applied_flags;
+    if (flags)
+    {
+        FrameView *view = &frame->view;
+        if (frame->borrowed)
+        {
+            // never write to source memory, convert on the way into our buffer
+            u64 size = (u64)view->width * view->height * 4;
+            if (!frame_buffer_ensure(pipeline->pool, buffer, size))
+            {
+                frame_pipeline_release(source, frame);
+                t->convert = profile_end(PROFILE_CONVERT, begin);
+                return false;
+            }
+
+            FrameView copy = frame_view((*buffer)->data, view->width, view->height, view->width * 4, view->format);
+            frame_view_copy(&copy, view, flags);
+            frame_pipeline_release(source, frame);
+            *view = copy;
+        }
+        else
+        {
+            convert_pixels(view->pixels, view->stride, view->pixels, view->stride, view->width, view->height, flags);
+        }
+    }
+    flags |= frame->applied_flags;
+    if (flags & CONVERT_FLIP_Y)
+        frame->flip_vertical = !frame->flip_vertical;
+    if (flags & CONVERT_SWIZZLE_RB)
+        frame->view.format = frame->view.format == PIXEL_FORMAT_BGRA8 ? PIXEL_FORMAT_RGBA8 : PIXEL_FORMAT_BGRA8;
+    t->convert = profile_end(PROFILE_CONVERT, begin);
+
+    // still before a borrowed view goes back, the source memory is read in place
+    if (pipeline->stats_enabled)
+    {
+        begin = profile_begin(PROFILE_STATS);
+        frame_stats_compute(stats, &frame->view, pipeline->stats_step, pipeline->queue);
+        frame->stats = stats;
+        t->stats = profile_end(PROFILE_STATS, begin);
+    }
+
+    return true;
+}
+
+// source begin/end run on the capture thread too, so capture APIs with
+// thread affinity (the D3D immediate context) stay on one thread
+function void capture_thread_proc(void *data)
+{
+    CaptureThread *capture = (CaptureThread*)data;
+    FrameSource *source = capture->source;
+
+    profile_thread_name("capture");
+
+    if (source->begin)
+        source->begin(source);
+
+    while (capture->running.load(std::memory_order_relaxed))
+    {
+        CaptureSlot *slot = &capture->slots[triple_buffer_back(&capture->handoff)];
+
+        Frame frame = {};
+        FrameTimings t = {};
+        if (frame_pipeline_capture(capture->pipeline, source, &slot->buffer, &slot->scaled, &slot->stats, &frame, &t))
+        {
+            slot->frame = frame;
+            slot->timings = t;
+            triple_buffer_publish(&capture->handoff);
+            platform_event_signal(&capture->frame_ready);
+        }
+        else if (!capture->pipeline->capture_pacer.interval_ns)
+        {
+            // static image or nothing new, don't spin (paced, the pacer sleeps)
+            platform_sleep_ms(1);
+        }
+    }
+
+    if (source->end)
+        source->end(source);
+}
+
+function void capture_thread_start(FramePipeline *pipeline, FrameSource *source)
+{
+    CaptureThread *capture = &pipeline->capture;
+    capture->pipeline = pipeline;
+    capture->source = source;
+    triple_buffer_init(&capture->handoff);
+    capture->running.store(true);
+    platform_thread_start(&capture->thread, capture_thread_proc, capture);
+}
+
+function void capture_thread_stop(FramePipeline *pipeline)
+{
+    CaptureThread *capture = &pipeline->capture;
+    capture->running.store(false);
+    platform_thread_join(&capture->thread);
+}
+
+// Move acquire + convert onto a capture thread. Call before the first step.
+function void frame_pipeline_enable_capture_thread(FramePipeline *pipeline)
+{
+    pipeline->capture_threaded = true;
+    platform_event_init(&pipeline->capture.frame_ready);
+}
+
+// Threaded: sleep until the capture thread published a frame, at most
+// timeout_ms. False on timeout, true right away when not threaded.
+function bool frame_pipeline_wait(FramePipeline *pipeline, u32 timeout_ms)
+{
+    if (!pipeline->capture_threaded)
+        return true;
+    return platform_event_wait(&pipeline->capture.frame_ready, timeout_ms);
+}
+
+// stop using the active source: end it, or stop the capture thread that owns it
+function void frame_pipeline_end_source(FramePipeline *pipeline)
+{
+    FrameSource *source = pipeline->sources[pipeline->test_image_type];
+    if (!pipeline->test_init || !source)
+        return;
+
+    if (pipeline->capture_threaded)
+        capture_thread_stop(pipeline);
+    else if (source->end)
+        source->end(source);
+}
+
+function void frame_pipeline_destroy(FramePipeline *pipeline)
+{
+    frame_pipeline_end_source(pipeline);
+
+    frame_buffer_release(pipeline->pool, pipeline->image_buffer);
+    frame_buffer_release(pipeline->pool, pipeline->scaled_buffer);
+    frame_buffer_release(pipeline->pool, pipeline->scale_scratch);
+    pipeline->image_buffer = 0;
+    pipeline->scaled_buffer = 0;
+    pipeline->scale_scratch = 0;
+
+    for (u32 i = 0; i < ArrayCount(pipeline->capture.slots); ++i)
+    {
+        frame_buffer_release(pipeline->pool, pipeline->capture.slots[i].buffer);
+        frame_buffer_release(pipeline->pool, pipeline->capture.slots[i].scaled);
+        pipeline->capture.slots[i].buffer = 0;
+        pipeline->capture.slots[i].scaled = 0;
+    }
+
+    tile_diff_destroy(&pipeline->tile_diff);
+    frame_pacer_destroy(&pipeline->capture_pacer);
+    platform_event_destroy(&pipeline->capture.frame_ready);
+}
+
+function void frame_pipeline_set_source(FramePipeline *pipeline, TestImageType type)
+{
+    frame_pipeline_end_source(pipeline);
+
+    pipeline->test_image_type = type;
+    pipeline->test_init = false;
+    pipeline->has_frame = false;
+    pipeline->upload_pending = false;
+    pipeline->source_lost.store(false);
+    frame_health_restart(&pipeline->health);
+}
+
+// draw with another sink from the next step on; the source starts over
+// and the diff forgets its frame so the new sink gets a whole one
+function void frame_pipeline_set_sink(FramePipeline *pipeline, FrameSink *sink)
+{
+    pipeline->sink = sink;
+    tile_diff_reset(&pipeline->tile_diff);
+    frame_pipeline_set_source(pipeline, pipeline->test_image_type);
+}
+
+// cycle to the next registered source, like pressing space in the window
+function void frame_pipeline_next_source(FramePipeline *pipeline)
+{
+    u32 type = pipeline->test_image_type;
+    for (u32 i = 0; i < TEST_IMAGE_TYPE_COUNT; ++i)
+    {
+        type = (type + 1) % TEST_IMAGE_TYPE_COUNT;
+        if (pipeline->sources[type])
+            break;
+    }
+
+    frame_pipeline_set_source(pipeline, (TestImageType)type);
+}
+
+function void frame_pipeline_reset_stats(FramePipeline *pipeline)
+{
+    memset(&pipeline->sum, 0, sizeof(pipeline->sum));
+    pipeline->sum_frame_count = 0;
+    pipeline->latency_sum = 0;
+    pipeline->latency_max = 0;
+    pipeline->latency_count = 0;
+}
+
+// Run one frame. Returns false if the active source produced nothing this
+// frame (the previous frame is presented again in that case, as before,
+// unless present_on_demand).
+function bool frame_pipeline_step(FramePipeline *pipeline)
+{
+    ++pipeline->frame_number;
+
+    FrameSource *source = pipeline->sources[pipeline->test_image_type];
+    if (!source)
+        return false;
+
+    u64 frame_begin = profile_begin(PROFILE_FRAME);
+    u64 begin = 0;
+
+    if (!pipeline->test_init)
+    {
+        pipeline->test_init = true;
+        if (pipeline->capture_threaded)
+            capture_thread_start(pipeline, source);
+        else if (source->begin)
+            source->begin(source);
+    }
+
+    FrameTimings t = {};
+    Frame frame = {};
+    bool new_frame = false;
+
+    if (pipeline->capture_threaded)
+    {
+        // latest published frame, if any; the front slot stays ours until the next consume
+        TripleBuffer *handoff = &pipeline->capture.handoff;
+        if (triple_buffer_consume(handoff))
+        {
+            CaptureSlot *slot = &pipeline->capture.slots[triple_buffer_front(handoff)];
+            frame = slot->frame;
+            t.acquire = slot->timings.acquire;
+            t.scale = slot->timings.scale;
+            t.convert = slot->timings.convert;
+            t.stats = slot->timings.stats;
+            new_frame = true;
+        }
+    }
+    else
+    {
+        new_frame = frame_pipeline_capture(pipeline, source, &pipeline->image_buffer, &pipeline->scaled_buffer,
+                                           &pipeline->stats, &frame, &t);
+    }
+
+    frame_health_set_lost(&pipeline->health, pipeline->source_lost.load(std::memory_order_relaxed));
+    if (pipeline->ring)
+        frame_ring_heartbeat(pipeline->ring);
+
+    if (new_frame)
+    {
+        if (frame.stats)
+            frame_health_update(&pipeline->health, frame.stats, frame.timestamp);
+        if (pipeline->recorder)
+            frame_recorder_append(pipeline->recorder, &frame.view, frame.flip_vertical, frame.timestamp);
+        if (pipeline->ring)
+            frame_ring_publish(pipeline->ring, &frame.view, frame.flip_vertical, frame.timestamp);
+
+        bool changed = true;
+        if (pipeline->tile_diff_enabled)
+        {
+            begin = profile_begin(PROFILE_DIFF);
+            TileDiff *diff = &pipeline->tile_diff;
+            diff->queue = pipeline->queue;
+            FrameView *view = &frame.view;
+            pipeline->tiles_dirty += tile_diff_update(diff, view->pixels, view->width, view->height, view->stride);
+            frame.dirty_rects = diff->dirty;
+            frame.dirty_count = diff->dirty_count;
+            changed = diff->dirty_count > 0;
+            t.diff = profile_end(PROFILE_DIFF, begin);
+        }
+
+        pipeline->frame = frame;
+        pipeline->has_frame = true;
+        if (changed)
+            pipeline->upload_pending = true;
+    }
+
+    // the frame shown, while its pixels are still there (a borrowed one is
+    // given back below)
+    if (pipeline->snapshot && pipeline->has_frame && pipeline->frame.view.pixels)
+        snapshot_writer_take(pipeline->snapshot, &pipeline->frame.view, pipeline->frame.flip_vertical);
+
+    // on demand: the window still shows the last present
+    bool present = !pipeline->present_on_demand || pipeline->upload_pending || pipeline->redraw;
+    pipeline->redraw = false;
+    if (!present)
+        pipeline->presents_skipped++;
+
+    if (pipeline->has_frame && pipeline->sink && present)
+    {
+        FrameSink *sink = pipeline->sink;
+
+        if (pipeline->upload_pending)
+        {
+            begin = profile_begin(PROFILE_UPLOAD);
+            Frame *frame = &pipeline->frame;
+            if (sink->upload(sink, frame))
+            {
+                u64 pixels = 0;
+                if (frame->dirty_rects)
+                {
+                    for (u32 i = 0; i < frame->dirty_count; ++i)
+                        pixels += (u64)frame->dirty_rects[i].width * frame->dirty_rects[i].height;
+                }
+                else
+                {
+                    pixels = (u64)frame->view.width * frame->view.height;
+                }
+                pipeline->bytes_uploaded += pixels * 4;
+
+                double latency = (double)(platform_time_ns() - frame->timestamp) * 1e-9;
+                pipeline->latency_sum += latency;
+                if (latency > pipeline->latency_max)
+                    pipeline->latency_max = latency;
+                pipeline->latency_count++;
+                pipeline->upload_pending = false;
+            }
+            else
+            {
+                // the sink kept an older frame than the one the diff moved on to:
+                // whole frames until an upload works, this one again next step
+                // unless it is borrowed and goes back to the source below
+                tile_diff_reset(&pipeline->tile_diff);
+                frame->dirty_rects = 0;
+                frame->dirty_count = 0;
+                pipeline->upload_pending = !frame->borrowed;
+                pipeline->uploads_failed++;
+            }
+            t.upload = profile_end(PROFILE_UPLOAD, begin);
+        }
+        else
+        {
+            pipeline->uploads_skipped++;
+        }
+
+        if (pipeline->frame.borrowed)
+        {
+            // the sink has its copy, the source gets its memory back (before
+            // present, which may block on vsync); an unchanged frame that was
+            // not uploaded is not needed again either
+            frame_pipeline_release(source, &pipeline->frame);
+            pipeline->frame.view.pixels = 0;
+        }
+        begin = profile_begin(PROFILE_PRESENT);
+        if (sink->present)
+            sink->present(sink);
+        t.present = profile_end(PROFILE_PRESENT, begin);
+    }
+
+    // no sink
+    if (pipeline->frame.borrowed)
+    {
+        frame_pipeline_release(source, &pipeline->frame);
+        pipeline->frame.view.pixels = 0;
+    }
+
+    t.total = profile_end(PROFILE_FRAME, frame_begin);
+
+    pipeline->last = t;
+    pipeline->sum.acquire += t.acquire;
+    pipeline->sum.scale += t.scale;
+    pipeline->sum.convert += t.convert;
+    pipeline->sum.stats += t.stats;
+    pipeline->sum.diff += t.diff;
+    pipeline->sum.upload += t.upload;
+    pipeline->sum.present += t.present;
+    pipeline->sum.total += t.total;
+    pipeline->sum_frame_count++;
+
+    return new_frame;
+}
+
+//
+// NOTE: platform-neutral sources
+//
+
+// the original test pattern, generated once when the source becomes active
+struct ColorGenSource {
+    u32 width;  // 0 = 256
+    u32 height; // 0 = 256
+    WorkQueue *queue;
+    bool generated;
+};
+
+function bool color_gen_begin(FrameSource *source)
+{
+    ColorGenSource *gen = (ColorGenSource*)source->user;
+    gen->generated = false;
+    return true;
+}
+
+function bool color_gen_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    ColorGenSource *gen = (ColorGenSource*)source->user;
+
+    // static image, only the first acquire is a new frame
+    if (gen->generated)
+        return false;
+
+    u32 width = gen->width ? gen->width : 256;
+    u32 height = gen->height ? gen->height : 256;
+    if (buffer_size < (u64)width * height * 4)
+    {
+        frame->required_size = (u64)width * height * 4;
+        return false;
+    }
+    gen->generated = true;
+
+    generate_test_pattern(buffer, width, height, width * 4, 0, gen->queue);
+
+    frame->view = frame_view(buffer, width, height, width * 4, PIXEL_FORMAT_RGBA8);
+    return true;
+}
+
+function FrameSource color_gen_source(ColorGenSource *gen)
+{
+    FrameSource source = {};
+    source.name = "color_gen";
+    source.user = gen;
+    source.begin = color_gen_begin;
+    source.acquire = color_gen_acquire;
+    return source;
+}
+
+// image file decoded with stb_image when the source becomes active, copied
+// into the pipeline buffer on the first acquire and freed right away
+struct FileSource {
+    const char *path;
+    bool delivered;
+    u8 *pixels;
+    u32 width;
+    u32 height;
+};
+
+function bool file_source_begin(FrameSource *source)
+{
+    FileSource *file = (FileSource*)source->user;
+
+    int width = 0, height = 0, png_channels = 0;
+    stbi_set_flip_vertically_on_load(true);
+    file->pixels = stbi_load(file->path, &width, &height, &png_channels, 4);
+    if (!file->pixels)
+    {
+        printf("Error: failed to load %s.\n", file->path);
+        return false;
+    }
+
+    file->width = width;
+    file->height = height;
+    file->delivered = false;
+    return true;
+}
+
+function bool file_source_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    FileSource *file = (FileSource*)source->user;
+    if (!file->pixels || file->delivered)
+        return false;
+
+    u64 size = (u64)file->width * file->height * 4;
+    if (buffer_size < size)
+    {
+        frame->required_size = size;
+        return false;
+    }
+
+    memcpy(buffer, file->pixels, size);
+    stbi_image_free(file->pixels);
+    file->pixels = 0;
+    file->delivered = true;
+
+    frame->view = frame_view(buffer, file->width, file->height, file->width * 4, PIXEL_FORMAT_RGBA8);
+    return true;
+}
+
+function void file_source_end(FrameSource *source)
+{
+    FileSource *file = (FileSource*)source->user;
+    if (file->pixels)
+    {
+        stbi_image_free(file->pixels);
+        file->pixels = 0;
+    }
+}
+
+function FrameSource file_source(FileSource *file, const char *path)
+{
+    file->path = path;
+
+    FrameSource source = {};
+    source.name = "file";
+    source.user = file;
+    source.begin = file_source_begin;
+    source.acquire = file_source_acquire;
+    source.end = file_source_end;
+    return source;
+}
+
+// A moving pattern of a given size that changes every frame, stands in for a
+// capture source on machines without a desktop. Like a mapped staging
+// texture it renders top-down into its own memory with a padded row pitch,
+// then lends a view of it (or of the roi) or copies the roi out.
+#define SYNTHETIC_PITCH_ALIGN 256
+
+struct SyntheticSource {
+    u32 width;
+    u32 height;
+    PixelFormat format;
+    bool mostly_static; // static desktop with a blinking cursor instead of a full-frame scroll
+    u32 stall_ms;       // after the first frame every acquire waits this long for none, an idle monitor
+    u8 *surface;
+    u32 stride;
+    u8 *background;     // mostly_static: the surface without the cursor
+    u32 tick;
+    WorkQueue *queue;
+};
+
+function bool synthetic_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    SyntheticSource *synth = (SyntheticSource*)source->user;
+
+    u32 width = synth->width;
+    u32 height = synth->height;
+    FrameRect roi = frame_rect_clip(source->roi, width, height);
+    bool borrow = source->allow_borrow && !source->convert_flags;
+
+    u64 copy_size = (u64)roi.width * roi.height * 4;
+    if (!borrow && buffer_size < copy_size)
+    {
+        frame->required_size = copy_size;
+        return false;
+    }
+    if (synth->stall_ms && synth->tick)
+    {
+        platform_sleep_ms(synth->stall_ms);
+        return false;
+    }
+
+    if (!synth->surface)
+    {
+        synth->stride = (width * 4 + SYNTHETIC_PITCH_ALIGN - 1) & ~(SYNTHETIC_PITCH_ALIGN - 1);
+        synth->surface = (u8*)malloc((u64)synth->stride * height);
+    }
+
+    u32 t = synth->tick++;
+    if (synth->mostly_static)
+    {
+        if (!synth->background)
+        {
+            synth->background = (u8*)malloc((u64)synth->stride * height);
+            generate_test_pattern(synth->background, width, height, synth->stride, 0, synth->queue);
+            memcpy(synth->surface, synth->background, (u64)synth->stride * height);
+        }
+
+        // 2x16 cursor, visible every other 16 frames
+        bool visible = ((t / 16) & 1) != 0;
+        u32 cursor_x = width / 3, cursor_y = height / 3;
+        for (u32 y = cursor_y; y < cursor_y + 16 && y < height; ++y)
+        {
+            u32 *row = (u32*)(synth->surface + (u64)y * synth->stride);
+            u32 *background = (u32*)(synth->background + (u64)y * synth->stride);
+            for (u32 x = cursor_x; x < cursor_x + 2 && x < width; ++x)
+                row[x] = visible ? 0xFF000000 : background[x];
+        }
+    }
+    else
+    {
+        generate_test_pattern(synth->surface, width, height, synth->stride, t, synth->queue);
+    }
+
+    FrameView view = frame_view_sub(frame_view(synth->surface, width, height, synth->stride, synth->format), roi);
+    if (borrow)
+    {
+        frame->view = view;
+        frame->borrowed = true;
+    }
+    else
+    {
+        frame->view = frame_view(buffer, view.width, view.height, view.width * 4, view.format);
+        frame_view_copy(&frame->view, &view, source->convert_flags);
+        frame->applied_flags = source->convert_flags;
+    }
+    frame->flip_vertical = true;
+    return true;
+}
+
+function void synthetic_end(FrameSource *source)
+{
+    SyntheticSource *synth = (SyntheticSource*)source->user;
+    free(synth->surface);
+    free(synth->background);
+    synth->surface = 0;
+    synth->background = 0;
+}
+
+function FrameSource synthetic_source(SyntheticSource *synth, u32 width, u32 height)
+{
+    synth->width = width;
+    synth->height = height;
+    synth->format = PIXEL_FORMAT_BGRA8;
+
+    FrameSource source = {};
+    source.name = "synthetic";
+    source.user = synth;
+    source.acquire = synthetic_acquire;
+    source.end = synthetic_end;
+    return source;
+}
+
+// Frames of a recording (frame_recording.cpp) in order, at the recorded
+// pace or as fast as they are asked for. With borrowing allowed the frames
+// are read straight out of the mapped file (or the decoder's frame for
+// compressed recordings).
+struct ReplaySource {
+    const char *path;
+    FrameRecording recording;
+    WorkQueue *queue; // decodes compressed recordings in parallel, may be 0
+    bool realtime; // wait for each frame's timestamp
+    bool loop;     // start over at the end
+    u64 next;
+    u64 start_ns;
+};
+
+function bool replay_begin(FrameSource *source)
+{
+    ReplaySource *replay = (ReplaySource*)source->user;
+    replay->next = 0;
+    replay->start_ns = platform_time_ns();
+    return frame_recording_open(&replay->recording, replay->path, replay->queue);
+}
+
+function bool replay_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    ReplaySource *replay = (ReplaySource*)source->user;
+    FrameRecording *recording = &replay->recording;
+    if (!recording->frame_count)
+        return false;
+
+    if (replay->next >= recording->frame_count)
+    {
+        if (!replay->loop)
+            return false;
+        replay->next = 0;
+        replay->start_ns = platform_time_ns();
+    }
+
+    FrameRecordEntry *entry = &recording->entries[replay->next];
+    if (replay->realtime && platform_time_ns() - replay->start_ns < entry->timestamp_ns)
+        return false;
+
+    FrameView view;
+    if (!frame_recording_frame(recording, replay->next, &view))
+        return false;
+    view = frame_view_sub(view, source->roi);
+    if (source->allow_borrow && !source->convert_flags)
+    {
+        frame->view = view;
+        frame->borrowed = true;
+    }
+    else
+    {
+        u64 size = (u64)view.width * view.height * 4;
+        if (buffer_size < size)
+        {
+            frame->required_size = size;
+            return false;
+        }
+        frame->view = frame_view(buffer, view.width, view.height, view.width * 4, view.format);
+        frame_view_copy(&frame->view, &view, source->convert_flags);
+        frame->applied_flags = source->convert_flags;
+    }
+    frame->flip_vertical = entry->flip_vertical != 0;
+
+    replay->next++;
+    return true;
+}
+
+function void replay_end(FrameSource *source)
+{
+    ReplaySource *replay = (ReplaySource*)source->user;
+    frame_recording_close(&replay->recording);
+}
+
+function FrameSource replay_source(ReplaySource *replay, const char *path)
+{
+    replay->path = path;
+
+    FrameSource source = {};
+    source.name = "replay";
+    source.user = replay;
+    source.begin = replay_begin;
+    source.acquire = replay_acquire;
+    source.end = replay_end;
+    return source;
+}
+
+//
+// NOTE: platform-neutral sinks
+//
+
+function bool null_sink_upload(FrameSink *sink, Frame *frame)
+{
+    return true;
+}
+
+function FrameSink null_sink()
+{
+    FrameSink sink = {};
+    sink.name = "null";
+    sink.upload = null_sink_upload;
+    return sink;
+}
+
+// copies every frame into memory it owns (tightly packed), stands in for the texture upload
+struct OffscreenSink {
+    u8 *pixels;
+    u64 size;
+    u32 width;
+    u32 height;
+    bool flip_vertical; // orientation of the last frame, a GL sink would flip texcoords
+};
+
+function bool offscreen_sink_upload(FrameSink *sink, Frame *frame)
+{
+    OffscreenSink *offscreen = (OffscreenSink*)sink->user;
+    FrameView *view = &frame->view;
+
+    u64 size = (u64)view->width * view->height * 4;
+    if (offscreen->size < size)
+    {
+        free(offscreen->pixels);
+        offscreen->pixels = (u8*)malloc(size);
+        offscreen->size = offscreen->pixels ? size : 0;
+        if (!offscreen->pixels)
+        {
+            printf("Error: out of memory for the %ux%u offscreen image.\n", view->width, view->height);
+            offscreen->width = offscreen->height = 0;
+            return false;
+        }
+    }
+    offscreen->flip_vertical = frame->flip_vertical;
+
+    FrameView target = frame_view(offscreen->pixels, view->width, view->height, view->width * 4, view->format);
+    if (frame->dirty_rects && offscreen->width == view->width && offscreen->height == view->height)
+    {
+        for (u32 i = 0; i < frame->dirty_count; ++i)
+        {
+            FrameView src = frame_view_sub(*view, frame->dirty_rects[i]);
+            FrameView dst = frame_view_sub(target, frame->dirty_rects[i]);
+            frame_view_copy(&dst, &src, 0);
+        }
+        return true;
+    }
+
+    frame_view_copy(&target, view, 0);
+    offscreen->width = view->width;
+    offscreen->height = view->height;
+    return true;
+}
+
+function FrameSink offscreen_sink(OffscreenSink *offscreen)
+{
+    FrameSink sink = {};
+    sink.name = "offscreen";
+    sink.user = offscreen;
+    sink.upload = offscreen_sink_upload;
+    return sink;
+}
+
+// Frames as planar YUV for a video encoder: every upload is converted
+// (only the dirty tiles when the frame size did not change; tiles are 64
+// aligned, so their chroma blocks are whole), every present appends the
+// current image to file when set, a raw stream ffmpeg reads with
+// -f rawvideo -pix_fmt nv12|yuv420p -s WxH.
+struct YuvSink {
+    YuvLayout layout;
+    u32 flags; // YUV_BT709, YUV_FULL_RANGE; the orientation comes from the frame
+    WorkQueue *queue;
+    FILE *file; // optional
+
+    u8 *memory;
+    u64 capacity;
+    YuvImage image;
+    bool valid; // image holds the last uploaded frame
+    u64 frames_written;
+};
+
+function bool yuv_sink_upload(FrameSink *sink, Frame *frame)
+{
+    YuvSink *yuv = (YuvSink*)sink->user;
+    FrameView *view = &frame->view;
+
+    // frames are bottom-up unless the sink is told to flip, encoders want top-down
+    u32 flags = yuv->flags | (frame->flip_vertical ? 0 : YUV_FLIP_Y);
+
+    if (frame->dirty_rects && yuv->valid && yuv->image.width == view->width && yuv->image.height == view->height)
+    {
+        for (u32 i = 0; i < frame->dirty_count; ++i)
+        {
+            FrameRect rect = frame->dirty_rects[i];
+            if (flags & YUV_FLIP_Y)
+                rect.y = view->height - rect.y - rect.height;
+            yuv_convert_rect(&yuv->image, view, rect, flags, yuv->queue);
+        }
+        return true;
+    }
+
+    u64 size = yuv_image_size(view->width, view->height);
+    if (yuv->capacity < size)
+    {
+        free(yuv->memory);
+        yuv->memory = (u8*)malloc(size);
+        yuv->capacity = yuv->memory ? size : 0;
+        if (!yuv->memory)
+        {
+            printf("Error: out of memory for the YUV image.\n");
+            yuv->valid = false;
+            return false;
+        }
+    }
+    yuv->image = yuv_image(yuv->memory, yuv->layout, view->width, view->height);
+    yuv_convert(&yuv->image, view, flags, yuv->queue);
+    yuv->valid = true;
+    return true;
+}
+
+function void yuv_sink_present(FrameSink *sink)
+{
+    YuvSink *yuv = (YuvSink*)sink->user;
+    if (!yuv->file || !yuv->valid)
+        return;
+
+    u64 size = yuv_image_size(yuv->image.width, yuv->image.height);
+    if (fwrite(yuv->memory, 1, size, yuv->file) != size)
+    {
+        printf("Error: failed to write the YUV stream.\n");
+        yuv->file = 0;
+        return;
+    }
+    yuv->frames_written++;
+}
+
+function void yuv_sink_destroy(YuvSink *yuv)
+{
+    free(yuv->memory);
+    yuv->memory = 0;
+    yuv->capacity = 0;
+    yuv->valid = false;
+}
+
+function FrameSink yuv_sink(YuvSink *yuv)
+{
+    FrameSink sink = {};
+    sink.name = "yuv";
+    sink.user = yuv;
+    sink.upload = yuv_sink_upload;
+    sink.present = yuv_sink_present;
+    return sink;
+}
@@ -0,0 +1,390 @@
+/*
+
+  Frame recording
+  ---------------
+  Raw frames from any source appended to a file, so a capture workload can
+  be replayed bit for bit on a machine without that desktop (see the replay
+  source in frame_pipeline.cpp, headless -record / -source replay).
+
+  Layout, everything page aligned so the replay can hand out views straight
+  into the mapped file:
+
+      page 0        FrameRecordingHeader
+      per frame     FrameRecordEntry, padding to the next page,
+                    height rows of width * 4 bytes, padding to the next page
+      at close      the array of all FrameRecordEntry (the index)
+
+  The header gets frame_count / index_offset when the recording is closed.
+  A recording that was never closed (crash, killed) has no index; the
+  reader then walks the per-frame entries instead.
+
+  Pixels are stored as they arrived (format, orientation), timestamps are
+  nanoseconds since the first frame.
+
+  With FRAME_CODEC_TILE every frame is stored tile_codec.cpp encoded
+  instead, right behind its entry (16 byte aligned, no page padding). Those
+  frames can't be viewed in place: frame_recording_frame decodes them,
+  walking forward from the last keyframe when asked for a frame that
+  doesn't follow the one decoded before.
+
+ */
+
+#define FRAME_RECORDING_MAGIC   0x434552454d415246ull // "FRAMEREC"
+#define FRAME_RECORD_MAGIC      0x454d5246u           // "FRME"
+#define FRAME_RECORDING_VERSION 1
+#define FRAME_RECORDING_PAGE    4096
+#define FRAME_RECORDING_PACKED_ALIGN 16
+
+enum FrameCodec {
+    FRAME_CODEC_RAW,  // tightly packed pixels, page aligned
+    FRAME_CODEC_TILE, // tile_codec.cpp frames
+};
+
+struct FrameRecordingHeader {
+    u64 magic;
+    u32 version;
+    u32 page_size;
+    u64 frame_count;  // 0 until closed
+    u64 index_offset; // 0 until closed
+    u32 codec;        // FrameCodec of every frame
+    u8 reserved[28];
+};
+
+struct FrameRecordEntry {
+    u32 magic;
+    u32 format; // PixelFormat
+    u32 width;
+    u32 height;
+    u32 stride;
+    u32 flip_vertical;
+    u64 timestamp_ns; // since the first frame
+    u64 offset;       // of the pixels in the file
+    u64 size;         // of the pixels, stride * height, or of the encoded frame
+    u32 keyframe;     // FRAME_CODEC_TILE: decodes without the frames before it
+    u8 reserved[12];
+};
+
+function u64 frame_recording_align(u64 offset)
+{
+    return (offset + FRAME_RECORDING_PAGE - 1) & ~((u64)FRAME_RECORDING_PAGE - 1);
+}
+
+// where the next entry starts after a frame that ends at offset
+function u64 frame_recording_next(u32 codec, u64 offset)
+{
+    if (codec == FRAME_CODEC_RAW)
+        return frame_recording_align(offset);
+    return (offset + FRAME_RECORDING_PACKED_ALIGN - 1) & ~((u64)FRAME_RECORDING_PACKED_ALIGN - 1);
+}
+
+//
+// NOTE: writing
+//
+
+struct FrameRecorder {
+    FILE *file;
+    u64 offset; // end of the file
+    bool failed;
+
+    FrameRecordEntry *index;
+    u64 frame_count;
+    u64 index_capacity;
+
+    u64 first_timestamp_ns;
+
+    u32 codec;           // FrameCodec
+    TileEncoder encoder; // FRAME_CODEC_TILE
+    u64 raw_bytes;       // what the frames would take uncompressed
+};
+
+function bool frame_recorder_write(FrameRecorder *recorder, void *data, u64 size)
+{
+    if (recorder->failed)
+        return false;
+    if (size && fwrite(data, 1, size, recorder->file) != size)
+    {
+        printf("Error: failed to write the recording, stopped recording.\n");
+        recorder->failed = true;
+        return false;
+    }
+    recorder->offset += size;
+    return true;
+}
+
+// zeros up to offset, less than a page away
+function bool frame_recorder_pad(FrameRecorder *recorder, u64 offset)
+{
+    static u8 zeros[FRAME_RECORDING_PAGE];
+    return frame_recorder_write(recorder, zeros, offset - recorder->offset);
+}
+
+// queue encodes the tiles of FRAME_CODEC_TILE frames in parallel, may be 0
+function bool frame_recorder_open(FrameRecorder *recorder, const char *path, FrameCodec codec, WorkQueue *queue)
+{
+    memset(recorder, 0, sizeof(FrameRecorder));
+    recorder->codec = codec;
+    recorder->encoder.queue = queue;
+    recorder->file = fopen(path, "wb");
+    if (!recorder->file)
+    {
+        printf("Error: failed to create the recording %s.\n", path);
+        return false;
+    }
+
+    FrameRecordingHeader header = {};
+    header.magic = FRAME_RECORDING_MAGIC;
+    header.version = FRAME_RECORDING_VERSION;
+    header.page_size = FRAME_RECORDING_PAGE;
+    header.codec = codec;
+    frame_recorder_write(recorder, &header, sizeof(header));
+    return frame_recorder_pad(recorder, FRAME_RECORDING_PAGE);
+}
+
+// append one frame, timestamp_ns from platform_time_ns
+function bool frame_recorder_append(FrameRecorder *recorder, FrameView *view, bool flip_vertical, u64 timestamp_ns)
+{
+    if (!recorder->file || recorder->failed)
+        return false;
+
+    if (recorder->frame_count == 0)
+        recorder->first_timestamp_ns = timestamp_ns;
+
+    FrameRecordEntry entry = {};
+    entry.magic = FRAME_RECORD_MAGIC;
+    entry.format = view->format;
+    entry.width = view->width;
+    entry.height = view->height;
+    entry.stride = view->width * 4;
+    entry.flip_vertical = flip_vertical;
+    entry.timestamp_ns = timestamp_ns - recorder->first_timestamp_ns;
+    entry.keyframe = 1;
+    recorder->raw_bytes += (u64)entry.stride * view->height;
+
+    if (recorder->codec == FRAME_CODEC_TILE)
+    {
+        u64 begin = profile_begin(PROFILE_ENCODE);
+        bool encoded = tile_encoder_encode(&recorder->encoder, view, false);
+        profile_end(PROFILE_ENCODE, begin);
+        if (!encoded)
+        {
+            recorder->failed = true;
+            return false;
+        }
+
+        entry.keyframe = recorder->encoder.keyframe;
+        entry.size = recorder->encoder.output_size;
+        entry.offset = recorder->offset + sizeof(entry);
+        frame_recorder_write(recorder, &entry, sizeof(entry));
+        frame_recorder_write(recorder, recorder->encoder.output, entry.size);
+        frame_recorder_pad(recorder, frame_recording_next(recorder->codec, recorder->offset));
+    }
+    else
+    {
+        entry.size = (u64)entry.stride * view->height;
+        entry.offset = recorder->offset + FRAME_RECORDING_PAGE;
+
+        frame_recorder_write(recorder, &entry, sizeof(entry));
+        frame_recorder_pad(recorder, entry.offset);
+        Assert(recorder->failed || recorder->offset == entry.offset);
+
+        // rows are stored tightly packed whatever the stride of the view
+        if (view->stride == entry.stride)
+        {
+            frame_recorder_write(recorder, view->pixels, entry.size);
+        }
+        else
+        {
+            for (u32 y = 0; y < view->height; ++y)
+                frame_recorder_write(recorder, view->pixels + (u64)y * view->stride, entry.stride);
+        }
+        frame_recorder_pad(recorder, frame_recording_next(recorder->codec, recorder->offset));
+    }
+
+    if (recorder->failed)
+        return false;
+
+    if (recorder->frame_count == recorder->index_capacity)
+    {
+        recorder->index_capacity = recorder->index_capacity ? recorder->index_capacity * 2 : 256;
+        recorder->index = (FrameRecordEntry*)realloc(recorder->index, recorder->index_capacity * sizeof(FrameRecordEntry));
+    }
+    recorder->index[recorder->frame_count++] = entry;
+    return true;
+}
+
+// write the index and finish the header
+function void frame_recorder_close(FrameRecorder *recorder)
+{
+    if (!recorder->file)
+        return;
+
+    FrameRecordingHeader header = {};
+    header.magic = FRAME_RECORDING_MAGIC;
+    header.version = FRAME_RECORDING_VERSION;
+    header.page_size = FRAME_RECORDING_PAGE;
+    header.index_offset = recorder->offset;
+    header.frame_count = recorder->frame_count;
+    header.codec = recorder->codec;
+
+    if (frame_recorder_write(recorder, recorder->index, recorder->frame_count * sizeof(FrameRecordEntry)) &&
+        fseek(recorder->file, 0, SEEK_SET) == 0)
+    {
+        fwrite(&header, 1, sizeof(header), recorder->file);
+    }
+
+    fclose(recorder->file);
+    free(recorder->index);
+    tile_encoder_destroy(&recorder->encoder);
+    memset(recorder, 0, sizeof(FrameRecorder));
+}
+
+//
+// NOTE: reading
+//
+
+struct FrameRecording {
+    PlatformFileMapping file;
+    FrameRecordEntry *entries; // in the mapping, or scanned (owns_entries)
+    u64 frame_count;
+    bool owns_entries;
+    u32 codec; // FrameCodec
+
+    TileDecoder decoder; // FRAME_CODEC_TILE, set decoder.queue to decode in parallel
+    u64 decoded;         // index of the frame in decoder.frame
+};
+
+function bool frame_record_entry_valid(FrameRecording *recording, FrameRecordEntry *entry)
+{
+    bool stored = recording->codec == FRAME_CODEC_RAW ?
+        entry->size == (u64)entry->stride * entry->height && (entry->offset % FRAME_RECORDING_PAGE) == 0 :
+        (entry->offset % FRAME_RECORDING_PACKED_ALIGN) == 0;
+    return entry->magic == FRAME_RECORD_MAGIC &&
+        entry->stride >= entry->width * 4 && stored &&
+        entry->offset <= recording->file.size && entry->size <= recording->file.size - entry->offset;
+}
+
+// index of a recording that was not closed, rebuilt from the per-frame entries
+function void frame_recording_scan(FrameRecording *recording)
+{
+    u64 capacity = 0;
+    u64 offset = FRAME_RECORDING_PAGE;
+    while (offset + sizeof(FrameRecordEntry) <= recording->file.size)
+    {
+        FrameRecordEntry *entry = (FrameRecordEntry*)(recording->file.data + offset);
+        if (!frame_record_entry_valid(recording, entry))
+            break;
+
+        if (recording->frame_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            recording->entries = (FrameRecordEntry*)realloc(recording->entries, capacity * sizeof(FrameRecordEntry));
+        }
+        recording->entries[recording->frame_count++] = *entry;
+        offset = frame_recording_next(recording->codec, entry->offset + entry->size);
+    }
+    recording->owns_entries = true;
+}
+
+function void frame_recording_close(FrameRecording *recording)
+{
+    if (recording->owns_entries)
+        free(recording->entries);
+    platform_unmap_file(&recording->file);
+    tile_decoder_destroy(&recording->decoder);
+    memset(recording, 0, sizeof(FrameRecording));
+}
+
+// queue decodes FRAME_CODEC_TILE frames in parallel, may be 0
+function bool frame_recording_open(FrameRecording *recording, const char *path, WorkQueue *queue)
+{
+    memset(recording, 0, sizeof(FrameRecording));
+    recording->decoder.queue = queue;
+    if (!platform_map_file(&recording->file, path))
+    {
+        printf("Error: failed to open the recording %s.\n", path);
+        return false;
+    }
+
+    FrameRecordingHeader *header = (FrameRecordingHeader*)recording->file.data;
+    if (recording->file.size < FRAME_RECORDING_PAGE || header->magic != FRAME_RECORDING_MAGIC ||
+        header->version != FRAME_RECORDING_VERSION || header->codec > FRAME_CODEC_TILE)
+    {
+        printf("Error: %s is not a frame recording.\n", path);
+        frame_recording_close(recording);
+        return false;
+    }
+    recording->codec = header->codec;
+
+    u64 index_size = header->frame_count * sizeof(FrameRecordEntry);
+    if (header->index_offset && header->index_offset <= recording->file.size &&
+        index_size <= recording->file.size - header->index_offset)
+    {
+        recording->entries = (FrameRecordEntry*)(recording->file.data + header->index_offset);
+        recording->frame_count = header->frame_count;
+        for (u64 i = 0; i < recording->frame_count; ++i)
+        {
+            if (!frame_record_entry_valid(recording, &recording->entries[i]))
+            {
+                printf("Error: %s has a broken index.\n", path);
+                frame_recording_close(recording);
+                return false;
+            }
+        }
+    }
+    else
+    {
+        printf("%s was not closed, scanning for frames.\n", path);
+        frame_recording_scan(recording);
+    }
+
+    return true;
+}
+
+// the frame in place in the mapped file, valid until frame_recording_close,
+// FRAME_CODEC_RAW only
+function FrameView frame_recording_view(FrameRecording *recording, u64 index)
+{
+    Assert(recording->codec == FRAME_CODEC_RAW);
+    FrameRecordEntry *entry = &recording->entries[index];
+    return frame_view(recording->file.data + entry->offset, entry->width, entry->height, entry->stride, (PixelFormat)entry->format);
+}
+
+// Any frame of any recording. FRAME_CODEC_TILE frames are decoded into the
+// recording's decoder, the view is valid until the next call; the next
+// frame in order costs one decode, a seek decodes from the keyframe before.
+function bool frame_recording_frame(FrameRecording *recording, u64 index, FrameView *view)
+{
+    if (index >= recording->frame_count)
+        return false;
+    if (recording->codec == FRAME_CODEC_RAW)
+    {
+        *view = frame_recording_view(recording, index);
+        return true;
+    }
+
+    TileDecoder *decoder = &recording->decoder;
+    FrameRecordEntry *entry = &recording->entries[index];
+    if (!decoder->valid || recording->decoded != index)
+    {
+        u64 first = index;
+        if (!(decoder->valid && recording->decoded + 1 == index))
+        {
+            while (first > 0 && !recording->entries[first].keyframe)
+                --first;
+        }
+
+        for (u64 i = first; i <= index; ++i)
+        {
+            FrameRecordEntry *e = &recording->entries[i];
+            if (!tile_decoder_decode(decoder, recording->file.data + e->offset, e->size))
+            {
+                printf("Error: failed to decode recorded frame %llu.\n", (unsigned long long)i);
+                return false;
+            }
+            recording->decoded = i;
+        }
+    }
+
+    *view = frame_view(decoder->frame, decoder->width, decoder->height, decoder->width * 4, (PixelFormat)entry->format);
+    return true;
+}
@@ -0,0 +1,416 @@
+/*
+
+  Frame ring
+  ----------
+  Captured frames published into named shared memory (platform.cpp) so
+  other processes on the host (an encoder, OCR, an archiver) read them in
+  place: no copies on their side, no sockets, no locks.
+
+  Layout, the pixels of every slot page aligned:
+
+      FrameRingHeader   geometry, the latest frame, writer stats, then the
+                        metadata of every slot and the reader cursors
+      pixels            slot_count x slot_size bytes
+
+  Every published frame gets the next sequence number (1, 2, ..). A
+  slot's sequence is twice that once the frame in it is complete and odd
+  while the writer fills it; latest names the newest complete frame.
+
+  A reader claims a cursor when it opens the ring. To take a frame it
+  stores the slot in its cursor and then checks that the slot still holds
+  the sequence latest named. The writer marks a slot odd and then checks
+  that no cursor holds it, backing off to the next slot if one does. Both
+  sides store before they load (seq_cst), so either the reader sees the
+  mark and retries or the writer sees the cursor: a frame a reader holds
+  is never overwritten. There are two more slots than readers, so the
+  writer always finds a free one and never waits; a reader that falls
+  behind only skips frames (missed).
+
+  A cursor whose heartbeat is older than FRAME_RING_READER_TIMEOUT_NS (a
+  crashed or stuck reader) no longer holds its slot, and another reader
+  may take the cursor over; readers poll more often than that.
+
+  Only one writer owns a name. Creating a ring that exists fails while its
+  writer lives; one that was closed, or whose writer has not beaten for
+  FRAME_RING_WRITER_TIMEOUT_NS (crashed), is replaced. Readers of the old
+  one keep their mapping and see the writer gone.
+
+  The writer copies each frame once, tightly packed, into the slot.
+  Frames bigger than the slot size given at create are not published
+  (too_big). Timestamps are platform_time_ns, the same monotonic clock in
+  every process, so a reader can tell how old a frame is.
+
+ */
+#include <atomic>
+
+#define FRAME_RING_MAGIC    0x474e49524d415246ull // "FRAMRING"
+#define FRAME_RING_VERSION  1
+#define FRAME_RING_SLOTS    8 // most slots of a ring
+#define FRAME_RING_PAGE     4096
+#define FRAME_RING_READER_TIMEOUT_NS 2000000000ull
+#define FRAME_RING_WRITER_TIMEOUT_NS 2000000000ull
+
+struct FrameRingSlot {
+    std::atomic<u64> sequence; // 2 * frame sequence when complete, odd while written, 0 = never used
+    u32 width;
+    u32 height;
+    u32 stride;
+    u32 format; // PixelFormat
+    u32 flip_vertical;
+    u32 reserved;
+    u64 timestamp; // platform_time_ns of the capture
+};
+
+struct FrameRingCursor {
+    std::atomic<u32> active;    // claimed by a reader
+    std::atomic<u32> slot;      // held slot + 1, 0 = none
+    std::atomic<u64> sequence;  // of the last frame taken
+    std::atomic<u64> heartbeat; // platform_time_ns of the last poll
+    u32 process_id;
+    u32 reserved;
+};
+
+struct FrameRingHeader {
+    u64 magic;
+    u32 version;
+    u32 slot_count;
+    u32 reader_count;  // cursors in use at most, slot_count - 2
+    u32 writer_process;
+    u64 slot_size;     // pixel bytes per slot
+    u64 pixels_offset; // of the first slot's pixels
+    u64 total_size;
+
+    std::atomic<u64> latest;    // sequence << 8 | slot of the newest complete frame, 0 = none yet
+    std::atomic<u64> heartbeat; // platform_time_ns of the last publish or frame_ring_heartbeat
+    std::atomic<u32> closed;    // the writer is gone, nothing new will come
+
+    // writer stats
+    std::atomic<u64> published;
+    std::atomic<u64> dropped; // no free slot
+    std::atomic<u64> too_big;
+
+    FrameRingSlot slots[FRAME_RING_SLOTS];
+    FrameRingCursor cursors[FRAME_RING_SLOTS - 2];
+};
+
+function u8 *frame_ring_pixels(FrameRingHeader *header, u32 slot)
+{
+    return (u8*)header + header->pixels_offset + slot * header->slot_size;
+}
+
+// a live reader holds the slot
+function bool frame_ring_slot_held(FrameRingHeader *header, u32 slot, u64 now)
+{
+    for (u32 i = 0; i < header->reader_count; ++i)
+    {
+        FrameRingCursor *cursor = &header->cursors[i];
+        if (cursor->slot.load() != slot + 1)
+            continue;
+        // heartbeats may be newer than now
+        if (cursor->heartbeat.load(std::memory_order_relaxed) + FRAME_RING_READER_TIMEOUT_NS > now)
+            return true;
+    }
+    return false;
+}
+
+// the shared memory holds a frame ring this build can read
+function bool frame_ring_header_valid(PlatformSharedMemory *memory)
+{
+    FrameRingHeader *header = (FrameRingHeader*)memory->data;
+    return memory->size >= sizeof(FrameRingHeader) && header->magic == FRAME_RING_MAGIC &&
+        header->version == FRAME_RING_VERSION && memory->size >= header->total_size &&
+        header->slot_count <= FRAME_RING_SLOTS && header->reader_count <= header->slot_count - 2;
+}
+
+// the writer closed the ring or stopped beating for timeout_ns
+function bool frame_ring_header_writer_gone(FrameRingHeader *header, u64 timeout_ns)
+{
+    return header->closed.load() || header->heartbeat.load(std::memory_order_relaxed) + timeout_ns < platform_time_ns();
+}
+
+//
+// NOTE: writer
+//
+
+struct FrameRing {
+    PlatformSharedMemory memory;
+    FrameRingHeader *header;
+    u32 next;         // slot to try first, the oldest
+    u64 sequence;     // of the last frame published
+    WorkQueue *queue; // copies rows in parallel, may be 0
+};
+
+// slot_count slots (3..FRAME_RING_SLOTS) of frames up to max_frame_bytes
+function bool frame_ring_create(FrameRing *ring, const char *name, u32 slot_count, u64 max_frame_bytes)
+{
+    memset(ring, 0, sizeof(FrameRing));
+    if (slot_count < 3)
+        slot_count = 3;
+    if (slot_count > FRAME_RING_SLOTS)
+        slot_count = FRAME_RING_SLOTS;
+
+    u64 page = FRAME_RING_PAGE;
+    u64 slot_size = (max_frame_bytes + page - 1) & ~(page - 1);
+    u64 pixels_offset = (sizeof(FrameRingHeader) + page - 1) & ~(page - 1);
+    u64 total_size = pixels_offset + slot_count * slot_size;
+    bool created = platform_shared_memory_create(&ring->memory, name, total_size);
+    if (!created)
+    {
+        // left behind by a writer that closed or crashed, never a live one
+        PlatformSharedMemory old;
+        if (platform_shared_memory_open(&old, name))
+        {
+            bool gone = frame_ring_header_valid(&old) &&
+                frame_ring_header_writer_gone((FrameRingHeader*)old.data, FRAME_RING_WRITER_TIMEOUT_NS);
+            platform_shared_memory_close(&old);
+            if (gone)
+            {
+                platform_shared_memory_remove(name);
+                created = platform_shared_memory_create(&ring->memory, name, total_size);
+            }
+        }
+    }
+    if (!created)
+    {
+        printf("Error: can't create the shared frame ring %s (%.1f MB).\n", name, total_size / (1024.0 * 1024.0));
+        return false;
+    }
+
+    // fresh memory is zeroed: no frame yet, every cursor free
+    FrameRingHeader *header = (FrameRingHeader*)ring->memory.data;
+    header->magic = FRAME_RING_MAGIC;
+    header->version = FRAME_RING_VERSION;
+    header->slot_count = slot_count;
+    header->reader_count = slot_count - 2;
+    header->writer_process = platform_process_id();
+    header->slot_size = slot_size;
+    header->pixels_offset = pixels_offset;
+    header->total_size = total_size;
+    header->heartbeat.store(platform_time_ns());
+    ring->header = header;
+    return true;
+}
+
+// readers see no new frames after this, their mappings stay valid
+function void frame_ring_close(FrameRing *ring)
+{
+    if (!ring->header)
+        return;
+    ring->header->closed.store(1);
+    platform_shared_memory_close(&ring->memory);
+    ring->header = 0;
+}
+
+// the writer is alive while no new frame comes, call it every capture step
+function void frame_ring_heartbeat(FrameRing *ring)
+{
+    ring->header->heartbeat.store(platform_time_ns(), std::memory_order_relaxed);
+}
+
+// copy view into the oldest slot no reader holds and make it the latest,
+// false when it was not published (too big, every slot held)
+function bool frame_ring_publish(FrameRing *ring, FrameView *view, bool flip_vertical, u64 timestamp)
+{
+    FrameRingHeader *header = ring->header;
+    u64 now = platform_time_ns();
+    header->heartbeat.store(now, std::memory_order_relaxed);
+
+    u32 stride = view->width * 4;
+    if ((u64)stride * view->height > header->slot_size)
+    {
+        header->too_big.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    for (u32 attempt = 0; attempt < header->slot_count; ++attempt)
+    {
+        u32 index = (ring->next + attempt) % header->slot_count;
+        if (frame_ring_slot_held(header, index, now))
+            continue;
+
+        FrameRingSlot *slot = &header->slots[index];
+        u64 previous = slot->sequence.load(std::memory_order_relaxed);
+        slot->sequence.store(previous | 1);
+        if (frame_ring_slot_held(header, index, now))
+        {
+            // a reader took it in between, its frame is still intact
+            slot->sequence.store(previous);
+            continue;
+        }
+
+        FrameView dst = frame_view(frame_ring_pixels(header, index), view->width, view->height, stride, view->format);
+        frame_view_copy_parallel(&dst, view, 0, ring->queue);
+
+        slot->width = view->width;
+        slot->height = view->height;
+        slot->stride = stride;
+        slot->format = view->format;
+        slot->flip_vertical = flip_vertical;
+        slot->timestamp = timestamp;
+
+        u64 sequence = ++ring->sequence;
+        slot->sequence.store(sequence * 2, std::memory_order_release);
+        header->latest.store(sequence << 8 | index, std::memory_order_release);
+        header->published.fetch_add(1, std::memory_order_relaxed);
+        ring->next = index + 1;
+        return true;
+    }
+
+    header->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// readers attached right now
+function u32 frame_ring_reader_count(FrameRing *ring)
+{
+    u32 count = 0;
+    for (u32 i = 0; i < ring->header->reader_count; ++i)
+        count += ring->header->cursors[i].active.load(std::memory_order_relaxed);
+    return count;
+}
+
+//
+// NOTE: reader
+//
+// The reader side, everything another process needs besides platform.cpp
+// and the FrameView of image_processing.cpp.
+//
+
+struct FrameRingReader {
+    PlatformSharedMemory memory;
+    FrameRingHeader *header;
+    FrameRingCursor *cursor;
+    u64 sequence; // of the last frame taken, 0 = none yet
+    u32 held;     // slot + 1 of the frame taken, 0 = none
+
+    u64 frames;
+    u64 missed;  // published frames skipped between two takes
+    u64 retries; // takes that raced the writer
+};
+
+struct FrameRingFrame {
+    FrameView view; // into the shared memory, valid until frame_ring_release
+    u64 sequence;
+    u64 timestamp;  // platform_time_ns of the capture
+    bool flip_vertical;
+};
+
+function bool frame_ring_open(FrameRingReader *reader, const char *name)
+{
+    memset(reader, 0, sizeof(FrameRingReader));
+    if (!platform_shared_memory_open(&reader->memory, name))
+    {
+        printf("Error: no shared frame ring %s.\n", name);
+        return false;
+    }
+
+    FrameRingHeader *header = (FrameRingHeader*)reader->memory.data;
+    if (!frame_ring_header_valid(&reader->memory))
+    {
+        printf("Error: %s is not a version %u frame ring.\n", name, FRAME_RING_VERSION);
+        platform_shared_memory_close(&reader->memory);
+        return false;
+    }
+    reader->header = header;
+
+    // a free cursor, else one whose reader stopped polling
+    u64 now = platform_time_ns();
+    for (u32 i = 0; i < header->reader_count && !reader->cursor; ++i)
+    {
+        FrameRingCursor *cursor = &header->cursors[i];
+        u32 free = 0;
+        u64 heartbeat = cursor->heartbeat.load();
+        if (cursor->active.compare_exchange_strong(free, 1) ||
+            (heartbeat + FRAME_RING_READER_TIMEOUT_NS <= now && cursor->heartbeat.compare_exchange_strong(heartbeat, now)))
+            reader->cursor = cursor;
+    }
+    if (!reader->cursor)
+    {
+        printf("Error: frame ring %s already has %u readers.\n", name, header->reader_count);
+        platform_shared_memory_close(&reader->memory);
+        return false;
+    }
+
+    FrameRingCursor *cursor = reader->cursor;
+    cursor->slot.store(0);
+    cursor->sequence.store(0, std::memory_order_relaxed);
+    cursor->heartbeat.store(now);
+    cursor->process_id = platform_process_id();
+    return true;
+}
+
+// give the frame taken back, false if it was overwritten while held
+// (the reader went quiet for longer than FRAME_RING_READER_TIMEOUT_NS)
+function bool frame_ring_release(FrameRingReader *reader)
+{
+    if (!reader->held)
+        return true;
+    FrameRingSlot *slot = &reader->header->slots[reader->held - 1];
+    bool intact = slot->sequence.load(std::memory_order_acquire) == reader->sequence * 2;
+    reader->cursor->slot.store(0, std::memory_order_release);
+    reader->cursor->heartbeat.store(platform_time_ns(), std::memory_order_relaxed);
+    reader->held = 0;
+    return intact;
+}
+
+// the newest frame if it is newer than the last one taken, read it in
+// place until frame_ring_release (or the next take, which releases it)
+function bool frame_ring_take(FrameRingReader *reader, FrameRingFrame *frame)
+{
+    frame_ring_release(reader);
+
+    FrameRingHeader *header = reader->header;
+    FrameRingCursor *cursor = reader->cursor;
+    cursor->heartbeat.store(platform_time_ns(), std::memory_order_relaxed);
+
+    // the writer only gets ahead again between the load and the check
+    for (u32 attempt = 0; attempt < header->slot_count; ++attempt)
+    {
+        u64 latest = header->latest.load(std::memory_order_acquire);
+        u64 sequence = latest >> 8;
+        u32 index = latest & 0xff;
+        if (sequence <= reader->sequence || index >= header->slot_count)
+            return false;
+
+        cursor->slot.store(index + 1);
+        FrameRingSlot *slot = &header->slots[index];
+        if (slot->sequence.load() != sequence * 2)
+        {
+            cursor->slot.store(0, std::memory_order_relaxed);
+            ++reader->retries;
+            continue;
+        }
+
+        frame->view = frame_view(frame_ring_pixels(header, index), slot->width, slot->height, slot->stride,
+                                 (PixelFormat)slot->format);
+        frame->sequence = sequence;
+        frame->timestamp = slot->timestamp;
+        frame->flip_vertical = slot->flip_vertical != 0;
+
+        if (reader->sequence)
+            reader->missed += sequence - reader->sequence - 1;
+        reader->sequence = sequence;
+        reader->held = index + 1;
+        ++reader->frames;
+        cursor->sequence.store(sequence, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+// the writer closed the ring or stopped beating for timeout_ns
+function bool frame_ring_writer_gone(FrameRingReader *reader, u64 timeout_ns)
+{
+    return frame_ring_header_writer_gone(reader->header, timeout_ns);
+}
+
+function void frame_ring_reader_close(FrameRingReader *reader)
+{
+    if (!reader->header)
+        return;
+    frame_ring_release(reader);
+    reader->cursor->active.store(0);
+    platform_shared_memory_close(&reader->memory);
+    reader->header = 0;
+    reader->cursor = 0;
+}
@@ -0,0 +1,349 @@
+/*
+
+  Frame statistics
+  ----------------
+  One pass over a frame for the capture health checks: R, G, B and luma
+  histograms, the mean and variance of each (taken from the histograms)
+  and a 64 bit fingerprint that changes when any counted pixel does.
+
+  With step > 1 only every step-th pixel of every step-th row is read. A
+  step of 4 reads 1/16 of a 4K frame and still fills the histograms well
+  enough to tell a black or blank frame; the fingerprint then only covers
+  the sampled pixels.
+
+  Luma (BT.709, Q8 weights) and the fingerprint are SSE2, four pixels at a
+  time. The histogram increments stay scalar (a scatter), spread over two
+  copies so a run of equal pixels does not wait on its own stores. Rows
+  are split across the work queue, every chunk counts into its own
+  histograms and merges them when done. The fingerprint is a sum of
+  per-row hashes, so it does not depend on how the rows were split.
+
+  FrameHealth turns the stats of consecutive frames into flags: black,
+  uniform (one flat color, a blank frame), frozen (the same fingerprint
+  for longer than frozen_after_ns) and lost (the source lost its device,
+  DXGI_ERROR_ACCESS_LOST). DXGI delivers nothing at all on a static
+  desktop, so frozen only shows for sources that keep delivering
+  identical frames.
+
+ */
+
+#define FRAME_STATS_LUMA 3 // histogram index after R, G, B
+
+struct FrameStats {
+    u32 width; // of the frame
+    u32 height;
+    u32 step;    // every step-th pixel of every step-th row was counted
+    u64 samples; // pixels in each histogram
+
+    u32 histogram[4][256]; // R, G, B, luma
+    double mean[4];
+    double variance[4];
+    u32 luma_min;
+    u32 luma_max;
+
+    u64 fingerprint; // equal for equal frames sampled with the same step
+};
+
+struct FrameStatsJob {
+    FrameView *view;
+    u32 step;
+    s16 weights[3]; // luma weights of memory channels 0, 1, 2
+    u32 channel[3]; // histogram of memory channels 0, 1, 2
+    FrameStats *stats;
+    std::mutex merge;
+};
+
+function inline u64 frame_stats_mix(u64 x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// luma of count pixels into luma, returns the hash of the row; pixel i
+// goes into hash lane i % 4 so the SSE2 loop and the tail agree
+function u64 frame_stats_row(u8 *pixels, u32 count, s16 *weights, u8 *luma)
+{
+    u32 lanes[4] = { 0x9E3779B9, 0x85EBCA6B, 0xC2B2AE35, 0x27D4EB2F };
+    u32 i = 0;
+#if IMAGE_SSE2
+    // c0 | c1 << 16 and c2 | 1 << 16 against w0 | w1 << 16 and w2 | 128 << 16:
+    // two madds give the weighted sum with its rounding
+    __m128i w01 = _mm_set1_epi32((s32)(((u32)(u16)weights[1] << 16) | (u16)weights[0]));
+    __m128i w2r = _mm_set1_epi32((s32)((128u << 16) | (u16)weights[2]));
+    __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i one = _mm_set1_epi32(0x10000);
+    __m128i s = _mm_loadu_si128((__m128i*)lanes);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((__m128i*)(pixels + (u64)i * 4));
+        __m128i c01 = _mm_or_si128(_mm_and_si128(p, mask), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 8), mask), 16));
+        __m128i c2 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), mask), one);
+        __m128i y = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(c01, w01), _mm_madd_epi16(c2, w2r)), 8);
+        y = _mm_packs_epi32(y, y);
+        u32 packed = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(y, y));
+        memcpy(luma + i, &packed, 4);
+
+        // s = rotl(s ^ p, 5) * 9
+        s = _mm_xor_si128(s, p);
+        s = _mm_or_si128(_mm_slli_epi32(s, 5), _mm_srli_epi32(s, 27));
+        s = _mm_add_epi32(s, _mm_slli_epi32(s, 3));
+    }
+    _mm_storeu_si128((__m128i*)lanes, s);
+#endif
+    for (; i < count; ++i)
+    {
+        u8 *p = pixels + (u64)i * 4;
+        luma[i] = (u8)((weights[0] * p[0] + weights[1] * p[1] + weights[2] * p[2] + 128) >> 8);
+
+        u32 value;
+        memcpy(&value, p, 4);
+        u32 x = lanes[i & 3] ^ value;
+        lanes[i & 3] = ((x << 5) | (x >> 27)) * 9;
+    }
+    return ((u64)(lanes[0] ^ ((lanes[2] << 16) | (lanes[2] >> 16))) << 32) | (lanes[1] ^ ((lanes[3] << 16) | (lanes[3] >> 16)));
+}
+
+// sampled rows [begin, end)
+function void frame_stats_rows(void *data, u32 begin, u32 end)
+{
+    FrameStatsJob *job = (FrameStatsJob*)data;
+    FrameView *view = job->view;
+    u32 step = job->step;
+    u32 count = (view->width + step - 1) / step;
+
+    // two copies of the four histograms, even and odd pixels
+    u32 *counts = (u32*)calloc(2 * 4 * 256, sizeof(u32));
+    u8 *luma = (u8*)malloc(count);
+    u32 *gathered = step > 1 ? (u32*)malloc((u64)count * 4) : 0;
+
+    u32 *a[4], *b[4];
+    for (u32 c = 0; c < 3; ++c)
+    {
+        a[c] = counts + job->channel[c] * 256;
+        b[c] = a[c] + 4 * 256;
+    }
+    a[3] = counts + FRAME_STATS_LUMA * 256;
+    b[3] = a[3] + 4 * 256;
+
+    u64 fingerprint = 0;
+    for (u32 row = begin; row < end; ++row)
+    {
+        u32 y = row * step;
+        u8 *pixels = view->pixels + (u64)y * view->stride;
+        if (gathered)
+        {
+            for (u32 x = 0; x < count; ++x)
+                memcpy(&gathered[x], pixels + (u64)x * step * 4, 4);
+            pixels = (u8*)gathered;
+        }
+
+        u64 hash = frame_stats_row(pixels, count, job->weights, luma);
+        fingerprint += frame_stats_mix(hash + (u64)y * 0x9E3779B97F4A7C15ull);
+
+        u32 i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            u8 *p = pixels + (u64)i * 4;
+            a[0][p[0]]++;
+            a[1][p[1]]++;
+            a[2][p[2]]++;
+            a[3][luma[i]]++;
+            b[0][p[4]]++;
+            b[1][p[5]]++;
+            b[2][p[6]]++;
+            b[3][luma[i + 1]]++;
+        }
+        if (i < count)
+        {
+            u8 *p = pixels + (u64)i * 4;
+            a[0][p[0]]++;
+            a[1][p[1]]++;
+            a[2][p[2]]++;
+            a[3][luma[i]]++;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job->merge);
+        FrameStats *stats = job->stats;
+        for (u32 c = 0; c < 4; ++c)
+        {
+            for (u32 v = 0; v < 256; ++v)
+                stats->histogram[c][v] += counts[c * 256 + v] + counts[(4 + c) * 256 + v];
+        }
+        stats->fingerprint += fingerprint;
+    }
+
+    free(gathered);
+    free(luma);
+    free(counts);
+}
+
+// Stats of view, counting every step-th pixel of every step-th row (0 or
+// 1 = all of them). Rows are split across queue, which may be 0.
+function void frame_stats_compute(FrameStats *stats, FrameView *view, u32 step, WorkQueue *queue)
+{
+    if (step == 0)
+        step = 1;
+
+    memset(stats, 0, sizeof(FrameStats));
+    stats->width = view->width;
+    stats->height = view->height;
+    stats->step = step;
+    if (!view->width || !view->height)
+        return;
+
+    FrameStatsJob job;
+    job.view = view;
+    job.step = step;
+    job.stats = stats;
+    // BT.709 in Q8 (summing to 256), BGRA keeps blue in channel 0
+    bool bgra = view->format == PIXEL_FORMAT_BGRA8;
+    job.weights[0] = bgra ? 19 : 54;
+    job.weights[1] = 183;
+    job.weights[2] = bgra ? 54 : 19;
+    job.channel[0] = bgra ? 2 : 0;
+    job.channel[1] = 1;
+    job.channel[2] = bgra ? 0 : 2;
+
+    u32 rows = (view->height + step - 1) / step;
+    u32 columns = (view->width + step - 1) / step;
+    parallel_for(queue, rows, parallel_row_grain(queue, rows), frame_stats_rows, &job);
+
+    stats->samples = (u64)rows * columns;
+    for (u32 c = 0; c < 4; ++c)
+    {
+        u64 sum = 0, squares = 0;
+        for (u32 v = 0; v < 256; ++v)
+        {
+            sum += (u64)stats->histogram[c][v] * v;
+            squares += (u64)stats->histogram[c][v] * v * v;
+        }
+        double mean = (double)sum / stats->samples;
+        double variance = (double)squares / stats->samples - mean * mean;
+        stats->mean[c] = mean;
+        stats->variance[c] = variance > 0 ? variance : 0;
+    }
+
+    u32 *luma = stats->histogram[FRAME_STATS_LUMA];
+    u32 lo = 0, hi = 255;
+    while (!luma[lo])
+        ++lo;
+    while (!luma[hi])
+        --hi;
+    stats->luma_min = lo;
+    stats->luma_max = hi;
+
+    stats->fingerprint = frame_stats_mix(stats->fingerprint ^ (((u64)view->width << 32) | view->height));
+}
+
+//
+// NOTE: frame health
+//
+
+enum FrameHealthFlags {
+    FRAME_HEALTH_BLACK = 1 << 0,   // nearly every pixel at or below black_level
+    FRAME_HEALTH_UNIFORM = 1 << 1, // luma variance below uniform_variance
+    FRAME_HEALTH_FROZEN = 1 << 2,  // the same fingerprint for frozen_after_ns
+    FRAME_HEALTH_LOST = 1 << 3,    // the source lost its capture device
+};
+
+struct FrameHealth {
+    u32 black_level;         // luma
+    double black_fraction;   // of the samples at or below black_level
+    double uniform_variance; // luma
+    u64 frozen_after_ns;
+
+    u32 flags; // FRAME_HEALTH_* of the last frame
+    u64 fingerprint;
+    u64 unchanged_since; // timestamp of the first frame with fingerprint, 0 = none yet
+
+    u64 frames;
+    u64 black_frames;
+    u64 uniform_frames;
+    u64 frozen_frames;
+    u64 lost_count; // times the source went from working to lost
+};
+
+function void frame_health_init(FrameHealth *health)
+{
+    memset(health, 0, sizeof(FrameHealth));
+    health->black_level = 16;
+    health->black_fraction = 0.99;
+    health->uniform_variance = 4.0;
+    health->frozen_after_ns = 2000000000ull;
+}
+
+// Flags for a frame with stats captured at timestamp (platform_time_ns).
+// FRAME_HEALTH_LOST stays whatever frame_health_set_lost left it.
+function u32 frame_health_update(FrameHealth *health, FrameStats *stats, u64 timestamp)
+{
+    u32 flags = health->flags & FRAME_HEALTH_LOST;
+    if (stats->samples)
+    {
+        u64 dark = 0;
+        for (u32 v = 0; v <= health->black_level && v < 256; ++v)
+            dark += stats->histogram[FRAME_STATS_LUMA][v];
+        if ((double)dark >= health->black_fraction * stats->samples)
+            flags |= FRAME_HEALTH_BLACK;
+        if (stats->variance[FRAME_STATS_LUMA] < health->uniform_variance)
+            flags |= FRAME_HEALTH_UNIFORM;
+    }
+
+    if (!health->unchanged_since || stats->fingerprint != health->fingerprint)
+    {
+        health->fingerprint = stats->fingerprint;
+        health->unchanged_since = timestamp;
+    }
+    else if (timestamp - health->unchanged_since >= health->frozen_after_ns)
+    {
+        flags |= FRAME_HEALTH_FROZEN;
+    }
+
+    health->frames++;
+    health->black_frames += (flags & FRAME_HEALTH_BLACK) != 0;
+    health->uniform_frames += (flags & FRAME_HEALTH_UNIFORM) != 0;
+    health->frozen_frames += (flags & FRAME_HEALTH_FROZEN) != 0;
+    health->flags = flags;
+    return flags;
+}
+
+// a new source: forget the flags and the fingerprint, keep the counters
+function void frame_health_restart(FrameHealth *health)
+{
+    health->flags = 0;
+    health->fingerprint = 0;
+    health->unchanged_since = 0;
+}
+
+// whether the source currently has no device, a lost source delivers no
+// frames so this is checked on every step rather than per frame
+function void frame_health_set_lost(FrameHealth *health, bool lost)
+{
+    if (lost && !(health->flags & FRAME_HEALTH_LOST))
+        health->lost_count++;
+    if (lost)
+        health->flags |= FRAME_HEALTH_LOST;
+    else
+        health->flags &= ~FRAME_HEALTH_LOST;
+}
+
+// "ok" or the flags as words, text holds at least 32 characters
+function const char *frame_health_text(u32 flags, char *text)
+{
+    static const char *names[] = { "black", "uniform", "frozen", "lost" };
+    text[0] = 0;
+    for (u32 i = 0; i < ArrayCount(names); ++i)
+    {
+        if (!(flags & (1u << i)))
+            continue;
+        if (text[0])
+            strcat(text, " ");
+        strcat(text, names[i]);
+    }
+    return text[0] ? text : "ok";
+}
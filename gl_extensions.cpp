@@ -0,0 +1,234 @@
+/*
+
+  OpenGL extension registry
+  -------------------------
+  The extension strings (GL_EXTENSIONS and, on Windows, the WGL string)
+  are parsed once into a bit set of the extensions we care about. Each
+  token is hashed (FNV-1a) and looked up in a switch over the hashes of
+  the known names, computed at compile time; a duplicate hash would be a
+  duplicate case label, so the switch is a perfect hash of the known set.
+  A hit is confirmed with a compare, unknown extensions cost one hash.
+
+  Entry points are resolved on first use through the platform loader
+  (wglGetProcAddress) and cached. The raw strings are kept so the list
+  can be dumped when asked instead of on every startup.
+
+  No GL headers here: the parser runs in headless on canned strings.
+  Only the render thread touches the registry.
+
+ */
+
+enum GlExtension {
+    GL_EXTENSION_ARB_framebuffer_sRGB,
+    GL_EXTENSION_EXT_framebuffer_sRGB,
+    GL_EXTENSION_ARB_pixel_buffer_object,
+    GL_EXTENSION_ARB_map_buffer_range,
+    GL_EXTENSION_ARB_buffer_storage,
+    GL_EXTENSION_ARB_sync,
+    GL_EXTENSION_ARB_texture_storage,
+    GL_EXTENSION_WGL_EXT_swap_control,
+    GL_EXTENSION_WGL_EXT_swap_control_tear,
+    GL_EXTENSION_WGL_ARB_extensions_string,
+    GL_EXTENSION_WGL_EXT_extensions_string,
+
+    GL_EXTENSION_COUNT
+};
+
+static const char *gl_extension_names[GL_EXTENSION_COUNT] = {
+    "GL_ARB_framebuffer_sRGB",
+    "GL_EXT_framebuffer_sRGB",
+    "GL_ARB_pixel_buffer_object",
+    "GL_ARB_map_buffer_range",
+    "GL_ARB_buffer_storage",
+    "GL_ARB_sync",
+    "GL_ARB_texture_storage",
+    "WGL_EXT_swap_control",
+    "WGL_EXT_swap_control_tear",
+    "WGL_ARB_extensions_string",
+    "WGL_EXT_extensions_string",
+};
+
+enum GlProc {
+    GL_PROC_wglGetExtensionsStringARB,
+    GL_PROC_wglGetExtensionsStringEXT,
+    GL_PROC_wglSwapIntervalEXT,
+
+    // buffer objects (GL 1.5), map_buffer_range (3.0), sync (3.2), texture_storage (4.2)
+    GL_PROC_glGenBuffers,
+    GL_PROC_glDeleteBuffers,
+    GL_PROC_glBindBuffer,
+    GL_PROC_glBufferData,
+    GL_PROC_glMapBufferRange,
+    GL_PROC_glUnmapBuffer,
+    GL_PROC_glFenceSync,
+    GL_PROC_glClientWaitSync,
+    GL_PROC_glDeleteSync,
+    GL_PROC_glTexStorage2D,
+
+    GL_PROC_COUNT
+};
+
+static const char *gl_proc_names[GL_PROC_COUNT] = {
+    "wglGetExtensionsStringARB",
+    "wglGetExtensionsStringEXT",
+    "wglSwapIntervalEXT",
+    "glGenBuffers",
+    "glDeleteBuffers",
+    "glBindBuffer",
+    "glBufferData",
+    "glMapBufferRange",
+    "glUnmapBuffer",
+    "glFenceSync",
+    "glClientWaitSync",
+    "glDeleteSync",
+    "glTexStorage2D",
+};
+
+#define GL_EXTENSIONS_MAX_STRINGS 2
+
+typedef void *GlProcLoader(const char *name);
+
+struct GlExtensions {
+    u64 present;  // 1 << GlExtension
+    u32 version;  // GL_VERSION as major * 10 + minor, 0 if not parsed
+    u32 token_count;
+
+    const char *strings[GL_EXTENSIONS_MAX_STRINGS]; // as parsed, for gl_extensions_dump
+    u32 string_count;
+
+    GlProcLoader *loader;
+    void *procs[GL_PROC_COUNT];
+    u64 resolved; // 1 << GlProc, also when the loader returned 0
+};
+
+// FNV-1a, constexpr (C++11: one return statement) for the case labels
+constexpr u32 gl_extension_hash(const char *name, u32 hash = 2166136261u)
+{
+    return *name ? gl_extension_hash(name + 1, (hash ^ (u8)*name) * 16777619u) : hash;
+}
+
+function u32 gl_extension_hash_token(const char *name, u64 length)
+{
+    u32 hash = 2166136261u;
+    for (u64 i = 0; i < length; ++i)
+        hash = (hash ^ (u8)name[i]) * 16777619u;
+    return hash;
+}
+
+// a token of length bytes to one of the known extensions, GL_EXTENSION_COUNT if unknown
+function GlExtension gl_extension_lookup(const char *name, u64 length)
+{
+    GlExtension extension = GL_EXTENSION_COUNT;
+    switch (gl_extension_hash_token(name, length))
+    {
+        case gl_extension_hash("GL_ARB_framebuffer_sRGB"): extension = GL_EXTENSION_ARB_framebuffer_sRGB; break;
+        case gl_extension_hash("GL_EXT_framebuffer_sRGB"): extension = GL_EXTENSION_EXT_framebuffer_sRGB; break;
+        case gl_extension_hash("GL_ARB_pixel_buffer_object"): extension = GL_EXTENSION_ARB_pixel_buffer_object; break;
+        case gl_extension_hash("GL_ARB_map_buffer_range"): extension = GL_EXTENSION_ARB_map_buffer_range; break;
+        case gl_extension_hash("GL_ARB_buffer_storage"): extension = GL_EXTENSION_ARB_buffer_storage; break;
+        case gl_extension_hash("GL_ARB_sync"): extension = GL_EXTENSION_ARB_sync; break;
+        case gl_extension_hash("GL_ARB_texture_storage"): extension = GL_EXTENSION_ARB_texture_storage; break;
+        case gl_extension_hash("WGL_EXT_swap_control"): extension = GL_EXTENSION_WGL_EXT_swap_control; break;
+        case gl_extension_hash("WGL_EXT_swap_control_tear"): extension = GL_EXTENSION_WGL_EXT_swap_control_tear; break;
+        case gl_extension_hash("WGL_ARB_extensions_string"): extension = GL_EXTENSION_WGL_ARB_extensions_string; break;
+        case gl_extension_hash("WGL_EXT_extensions_string"): extension = GL_EXTENSION_WGL_EXT_extensions_string; break;
+        default: return GL_EXTENSION_COUNT;
+    }
+
+    // the hash only tells the known names apart, an unknown token can collide
+    const char *known = gl_extension_names[extension];
+    if (strlen(known) != length || memcmp(known, name, length) != 0)
+        return GL_EXTENSION_COUNT;
+    return extension;
+}
+
+// spaces per the spec, also line breaks so a gl_extensions_dump parses back
+function bool gl_extension_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// adds a space separated extension string, may be called for GL and WGL;
+// the string must stay alive while the registry is used
+function void gl_extensions_parse(GlExtensions *extensions, const char *string)
+{
+    if (!string)
+        return;
+    if (extensions->string_count < GL_EXTENSIONS_MAX_STRINGS)
+        extensions->strings[extensions->string_count++] = string;
+
+    const char *at = string;
+    while (*at)
+    {
+        while (gl_extension_separator(*at))
+            ++at;
+        const char *start = at;
+        while (*at && !gl_extension_separator(*at))
+            ++at;
+        if (at == start)
+            continue;
+
+        ++extensions->token_count;
+        GlExtension extension = gl_extension_lookup(start, (u64)(at - start));
+        if (extension != GL_EXTENSION_COUNT)
+            extensions->present |= (u64)1 << extension;
+    }
+}
+
+function bool gl_extension_supported(GlExtensions *extensions, GlExtension extension)
+{
+    return (extensions->present >> extension) & 1;
+}
+
+// GL_VERSION: "major.minor[.release] vendor info", ES adds an "OpenGL ES " prefix
+function void gl_extensions_parse_version(GlExtensions *extensions, const char *string)
+{
+    u32 major = 0, minor = 0;
+    if (string && (sscanf(string, "%u.%u", &major, &minor) == 2 ||
+                   sscanf(string, "OpenGL ES %u.%u", &major, &minor) == 2))
+        extensions->version = major * 10 + minor;
+}
+
+// the extension, or a version where it is core (e.g. 32 for ARB_sync)
+function bool gl_extension_available(GlExtensions *extensions, GlExtension extension, u32 core_version)
+{
+    return gl_extension_supported(extensions, extension) || extensions->version >= core_version;
+}
+
+// the entry point, loaded on first use; 0 if the driver does not have it
+function void *gl_proc(GlExtensions *extensions, GlProc proc)
+{
+    u64 bit = (u64)1 << proc;
+    if (!(extensions->resolved & bit))
+    {
+        void *address = extensions->loader ? extensions->loader(gl_proc_names[proc]) : 0;
+        // some wglGetProcAddress implementations return small integers on failure
+        if ((size_t)address <= 3 || address == (void*)-1)
+            address = 0;
+        extensions->procs[proc] = address;
+        extensions->resolved |= bit;
+    }
+    return extensions->procs[proc];
+}
+
+// typed: GL_PROC(extensions, wglSwapIntervalEXT) needs a wglSwapIntervalEXT_func typedef
+#define GL_PROC(extensions, name) ((name##_func*)gl_proc(extensions, GL_PROC_##name))
+
+// every parsed extension, one per line (parses back with gl_extensions_parse)
+function void gl_extensions_dump(GlExtensions *extensions, FILE *out)
+{
+    for (u32 i = 0; i < extensions->string_count; ++i)
+    {
+        const char *at = extensions->strings[i];
+        while (*at)
+        {
+            while (gl_extension_separator(*at))
+                ++at;
+            const char *start = at;
+            while (*at && !gl_extension_separator(*at))
+                ++at;
+            if (at > start)
+                fprintf(out, "%.*s\n", (int)(at - start), start);
+        }
+    }
+}
@@ -0,0 +1,1109 @@
+/*
+
+  Headless driver for the frame pipeline: runs source -> convert -> sink
+  as fast as possible without a window so the hot path can be profiled and
+  soak-tested on the Linux build/bench machines.
+
+  usage: headless [-source synthetic|gen|file|replay|composite] [-sink null|offscreen|yuv|gl|tiles]
+                  [-size WxH] [-frames N] [-threads N] [-file path] [-flip] [-swizzle] [-opaque]
+                  [-diff] [-static] [-threaded] [-huge_pages] [-roi x,y,w,h] [-copy] [-viewport WxH] [-linear]
+                  [-profile] [-trace path] [-record path] [-compress] [-replay path] [-realtime] [-loop]
+                  [-yuv nv12|i420] [-bt709] [-full_range] [-yuv_out path] [-gl_client]
+                  [-layers N] [-pip] [-stall_layer MS] [-capture_fps N] [-on_demand] [-stats N] [-ring name]
+                  [-snapshot path] [-zoom Z] [-tour] [-tile_cache N] [-tile_budget N]
+         headless -ring_reader name [-frames N] [-stats N]
+         headless -stress_handoff [-frames N] [-size WxH]
+         headless -gl_extensions path
+
+  -threads N  worker threads for the image kernels, 0 = one per core
+  -flip    flip rows on the CPU instead of leaving it to the sink
+  -diff    upload only dirty tiles and skip unchanged frames
+  -static  synthetic source draws a static desktop with a blinking cursor
+  -huge_pages  back 4K+ frame buffers with huge pages
+  -threaded  acquire + convert on a capture thread (triple buffer hand-off)
+  -roi x,y,w,h  capture only this rectangle of the synthetic source
+  -viewport WxH  downscale frames bigger than WxH to it, like a window that size
+  -linear  downscale on linear light (gamma correct, for sRGB output)
+  -copy    always copy out of the source instead of reading its memory in place
+  -profile print p50/p95/p99 per stage (profiler.cpp)
+  -trace path  write the last zones of every thread as Chrome trace JSON
+  -record path  append every new frame to a raw recording (frame_recording.cpp)
+  -compress     store the recording tile-delta compressed (tile_codec.cpp)
+  -replay path  replay a recording (-source replay), as fast as possible unless
+                -realtime; -loop starts over at the end
+  -sink yuv  convert every frame to planar YUV for an encoder, -yuv picks
+             the layout (nv12), -bt709 / -full_range the matrix and range
+             (BT.601 limited), -yuv_out appends every presented frame to a
+             raw .yuv file
+  -sink gl   the OpenGL sink main.exe uses (opengl_sink.cpp) on an EGL
+             pbuffer, Mesa's llvmpipe without a GPU; only in a ./build.sh gl
+             build. -gl_client turns the PBO streaming off, uploads go
+             straight from client memory as without the extensions
+  -sink tiles  the large image viewer main.exe switches to with F7
+               (opengl_tiles.cpp) in a -viewport window, also gl only:
+               frames go into a tile pyramid and only the tiles on screen
+               are uploaded, into -tile_cache N textures (192), at most
+               -tile_budget N a present (all). -zoom Z shows screen
+               pixels per image pixel (0 fits the image), -tour zooms in
+               to 2x and back while circling over the image
+  -source composite  -layers N synthetic sources of -size side by side on
+                     one canvas (compositor.cpp), like N monitors; -pip adds a
+                     quarter size layer over the first one, with -static a
+                     still image whose pixels are checked at the end to have
+                     survived the blits of the base layer. -stall_layer MS
+                     makes the last of the N an idle monitor: after its first
+                     frame every acquire blocks MS ms for nothing; the
+                     composite rate is checked not to follow it
+  -capture_fps N  acquire at most N times a second, paced with precise
+                  sleeps (frame_pacing.cpp); missed deadlines are reported
+  -on_demand  upload + present only frames that changed; with -threaded the
+              render loop sleeps until the capture thread has a frame
+  -stats N  histograms, fingerprint and health flags of every new frame
+            (frame_stats.cpp) from every N-th pixel of every N-th row,
+            1 = all of them
+  -ring name  share every new frame with other processes through the shared
+              memory frame ring name (frame_ring.cpp), frames up to -size
+              (the whole canvas with -source composite)
+  -snapshot path  write the first frame to path on the snapshot thread
+                  (image_export.cpp), QOI for .qoi, else PNG
+  -ring_reader name  attach to the frame ring name as another process would,
+                     take -frames frames (or until the writer is gone) and
+                     report missed frames and latency; -stats N reads every
+                     frame in place with frame_stats.cpp
+  -stress_handoff  hammer the triple buffer with a synthetic producer and
+                   verify every consumed frame is complete and in order,
+                   build with ./build.sh tsan to run it under ThreadSanitizer
+  -gl_extensions path  parse a canned extension string (GL_EXTENSIONS as the
+                       driver returns it, or main.exe's opengl_extensions.txt)
+                       with gl_extensions.cpp and print what it found
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ./build.sh gl: -sink gl through EGL (links libEGL and libGL)
+#if HEADLESS_GL
+#include <EGL/egl.h>
+#include <GL/gl.h>
+#endif
+
+#include "base.h"
+
+#include "platform.cpp"
+#include "profiler.cpp"
+#include "work_queue.cpp"
+#include "image_processing.cpp"
+#include "frame_buffer_pool.cpp"
+#include "tile_diff.cpp"
+#include "frame_handoff.cpp"
+#include "tile_codec.cpp"
+#include "frame_recording.cpp"
+#include "frame_pacing.cpp"
+#include "frame_stats.cpp"
+#include "frame_ring.cpp"
+#include "image_export.cpp"
+#include "tile_pyramid.cpp"
+#include "frame_pipeline.cpp"
+#include "compositor.cpp"
+#include "gl_extensions.cpp"
+#if HEADLESS_GL
+#include "opengl_sink.cpp"
+#include "opengl_tiles.cpp"
+#endif
+
+struct HeadlessOptions {
+    const char *source;
+    const char *sink;
+    const char *file;
+    u32 width;
+    u32 height;
+    u32 frames;
+    u32 threads;
+    bool diff;
+    bool mostly_static;
+    bool threaded;
+    bool huge_pages;
+    bool stress_handoff;
+    const char *gl_extensions;
+    bool copy;
+    bool profile;
+    const char *trace;
+    const char *record;
+    const char *yuv;
+    const char *yuv_out;
+    u32 yuv_flags;
+    bool compress;
+    const char *replay;
+    bool realtime;
+    bool loop;
+    FrameRect roi;
+    u32 viewport_width;
+    u32 viewport_height;
+    bool linear;
+    bool gl_client;
+    u32 layers;
+    u32 stall_layer_ms;
+    bool pip;
+    double capture_fps;
+    bool on_demand;
+    u32 stats_step; // 0 = no frame stats
+    const char *ring;
+    const char *ring_reader;
+    const char *snapshot;
+    double zoom;
+    bool tour;
+    u32 tile_cache;
+    u32 tile_budget;
+    u32 convert_flags;
+};
+
+function bool parse_options(HeadlessOptions *options, int argc, char **argv)
+{
+    options->source = "synthetic";
+    options->sink = "offscreen";
+    options->yuv = "nv12";
+    options->file = "desktop.png";
+    options->width = 1920;
+    options->height = 1080;
+    options->frames = 300;
+    options->layers = 2;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        char *arg = argv[i];
+        char *value = (i + 1 < argc) ? argv[i + 1] : 0;
+
+        if (strcmp(arg, "-flip") == 0)
+        {
+            options->convert_flags |= CONVERT_FLIP_Y;
+            continue;
+        }
+        if (strcmp(arg, "-diff") == 0)
+        {
+            options->diff = true;
+            continue;
+        }
+        if (strcmp(arg, "-static") == 0)
+        {
+            options->mostly_static = true;
+            continue;
+        }
+        if (strcmp(arg, "-huge_pages") == 0)
+        {
+            options->huge_pages = true;
+            continue;
+        }
+        if (strcmp(arg, "-threaded") == 0)
+        {
+            options->threaded = true;
+            continue;
+        }
+        if (strcmp(arg, "-stress_handoff") == 0)
+        {
+            options->stress_handoff = true;
+            continue;
+        }
+        if (strcmp(arg, "-realtime") == 0)
+        {
+            options->realtime = true;
+            continue;
+        }
+        if (strcmp(arg, "-gl_client") == 0)
+        {
+            options->gl_client = true;
+            continue;
+        }
+        if (strcmp(arg, "-on_demand") == 0)
+        {
+            options->on_demand = true;
+            continue;
+        }
+        if (strcmp(arg, "-tour") == 0)
+        {
+            options->tour = true;
+            continue;
+        }
+        if (strcmp(arg, "-pip") == 0)
+        {
+            options->pip = true;
+            continue;
+        }
+        if (strcmp(arg, "-linear") == 0)
+        {
+            options->linear = true;
+            continue;
+        }
+        if (strcmp(arg, "-bt709") == 0)
+        {
+            options->yuv_flags |= YUV_BT709;
+            continue;
+        }
+        if (strcmp(arg, "-full_range") == 0)
+        {
+            options->yuv_flags |= YUV_FULL_RANGE;
+            continue;
+        }
+        if (strcmp(arg, "-compress") == 0)
+        {
+            options->compress = true;
+            continue;
+        }
+        if (strcmp(arg, "-loop") == 0)
+        {
+            options->loop = true;
+            continue;
+        }
+        if (strcmp(arg, "-profile") == 0)
+        {
+            options->profile = true;
+            continue;
+        }
+        if (strcmp(arg, "-copy") == 0)
+        {
+            options->copy = true;
+            continue;
+        }
+        if (strcmp(arg, "-swizzle") == 0)
+        {
+            options->convert_flags |= CONVERT_SWIZZLE_RB;
+            continue;
+        }
+        if (strcmp(arg, "-opaque") == 0)
+        {
+            options->convert_flags |= CONVERT_FORCE_OPAQUE;
+            continue;
+        }
+
+        if (!value)
+        {
+            printf("Error: missing value for %s.\n", arg);
+            return false;
+        }
+
+        if (strcmp(arg, "-source") == 0)
+            options->source = value;
+        else if (strcmp(arg, "-sink") == 0)
+            options->sink = value;
+        else if (strcmp(arg, "-file") == 0)
+            options->file = value;
+        else if (strcmp(arg, "-trace") == 0)
+            options->trace = value;
+        else if (strcmp(arg, "-yuv") == 0)
+            options->yuv = value;
+        else if (strcmp(arg, "-gl_extensions") == 0)
+            options->gl_extensions = value;
+        else if (strcmp(arg, "-yuv_out") == 0)
+            options->yuv_out = value;
+        else if (strcmp(arg, "-record") == 0)
+            options->record = value;
+        else if (strcmp(arg, "-ring") == 0)
+            options->ring = value;
+        else if (strcmp(arg, "-ring_reader") == 0)
+            options->ring_reader = value;
+        else if (strcmp(arg, "-snapshot") == 0)
+            options->snapshot = value;
+        else if (strcmp(arg, "-replay") == 0)
+        {
+            options->replay = value;
+            options->source = "replay";
+        }
+        else if (strcmp(arg, "-frames") == 0)
+            options->frames = (u32)atoi(value);
+        else if (strcmp(arg, "-threads") == 0)
+            options->threads = (u32)atoi(value);
+        else if (strcmp(arg, "-layers") == 0)
+            options->layers = (u32)atoi(value);
+        else if (strcmp(arg, "-stall_layer") == 0)
+            options->stall_layer_ms = (u32)atoi(value);
+        else if (strcmp(arg, "-stats") == 0)
+            options->stats_step = (u32)atoi(value);
+        else if (strcmp(arg, "-capture_fps") == 0)
+            options->capture_fps = atof(value);
+        else if (strcmp(arg, "-zoom") == 0)
+            options->zoom = atof(value);
+        else if (strcmp(arg, "-tile_cache") == 0)
+            options->tile_cache = (u32)atoi(value);
+        else if (strcmp(arg, "-tile_budget") == 0)
+            options->tile_budget = (u32)atoi(value);
+        else if (strcmp(arg, "-size") == 0)
+        {
+            if (sscanf(value, "%ux%u", &options->width, &options->height) != 2)
+            {
+                printf("Error: bad size %s, expected WxH.\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "-viewport") == 0)
+        {
+            if (sscanf(value, "%ux%u", &options->viewport_width, &options->viewport_height) != 2)
+            {
+                printf("Error: bad viewport %s, expected WxH.\n", value);
+                return false;
+            }
+        }
+        else if (strcmp(arg, "-roi") == 0)
+        {
+            FrameRect *roi = &options->roi;
+            if (sscanf(value, "%u,%u,%u,%u", &roi->x, &roi->y, &roi->width, &roi->height) != 4)
+            {
+                printf("Error: bad roi %s, expected x,y,w,h.\n", value);
+                return false;
+            }
+        }
+        else
+        {
+            printf("Error: unknown option %s.\n", arg);
+            return false;
+        }
+
+        ++i;
+    }
+
+    return true;
+}
+
+struct StressSlot {
+    u32 *pixels;
+    u32 sequence;
+};
+
+struct StressProducer {
+    TripleBuffer *handoff;
+    StressSlot *slots;
+    u32 pixel_count;
+    u32 frames;
+    std::atomic<bool> done;
+};
+
+function void stress_producer_proc(void *data)
+{
+    StressProducer *producer = (StressProducer*)data;
+
+    for (u32 sequence = 1; sequence <= producer->frames; ++sequence)
+    {
+        StressSlot *slot = &producer->slots[triple_buffer_back(producer->handoff)];
+        for (u32 i = 0; i < producer->pixel_count; ++i)
+            slot->pixels[i] = sequence;
+        slot->sequence = sequence;
+        triple_buffer_publish(producer->handoff);
+    }
+
+    producer->done.store(true);
+}
+
+// every consumed slot must hold one complete frame, newer than the last one
+function int stress_handoff(u32 frames, u32 width, u32 height)
+{
+    TripleBuffer handoff;
+    triple_buffer_init(&handoff);
+
+    StressSlot slots[3] = {};
+    u32 pixel_count = width * height;
+    for (u32 i = 0; i < ArrayCount(slots); ++i)
+        slots[i].pixels = (u32*)calloc(pixel_count, 4);
+
+    StressProducer producer;
+    producer.handoff = &handoff;
+    producer.slots = slots;
+    producer.pixel_count = pixel_count;
+    producer.frames = frames;
+    producer.done.store(false);
+
+    PerfCounter perf = {};
+    perf.begin();
+
+    PlatformThread thread = {};
+    platform_thread_start(&thread, stress_producer_proc, &producer);
+
+    u32 last_sequence = 0;
+    u64 torn = 0, out_of_order = 0;
+    while (true)
+    {
+        bool done = producer.done.load();
+        if (!triple_buffer_consume(&handoff))
+        {
+            if (done)
+                break;
+            continue;
+        }
+
+        StressSlot *slot = &slots[triple_buffer_front(&handoff)];
+        if (slot->sequence <= last_sequence)
+            ++out_of_order;
+        for (u32 i = 0; i < pixel_count; ++i)
+        {
+            if (slot->pixels[i] != slot->sequence)
+            {
+                ++torn;
+                break;
+            }
+        }
+        last_sequence = slot->sequence;
+    }
+
+    platform_thread_join(&thread);
+    double elapsed = perf.end();
+
+    u64 published = handoff.published.load();
+    u64 consumed = handoff.consumed.load();
+    u64 dropped = handoff.dropped.load();
+    bool ok = !torn && !out_of_order && last_sequence == frames && consumed + dropped == published;
+
+    printf("stress_handoff: published: %llu consumed: %llu dropped: %llu torn: %llu out of order: %llu last: %u %.2f s %s\n",
+           published, consumed, dropped, torn, out_of_order, last_sequence, elapsed, ok ? "ok" : "FAILED");
+
+    for (u32 i = 0; i < ArrayCount(slots); ++i)
+        free(slots[i].pixels);
+
+    return ok ? 0 : 1;
+}
+
+//
+// NOTE: frame ring reader
+//
+// What another process on the host does with frame_ring.cpp: poll for the
+// newest frame, read it where it lies, give it back.
+//
+
+function int read_frame_ring(const char *name, u32 frames, u32 stats_step)
+{
+    FrameRingReader reader;
+    if (!frame_ring_open(&reader, name))
+        return 1;
+    printf("ring: %s from process %u, %u slots of %.1f MB, %u readers at most\n", name, reader.header->writer_process,
+           reader.header->slot_count, reader.header->slot_size / (1024.0 * 1024.0), reader.header->reader_count);
+
+    FrameStats stats = {};
+    u64 overwritten = 0;
+    u64 latency_sum = 0, latency_max = 0;
+    FrameRingFrame frame = {};
+    while (reader.frames < frames)
+    {
+        if (!frame_ring_take(&reader, &frame))
+        {
+            if (frame_ring_writer_gone(&reader, 1000000000ull))
+                break;
+            platform_sleep_ms(1);
+            continue;
+        }
+
+        u64 now = platform_time_ns();
+        u64 latency = now > frame.timestamp ? now - frame.timestamp : 0;
+        latency_sum += latency;
+        if (latency > latency_max)
+            latency_max = latency;
+        if (stats_step)
+            frame_stats_compute(&stats, &frame.view, stats_step, 0);
+        if (!frame_ring_release(&reader))
+            ++overwritten;
+    }
+
+    printf("ring: %llu frames taken, last %llu, %llu missed, %llu retries, %llu overwritten while held\n",
+           reader.frames, reader.sequence, reader.missed, reader.retries, overwritten);
+    printf("ring: %ux%u, latency from capture avg %.3f ms max %.3f ms\n", frame.view.width, frame.view.height,
+           reader.frames ? 1e-6 * latency_sum / reader.frames : 0.0, 1e-6 * latency_max);
+    if (stats_step && reader.frames)
+        printf("last frame: mean luma %.1f, fingerprint %016llx\n", stats.mean[FRAME_STATS_LUMA], stats.fingerprint);
+    frame_ring_reader_close(&reader);
+    return 0;
+}
+
+#if HEADLESS_GL
+// an offscreen context for opengl_sink.cpp, surfaceless on Mesa so no X or GPU is needed
+struct HeadlessGl {
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+    GlExtensions extensions;
+    OpenGLSink sink;
+    OpenGLTileSink tiles;
+};
+
+function void *headless_gl_proc_loader(const char *name)
+{
+    return (void*)eglGetProcAddress(name);
+}
+
+function void headless_gl_swap(void *user)
+{
+    HeadlessGl *gl = (HeadlessGl*)user;
+    eglSwapBuffers(gl->display, gl->surface);
+}
+
+function bool headless_gl_init(HeadlessGl *gl, u32 width, u32 height)
+{
+    typedef EGLDisplay eglGetPlatformDisplayEXT_func(EGLenum platform, void *native_display, const EGLint *attributes);
+    eglGetPlatformDisplayEXT_func *get_platform_display = (eglGetPlatformDisplayEXT_func*)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+    // EGL_PLATFORM_SURFACELESS_MESA, the default display needs X or a DRM device
+    gl->display = get_platform_display ? get_platform_display(0x31DD, EGL_DEFAULT_DISPLAY, 0) : EGL_NO_DISPLAY;
+    EGLint major = 0, minor = 0;
+    if (gl->display == EGL_NO_DISPLAY || !eglInitialize(gl->display, &major, &minor))
+    {
+        gl->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (gl->display == EGL_NO_DISPLAY || !eglInitialize(gl->display, &major, &minor))
+        {
+            printf("Error: no EGL display (0x%x).\n", eglGetError());
+            return false;
+        }
+    }
+
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint config_count = 0;
+    if (!eglChooseConfig(gl->display, config_attributes, &config, 1, &config_count) || !config_count)
+    {
+        printf("Error: no EGL config for desktop GL pbuffers (0x%x).\n", eglGetError());
+        return false;
+    }
+
+    EGLint surface_attributes[] = { EGL_WIDTH, (EGLint)width, EGL_HEIGHT, (EGLint)height, EGL_NONE };
+    gl->surface = eglCreatePbufferSurface(gl->display, config, surface_attributes);
+    eglBindAPI(EGL_OPENGL_API);
+    gl->context = eglCreateContext(gl->display, config, EGL_NO_CONTEXT, 0);
+    if (gl->surface == EGL_NO_SURFACE || gl->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(gl->display, gl->surface, gl->surface, gl->context))
+    {
+        printf("Error: failed to create the EGL context (0x%x).\n", eglGetError());
+        return false;
+    }
+    glViewport(0, 0, width, height);
+
+    gl->extensions.loader = headless_gl_proc_loader;
+    gl_extensions_parse_version(&gl->extensions, (const char*)glGetString(GL_VERSION));
+    gl_extensions_parse(&gl->extensions, (const char*)glGetString(GL_EXTENSIONS));
+
+    gl->sink.extensions = &gl->extensions;
+    gl->sink.internal_format = GL_RGBA8;
+    gl->sink.swap = headless_gl_swap;
+    gl->sink.swap_user = gl;
+    gl->tiles.extensions = &gl->extensions;
+    gl->tiles.internal_format = GL_RGBA8;
+    gl->tiles.swap = headless_gl_swap;
+    gl->tiles.swap_user = gl;
+    gl->tiles.view.width = width;
+    gl->tiles.view.height = height;
+    return true;
+}
+
+function void headless_gl_destroy(HeadlessGl *gl)
+{
+    if (gl->context == EGL_NO_CONTEXT)
+        return;
+    opengl_sink_destroy(&gl->sink);
+    opengl_tiles_destroy(&gl->tiles);
+    eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gl->display, gl->context);
+    eglDestroySurface(gl->display, gl->surface);
+    eglTerminate(gl->display);
+}
+
+// -tour: from the fitted image in to 2x and back out over the run while
+// circling around the center, like someone zooming and dragging around
+function void headless_tour(OpenGLTileSink *tiles, u32 frame, u32 frames)
+{
+    TilePyramid *pyramid = &tiles->pyramid;
+    if (!pyramid->level_count || !frames)
+        return;
+    TileView fit = tiles->view;
+    tile_view_fit(&fit, pyramid);
+
+    double t = (double)(frame % frames) / frames;
+    double in = sin(t * 3.14159265358979);
+    double angle = t * 6 * 3.14159265358979;
+    tiles->view.zoom = fit.zoom * pow(2.0 / fit.zoom, in);
+    tiles->view.center_x = fit.center_x * (1.0 + 0.8 * in * cos(angle));
+    tiles->view.center_y = fit.center_y * (1.0 + 0.8 * in * sin(angle));
+}
+
+// before every step, the first present fits the new image
+function void headless_tiles_view(HeadlessGl *gl, HeadlessOptions *options, u32 frame)
+{
+    OpenGLTileSink *tiles = &gl->tiles;
+    if (!tiles->pyramid.level_count)
+        return;
+    if (options->tour)
+    {
+        headless_tour(tiles, frame, options->frames);
+    }
+    else if (options->zoom > 0)
+    {
+        tiles->view.zoom = options->zoom;
+        tile_view_clamp(&tiles->view, &tiles->pyramid);
+    }
+}
+#endif
+
+// -source composite -pip -static: the still picture-in-picture drew its one
+// frame at the start, the base layer below it blitted again every frame
+function bool headless_check_pip(Compositor *compositor, CompositorLayer *pip)
+{
+    if (!compositor->canvas)
+        return false;
+    FrameRect rect = pip->rect;
+    u64 size = (u64)rect.width * rect.height * 4;
+    u8 *expected = (u8*)malloc(2 * size);
+    if (!expected)
+        return false;
+
+    // what color_gen_acquire produced, placed like compositor_layer_draw does
+    generate_test_pattern(expected + size, rect.width, rect.height, rect.width * 4, 0, 0);
+    FrameView src = frame_view(expected + size, rect.width, rect.height, rect.width * 4, PIXEL_FORMAT_RGBA8);
+    FrameView dst = frame_view(expected, rect.width, rect.height, rect.width * 4, compositor->format);
+    frame_view_copy(&dst, &src, CONVERT_FLIP_Y | CONVERT_SWIZZLE_RB);
+
+    u32 bad_rows = 0;
+    for (u32 y = 0; y < rect.height; ++y)
+    {
+        u8 *row = compositor->canvas + (u64)(rect.y + y) * compositor->stride + (u64)rect.x * 4;
+        if (memcmp(row, expected + (u64)y * rect.width * 4, (u64)rect.width * 4) != 0)
+            bad_rows++;
+    }
+    free(expected);
+
+    printf("pip check: %u of %u rows of %s intact after %llu frames of layer 0\n",
+           rect.height - bad_rows, rect.height, pip->name, compositor->layers[0].frames);
+    if (bad_rows)
+        printf("Error: the base layer drew over the picture-in-picture.\n");
+    return bad_rows == 0;
+}
+
+// the registry main.exe builds at startup, from a file instead of the driver
+function int print_gl_extensions(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        printf("Error: could not open %s.\n", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *string = (char*)calloc((size_t)size + 1, 1);
+    size_t read = fread(string, 1, (size_t)size, f);
+    fclose(f);
+    string[read] = 0;
+
+    GlExtensions extensions = {};
+    PerfCounter perf = {};
+    perf.begin();
+    gl_extensions_parse(&extensions, string);
+    double elapsed = perf.end();
+
+    printf("gl_extensions: %u extensions parsed in %.3f ms, known:\n", extensions.token_count, elapsed * 1000.0);
+    for (u32 i = 0; i < GL_EXTENSION_COUNT; ++i)
+        printf("  %-28s %s\n", gl_extension_names[i], gl_extension_supported(&extensions, (GlExtension)i) ? "yes" : "no");
+
+    free(string);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    HeadlessOptions options = {};
+    if (!parse_options(&options, argc, argv))
+    {
+        printf("usage: headless [-source synthetic|gen|file|replay|composite] [-sink null|offscreen|yuv|gl|tiles] [-size WxH] [-frames N] [-threads N] [-file path] [-flip] [-swizzle] [-opaque] [-diff] [-static] [-threaded] [-huge_pages] [-roi x,y,w,h] [-copy] [-viewport WxH] [-linear] [-profile] [-trace path]\n");
+        printf("                [-record path] [-compress] [-replay path] [-realtime] [-loop]\n");
+        printf("                [-yuv nv12|i420] [-bt709] [-full_range] [-yuv_out path] [-gl_client]\n");
+        printf("                [-layers N] [-pip] [-stall_layer MS] [-capture_fps N] [-on_demand] [-stats N] [-ring name]\n");
+        printf("                [-snapshot path] [-zoom Z] [-tour] [-tile_cache N] [-tile_budget N]\n");
+        printf("       headless -ring_reader name [-frames N] [-stats N]\n");
+        printf("       headless -stress_handoff [-frames N] [-size WxH]\n");
+        printf("       headless -gl_extensions path\n");
+        return 1;
+    }
+
+    if (options.stress_handoff)
+        return stress_handoff(options.frames, options.width, options.height);
+    if (options.gl_extensions)
+        return print_gl_extensions(options.gl_extensions);
+    if (options.ring_reader)
+        return read_frame_ring(options.ring_reader, options.frames, options.stats_step);
+
+    profile_thread_name("render");
+    profiler_enable(options.profile || options.trace);
+
+    WorkQueue queue;
+    work_queue_init(&queue, options.threads);
+
+    OffscreenSink offscreen = {};
+    YuvSink yuv = {};
+#if HEADLESS_GL
+    HeadlessGl gl = {};
+#endif
+    yuv.layout = strcmp(options.yuv, "i420") == 0 ? YUV_I420 : YUV_NV12;
+    yuv.flags = options.yuv_flags;
+    yuv.queue = &queue;
+    FrameSink sink = {};
+    if (strcmp(options.sink, "null") == 0)
+        sink = null_sink();
+    else if (strcmp(options.sink, "offscreen") == 0)
+        sink = offscreen_sink(&offscreen);
+    else if (strcmp(options.sink, "yuv") == 0)
+        sink = yuv_sink(&yuv);
+#if HEADLESS_GL
+    else if (strcmp(options.sink, "gl") == 0)
+    {
+        u32 width = options.viewport_width ? options.viewport_width : options.width;
+        u32 height = options.viewport_height ? options.viewport_height : options.height;
+        if (!headless_gl_init(&gl, width, height))
+        {
+            work_queue_destroy(&queue);
+            return 1;
+        }
+        gl.sink.disable_streaming = options.gl_client;
+        sink = opengl_sink(&gl.sink);
+    }
+    else if (strcmp(options.sink, "tiles") == 0)
+    {
+        u32 width = options.viewport_width ? options.viewport_width : 1920;
+        u32 height = options.viewport_height ? options.viewport_height : 1080;
+        if (!headless_gl_init(&gl, width, height))
+        {
+            work_queue_destroy(&queue);
+            return 1;
+        }
+        gl.tiles.queue = &queue;
+        gl.tiles.cache_tiles = options.tile_cache;
+        gl.tiles.upload_budget = options.tile_budget;
+        sink = opengl_tile_sink(&gl.tiles);
+    }
+#endif
+    else
+    {
+        printf("Error: unknown sink %s.\n", options.sink);
+        work_queue_destroy(&queue);
+        return 1;
+    }
+    if (options.yuv_out)
+    {
+        yuv.file = fopen(options.yuv_out, "wb");
+        if (!yuv.file)
+        {
+            printf("Error: failed to create %s.\n", options.yuv_out);
+            work_queue_destroy(&queue);
+            return 1;
+        }
+    }
+
+    // the synthetic source takes the slot of the capture source it stands in for
+    ColorGenSource color_gen = {};
+    color_gen.width = options.width;
+    color_gen.height = options.height;
+    color_gen.queue = &queue;
+    FileSource file = {};
+    SyntheticSource synth = {};
+    synth.queue = &queue;
+    FrameSource gen_source = color_gen_source(&color_gen);
+    FrameSource image_source = file_source(&file, options.file);
+    FrameSource synth_source = synthetic_source(&synth, options.width, options.height);
+    ReplaySource replay = {};
+    replay.realtime = options.realtime;
+    replay.loop = options.loop;
+    replay.queue = &queue;
+    FrameSource replay_frames = replay_source(&replay, options.replay);
+    replay_frames.roi = options.roi;
+    synth_source.roi = options.roi;
+    synth.mostly_static = options.mostly_static;
+
+    // the layers draw on their own threads, their kernels stay off the queue
+    Compositor compositor = {};
+    SyntheticSource layer_synths[COMPOSITOR_MAX_LAYERS] = {};
+    ColorGenSource pip_gen = {}; // -pip -static: a still picture, one frame
+    FrameSource layer_sources[COMPOSITOR_MAX_LAYERS] = {};
+    u32 layer_count = options.layers + (options.pip ? 1 : 0);
+    if (layer_count > COMPOSITOR_MAX_LAYERS)
+        layer_count = COMPOSITOR_MAX_LAYERS;
+    for (u32 i = 0; i < layer_count; ++i)
+    {
+        bool pip = options.pip && i == layer_count - 1;
+        u32 width = pip ? options.width / 4 : options.width;
+        u32 height = pip ? options.height / 4 : options.height;
+        layer_synths[i].mostly_static = options.mostly_static;
+        if (options.layers > 1 && i == options.layers - 1)
+            layer_synths[i].stall_ms = options.stall_layer_ms;
+        layer_sources[i] = synthetic_source(&layer_synths[i], width, height);
+        if (pip && options.mostly_static)
+        {
+            pip_gen.width = width;
+            pip_gen.height = height;
+            layer_sources[i] = color_gen_source(&pip_gen);
+        }
+        s32 x = pip ? (s32)(options.width - width - options.width / 32) : (s32)(i * options.width);
+        s32 y = pip ? (s32)(options.height / 32) : 0;
+        compositor_add_layer(&compositor, &layer_sources[i], x, y, width, height);
+    }
+    FrameSource composite_source = compositor_source(&compositor);
+    composite_source.roi = options.roi;
+
+    FrameBufferPool pool = {};
+    pool.use_huge_pages = options.huge_pages;
+
+    FramePipeline pipeline = {};
+    frame_pipeline_init(&pipeline, &sink, &pool);
+    pipeline.convert_flags = options.convert_flags;
+    pipeline.tile_diff_enabled = options.diff;
+    pipeline.zero_copy = !options.copy;
+    pipeline.queue = &queue;
+    // the viewer draws the image at any zoom, the viewport is only its window
+    pipeline.downscale_enabled = options.viewport_width != 0 && strcmp(options.sink, "tiles") != 0;
+    pipeline.downscale_linear = options.linear;
+    frame_pipeline_set_viewport(&pipeline, options.viewport_width, options.viewport_height);
+    pipeline.present_on_demand = options.on_demand;
+    pipeline.stats_enabled = options.stats_step != 0;
+    pipeline.stats_step = options.stats_step;
+    frame_pipeline_set_capture_rate(&pipeline, options.capture_fps);
+    if (options.threaded)
+        frame_pipeline_enable_capture_thread(&pipeline);
+    pipeline.sources[TEST_IMAGE_COLOR_GEN] = &gen_source;
+    pipeline.sources[TEST_IMAGE_FILE] = &image_source;
+    pipeline.sources[TEST_IMAGE_CAPTURE_DX] = &synth_source;
+    pipeline.sources[TEST_IMAGE_REPLAY] = &replay_frames;
+    pipeline.sources[TEST_IMAGE_COMPOSITE] = &composite_source;
+
+    FrameRecorder recorder = {};
+    if (options.record)
+    {
+        if (!frame_recorder_open(&recorder, options.record, options.compress ? FRAME_CODEC_TILE : FRAME_CODEC_RAW, &queue))
+            return 1;
+        pipeline.recorder = &recorder;
+    }
+
+    SnapshotWriter snapshot;
+    if (options.snapshot)
+    {
+        snapshot_writer_init(&snapshot, &queue);
+        snapshot_writer_request(&snapshot, options.snapshot, 0);
+        pipeline.snapshot = &snapshot;
+    }
+
+    FrameRing ring = {};
+    if (options.ring)
+    {
+        u64 width = strcmp(options.source, "composite") == 0 ? (u64)options.width * options.layers : options.width;
+        if (!frame_ring_create(&ring, options.ring, FRAME_RING_SLOTS, width * options.height * 4))
+            return 1;
+        ring.queue = &queue;
+        pipeline.ring = &ring;
+    }
+
+    if (strcmp(options.source, "gen") == 0)
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_COLOR_GEN);
+    else if (strcmp(options.source, "file") == 0)
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_FILE);
+    else if (strcmp(options.source, "synthetic") == 0)
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_CAPTURE_DX);
+    else if (strcmp(options.source, "replay") == 0 && options.replay)
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_REPLAY);
+    else if (strcmp(options.source, "composite") == 0)
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_COMPOSITE);
+    else
+    {
+        printf("Error: unknown source %s.\n", options.source);
+        return 1;
+    }
+
+    PerfCounter wall = {};
+    wall.begin();
+    u64 cpu_begin = platform_process_cpu_ns();
+
+    u32 new_frames = 0;
+    if (options.threaded)
+    {
+        // the render side spins on the hand-off until -frames captured frames
+        // arrived (static sources only ever produce one, hence the time limit)
+        while (new_frames < options.frames && wall.end() < 10.0)
+        {
+            // on demand the render side sleeps until there is something to show
+            if (options.on_demand)
+                frame_pipeline_wait(&pipeline, 100);
+#if HEADLESS_GL
+            headless_tiles_view(&gl, &options, (u32)pipeline.frame_number);
+#endif
+            if (frame_pipeline_step(&pipeline))
+                ++new_frames;
+        }
+    }
+    else
+    {
+        for (u32 i = 0; i < options.frames; ++i)
+        {
+#if HEADLESS_GL
+            headless_tiles_view(&gl, &options, i);
+#endif
+            if (frame_pipeline_step(&pipeline))
+                ++new_frames;
+        }
+    }
+#if HEADLESS_GL
+    // what was queued counts too, llvmpipe runs the texture updates on its own threads
+    if (gl.context != EGL_NO_CONTEXT)
+        glFinish();
+#endif
+    double wall_time = wall.end();
+    int result = 0;
+    double cpu_time = (double)(platform_process_cpu_ns() - cpu_begin) * 1e-9;
+
+    // threaded: most render steps find nothing new, average over the frames that arrived
+    double n = options.threaded ? (double)new_frames : (double)pipeline.sum_frame_count;
+    if (n == 0)
+        n = 1.0;
+    FrameTimings *sum = &pipeline.sum;
+    printf("source: %s sink: %s frames: %u new: %u size: %ux%u\n",
+           options.source, options.sink, options.frames, new_frames,
+           pipeline.frame.view.width, pipeline.frame.view.height);
+    printf("avg ms  acquire: %.3f scale: %.3f convert: %.3f diff: %.3f upload: %.3f present: %.3f total: %.3f\n",
+           1000.0 * sum->acquire / n, 1000.0 * sum->scale / n, 1000.0 * sum->convert / n, 1000.0 * sum->diff / n, 1000.0 * sum->upload / n,
+           1000.0 * sum->present / n, 1000.0 * sum->total / n);
+    printf("fps: %.1f upload: %.1f MB/s\n",
+           sum->total > 0 ? n / sum->total : 0.0,
+           wall_time > 0 ? (double)pipeline.bytes_uploaded / (1024.0 * 1024.0) / wall_time : 0.0);
+
+    if (options.threaded)
+    {
+        TripleBuffer *handoff = &pipeline.capture.handoff;
+        printf("captured: %llu consumed: %llu dropped: %llu new frames/s: %.1f\n",
+               handoff->published.load(), handoff->consumed.load(), handoff->dropped.load(),
+               new_frames / wall_time);
+    }
+    if (options.diff)
+        printf("dirty tiles: %llu uploads skipped: %llu\n", pipeline.tiles_dirty, pipeline.uploads_skipped);
+    if (pipeline.uploads_failed)
+        printf("uploads failed: %llu\n", pipeline.uploads_failed);
+    FramePacer *pacer = &pipeline.capture_pacer;
+    if (pacer->interval_ns)
+        printf("pacing: %.1f fps, %llu ticks, %llu missed deadlines, late avg %.3f ms max %.3f ms, slept %.1f%%\n",
+               options.capture_fps, pacer->ticks.load(), pacer->missed.load(),
+               pacer->ticks ? 1e-6 * pacer->late_ns.load() / pacer->ticks.load() : 0.0, 1e-6 * pacer->max_late_ns.load(),
+               wall_time > 0 ? 100.0 * pacer->slept_ns.load() * 1e-9 / wall_time : 0.0);
+    if (options.on_demand)
+        printf("presents skipped: %llu\n", pipeline.presents_skipped);
+    if (pipeline.stats_enabled)
+    {
+        FrameHealth *health = &pipeline.health;
+        FrameStats *stats = pipeline.frame.stats;
+        char flags[32];
+        printf("stats: avg %.3f ms, %llu frames: %llu black %llu uniform %llu frozen, lost %llu times, now %s\n",
+               1000.0 * sum->stats / n, health->frames, health->black_frames, health->uniform_frames,
+               health->frozen_frames, health->lost_count, frame_health_text(health->flags, flags));
+        if (stats)
+            printf("last frame: %llu samples, mean r %.1f g %.1f b %.1f luma %.1f (sd %.1f, %u..%u), fingerprint %016llx\n",
+                   stats->samples, stats->mean[0], stats->mean[1], stats->mean[2], stats->mean[FRAME_STATS_LUMA],
+                   sqrt(stats->variance[FRAME_STATS_LUMA]), stats->luma_min, stats->luma_max, stats->fingerprint);
+    }
+    printf("latency avg %.3f ms max %.3f ms, cpu %.3f s of %.3f s wall (%.1f%% of a core)\n",
+           pipeline.latency_count ? 1000.0 * pipeline.latency_sum / pipeline.latency_count : 0.0,
+           1000.0 * pipeline.latency_max, cpu_time, wall_time, wall_time > 0 ? 100.0 * cpu_time / wall_time : 0.0);
+#if HEADLESS_GL
+    if (gl.context != EGL_NO_CONTEXT)
+    {
+        OpenGLSink *s = &gl.sink;
+        if (s->initialized)
+        {
+            printf("gl: %s, GL %u.%u, %s%s%s%s\n", (const char*)glGetString(GL_RENDERER),
+                   gl.extensions.version / 10, gl.extensions.version % 10,
+                   s->streaming ? "pbo streaming" : "client uploads", s->fenced ? ", fenced" : "",
+                   s->texture_storage ? ", texture storage" : "", s->quad_buffer ? ", quad buffer" : ", immediate mode");
+            printf("gl: %llu texture allocations, %llu streamed uploads, %llu client uploads, %llu fence stalls\n",
+                   s->texture_allocations, s->streamed_uploads, s->client_uploads, s->fence_stalls);
+        }
+    }
+    OpenGLTileSink *tiles = &gl.tiles;
+    if (tiles->initialized)
+    {
+        printf("gl: %s, GL %u.%u%s\n", (const char*)glGetString(GL_RENDERER),
+               gl.extensions.version / 10, gl.extensions.version % 10, tiles->texture_storage ? ", texture storage" : "");
+        TilePyramid *pyramid = &tiles->pyramid;
+        TileCache *cache = &tiles->cache;
+        printf("tiles: %u levels, %.1f MB pyramid, %llu builds %llu updates %llu tiles rebuilt above level 0\n",
+               pyramid->level_count, pyramid->capacity / (1024.0 * 1024.0), pyramid->builds, pyramid->updates, pyramid->tiles_rebuilt);
+        printf("tiles: last drawn level %u zoom %.3f, %u visible, %llu uploads %llu hits %llu evictions %llu fallbacks, %u slots (%.1f MB)%s\n",
+               tiles->level, tiles->view.zoom, tiles->visible, tiles->uploads, cache->hits, cache->evictions, tiles->fallbacks,
+               cache->capacity, (double)cache->capacity * TILE_TEXELS * TILE_TEXELS * 4 / (1024.0 * 1024.0),
+               tiles->pending ? ", tiles missing" : "");
+    }
+#endif
+
+    frame_pipeline_destroy(&pipeline);
+    if (options.snapshot)
+    {
+        snapshot_writer_destroy(&snapshot);
+        printf("snapshot: %s, %.1f MB, encoded in %.1f ms, written in %.1f ms, %.1f ms after it was taken\n",
+               options.snapshot, snapshot.bytes / (1024.0 * 1024.0), snapshot.encode_ms, snapshot.write_ms, snapshot.latency_ms);
+    }
+    if (strcmp(options.source, "composite") == 0)
+    {
+        printf("composite: %ux%u canvas, %llu compositions\n", compositor.width, compositor.height, compositor.compositions);
+        for (u32 i = 0; i < compositor.layer_count; ++i)
+        {
+            CompositorLayer *layer = &compositor.layers[i];
+            printf("  %-8s %ux%u at %d,%d frames: %llu late: %llu avg ms: %.3f\n", layer->name, layer->width, layer->height,
+                   layer->x, layer->y, layer->frames, layer->late,
+                   layer->frames ? 1000.0 * layer->acquire_time / layer->frames : 0.0);
+        }
+        if (options.pip && options.mostly_static && compositor.layer_count > 1 &&
+            !headless_check_pip(&compositor, &compositor.layers[compositor.layer_count - 1]))
+            result = 1;
+        if (options.stall_layer_ms && options.layers > 1)
+        {
+            // waiting for the idle layer would cap the rate at one composition a stall
+            double rate = wall_time > 0 ? compositor.compositions / wall_time : 0.0;
+            double capped = 1000.0 / options.stall_layer_ms;
+            printf("stall check: %.1f compositions/s with layer %u idle %u ms an acquire (%.1f/s if waited for)\n",
+                   rate, options.layers - 1, options.stall_layer_ms, capped);
+            if (rate < 4 * capped)
+            {
+                printf("Error: the composite waits for the idle layer.\n");
+                result = 1;
+            }
+        }
+    }
+    compositor_destroy(&compositor);
+#if HEADLESS_GL
+    headless_gl_destroy(&gl);
+#endif
+    if (options.record)
+    {
+        printf("recorded: %llu frames to %s, %.1f MB of %.1f MB raw (%.1fx)\n", recorder.frame_count, options.record,
+               recorder.offset / (1024.0 * 1024.0), recorder.raw_bytes / (1024.0 * 1024.0),
+               recorder.offset ? (double)recorder.raw_bytes / recorder.offset : 0.0);
+        frame_recorder_close(&recorder);
+    }
+    if (options.ring)
+    {
+        FrameRingHeader *header = ring.header;
+        printf("ring: %llu frames shared on %s, %llu dropped, %llu too big, %u readers attached\n",
+               header->published.load(), options.ring, header->dropped.load(), header->too_big.load(),
+               frame_ring_reader_count(&ring));
+        frame_ring_close(&ring);
+    }
+    if (options.profile)
+        profiler_report(stdout);
+    if (options.trace && profiler_export_chrome_trace(options.trace))
+        printf("trace: %s\n", options.trace);
+    WorkQueueStats *work = &queue.stats;
+    printf("work queue: %u threads, %llu jobs, %llu chunks, %.1f%% stolen, busy %.3f s\n", queue.thread_count + 1,
+           work->jobs.load(), work->chunks.load(), work->chunks ? 100.0 * work->stolen.load() / work->chunks.load() : 0.0,
+           1e-9 * work->busy_ns.load());
+    printf("frame buffers: %llu allocated (%.1f MB) %llu reused\n",
+           pool.allocations, pool.bytes_allocated / (1024.0 * 1024.0), pool.reuses);
+    frame_buffer_pool_destroy(&pool);
+    work_queue_destroy(&queue);
+    free(offscreen.pixels);
+    if (yuv.file)
+    {
+        printf("yuv: %llu %s frames to %s\n", yuv.frames_written, options.yuv, options.yuv_out);
+        fclose(yuv.file);
+    }
+    yuv_sink_destroy(&yuv);
+
+    return result;
+}
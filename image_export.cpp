@@ -0,0 +1,1346 @@
+/*
+
+  Image export
+  ------------
+  Lossless snapshots of frames: QOI and PNG encoders that read BGRA or RGBA
+  views as they are (the swizzle is part of the encode), and a
+  SnapshotWriter that encodes and writes on its own thread, so the render
+  loop only pays for one copy of the frame.
+
+  Both encoders cut the frame into bands of rows that are encoded in
+  parallel and written out in order.
+
+  QOI: the encoder state at the start of a band, the previous pixel and
+  the 64 entry index, only depends on the pixels before it: index[h] is
+  the last pixel with hash h. A first pass collects that per band, a
+  prefix over the bands gives every band its starting index and the
+  second pass encodes. Runs are cut at band edges, otherwise the stream is
+  what a sequential encoder writes.
+
+  PNG: every band is filtered (Sub or Up per row, whichever looks smaller)
+  and deflated on its own: greedy LZ77 with one hash probe over the 32K
+  window, a dynamic Huffman block per DEFLATE_BLOCK_TOKENS symbols or a
+  stored block when that is smaller, ending on a byte boundary with an
+  empty stored block like a zlib sync flush. A band is its own IDAT chunk
+  with its own crc; the adler32 of the zlib stream is combined from the
+  bands' and written as a last small IDAT.
+
+  IMAGE_EXPORT_OPAQUE ignores alpha (a capture's alpha is often
+  undefined). PNG stores RGB then, and also when every pixel is opaque.
+
+ */
+
+enum ImageExportFlags {
+    IMAGE_EXPORT_FLIP_Y = 1 << 0, // rows are bottom-up (Frame::flip_vertical)
+    IMAGE_EXPORT_OPAQUE = 1 << 1, // ignore alpha, every pixel is stored opaque
+};
+
+enum ImageFileFormat {
+    IMAGE_FILE_PNG,
+    IMAGE_FILE_QOI,
+};
+
+struct ImageBand {
+    u8 *data;
+    u64 size;
+};
+
+// an encoded image: head, the bands in order, tail
+struct ImageEncoding {
+    u8 head[64];
+    u32 head_size;
+    ImageBand *bands;
+    u32 band_count;
+    u8 tail[64];
+    u32 tail_size;
+    u64 size; // of all of it
+};
+
+function void image_put_u32_be(u8 *out, u32 value)
+{
+    out[0] = (u8)(value >> 24);
+    out[1] = (u8)(value >> 16);
+    out[2] = (u8)(value >> 8);
+    out[3] = (u8)value;
+}
+
+function u32 image_ctz64(u64 value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (u32)index;
+#else
+    return (u32)__builtin_ctzll(value);
+#endif
+}
+
+// row y of the image as stored, top-down
+function u32 *image_export_row(FrameView *view, u32 flags, u32 y)
+{
+    u32 row = (flags & IMAGE_EXPORT_FLIP_Y) ? view->height - 1 - y : y;
+    return (u32*)(view->pixels + (u64)row * view->stride);
+}
+
+// rows per band: a few bands per thread, but big enough to compress well
+function u32 image_export_band_rows(WorkQueue *queue, FrameView *view)
+{
+    u32 rows = parallel_row_grain(queue, view->height);
+    u32 min_rows = 65536 / (view->width ? view->width : 1) + 1;
+    return rows < min_rows ? min_rows : rows;
+}
+
+// false when out of memory, the encoding then has no bands to free
+function bool image_encoding_alloc_bands(ImageEncoding *encoding, FrameView *view, u32 band_rows)
+{
+    u32 band_count = (view->height + band_rows - 1) / band_rows;
+    encoding->bands = (ImageBand*)calloc(band_count ? band_count : 1, sizeof(ImageBand));
+    encoding->band_count = encoding->bands ? band_count : 0;
+    return encoding->bands != 0;
+}
+
+function void image_encoding_free(ImageEncoding *encoding)
+{
+    for (u32 i = 0; i < encoding->band_count; ++i)
+        free(encoding->bands[i].data);
+    free(encoding->bands);
+    memset(encoding, 0, sizeof(ImageEncoding));
+}
+
+// false when a band failed to encode (out of memory)
+function bool image_encoding_finish(ImageEncoding *encoding)
+{
+    encoding->size = encoding->head_size + encoding->tail_size;
+    for (u32 i = 0; i < encoding->band_count; ++i)
+    {
+        if (!encoding->bands[i].data)
+            return false;
+        encoding->size += encoding->bands[i].size;
+    }
+    return true;
+}
+
+function bool image_encoding_write(ImageEncoding *encoding, FILE *file)
+{
+    bool ok = fwrite(encoding->head, 1, encoding->head_size, file) == encoding->head_size;
+    for (u32 i = 0; ok && i < encoding->band_count; ++i)
+        ok = fwrite(encoding->bands[i].data, 1, encoding->bands[i].size, file) == encoding->bands[i].size;
+    return ok && fwrite(encoding->tail, 1, encoding->tail_size, file) == encoding->tail_size;
+}
+
+//
+// NOTE: QOI
+//
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MAX_RUN  62
+#define QOI_START    0xff000000u // the previous pixel before the first: black, opaque
+
+struct QoiJob {
+    FrameView *view;
+    u32 flags;
+    u32 band_rows;
+    u32 alpha;     // or-ed into every pixel, 0xff000000 with IMAGE_EXPORT_OPAQUE
+    u64 hash_mul;  // see qoi_hash
+    u32 red_shift; // of red and blue in the view's pixels
+    u32 blue_shift;
+    u32 (*index)[64]; // per band: the last pixel per hash in it, then the index at its start
+    u64 *seen;        // per band: which of index were set by the first pass
+    ImageBand *bands;
+};
+
+// (r * 3 + g * 5 + b * 7 + a * 11) % 64 with one multiply: the four bytes
+// spread to 16-bit lanes, the weights in the opposite lanes of hash_mul so
+// their products all land in the top lane
+function u32 qoi_hash(u32 pixel, u64 hash_mul)
+{
+    u64 lanes = (pixel & 0xff00ff) | ((u64)(pixel & 0xff00ff00) << 24);
+    return (u32)((lanes * hash_mul) >> 48) & 63;
+}
+
+// lanes hold bytes 0, 2, 1, 3 of the pixel
+function u64 qoi_hash_mul(PixelFormat format)
+{
+    u64 weight0 = format == PIXEL_FORMAT_BGRA8 ? 7 : 3; // b or r
+    u64 weight2 = format == PIXEL_FORMAT_BGRA8 ? 3 : 7;
+    return weight0 << 48 | weight2 << 32 | 5ull << 16 | 11;
+}
+
+// the first pass: the last pixel per hash in the band
+function void qoi_scan_band(QoiJob *job, u32 band)
+{
+    FrameView *view = job->view;
+    u32 *index = job->index[band];
+    u64 seen = 0;
+    u32 y_end = (band + 1) * job->band_rows;
+    if (y_end > view->height)
+        y_end = view->height;
+
+    u32 prev = 0;
+    bool first = true;
+    for (u32 y = band * job->band_rows; y < y_end; ++y)
+    {
+        u32 *row = image_export_row(view, job->flags, y);
+        for (u32 x = 0; x < view->width; ++x)
+        {
+            u32 pixel = row[x] | job->alpha;
+            if (pixel == prev && !first)
+                continue;
+            u32 hash = qoi_hash(pixel, job->hash_mul);
+            index[hash] = pixel;
+            seen |= 1ull << hash;
+            prev = pixel;
+            first = false;
+        }
+    }
+    job->seen[band] = seen;
+}
+
+function void qoi_encode_band(QoiJob *job, u32 band)
+{
+    FrameView *view = job->view;
+    u32 *index = job->index[band];
+    u32 y_begin = band * job->band_rows;
+    u32 y_end = y_begin + job->band_rows;
+    if (y_end > view->height)
+        y_end = view->height;
+
+    // every pixel as RGBA, 5 bytes, at worst
+    u8 *out = (u8*)malloc((u64)view->width * (y_end - y_begin) * 5 + 16);
+    if (!out)
+        return;
+    u8 *start = out;
+
+    u32 prev = QOI_START;
+    if (band)
+        prev = image_export_row(view, job->flags, y_begin - 1)[view->width - 1] | job->alpha;
+
+    u32 run = 0;
+    for (u32 y = y_begin; y < y_end; ++y)
+    {
+        u32 *row = image_export_row(view, job->flags, y);
+        for (u32 x = 0; x < view->width; ++x)
+        {
+            u32 pixel = row[x] | job->alpha;
+            if (pixel == prev)
+            {
+                if (++run == QOI_MAX_RUN)
+                {
+                    *out++ = (u8)(QOI_OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run)
+            {
+                *out++ = (u8)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            u32 hash = qoi_hash(pixel, job->hash_mul);
+            u8 r = (u8)(pixel >> job->red_shift), g = (u8)(pixel >> 8), b = (u8)(pixel >> job->blue_shift);
+            if (index[hash] == pixel)
+            {
+                *out++ = (u8)(QOI_OP_INDEX | hash);
+            }
+            else if ((pixel ^ prev) >> 24)
+            {
+                index[hash] = pixel;
+                out[0] = QOI_OP_RGBA;
+                out[1] = r;
+                out[2] = g;
+                out[3] = b;
+                out[4] = (u8)(pixel >> 24);
+                out += 5;
+            }
+            else
+            {
+                index[hash] = pixel;
+                // wrapping differences, as the decoder adds them
+                signed char dr = (signed char)(r - (u8)(prev >> job->red_shift));
+                signed char dg = (signed char)(g - (u8)(prev >> 8));
+                signed char db = (signed char)(b - (u8)(prev >> job->blue_shift));
+                signed char dr_dg = (signed char)(dr - dg);
+                signed char db_dg = (signed char)(db - dg);
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    *out++ = (u8)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+                {
+                    out[0] = (u8)(QOI_OP_LUMA | (dg + 32));
+                    out[1] = (u8)((dr_dg + 8) << 4 | (db_dg + 8));
+                    out += 2;
+                }
+                else
+                {
+                    out[0] = QOI_OP_RGB;
+                    out[1] = r;
+                    out[2] = g;
+                    out[3] = b;
+                    out += 4;
+                }
+            }
+            prev = pixel;
+        }
+    }
+    if (run)
+        *out++ = (u8)(QOI_OP_RUN | (run - 1));
+
+    job->bands[band].size = out - start;
+    job->bands[band].data = start;
+}
+
+function void qoi_scan_bands(void *data, u32 begin, u32 end)
+{
+    for (u32 band = begin; band < end; ++band)
+        qoi_scan_band((QoiJob*)data, band);
+}
+
+function void qoi_encode_bands(void *data, u32 begin, u32 end)
+{
+    for (u32 band = begin; band < end; ++band)
+        qoi_encode_band((QoiJob*)data, band);
+}
+
+function bool qoi_encode(ImageEncoding *encoding, FrameView *view, u32 flags, WorkQueue *queue)
+{
+    memset(encoding, 0, sizeof(ImageEncoding));
+    QoiJob job = {};
+    job.view = view;
+    job.flags = flags;
+    job.band_rows = image_export_band_rows(queue, view);
+    job.alpha = (flags & IMAGE_EXPORT_OPAQUE) ? 0xff000000u : 0;
+    job.hash_mul = qoi_hash_mul(view->format);
+    job.red_shift = view->format == PIXEL_FORMAT_BGRA8 ? 16 : 0;
+    job.blue_shift = view->format == PIXEL_FORMAT_BGRA8 ? 0 : 16;
+    if (!image_encoding_alloc_bands(encoding, view, job.band_rows))
+        return false;
+    u32 band_count = encoding->band_count;
+    job.bands = encoding->bands;
+    job.seen = (u64*)calloc(band_count + 1, sizeof(u64));
+    job.index = (u32(*)[64])calloc(band_count + 1, sizeof(u32[64]));
+    if (!job.index || !job.seen)
+    {
+        free(job.index);
+        free(job.seen);
+        return false;
+    }
+
+    // the last band's pixels are nobody's history
+    if (band_count > 1)
+        parallel_for(queue, band_count - 1, 1, qoi_scan_bands, &job);
+
+    // a band starts with the index the bands before it left behind
+    u32 carried[64] = {};
+    for (u32 band = 0; band < band_count; ++band)
+    {
+        u32 scanned[64];
+        memcpy(scanned, job.index[band], sizeof(scanned));
+        memcpy(job.index[band], carried, sizeof(carried));
+        for (u32 h = 0; h < 64; ++h)
+        {
+            if (job.seen[band] & (1ull << h))
+                carried[h] = scanned[h];
+        }
+    }
+    parallel_for(queue, band_count, 1, qoi_encode_bands, &job);
+    free(job.index);
+    free(job.seen);
+
+    u8 *head = encoding->head;
+    memcpy(head, "qoif", 4);
+    image_put_u32_be(head + 4, view->width);
+    image_put_u32_be(head + 8, view->height);
+    head[12] = (flags & IMAGE_EXPORT_OPAQUE) ? 3 : 4; // channels
+    head[13] = 0; // sRGB
+    encoding->head_size = 14;
+    static const u8 end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    memcpy(encoding->tail, end_marker, sizeof(end_marker));
+    encoding->tail_size = sizeof(end_marker);
+    return image_encoding_finish(encoding);
+}
+
+//
+// NOTE: deflate
+//
+// Enough of RFC 1951 to write it, not to read it.
+//
+
+#define DEFLATE_WINDOW       32768
+#define DEFLATE_HASH_BITS    15
+#define DEFLATE_MIN_MATCH    4 // what the hash finds, the format allows 3
+#define DEFLATE_MAX_MATCH    258
+#define DEFLATE_BLOCK_TOKENS 32768
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_DIST_CODES   30
+#define DEFLATE_MATCH_BIT    0x80000000u // token: match, (distance - 1) << 8 | (length - 3), else a literal
+
+static const u16 deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const u8 deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// the order code length code lengths are stored in
+static const u8 deflate_code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct DeflateTables {
+    u8 length_code[256]; // length - 3 -> 0..28, the symbol is 257 + that
+    u8 dist_code[512];   // see deflate_dist_code
+
+    DeflateTables()
+    {
+        for (u32 code = 0; code < 29; ++code)
+        {
+            for (u32 i = 0; i < (1u << deflate_length_extra[code]); ++i)
+            {
+                u32 length = deflate_length_base[code] + i;
+                if (length <= DEFLATE_MAX_MATCH)
+                    length_code[length - 3] = (u8)code;
+            }
+        }
+        for (u32 code = 0; code < 30; ++code)
+        {
+            for (u32 i = 0; i < (1u << deflate_dist_extra[code]); ++i)
+            {
+                u32 d = deflate_dist_base[code] - 1 + i;
+                dist_code[d < 256 ? d : 256 + (d >> 7)] = (u8)code;
+            }
+        }
+    }
+};
+
+// built once, thread-safe
+function DeflateTables *deflate_tables()
+{
+    static DeflateTables tables;
+    return &tables;
+}
+
+// distance - 1 -> 0..29
+function u32 deflate_dist_code(DeflateTables *tables, u32 d)
+{
+    return tables->dist_code[d < 256 ? d : 256 + (d >> 7)];
+}
+
+// LSB first, whole u32s at a time; out has 8 bytes of slack
+struct BitWriter {
+    u8 *out;
+    u64 size;
+    u64 bits;
+    u32 count;
+};
+
+function void bits_put(BitWriter *writer, u32 value, u32 count)
+{
+    writer->bits |= (u64)value << writer->count;
+    writer->count += count;
+    if (writer->count >= 32)
+    {
+        u32 low = (u32)writer->bits;
+        memcpy(writer->out + writer->size, &low, 4);
+        writer->size += 4;
+        writer->bits >>= 32;
+        writer->count -= 32;
+    }
+}
+
+// pad to a byte boundary with zero bits
+function void bits_align(BitWriter *writer)
+{
+    while (writer->count > 0)
+    {
+        writer->out[writer->size++] = (u8)writer->bits;
+        writer->bits >>= 8;
+        writer->count = writer->count > 8 ? writer->count - 8 : 0;
+    }
+    writer->bits = 0;
+}
+
+function int huffman_compare_keys(const void *a, const void *b)
+{
+    u64 x = *(u64*)a, y = *(u64*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Huffman code lengths for freq, none longer than max_bits; needs at least
+// two symbols with a count
+function void huffman_lengths(u32 *freq, u32 count, u32 max_bits, u8 *lengths)
+{
+    // leaves by count, ties by symbol
+    u64 leaves[DEFLATE_LITLEN_CODES];
+    u32 used = 0;
+    for (u32 s = 0; s < count; ++s)
+    {
+        lengths[s] = 0;
+        if (freq[s])
+            leaves[used++] = (u64)freq[s] << 16 | s;
+    }
+    qsort(leaves, used, sizeof(u64), huffman_compare_keys);
+
+    // two queues: the sorted leaves and the inner nodes in the order they are made
+    u64 weight[2 * DEFLATE_LITLEN_CODES];
+    u16 parent[2 * DEFLATE_LITLEN_CODES];
+    u16 depth[2 * DEFLATE_LITLEN_CODES];
+    for (u32 i = 0; i < used; ++i)
+        weight[i] = leaves[i] >> 16;
+    u32 leaf = 0, inner = used;
+    for (u32 next = used; next < 2 * used - 1; ++next)
+    {
+        u32 pick[2];
+        for (u32 k = 0; k < 2; ++k)
+        {
+            if (leaf < used && (inner >= next || weight[leaf] <= weight[inner]))
+                pick[k] = leaf++;
+            else
+                pick[k] = inner++;
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = (u16)next;
+    }
+    u32 root = 2 * used - 2;
+    depth[root] = 0;
+    for (u32 i = root; i-- > 0;)
+        depth[i] = depth[parent[i]] + 1;
+
+    // too deep leaves move up to max_bits, then the shallowest codes that
+    // can take it move down a level until the code is complete again
+    u32 bl_count[32] = {};
+    for (u32 i = 0; i < used; ++i)
+        bl_count[depth[i] < max_bits ? depth[i] : max_bits]++;
+    u32 total = 0;
+    for (u32 bits = 1; bits <= max_bits; ++bits)
+        total += bl_count[bits] << (max_bits - bits);
+    while (total > (1u << max_bits))
+    {
+        bl_count[max_bits]--;
+        for (u32 bits = max_bits - 1; bits > 0; --bits)
+        {
+            if (bl_count[bits])
+            {
+                bl_count[bits]--;
+                bl_count[bits + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // the rarest symbols get the longest codes
+    u32 rank = 0;
+    for (u32 bits = max_bits; bits > 0; --bits)
+    {
+        for (u32 n = bl_count[bits]; n > 0; --n)
+            lengths[leaves[rank++] & 0xffff] = (u8)bits;
+    }
+}
+
+// canonical codes, bit reversed for LSB first output
+function void huffman_codes(u8 *lengths, u32 count, u16 *codes)
+{
+    u32 bl_count[16] = {};
+    for (u32 s = 0; s < count; ++s)
+        bl_count[lengths[s]]++;
+    bl_count[0] = 0;
+
+    u32 next[16];
+    u32 code = 0;
+    for (u32 bits = 1; bits < 16; ++bits)
+    {
+        code = (code + bl_count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (u32 s = 0; s < count; ++s)
+    {
+        u32 length = lengths[s];
+        if (!length)
+            continue;
+        u32 c = next[length]++, reversed = 0;
+        for (u32 i = 0; i < length; ++i)
+            reversed |= ((c >> i) & 1) << (length - 1 - i);
+        codes[s] = (u16)reversed;
+    }
+}
+
+// give a tree the two used symbols a decoder insists on
+function void huffman_min_symbols(u32 *freq, u32 count)
+{
+    u32 used = 0;
+    for (u32 s = 0; s < count; ++s)
+        used += freq[s] != 0;
+    for (u32 s = 0; used < 2; ++s)
+    {
+        if (!freq[s])
+        {
+            freq[s] = 1;
+            ++used;
+        }
+    }
+}
+
+struct DeflateBlock {
+    u32 *tokens;
+    u32 token_count;
+    u32 litlen_freq[DEFLATE_LITLEN_CODES];
+    u32 dist_freq[DEFLATE_DIST_CODES];
+};
+
+function void deflate_stored(BitWriter *writer, u8 *in, u64 size, bool final)
+{
+    do
+    {
+        u32 chunk = size < 65535 ? (u32)size : 65535;
+        size -= chunk;
+        bits_put(writer, final && size == 0, 1);
+        bits_put(writer, 0, 2);
+        bits_align(writer);
+        u8 *out = writer->out + writer->size;
+        out[0] = (u8)chunk;
+        out[1] = (u8)(chunk >> 8);
+        out[2] = (u8)~chunk;
+        out[3] = (u8)(~chunk >> 8);
+        memcpy(out + 4, in, chunk);
+        writer->size += 4 + chunk;
+        in += chunk;
+    } while (size);
+}
+
+// the block's tokens covering in[0, size), dynamic Huffman or stored, whichever is smaller
+function void deflate_block(BitWriter *writer, DeflateBlock *block, u8 *in, u64 size, bool final)
+{
+    DeflateTables *tables = deflate_tables();
+    u32 *litlen_freq = block->litlen_freq;
+    u32 *dist_freq = block->dist_freq;
+    litlen_freq[256] = 1; // end of block
+    huffman_min_symbols(litlen_freq, DEFLATE_LITLEN_CODES);
+    huffman_min_symbols(dist_freq, DEFLATE_DIST_CODES);
+
+    u8 lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    u8 *litlen_lengths = lengths, *dist_lengths = lengths + DEFLATE_LITLEN_CODES;
+    huffman_lengths(litlen_freq, DEFLATE_LITLEN_CODES, 15, litlen_lengths);
+    huffman_lengths(dist_freq, DEFLATE_DIST_CODES, 15, dist_lengths);
+    u32 hlit = DEFLATE_LITLEN_CODES, hdist = DEFLATE_DIST_CODES;
+    while (hlit > 257 && !litlen_lengths[hlit - 1])
+        --hlit;
+    while (hdist > 1 && !dist_lengths[hdist - 1])
+        --hdist;
+
+    // both length lists back to back, run-length coded with 16, 17 and 18
+    u8 all[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    memcpy(all, litlen_lengths, hlit);
+    memcpy(all + hlit, dist_lengths, hdist);
+    u32 all_count = hlit + hdist;
+    u8 cl_symbols[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    u8 cl_extra[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    u32 cl_count = 0;
+    u32 cl_freq[19] = {};
+    for (u32 i = 0; i < all_count;)
+    {
+        u32 length = all[i], run = 1;
+        while (i + run < all_count && all[i + run] == length)
+            ++run;
+        i += run;
+        if (length == 0)
+        {
+            while (run >= 11)
+            {
+                u32 n = run < 138 ? run : 138;
+                cl_symbols[cl_count] = 18, cl_extra[cl_count++] = (u8)(n - 11);
+                cl_freq[18]++;
+                run -= n;
+            }
+            if (run >= 3)
+            {
+                cl_symbols[cl_count] = 17, cl_extra[cl_count++] = (u8)(run - 3);
+                cl_freq[17]++;
+                run = 0;
+            }
+        }
+        else
+        {
+            cl_symbols[cl_count] = (u8)length, cl_extra[cl_count++] = 0;
+            cl_freq[length]++;
+            --run;
+            while (run >= 3)
+            {
+                u32 n = run < 6 ? run : 6;
+                cl_symbols[cl_count] = 16, cl_extra[cl_count++] = (u8)(n - 3);
+                cl_freq[16]++;
+                run -= n;
+            }
+        }
+        for (; run > 0; --run)
+        {
+            cl_symbols[cl_count] = (u8)length, cl_extra[cl_count++] = 0;
+            cl_freq[length]++;
+        }
+    }
+    huffman_min_symbols(cl_freq, 19);
+    u8 cl_lengths[19];
+    huffman_lengths(cl_freq, 19, 7, cl_lengths);
+    u32 hclen = 19;
+    while (hclen > 4 && !cl_lengths[deflate_code_length_order[hclen - 1]])
+        --hclen;
+
+    // sizes in bits, the padded counts only make the dynamic block look bigger
+    u64 dynamic_bits = 3 + 14 + hclen * 3 + cl_freq[16] * 2 + cl_freq[17] * 3 + cl_freq[18] * 7;
+    for (u32 s = 0; s < 19; ++s)
+        dynamic_bits += (u64)cl_freq[s] * cl_lengths[s];
+    for (u32 s = 0; s < DEFLATE_LITLEN_CODES; ++s)
+        dynamic_bits += (u64)litlen_freq[s] * (litlen_lengths[s] + (s > 256 ? deflate_length_extra[s - 257] : 0));
+    for (u32 s = 0; s < DEFLATE_DIST_CODES; ++s)
+        dynamic_bits += (u64)dist_freq[s] * (dist_lengths[s] + deflate_dist_extra[s]);
+    u64 stored_bits = (size / 65535 + 1) * (3 + 7 + 32) + size * 8;
+    if (stored_bits <= dynamic_bits)
+    {
+        deflate_stored(writer, in, size, final);
+        return;
+    }
+
+    u16 litlen_codes[DEFLATE_LITLEN_CODES], dist_codes[DEFLATE_DIST_CODES], cl_codes[19];
+    huffman_codes(litlen_lengths, DEFLATE_LITLEN_CODES, litlen_codes);
+    huffman_codes(dist_lengths, DEFLATE_DIST_CODES, dist_codes);
+    huffman_codes(cl_lengths, 19, cl_codes);
+
+    bits_put(writer, final, 1);
+    bits_put(writer, 2, 2);
+    bits_put(writer, hlit - 257, 5);
+    bits_put(writer, hdist - 1, 5);
+    bits_put(writer, hclen - 4, 4);
+    for (u32 i = 0; i < hclen; ++i)
+        bits_put(writer, cl_lengths[deflate_code_length_order[i]], 3);
+    static const u8 cl_extra_bits[3] = { 2, 3, 7 };
+    for (u32 i = 0; i < cl_count; ++i)
+    {
+        u32 symbol = cl_symbols[i];
+        bits_put(writer, cl_codes[symbol], cl_lengths[symbol]);
+        if (symbol >= 16)
+            bits_put(writer, cl_extra[i], cl_extra_bits[symbol - 16]);
+    }
+
+    for (u32 i = 0; i < block->token_count; ++i)
+    {
+        u32 token = block->tokens[i];
+        if (!(token & DEFLATE_MATCH_BIT))
+        {
+            bits_put(writer, litlen_codes[token], litlen_lengths[token]);
+            continue;
+        }
+        u32 length = token & 0xff, d = (token >> 8) & 0x7fff;
+        u32 code = tables->length_code[length];
+        bits_put(writer, litlen_codes[257 + code], litlen_lengths[257 + code]);
+        if (deflate_length_extra[code])
+            bits_put(writer, length + 3 - deflate_length_base[code], deflate_length_extra[code]);
+        code = deflate_dist_code(tables, d);
+        bits_put(writer, dist_codes[code], dist_lengths[code]);
+        if (deflate_dist_extra[code])
+            bits_put(writer, d + 1 - deflate_dist_base[code], deflate_dist_extra[code]);
+    }
+    bits_put(writer, litlen_codes[256], litlen_lengths[256]);
+}
+
+function u32 deflate_match_length(u8 *a, u8 *b, u32 max)
+{
+    u32 length = DEFLATE_MIN_MATCH;
+    while (length + 8 <= max)
+    {
+        u64 x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y)
+            return length + (image_ctz64(x ^ y) >> 3);
+        length += 8;
+    }
+    while (length < max && a[length] == b[length])
+        ++length;
+    return length;
+}
+
+function u32 deflate_hash(u32 bytes)
+{
+    return (bytes * 0x9e3779b1u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// worst case of deflate_band for size bytes, stored blocks and their headers
+function u64 deflate_bound(u64 size)
+{
+    return size + (size / 65535 + size / DEFLATE_BLOCK_TOKENS + 2) * 6 + 64;
+}
+
+// in as a run of blocks that ends on a byte boundary: the last of the
+// stream (final) or followed by an empty stored block, so the next band's
+// blocks can be appended; head holds 1 << DEFLATE_HASH_BITS positions,
+// tokens DEFLATE_BLOCK_TOKENS
+function void deflate_band(BitWriter *writer, u8 *in, u64 size, bool final, u32 *head, u32 *tokens)
+{
+    DeflateTables *tables = deflate_tables();
+    memset(head, 0, sizeof(u32) << DEFLATE_HASH_BITS);
+    DeflateBlock block = {};
+    block.tokens = tokens;
+
+    u64 block_begin = 0;
+    u64 i = 0;
+    while (i < size)
+    {
+        u32 length = 0, d = 0;
+        if (i + DEFLATE_MIN_MATCH <= size)
+        {
+            u32 bytes;
+            memcpy(&bytes, in + i, 4);
+            u32 *slot = &head[deflate_hash(bytes)];
+            u64 candidate = *slot; // position + 1, 0 = none
+            *slot = (u32)(i + 1);
+            if (candidate && i + 1 - candidate <= DEFLATE_WINDOW)
+            {
+                u32 other;
+                memcpy(&other, in + candidate - 1, 4);
+                if (other == bytes)
+                {
+                    u64 left = size - i;
+                    length = deflate_match_length(in + candidate - 1, in + i, left < DEFLATE_MAX_MATCH ? (u32)left : DEFLATE_MAX_MATCH);
+                    d = (u32)(i + 1 - candidate);
+                }
+            }
+        }
+
+        if (length)
+        {
+            block.tokens[block.token_count++] = DEFLATE_MATCH_BIT | (d - 1) << 8 | (length - 3);
+            block.litlen_freq[257 + tables->length_code[length - 3]]++;
+            block.dist_freq[deflate_dist_code(tables, d - 1)]++;
+            // short matches are all indexed, long ones (runs) only at their end
+            u64 end = i + length;
+            u64 j = length <= 32 ? i + 1 : end - 3;
+            for (; j < end && j + DEFLATE_MIN_MATCH <= size; ++j)
+            {
+                u32 bytes;
+                memcpy(&bytes, in + j, 4);
+                head[deflate_hash(bytes)] = (u32)(j + 1);
+            }
+            i = end;
+        }
+        else
+        {
+            block.tokens[block.token_count++] = in[i];
+            block.litlen_freq[in[i]]++;
+            ++i;
+        }
+
+        if (block.token_count == DEFLATE_BLOCK_TOKENS && i < size)
+        {
+            deflate_block(writer, &block, in + block_begin, i - block_begin, false);
+            memset(block.litlen_freq, 0, sizeof(block.litlen_freq));
+            memset(block.dist_freq, 0, sizeof(block.dist_freq));
+            block.token_count = 0;
+            block_begin = i;
+        }
+    }
+    deflate_block(writer, &block, in + block_begin, i - block_begin, final);
+
+    if (!final)
+    {
+        // empty stored block: byte aligned, the next band starts a new block
+        bits_put(writer, 0, 3);
+        bits_align(writer);
+        static const u8 empty[4] = { 0, 0, 0xff, 0xff };
+        memcpy(writer->out + writer->size, empty, 4);
+        writer->size += 4;
+    }
+    bits_align(writer);
+}
+
+//
+// NOTE: PNG
+//
+
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552 // bytes before the sums have to be reduced
+
+function u32 adler32_update(u32 adler, u8 *data, u64 size)
+{
+    u32 a = adler & 0xffff, b = adler >> 16;
+    while (size)
+    {
+        u32 n = size < ADLER_NMAX ? (u32)size : ADLER_NMAX;
+        size -= n;
+        for (; n >= 4; n -= 4, data += 4)
+        {
+            a += data[0], b += a;
+            a += data[1], b += a;
+            a += data[2], b += a;
+            a += data[3], b += a;
+        }
+        for (; n > 0; --n)
+            a += *data++, b += a;
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return a | b << 16;
+}
+
+// the adler32 of two pieces back to back, second is size2 bytes long
+function u32 adler32_combine(u32 first, u32 second, u64 size2)
+{
+    u32 rem = (u32)(size2 % ADLER_BASE);
+    u32 sum1 = first & 0xffff;
+    u32 sum2 = (u32)(((u64)rem * sum1) % ADLER_BASE);
+    sum1 += (second & 0xffff) + ADLER_BASE - 1;
+    sum2 += (first >> 16) + (second >> 16) + ADLER_BASE - rem;
+    if (sum1 >= ADLER_BASE)
+        sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE)
+        sum1 -= ADLER_BASE;
+    if (sum2 >= 2 * ADLER_BASE)
+        sum2 -= 2 * ADLER_BASE;
+    if (sum2 >= ADLER_BASE)
+        sum2 -= ADLER_BASE;
+    return sum1 | sum2 << 16;
+}
+
+struct PngCrcTable {
+    u32 entries[256];
+
+    PngCrcTable()
+    {
+        for (u32 i = 0; i < 256; ++i)
+        {
+            u32 c = i;
+            for (u32 k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+
+function u32 png_crc(u8 *data, u64 size)
+{
+    static PngCrcTable table;
+    u32 c = 0xffffffffu;
+    for (u64 i = 0; i < size; ++i)
+        c = table.entries[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+// a chunk of size bytes of data at out + 8: length, type, the data, crc
+function u64 png_chunk(u8 *out, const char *type, u32 size)
+{
+    image_put_u32_be(out, size);
+    memcpy(out + 4, type, 4);
+    image_put_u32_be(out + 8 + size, png_crc(out + 4, size + 4));
+    return 12 + (u64)size;
+}
+
+struct PngJob {
+    FrameView *view;
+    u32 flags;
+    u32 band_rows;
+    u32 bpp;       // 3 or 4
+    ImageBand *bands;
+    u32 *adler;    // per band, of its filtered rows
+    u64 *filtered; // per band, their size
+    std::atomic<bool> translucent;
+};
+
+// one row as the PNG stores it: RGB or RGBA, whatever order the view has
+function void png_pack_row(u8 *out, u32 *row, u32 width, u32 bpp, PixelFormat format)
+{
+    if (bpp == 4)
+    {
+        if (format == PIXEL_FORMAT_BGRA8)
+            convert_row((u32*)out, row, width, CONVERT_SWIZZLE_RB);
+        else
+            memcpy(out, row, (u64)width * 4);
+        return;
+    }
+    u32 red_shift = format == PIXEL_FORMAT_BGRA8 ? 16 : 0;
+    u32 blue_shift = format == PIXEL_FORMAT_BGRA8 ? 0 : 16;
+    for (u32 x = 0; x < width; ++x, out += 3)
+    {
+        u32 pixel = row[x];
+        out[0] = (u8)(pixel >> red_shift);
+        out[1] = (u8)(pixel >> 8);
+        out[2] = (u8)(pixel >> blue_shift);
+    }
+}
+
+// Sub into sub, Up into up; returns true when Sub looks smaller (the sum
+// of the filtered bytes as signed magnitudes, the usual heuristic)
+function bool png_filter_row(u8 *sub, u8 *up, u8 *row, u8 *above, u32 size, u32 bpp)
+{
+    // row has bpp zero bytes in front, Sub of the first pixel is the pixel
+    u8 *left = row - bpp;
+    u64 sub_cost = 0, up_cost = 0;
+    u32 i = 0;
+#if IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i sub_sum = zero, up_sum = zero;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i current = _mm_loadu_si128((__m128i*)(row + i));
+        __m128i before = _mm_loadu_si128((__m128i*)(left + i));
+        __m128i top = _mm_loadu_si128((__m128i*)(above + i));
+        __m128i s = _mm_sub_epi8(current, before);
+        __m128i u = _mm_sub_epi8(current, top);
+        _mm_storeu_si128((__m128i*)(sub + i), s);
+        _mm_storeu_si128((__m128i*)(up + i), u);
+        // |signed byte| is the smaller of x and -x as unsigned
+        sub_sum = _mm_add_epi64(sub_sum, _mm_sad_epu8(_mm_min_epu8(s, _mm_sub_epi8(zero, s)), zero));
+        up_sum = _mm_add_epi64(up_sum, _mm_sad_epu8(_mm_min_epu8(u, _mm_sub_epi8(zero, u)), zero));
+    }
+    // a row's sums stay far below 2^32
+    sub_cost = (u32)_mm_cvtsi128_si32(_mm_add_epi64(sub_sum, _mm_unpackhi_epi64(sub_sum, sub_sum)));
+    up_cost = (u32)_mm_cvtsi128_si32(_mm_add_epi64(up_sum, _mm_unpackhi_epi64(up_sum, up_sum)));
+#endif
+    for (; i < size; ++i)
+    {
+        u8 s = (u8)(row[i] - left[i]);
+        u8 u = (u8)(row[i] - above[i]);
+        sub[i] = s;
+        up[i] = u;
+        sub_cost += s < 128 ? s : 256 - s;
+        up_cost += u < 128 ? u : 256 - u;
+    }
+    return sub_cost < up_cost;
+}
+
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP  2
+
+function void png_encode_band(PngJob *job, u32 band)
+{
+    FrameView *view = job->view;
+    u32 bpp = job->bpp;
+    u32 y_begin = band * job->band_rows;
+    u32 y_end = y_begin + job->band_rows;
+    if (y_end > view->height)
+        y_end = view->height;
+    bool first = band == 0;
+    bool final = y_end == view->height;
+
+    u32 row_size = view->width * bpp;
+    u64 filtered_size = (u64)(y_end - y_begin) * (row_size + 1);
+    u64 pad = 16; // zeros in front of a packed row, for the Sub of its first pixel
+    u8 *filtered = (u8*)malloc(filtered_size);
+    u8 *rows = (u8*)calloc(2 * (pad + row_size + 16) + row_size + 16, 1);
+    u32 *head = (u32*)malloc(sizeof(u32) << DEFLATE_HASH_BITS);
+    u32 *tokens = (u32*)malloc(DEFLATE_BLOCK_TOKENS * sizeof(u32));
+    u64 capacity = 8 + 2 + deflate_bound(filtered_size) + 4 + 8;
+    u8 *out = (u8*)malloc(capacity);
+    if (!filtered || !rows || !head || !tokens || !out)
+    {
+        free(filtered), free(rows), free(head), free(tokens), free(out);
+        return;
+    }
+
+    u8 *above = rows + pad;
+    u8 *row = above + row_size + 16 + pad;
+    u8 *other = row + row_size + 16;
+    if (y_begin > 0)
+        png_pack_row(above, image_export_row(view, job->flags, y_begin - 1), view->width, bpp, view->format);
+
+    u8 *at = filtered;
+    for (u32 y = y_begin; y < y_end; ++y)
+    {
+        png_pack_row(row, image_export_row(view, job->flags, y), view->width, bpp, view->format);
+        bool sub = png_filter_row(at + 1, other, row, above, row_size, bpp);
+        at[0] = sub ? PNG_FILTER_SUB : PNG_FILTER_UP;
+        if (!sub)
+            memcpy(at + 1, other, row_size);
+        at += row_size + 1;
+        u8 *swap = above;
+        above = row;
+        row = swap;
+    }
+    job->adler[band] = adler32_update(1, filtered, filtered_size);
+    job->filtered[band] = filtered_size;
+
+    // IDAT: length, type, (zlib header), blocks, crc
+    BitWriter writer = {};
+    writer.out = out + 8;
+    if (first)
+    {
+        writer.out[0] = 0x78; // deflate, 32K window
+        writer.out[1] = 0x01; // no dictionary, fastest, check bits
+        writer.size = 2;
+    }
+    deflate_band(&writer, filtered, filtered_size, final, head, tokens);
+    job->bands[band].size = png_chunk(out, "IDAT", (u32)writer.size);
+    job->bands[band].data = out;
+
+    free(filtered);
+    free(rows);
+    free(head);
+    free(tokens);
+}
+
+function void png_encode_bands(void *data, u32 begin, u32 end)
+{
+    for (u32 band = begin; band < end; ++band)
+        png_encode_band((PngJob*)data, band);
+}
+
+function void png_alpha_rows(void *data, u32 begin, u32 end)
+{
+    PngJob *job = (PngJob*)data;
+    FrameView *view = job->view;
+    for (u32 y = begin; y < end && !job->translucent.load(std::memory_order_relaxed); ++y)
+    {
+        u32 *row = (u32*)(view->pixels + (u64)y * view->stride);
+        u32 alpha = 0xff000000u;
+        for (u32 x = 0; x < view->width; ++x)
+            alpha &= row[x];
+        if (alpha != 0xff000000u)
+            job->translucent.store(true, std::memory_order_relaxed);
+    }
+}
+
+function bool png_encode(ImageEncoding *encoding, FrameView *view, u32 flags, WorkQueue *queue)
+{
+    memset(encoding, 0, sizeof(ImageEncoding));
+    PngJob job;
+    job.view = view;
+    job.flags = flags;
+    job.band_rows = image_export_band_rows(queue, view);
+    job.translucent.store(false);
+    if (!(flags & IMAGE_EXPORT_OPAQUE))
+        parallel_for(queue, view->height, parallel_row_grain(queue, view->height), png_alpha_rows, &job);
+    job.bpp = job.translucent.load() ? 4 : 3;
+    if (!image_encoding_alloc_bands(encoding, view, job.band_rows))
+        return false;
+    u32 band_count = encoding->band_count;
+    job.bands = encoding->bands;
+    job.adler = (u32*)calloc(band_count + 1, sizeof(u32));
+    job.filtered = (u64*)calloc(band_count + 1, sizeof(u64));
+    if (!job.adler || !job.filtered)
+    {
+        free(job.adler);
+        free(job.filtered);
+        return false;
+    }
+
+    parallel_for(queue, band_count, 1, png_encode_bands, &job);
+
+    u32 adler = 1;
+    for (u32 band = 0; band < band_count; ++band)
+        adler = adler32_combine(adler, job.adler[band], job.filtered[band]);
+    free(job.adler);
+    free(job.filtered);
+
+    static const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    u8 *head = encoding->head;
+    memcpy(head, signature, 8);
+    u8 *ihdr = head + 8 + 8;
+    image_put_u32_be(ihdr, view->width);
+    image_put_u32_be(ihdr + 4, view->height);
+    ihdr[8] = 8;                      // bits per channel
+    ihdr[9] = job.bpp == 4 ? 6 : 2;   // RGBA or RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // deflate, adaptive filters, not interlaced
+    encoding->head_size = 8 + (u32)png_chunk(head + 8, "IHDR", 13);
+
+    u8 *tail = encoding->tail;
+    image_put_u32_be(tail + 8, adler);
+    u64 size = png_chunk(tail, "IDAT", 4);
+    size += png_chunk(tail + size, "IEND", 0);
+    encoding->tail_size = (u32)size;
+    return image_encoding_finish(encoding);
+}
+
+//
+// NOTE: files
+//
+
+// .qoi is QOI, anything else PNG
+function ImageFileFormat image_file_format(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot && (strcmp(dot, ".qoi") == 0 || strcmp(dot, ".QOI") == 0))
+        return IMAGE_FILE_QOI;
+    return IMAGE_FILE_PNG;
+}
+
+function bool image_encode(ImageEncoding *encoding, ImageFileFormat format, FrameView *view, u32 flags, WorkQueue *queue)
+{
+    return format == IMAGE_FILE_QOI ? qoi_encode(encoding, view, flags, queue) : png_encode(encoding, view, flags, queue);
+}
+
+function bool image_encoding_save(ImageEncoding *encoding, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        printf("Error: can't create %s.\n", path);
+        return false;
+    }
+    bool ok = image_encoding_write(encoding, file);
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        printf("Error: failed to write %s.\n", path);
+    return ok;
+}
+
+// encode view as the format path's extension asks for and write it
+function bool image_export_save(const char *path, FrameView *view, u32 flags, WorkQueue *queue)
+{
+    ImageEncoding encoding;
+    bool ok = image_encode(&encoding, image_file_format(path), view, flags, queue);
+    if (!ok)
+        printf("Error: out of memory encoding %s.\n", path);
+    else
+        ok = image_encoding_save(&encoding, path);
+    image_encoding_free(&encoding);
+    return ok;
+}
+
+//
+// NOTE: snapshots
+//
+// snapshot_writer_request names the file, the pipeline hands the next
+// frame to snapshot_writer_take (frame_pipeline.cpp), which copies it (the
+// frame may be borrowed source memory) and returns. The writer thread
+// encodes with the work queue's help and writes the file. One snapshot at
+// a time: a request made while one is written is taken once it is done.
+//
+
+struct SnapshotWriter {
+    PlatformThread thread;
+    PlatformEvent wake;
+    std::atomic<bool> busy; // the thread owns the copy until it clears this
+    std::atomic<bool> quit;
+    WorkQueue *queue;
+
+    // render thread
+    char requested[260]; // "" = none
+    u32 requested_flags;
+
+    // the copy being written
+    u8 *pixels;
+    u64 capacity;
+    FrameView view;
+    u32 flags;
+    char path[260];
+    u64 taken_ns;
+
+    // results, written before busy is cleared
+    u64 written;
+    u64 failed;
+    u64 bytes;         // of the last file
+    double encode_ms;  // of the last file
+    double write_ms;
+    double latency_ms; // taken to written
+};
+
+function void snapshot_writer_thread_proc(void *data)
+{
+    SnapshotWriter *writer = (SnapshotWriter*)data;
+    profile_thread_name("snapshot");
+    while (true)
+    {
+        platform_event_wait(&writer->wake, 1000);
+        if (writer->busy.load(std::memory_order_acquire))
+        {
+            u64 begin = platform_time_ns();
+            ImageEncoding encoding;
+            bool ok = image_encode(&encoding, image_file_format(writer->path), &writer->view, writer->flags, writer->queue);
+            u64 encoded = platform_time_ns();
+            if (!ok)
+                printf("Error: out of memory encoding %s.\n", writer->path);
+            else
+                ok = image_encoding_save(&encoding, writer->path);
+            u64 end = platform_time_ns();
+
+            writer->bytes = encoding.size;
+            writer->encode_ms = (encoded - begin) * 1e-6;
+            writer->write_ms = (end - encoded) * 1e-6;
+            writer->latency_ms = (end - writer->taken_ns) * 1e-6;
+            if (ok)
+                writer->written++;
+            else
+                writer->failed++;
+            image_encoding_free(&encoding);
+            writer->busy.store(false, std::memory_order_release);
+        }
+        if (writer->quit.load())
+            return;
+    }
+}
+
+function void snapshot_writer_init(SnapshotWriter *writer, WorkQueue *queue)
+{
+    writer->queue = queue;
+    writer->requested[0] = 0;
+    writer->pixels = 0;
+    writer->capacity = 0;
+    writer->written = writer->failed = writer->bytes = 0;
+    writer->encode_ms = writer->write_ms = writer->latency_ms = 0;
+    writer->busy.store(false);
+    writer->quit.store(false);
+    platform_event_init(&writer->wake);
+    platform_thread_start(&writer->thread, snapshot_writer_thread_proc, writer);
+}
+
+// finishes the snapshot being written
+function void snapshot_writer_destroy(SnapshotWriter *writer)
+{
+    writer->quit.store(true);
+    platform_event_signal(&writer->wake);
+    platform_thread_join(&writer->thread);
+    platform_event_destroy(&writer->wake);
+    free(writer->pixels);
+    writer->pixels = 0;
+}
+
+// snapshot the next frame to path (.png or .qoi), IMAGE_EXPORT_* flags
+function void snapshot_writer_request(SnapshotWriter *writer, const char *path, u32 flags)
+{
+    snprintf(writer->requested, sizeof(writer->requested), "%s", path);
+    writer->requested_flags = flags;
+}
+
+// copy view for the thread if a snapshot was requested and the last one
+// is done; true when it was taken
+function bool snapshot_writer_take(SnapshotWriter *writer, FrameView *view, bool flip_vertical)
+{
+    if (!writer->requested[0] || writer->busy.load(std::memory_order_acquire))
+        return false;
+
+    u32 stride = view->width * 4;
+    u64 size = (u64)stride * view->height;
+    if (size > writer->capacity)
+    {
+        free(writer->pixels);
+        writer->pixels = (u8*)malloc(size);
+        writer->capacity = writer->pixels ? size : 0;
+        if (!writer->pixels)
+        {
+            printf("Error: out of memory for a %ux%u snapshot.\n", view->width, view->height);
+            writer->requested[0] = 0;
+            return false;
+        }
+    }
+
+    writer->view = frame_view(writer->pixels, view->width, view->height, stride, view->format);
+    frame_view_copy_parallel(&writer->view, view, 0, writer->queue);
+    writer->flags = writer->requested_flags | (flip_vertical ? IMAGE_EXPORT_FLIP_Y : 0);
+    memcpy(writer->path, writer->requested, sizeof(writer->path));
+    writer->requested[0] = 0;
+    writer->taken_ns = platform_time_ns();
+    writer->busy.store(true, std::memory_order_release);
+    platform_event_signal(&writer->wake);
+    return true;
+}
@@ -1,64 +1,2350 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define IMAGE_AVX2 1
+#include <immintrin.h>
+#endif
+
 typedef struct {
     unsigned char r, g, b, a;
 } RGBA;
 
-function bool blt_capture_screen(u8* image_data, u32 size, u32* width, u32* height)
-{
-    u32 w = GetSystemMetrics(SM_CXVIRTUALSCREEN);  
-    u32 h = GetSystemMetrics(SM_CYVIRTUALSCREEN);  
-    
-    Assert(size >= w * h * 4);
-    
-    HDC hdc = GetDC(NULL);
-    
-    HDC hDest = CreateCompatibleDC(hdc); // create a dc to use for capture 
-    
-    HBITMAP hbCapture = CreateCompatibleBitmap(hdc, w, h);  
-    SelectObject(hDest, hbCapture); 
-    
-    // the following line effectively copies the screen into the capture bitamp 
-    BitBlt(hDest, 0,0, w, h, hdc, 0, 0, SRCCOPY);  
-    
-    BITMAPINFOHEADER bmpInfoHeader = { sizeof(BITMAPINFOHEADER), (long)w, (long)h, 1, 32 };
-    GetDIBits(hdc, hbCapture, 0, h, image_data, (BITMAPINFO*)&bmpInfoHeader, DIB_RGB_COLORS);
-    
-    // clean up - release unused resources! 
-    ReleaseDC(NULL, hdc);  
-    DeleteDC(hDest);
-    DeleteObject(hbCapture);
-    
-    *width = w;
-    *height = h;
-    return true;
+//
+// NOTE: frame views
+//
+// A view is a window onto 4 byte per pixel memory with its own row pitch,
+// e.g. a mapped staging texture (RowPitch) or a region of interest inside a
+// bigger frame. Kernels take views so they can read that memory in place.
+//
+
+enum PixelFormat {
+    PIXEL_FORMAT_RGBA8,
+    PIXEL_FORMAT_BGRA8,
+};
+
+struct FrameRect {
+    u32 x;
+    u32 y;
+    u32 width;
+    u32 height;
+};
+
+struct FrameView {
+    u8 *pixels;
+    u32 width;
+    u32 height;
+    u32 stride; // bytes between rows
+    PixelFormat format;
+};
+
+function FrameView frame_view(u8 *pixels, u32 width, u32 height, u32 stride, PixelFormat format)
+{
+    FrameView view = { pixels, width, height, stride, format };
+    return view;
 }
 
-RGBA interpolate_rgba(RGBA color1, RGBA color2, float t) {
-    // Clamp interpolation factor between 0 and 1
-    t = fmaxf(0.0f, fminf(1.0f, t));
-    
-    // Calculate interpolated values for each channel
-    RGBA result;
-    result.r = (unsigned char)(color1.r + t * (color2.r - color1.r));
-    result.g = (unsigned char)(color1.g + t * (color2.g - color1.g));
-    result.b = (unsigned char)(color1.b + t * (color2.b - color1.b));
-    result.a = (unsigned char)(color1.a + t * (color2.a - color1.a));
-    
+// clip rect to width x height, a rect with width or height 0 means everything
+function FrameRect frame_rect_clip(FrameRect rect, u32 width, u32 height)
+{
+    if (rect.width == 0 || rect.height == 0)
+    {
+        FrameRect all = { 0, 0, width, height };
+        return all;
+    }
+
+    FrameRect result = {};
+    if (rect.x >= width || rect.y >= height)
+        return result;
+
+    result.x = rect.x;
+    result.y = rect.y;
+    result.width = rect.width < width - rect.x ? rect.width : width - rect.x;
+    result.height = rect.height < height - rect.y ? rect.height : height - rect.y;
     return result;
 }
 
+// the part of view inside rect (clipped), no pixels are touched
+function FrameView frame_view_sub(FrameView view, FrameRect rect)
+{
+    rect = frame_rect_clip(rect, view.width, view.height);
+    view.pixels += (u64)rect.y * view.stride + (u64)rect.x * 4;
+    view.width = rect.width;
+    view.height = rect.height;
+    return view;
+}
+
+//
+// NOTE: generated images
+//
+// Synthetic load for the pipeline, so generation has to cost far less than
+// the stages it feeds. Fixed point only, rows split across the work queue.
+//
+
+// one row of the gradient in 16.16 fixed point per channel,
+// t = x / (width - 1) like the float version this replaces; the step is
+// rounded and the values too (the 0.5 in acc), so the row ends on end_color
+function void gradient_row(u32 *row, u32 width, RGBA start_color, RGBA end_color)
+{
+    int start[4] = { start_color.r, start_color.g, start_color.b, start_color.a };
+    int end[4] = { end_color.r, end_color.g, end_color.b, end_color.a };
+    int step[4];
+    for (int c = 0; c < 4; ++c)
+    {
+        // a decreasing channel is negative, multiplied since shifting it is undefined
+        long long delta = (long long)(end[c] - start[c]) * 65536;
+        long long half = (long long)(width - 1) / 2;
+        step[c] = width > 1 ? (int)((delta + (delta < 0 ? -half : half)) / (long long)(width - 1)) : 0;
+    }
+
+#if IMAGE_SSE2
+    // one pixel per iteration, the four channels side by side in 32-bit lanes
+    __m128i acc = _mm_setr_epi32((start[0] << 16) + 0x8000, (start[1] << 16) + 0x8000,
+                                 (start[2] << 16) + 0x8000, (start[3] << 16) + 0x8000);
+    __m128i inc = _mm_setr_epi32(step[0], step[1], step[2], step[3]);
+    for (u32 x = 0; x < width; ++x)
+    {
+        __m128i v = _mm_srai_epi32(acc, 16);
+        v = _mm_packs_epi32(v, v);
+        v = _mm_packus_epi16(v, v);
+        row[x] = (u32)_mm_cvtsi128_si32(v);
+        acc = _mm_add_epi32(acc, inc);
+    }
+#else
+    int acc[4];
+    for (int c = 0; c < 4; ++c)
+        acc[c] = (start[c] << 16) + 0x8000;
+    for (u32 x = 0; x < width; ++x)
+    {
+        u8 *p = (u8*)(row + x);
+        for (int c = 0; c < 4; ++c)
+        {
+            p[c] = (u8)(acc[c] >> 16);
+            acc[c] += step[c];
+        }
+    }
+#endif
+}
+
+struct ReplicateRowJob {
+    u8 *pixels;
+    u32 stride;
+    u32 row_bytes;
+};
+
+function void replicate_row_proc(void *data, u32 begin, u32 end)
+{
+    ReplicateRowJob *job = (ReplicateRowJob*)data;
+    u8 *row = job->pixels;
+    for (u32 y = begin; y < end; ++y)
+    {
+        if (y)
+            memcpy(job->pixels + (u64)y * job->stride, row, job->row_bytes);
+    }
+}
+
+// horizontal gradient: one row is computed, the others are copies of it
+function void generate_gradient(u8 *pixels, u32 width, u32 height, u32 stride,
+                                RGBA start_color, RGBA end_color, WorkQueue *queue)
+{
+    if (!width || !height)
+        return;
+
+    gradient_row((u32*)pixels, width, start_color, end_color);
+
+    ReplicateRowJob job = { pixels, stride, width * 4 };
+    parallel_for(queue, height, parallel_row_grain(queue, height), replicate_row_proc, &job);
+}
+
 void generate_interpolated_image(int width, int height, RGBA start_color, RGBA end_color, RGBA* image_data) {
-    // Calculate step size for interpolation factor
-    float step_t = 1.0f / (width - 1);
-    
-    // Iterate through each pixel and perform interpolation
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            // Calculate interpolation factor based on position
-            float t = x * step_t;
-            image_data[y * width + x] = interpolate_rgba(start_color, end_color, t);
+    generate_gradient((u8*)image_data, width, height, width * 4, start_color, end_color, 0);
+}
+
+// Test pattern, 8 bits per channel (values wrap):
+//   R = x + offset, G = y + offset, B = 128, A = (x + y) / 2
+struct TestPatternJob {
+    u8 *pixels;
+    u32 width;
+    u32 stride;
+    u32 offset;
+};
+
+function void test_pattern_rows(void *data, u32 begin, u32 end)
+{
+    TestPatternJob *job = (TestPatternJob*)data;
+    u32 width = job->width;
+
+    for (u32 y = begin; y < end; ++y)
+    {
+        u32 *row = (u32*)(job->pixels + (u64)y * job->stride);
+        u32 g_b = (((y + job->offset) & 0xFF) << 8) | (128 << 16);
+
+        u32 x = 0;
+#if IMAGE_AVX2
+        __m256i xs8 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i gb8 = _mm256_set1_epi32((int)g_b);
+        __m256i ff8 = _mm256_set1_epi32(0xFF);
+        for (; x + 8 <= width; x += 8)
+        {
+            __m256i xv = _mm256_add_epi32(_mm256_set1_epi32((int)x), xs8);
+            __m256i r = _mm256_and_si256(_mm256_add_epi32(xv, _mm256_set1_epi32((int)job->offset)), ff8);
+            __m256i a = _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(_mm256_add_epi32(xv, _mm256_set1_epi32((int)y)), 1), ff8), 24);
+            _mm256_storeu_si256((__m256i*)(row + x), _mm256_or_si256(_mm256_or_si256(r, gb8), a));
+        }
+#endif
+#if IMAGE_SSE2
+        __m128i xs = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i gb = _mm_set1_epi32((int)g_b);
+        __m128i ff = _mm_set1_epi32(0xFF);
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i xv = _mm_add_epi32(_mm_set1_epi32((int)x), xs);
+            __m128i r = _mm_and_si128(_mm_add_epi32(xv, _mm_set1_epi32((int)job->offset)), ff);
+            __m128i a = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(_mm_add_epi32(xv, _mm_set1_epi32((int)y)), 1), ff), 24);
+            _mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(_mm_or_si128(r, gb), a));
+        }
+#endif
+        for (; x < width; ++x)
+            row[x] = ((x + job->offset) & 0xFF) | g_b | ((((x + y) >> 1) & 0xFF) << 24);
+    }
+}
+
+function void generate_test_pattern(u8 *pixels, u32 width, u32 height, u32 stride, u32 offset, WorkQueue *queue)
+{
+    TestPatternJob job = { pixels, width, stride, offset };
+    parallel_for(queue, height, parallel_row_grain(queue, height), test_pattern_rows, &job);
+}
+
+//
+// NOTE: fused pixel conversion
+//
+// One pass over the source that does any combination of R/B swap
+// (BGRA <-> RGBA), vertical flip and alpha = 0xFF while copying into the
+// destination, instead of memcpy + stbi__vertical_flip + an alpha loop.
+// src == dst (same stride) is allowed, rows are then swapped in pairs.
+//
+
+enum ConvertFlags {
+    CONVERT_SWIZZLE_RB   = 1 << 0,
+    CONVERT_FLIP_Y       = 1 << 1,
+    CONVERT_FORCE_OPAQUE = 1 << 2,
+};
+
+function inline u32 convert_pixel(u32 p, u32 flags)
+{
+    if (flags & CONVERT_SWIZZLE_RB)
+        p = (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+    if (flags & CONVERT_FORCE_OPAQUE)
+        p |= 0xFF000000;
+    return p;
+}
+
+#if IMAGE_SSE2
+function inline __m128i convert_pixels_sse2(__m128i p, u32 flags)
+{
+    if (flags & CONVERT_SWIZZLE_RB)
+    {
+        __m128i ga = _mm_and_si128(p, _mm_set1_epi32((int)0xFF00FF00));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0xFF));
+        __m128i b = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xFF)), 16);
+        p = _mm_or_si128(ga, _mm_or_si128(r, b));
+    }
+    if (flags & CONVERT_FORCE_OPAQUE)
+        p = _mm_or_si128(p, _mm_set1_epi32((int)0xFF000000));
+    return p;
+}
+#endif
+
+#if IMAGE_AVX2
+function inline __m256i convert_pixels_avx2(__m256i p, u32 flags)
+{
+    if (flags & CONVERT_SWIZZLE_RB)
+    {
+        __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        p = _mm256_shuffle_epi8(p, mask);
+    }
+    if (flags & CONVERT_FORCE_OPAQUE)
+        p = _mm256_or_si256(p, _mm256_set1_epi32((int)0xFF000000));
+    return p;
+}
+#endif
+
+// convert one row of width pixels, src and dst may be the same row
+function void convert_row(u32 *dst, u32 *src, u32 width, u32 flags)
+{
+    u32 x = 0;
+#if IMAGE_AVX2
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i p = _mm256_loadu_si256((__m256i*)(src + x));
+        _mm256_storeu_si256((__m256i*)(dst + x), convert_pixels_avx2(p, flags));
+    }
+#endif
+#if IMAGE_SSE2
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i p = _mm_loadu_si128((__m128i*)(src + x));
+        _mm_storeu_si128((__m128i*)(dst + x), convert_pixels_sse2(p, flags));
+    }
+#endif
+    for (; x < width; ++x)
+        dst[x] = convert_pixel(src[x], flags);
+}
+
+// in place: convert rows a and b and swap them
+function void convert_swap_rows(u32 *a, u32 *b, u32 width, u32 flags)
+{
+    u32 x = 0;
+#if IMAGE_AVX2
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i pa = _mm256_loadu_si256((__m256i*)(a + x));
+        __m256i pb = _mm256_loadu_si256((__m256i*)(b + x));
+        _mm256_storeu_si256((__m256i*)(a + x), convert_pixels_avx2(pb, flags));
+        _mm256_storeu_si256((__m256i*)(b + x), convert_pixels_avx2(pa, flags));
+    }
+#endif
+#if IMAGE_SSE2
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i pa = _mm_loadu_si128((__m128i*)(a + x));
+        __m128i pb = _mm_loadu_si128((__m128i*)(b + x));
+        _mm_storeu_si128((__m128i*)(a + x), convert_pixels_sse2(pb, flags));
+        _mm_storeu_si128((__m128i*)(b + x), convert_pixels_sse2(pa, flags));
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        u32 pa = a[x];
+        a[x] = convert_pixel(b[x], flags);
+        b[x] = convert_pixel(pa, flags);
+    }
+}
+
+// strides are in bytes and must be a multiple of 4
+function void convert_pixels(u8 *dst, u32 dst_stride, u8 *src, u32 src_stride, u32 width, u32 height, u32 flags)
+{
+    u32 pixel_flags = flags & (CONVERT_SWIZZLE_RB | CONVERT_FORCE_OPAQUE);
+
+    if (src == dst && (flags & CONVERT_FLIP_Y))
+    {
+        Assert(src_stride == dst_stride);
+        u32 y = 0;
+        for (; y < height / 2; ++y)
+            convert_swap_rows((u32*)(dst + (u64)y * dst_stride), (u32*)(dst + (u64)(height - 1 - y) * dst_stride), width, pixel_flags);
+        if (height & 1)
+            convert_row((u32*)(dst + (u64)y * dst_stride), (u32*)(dst + (u64)y * dst_stride), width, pixel_flags);
+        return;
+    }
+
+    if (src == dst && !pixel_flags)
+        return;
+
+    for (u32 y = 0; y < height; ++y)
+    {
+        u32 src_y = (flags & CONVERT_FLIP_Y) ? height - 1 - y : y;
+        u32 *s = (u32*)(src + (u64)src_y * src_stride);
+        u32 *d = (u32*)(dst + (u64)y * dst_stride);
+        if (!pixel_flags)
+            memcpy(d, s, width * 4);
+        else
+            convert_row(d, s, width, pixel_flags);
+    }
+}
+
+// copy src into dst (same size, any strides) applying CONVERT_* on the way
+function void frame_view_copy(FrameView *dst, FrameView *src, u32 flags)
+{
+    Assert(dst->width == src->width && dst->height == src->height);
+    convert_pixels(dst->pixels, dst->stride, src->pixels, src->stride, src->width, src->height, flags);
+}
+
+struct CopyJob {
+    FrameView *dst;
+    FrameView *src;
+    u32 flags;
+};
+
+function void copy_rows(void *data, u32 begin, u32 end)
+{
+    CopyJob *job = (CopyJob*)data;
+    u32 height = job->src->height;
+    // flipped, dst rows begin..end come from the mirrored src rows
+    u32 src_begin = (job->flags & CONVERT_FLIP_Y) ? height - end : begin;
+    FrameRect dst_rows = { 0, begin, job->dst->width, end - begin };
+    FrameRect src_rows = { 0, src_begin, job->src->width, end - begin };
+    FrameView dst = frame_view_sub(*job->dst, dst_rows);
+    FrameView src = frame_view_sub(*job->src, src_rows);
+    frame_view_copy(&dst, &src, job->flags);
+}
+
+// frame_view_copy with the rows split across the work queue
+function void frame_view_copy_parallel(FrameView *dst, FrameView *src, u32 flags, WorkQueue *queue)
+{
+    Assert(dst->width == src->width && dst->height == src->height);
+    CopyJob job = { dst, src, flags };
+    parallel_for(queue, src->height, parallel_row_grain(queue, src->height), copy_rows, &job);
+}
+
+//
+// NOTE: downscaling
+//
+// Fitting a big capture (4K, the whole virtual screen) to the window before
+// it is uploaded. An integer factor is a box average over factor x factor
+// pixels; any other size first takes the largest integer factor that keeps
+// the frame at least as big as the target and then finishes with a
+// separable bilinear pass, which then never skips source pixels. Channels
+// are treated alike, so BGRA and RGBA scale the same. Rows are split
+// across the work queue. Box averaging drops the last src % factor columns
+// and rows.
+//
+
+#define DOWNSCALE_MAX_FACTOR 15 // factor^2 * 255 plus rounding still fits 16 bits
+#define DOWNSCALE_WEIGHT_BITS 7
+
+struct DownscaleJob {
+    FrameView *dst;
+    FrameView *src;
+    u32 factor;
+
+    // bilinear: per dst column the left source pixel and the weight of the right one
+    u32 *x0;
+    u16 *wx;
+};
+
+// 2x2 box straight from the two source rows, the common 4K -> 1080p case
+function void downscale_half_row(u32 *out, u8 *row0, u8 *row1, u32 width)
+{
+    u32 x = 0;
+#if IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi16(2);
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i half[2];
+        for (u32 k = 0; k < 2; ++k)
+        {
+            __m128i a = _mm_loadu_si128((__m128i*)(row0 + (u64)x * 8 + k * 16));
+            __m128i b = _mm_loadu_si128((__m128i*)(row1 + (u64)x * 8 + k * 16));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)); // pixels 0, 1
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)); // pixels 2, 3
+            __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+            half[k] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        }
+        _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(half[0], half[1]));
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        u8 *a = row0 + (u64)x * 8, *b = row1 + (u64)x * 8;
+        u32 pixel = 0;
+        for (u32 c = 0; c < 4; ++c)
+            pixel |= ((a[c] + a[c + 4] + b[c] + b[c + 4] + 2) >> 2) << (c * 8);
+        out[x] = pixel;
+    }
+}
+
+function void downscale_area_rows(void *data, u32 begin, u32 end)
+{
+    DownscaleJob *job = (DownscaleJob*)data;
+    FrameView *dst = job->dst, *src = job->src;
+    u32 f = job->factor;
+    if (f == 2)
+    {
+        for (u32 dy = begin; dy < end; ++dy)
+            downscale_half_row((u32*)(dst->pixels + (u64)dy * dst->stride), src->pixels + (u64)dy * 2 * src->stride,
+                               src->pixels + ((u64)dy * 2 + 1) * src->stride, dst->width);
+        return;
+    }
+
+    // round(sum / n) = (sum + n/2) / n. A 16-bit reciprocal is off by one
+    // for some sums, the SIMD path corrects it with the remainder; the 32-bit
+    // one of the scalar path is exact for all sums below 2^16.
+    u32 n = f * f;
+    u32 src_width = dst->width * f;
+    u16 round = (u16)(n / 2);
+    u16 recip = (u16)((65536 + n / 2) / n);
+    u32 recip32 = 0xFFFFFFFFu / n + 1;
+
+    // the f source rows of a dst row summed per channel
+    u16 *sums = (u16*)malloc((u64)src_width * 4 * sizeof(u16) + 16);
+
+    for (u32 dy = begin; dy < end; ++dy)
+    {
+        for (u32 k = 0; k < f; ++k)
+        {
+            u8 *row = src->pixels + (u64)(dy * f + k) * src->stride;
+            u32 i = 0;
+#if IMAGE_SSE2
+            __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= src_width * 4; i += 16)
+            {
+                __m128i p = _mm_loadu_si128((__m128i*)(row + i));
+                __m128i lo = _mm_unpacklo_epi8(p, zero);
+                __m128i hi = _mm_unpackhi_epi8(p, zero);
+                if (k)
+                {
+                    lo = _mm_add_epi16(lo, _mm_loadu_si128((__m128i*)(sums + i)));
+                    hi = _mm_add_epi16(hi, _mm_loadu_si128((__m128i*)(sums + i + 8)));
+                }
+                _mm_storeu_si128((__m128i*)(sums + i), lo);
+                _mm_storeu_si128((__m128i*)(sums + i + 8), hi);
+            }
+#endif
+            for (; i < src_width * 4; ++i)
+                sums[i] = (u16)((k ? sums[i] : 0) + row[i]);
+        }
+
+        u32 *out = (u32*)(dst->pixels + (u64)dy * dst->stride);
+        u32 x = 0;
+#if IMAGE_SSE2
+        __m128i round4 = _mm_set1_epi16((short)round);
+        __m128i recip4 = _mm_set1_epi16((short)recip);
+        __m128i n4 = _mm_set1_epi16((short)n);
+        __m128i last4 = _mm_set1_epi16((short)(n - 1));
+        __m128i zero4 = _mm_setzero_si128();
+        for (; x < dst->width; ++x)
+        {
+            u16 *s = sums + (u64)x * f * 4;
+            __m128i acc = _mm_loadl_epi64((__m128i*)s);
+            for (u32 k = 1; k < f; ++k)
+                acc = _mm_add_epi16(acc, _mm_loadl_epi64((__m128i*)(s + k * 4)));
+            acc = _mm_add_epi16(acc, round4);
+            __m128i q = _mm_mulhi_epu16(acc, recip4);
+            // q is within one of the quotient, the remainder (-n..2n) fits a signed 16 bits
+            __m128i r = _mm_sub_epi16(acc, _mm_mullo_epi16(q, n4));
+            q = _mm_sub_epi16(q, _mm_cmpgt_epi16(r, last4));
+            q = _mm_add_epi16(q, _mm_cmplt_epi16(r, zero4));
+            out[x] = (u32)_mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+        }
+#endif
+        for (; x < dst->width; ++x)
+        {
+            u16 *s = sums + (u64)x * f * 4;
+            u32 pixel = 0;
+            for (u32 c = 0; c < 4; ++c)
+            {
+                u32 sum = 0;
+                for (u32 k = 0; k < f; ++k)
+                    sum += s[k * 4 + c];
+                pixel |= (u32)(((u64)(sum + round) * recip32) >> 32) << (c * 8);
+            }
+            out[x] = pixel;
+        }
+    }
+
+    free(sums);
+}
+
+// dst is src / factor (rounded down) in both dimensions, 2 <= factor <= DOWNSCALE_MAX_FACTOR
+function void downscale_area(FrameView *dst, FrameView *src, u32 factor, WorkQueue *queue)
+{
+    Assert(factor >= 2 && factor <= DOWNSCALE_MAX_FACTOR);
+    Assert(dst->width == src->width / factor && dst->height == src->height / factor);
+
+    DownscaleJob job = {};
+    job.dst = dst;
+    job.src = src;
+    job.factor = factor;
+    parallel_for(queue, dst->height, parallel_row_grain(queue, dst->height), downscale_area_rows, &job);
+}
+
+// source position of a dst pixel center in 1 / 2^DOWNSCALE_WEIGHT_BITS
+// steps: the left/top pixel (at most size - 2) and the weight of the next one
+function void downscale_sample(u32 d, u32 dst_size, u32 src_size, u32 *s0, u16 *w)
+{
+    u32 one = 1 << DOWNSCALE_WEIGHT_BITS;
+    s64 pos = (((s64)(2 * d + 1) * src_size * one) / dst_size - one) / 2;
+    if (pos < 0)
+        pos = 0;
+    u32 first = (u32)(pos >> DOWNSCALE_WEIGHT_BITS);
+    u32 weight = (u32)(pos & (one - 1));
+    if (src_size < 2)
+    {
+        first = 0;
+        weight = 0;
+    }
+    else if (first >= src_size - 1)
+    {
+        first = src_size - 2;
+        weight = one;
+    }
+    *s0 = first;
+    *w = (u16)weight;
+}
+
+// one source row, horizontally resampled into 4 weighted channels per dst pixel (15 bits)
+function void downscale_bilinear_row(u16 *out, u8 *row, DownscaleJob *job, u32 src_width)
+{
+    u32 width = job->dst->width;
+    u32 one = 1 << DOWNSCALE_WEIGHT_BITS;
+    u32 x = 0;
+#if IMAGE_SSE2
+    if (src_width >= 2)
+    {
+        __m128i zero = _mm_setzero_si128();
+        for (; x + 2 <= width; x += 2)
+        {
+            __m128i sum[2];
+            for (u32 k = 0; k < 2; ++k)
+            {
+                __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(row + (u64)job->x0[x + k] * 4)), zero);
+                __m128i pairs = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8)); // a0 b0 a1 b1 ...
+                u32 w = job->wx[x + k];
+                sum[k] = _mm_madd_epi16(pairs, _mm_set1_epi32((int)((w << 16) | (one - w))));
+            }
+            _mm_storeu_si128((__m128i*)(out + x * 4), _mm_packs_epi32(sum[0], sum[1]));
+        }
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        u8 *a = row + (u64)job->x0[x] * 4;
+        u8 *b = src_width >= 2 ? a + 4 : a;
+        u32 w = job->wx[x];
+        for (u32 c = 0; c < 4; ++c)
+            out[x * 4 + c] = (u16)(a[c] * (one - w) + b[c] * w);
+    }
+}
+
+// one dst row from two horizontally resampled source rows, wy the weight of bottom
+function void downscale_bilinear_blend(u8 *out, u16 *top, u16 *bottom, u32 channels, u16 wy)
+{
+    u32 one = 1 << DOWNSCALE_WEIGHT_BITS;
+    u32 shift = 2 * DOWNSCALE_WEIGHT_BITS;
+    u32 i = 0;
+#if IMAGE_SSE2
+    __m128i weights = _mm_set1_epi32((int)(((u32)wy << 16) | (one - wy)));
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    for (; i + 8 <= channels; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((__m128i*)(top + i));
+        __m128i b = _mm_loadu_si128((__m128i*)(bottom + i));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), shift);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), shift);
+        __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for (; i < channels; ++i)
+        out[i] = (u8)((top[i] * (one - wy) + bottom[i] * wy + (1 << (shift - 1))) >> shift);
+}
+
+function void downscale_bilinear_rows(void *data, u32 begin, u32 end)
+{
+    DownscaleJob *job = (DownscaleJob*)data;
+    FrameView *dst = job->dst, *src = job->src;
+    u32 channels = dst->width * 4;
+
+    u16 *top = (u16*)malloc((u64)channels * 2 * sizeof(u16));
+    u16 *bottom = top + channels;
+
+    for (u32 dy = begin; dy < end; ++dy)
+    {
+        u32 y0;
+        u16 wy;
+        downscale_sample(dy, dst->height, src->height, &y0, &wy);
+        u32 y1 = src->height >= 2 ? y0 + 1 : y0;
+
+        downscale_bilinear_row(top, src->pixels + (u64)y0 * src->stride, job, src->width);
+        downscale_bilinear_row(bottom, src->pixels + (u64)y1 * src->stride, job, src->width);
+
+        downscale_bilinear_blend(dst->pixels + (u64)dy * dst->stride, top, bottom, channels, wy);
+    }
+
+    free(top);
+}
+
+// any dst size up to the src size, bilinear from the four nearest pixels
+function void downscale_bilinear(FrameView *dst, FrameView *src, WorkQueue *queue)
+{
+    Assert(dst->width <= src->width && dst->height <= src->height);
+
+    DownscaleJob job = {};
+    job.dst = dst;
+    job.src = src;
+    job.x0 = (u32*)malloc((u64)dst->width * sizeof(u32));
+    job.wx = (u16*)malloc((u64)dst->width * sizeof(u16));
+    for (u32 x = 0; x < dst->width; ++x)
+        downscale_sample(x, dst->width, src->width, &job.x0[x], &job.wx[x]);
+
+    parallel_for(queue, dst->height, parallel_row_grain(queue, dst->height), downscale_bilinear_rows, &job);
+
+    free(job.x0);
+    free(job.wx);
+}
+
+// largest box factor that keeps the frame at least dst_width x dst_height
+function u32 downscale_area_factor(u32 src_width, u32 src_height, u32 dst_width, u32 dst_height)
+{
+    u32 fx = dst_width ? src_width / dst_width : 1;
+    u32 fy = dst_height ? src_height / dst_height : 1;
+    u32 factor = fx < fy ? fx : fy;
+    return factor > DOWNSCALE_MAX_FACTOR ? DOWNSCALE_MAX_FACTOR : factor;
+}
+
+//
+// NOTE: YUV conversion
+//
+// Packed BGRA/RGBA to the planar 4:2:0 layouts video encoders take: NV12
+// (Y plane, interleaved UV plane) and I420 (Y, U, V planes). BT.601 or
+// BT.709 coefficients, limited (16-235/240) or full range, 14 bit fixed
+// point. Chroma is the average of each 2x2 block, the last column/row of
+// an odd sized frame counts twice. One pass reads the frame once and writes
+// every plane; pairs of rows are split across the work queue.
+//
+
+enum YuvLayout {
+    YUV_NV12,
+    YUV_I420,
+};
+
+enum YuvFlags {
+    YUV_BT709      = 1 << 0, // BT.601 otherwise
+    YUV_FULL_RANGE = 1 << 1, // limited range otherwise
+    YUV_FLIP_Y     = 1 << 2, // source rows are bottom-up
+};
+
+#define YUV_SHIFT 14
+
+struct YuvImage {
+    YuvLayout layout;
+    u32 width;
+    u32 height;
+    u8 *planes[3]; // Y, UV (NV12) or Y, U, V (I420)
+    u32 strides[3];
+};
+
+// bytes for a tightly packed image
+function u64 yuv_image_size(u32 width, u32 height)
+{
+    u64 chroma = (u64)((width + 1) / 2) * ((height + 1) / 2);
+    return (u64)width * height + chroma * 2;
+}
+
+// planes back to back in memory (yuv_image_size bytes), the usual raw .yuv layout
+function YuvImage yuv_image(u8 *memory, YuvLayout layout, u32 width, u32 height)
+{
+    YuvImage image = {};
+    image.layout = layout;
+    image.width = width;
+    image.height = height;
+    u32 chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+
+    image.planes[0] = memory;
+    image.strides[0] = width;
+    image.planes[1] = memory + (u64)width * height;
+    if (layout == YUV_NV12)
+    {
+        image.strides[1] = chroma_width * 2;
+    }
+    else
+    {
+        image.strides[1] = chroma_width;
+        image.planes[2] = image.planes[1] + (u64)chroma_width * chroma_height;
+        image.strides[2] = chroma_width;
+    }
+    return image;
+}
+
+// per output: the weight of channel 0, 1, 2 of the source pixel and the bias
+struct YuvCoefficients {
+    s32 y[3];
+    s32 u[3];
+    s32 v[3];
+    s32 y_bias;
+    s32 c_bias;
+};
+
+function YuvCoefficients yuv_coefficients(u32 flags, PixelFormat format)
+{
+    double kr = (flags & YUV_BT709) ? 0.2126 : 0.299;
+    double kb = (flags & YUV_BT709) ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    bool full = (flags & YUV_FULL_RANGE) != 0;
+    double y_scale = full ? 1.0 : 219.0 / 255.0;
+    double c_scale = full ? 1.0 : 224.0 / 255.0;
+    double one = (double)(1 << YUV_SHIFT);
+
+    // in R, G, B order
+    double y[3] = { kr * y_scale, kg * y_scale, kb * y_scale };
+    double u[3] = { -kr / (2.0 * (1.0 - kb)) * c_scale, -kg / (2.0 * (1.0 - kb)) * c_scale, 0.5 * c_scale };
+    double v[3] = { 0.5 * c_scale, -kg / (2.0 * (1.0 - kr)) * c_scale, -kb / (2.0 * (1.0 - kr)) * c_scale };
+
+    // memory order of the channels: BGRA puts B first
+    u32 order[3] = { 2, 1, 0 };
+    if (format == PIXEL_FORMAT_RGBA8)
+    {
+        order[0] = 0;
+        order[2] = 2;
+    }
+
+    YuvCoefficients c = {};
+    for (u32 i = 0; i < 3; ++i)
+    {
+        c.y[i] = (s32)(y[order[i]] * one + (y[order[i]] < 0 ? -0.5 : 0.5));
+        c.u[i] = (s32)(u[order[i]] * one + (u[order[i]] < 0 ? -0.5 : 0.5));
+        c.v[i] = (s32)(v[order[i]] * one + (v[order[i]] < 0 ? -0.5 : 0.5));
+    }
+    c.y_bias = ((full ? 0 : 16) << YUV_SHIFT) + (1 << (YUV_SHIFT - 1));
+    c.c_bias = (128 << YUV_SHIFT) + (1 << (YUV_SHIFT - 1));
+    return c;
+}
+
+function inline u8 yuv_clamp(s32 value)
+{
+    value >>= YUV_SHIFT;
+    return (u8)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+struct YuvJob {
+    YuvImage *dst;
+    FrameView *src;
+    u32 flags;
+    YuvCoefficients c;
+    u32 x0, x1; // even x0, dst columns to convert
+    u32 y0;     // even, first dst row
+    u32 y1;
+};
+
+#if IMAGE_SSE2
+// channels 0, 1, 2 of 8 pixels as 16 bit lanes
+function inline void yuv_split_sse2(u8 *pixels, __m128i *c0, __m128i *c1, __m128i *c2)
+{
+    __m128i a = _mm_loadu_si128((__m128i*)pixels);
+    __m128i b = _mm_loadu_si128((__m128i*)(pixels + 16));
+    __m128i mask = _mm_set1_epi32(0xFF);
+    *c0 = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    *c1 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask), _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+    *c2 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), mask), _mm_and_si128(_mm_srli_epi32(b, 16), mask));
+}
+
+// (w0 c0 + w1 c1 + w2 c2 + bias) >> YUV_SHIFT for the low or high 4 lanes
+function inline __m128i yuv_weigh_sse2(__m128i c01, __m128i c2z, __m128i w01, __m128i w2z, __m128i bias)
+{
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(c01, w01), _mm_madd_epi16(c2z, w2z));
+    return _mm_srai_epi32(_mm_add_epi32(sum, bias), YUV_SHIFT);
+}
+
+// 8 outputs from 8 lanes of channels
+function inline __m128i yuv_weigh8_sse2(__m128i c0, __m128i c1, __m128i c2, s32 *w, s32 bias)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i w01 = _mm_set1_epi32((s32)(((u32)w[1] << 16) | (u16)w[0]));
+    __m128i w2z = _mm_set1_epi32((u16)w[2]);
+    __m128i b = _mm_set1_epi32(bias);
+    __m128i lo = yuv_weigh_sse2(_mm_unpacklo_epi16(c0, c1), _mm_unpacklo_epi16(c2, zero), w01, w2z, b);
+    __m128i hi = yuv_weigh_sse2(_mm_unpackhi_epi16(c0, c1), _mm_unpackhi_epi16(c2, zero), w01, w2z, b);
+    return _mm_packs_epi32(lo, hi);
+}
+#endif
+
+function void yuv_convert_rows(void *data, u32 begin, u32 end)
+{
+    YuvJob *job = (YuvJob*)data;
+    YuvImage *dst = job->dst;
+    FrameView *src = job->src;
+    YuvCoefficients *c = &job->c;
+    bool nv12 = dst->layout == YUV_NV12;
+
+    // one index per pair of dst rows
+    for (u32 pair = begin; pair < end; ++pair)
+    {
+        u32 y = job->y0 + pair * 2;
+        u32 y_next = y + 1 < dst->height ? y + 1 : y;
+        u32 sy = (job->flags & YUV_FLIP_Y) ? src->height - 1 - y : y;
+        u32 sy_next = (job->flags & YUV_FLIP_Y) ? src->height - 1 - y_next : y_next;
+        u8 *row0 = src->pixels + (u64)sy * src->stride;
+        u8 *row1 = src->pixels + (u64)sy_next * src->stride;
+        u8 *out0 = dst->planes[0] + (u64)y * dst->strides[0];
+        u8 *out1 = dst->planes[0] + (u64)y_next * dst->strides[0];
+        u8 *uv = dst->planes[1] + (u64)(y / 2) * dst->strides[1];
+        u8 *v_plane = nv12 ? 0 : dst->planes[2] + (u64)(y / 2) * dst->strides[2];
+
+        u32 x = job->x0;
+#if IMAGE_SSE2
+        __m128i two = _mm_set1_epi32(2);
+        __m128i ones = _mm_set1_epi16(1);
+        for (; x + 8 <= job->x1; x += 8)
+        {
+            __m128i a0, a1, a2, b0, b1, b2;
+            yuv_split_sse2(row0 + (u64)x * 4, &a0, &a1, &a2);
+            yuv_split_sse2(row1 + (u64)x * 4, &b0, &b1, &b2);
+
+            __m128i ya = yuv_weigh8_sse2(a0, a1, a2, c->y, c->y_bias);
+            __m128i yb = yuv_weigh8_sse2(b0, b1, b2, c->y, c->y_bias);
+            _mm_storel_epi64((__m128i*)(out0 + x), _mm_packus_epi16(ya, ya));
+            _mm_storel_epi64((__m128i*)(out1 + x), _mm_packus_epi16(yb, yb));
+
+            // 2x2 averages: rows added, neighbours added by madd with ones
+            __m128i s0 = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_add_epi16(a0, b0), ones), two), 2);
+            __m128i s1 = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_add_epi16(a1, b1), ones), two), 2);
+            __m128i s2 = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_add_epi16(a2, b2), ones), two), 2);
+            __m128i m0 = _mm_packs_epi32(s0, s0), m1 = _mm_packs_epi32(s1, s1), m2 = _mm_packs_epi32(s2, s2);
+
+            // 8 lanes, the upper 4 repeat the lower 4
+            __m128i u = yuv_weigh8_sse2(m0, m1, m2, c->u, c->c_bias);
+            __m128i v = yuv_weigh8_sse2(m0, m1, m2, c->v, c->c_bias);
+            if (nv12)
+            {
+                __m128i interleaved = _mm_unpacklo_epi16(u, v);
+                _mm_storel_epi64((__m128i*)(uv + x), _mm_packus_epi16(interleaved, interleaved));
+            }
+            else
+            {
+                __m128i packed = _mm_packus_epi16(_mm_unpacklo_epi64(u, v), _mm_setzero_si128());
+                u32 u4 = (u32)_mm_cvtsi128_si32(packed);
+                u32 v4 = (u32)_mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+                memcpy(uv + x / 2, &u4, 4);
+                memcpy(v_plane + x / 2, &v4, 4);
+            }
+        }
+#endif
+        for (; x < job->x1; x += 2)
+        {
+            u32 x_next = x + 1 < dst->width ? x + 1 : x;
+            u8 *p[4] = { row0 + (u64)x * 4, row0 + (u64)x_next * 4, row1 + (u64)x * 4, row1 + (u64)x_next * 4 };
+
+            s32 sum[3] = {};
+            for (u32 k = 0; k < 4; ++k)
+            {
+                s32 luma = c->y_bias + c->y[0] * p[k][0] + c->y[1] * p[k][1] + c->y[2] * p[k][2];
+                u8 *out = (k < 2 ? out0 : out1) + (k & 1 ? x_next : x);
+                *out = yuv_clamp(luma);
+                for (u32 i = 0; i < 3; ++i)
+                    sum[i] += p[k][i];
+            }
+
+            s32 m[3] = { (sum[0] + 2) >> 2, (sum[1] + 2) >> 2, (sum[2] + 2) >> 2 };
+            u8 u = yuv_clamp(c->c_bias + c->u[0] * m[0] + c->u[1] * m[1] + c->u[2] * m[2]);
+            u8 v = yuv_clamp(c->c_bias + c->v[0] * m[0] + c->v[1] * m[1] + c->v[2] * m[2]);
+            if (nv12)
+            {
+                uv[x] = u;
+                uv[x + 1] = v;
+            }
+            else
+            {
+                uv[x / 2] = u;
+                v_plane[x / 2] = v;
+            }
+        }
+    }
+}
+
+// Convert rect of src (0 size = all of it, in dst coordinates, grown to
+// even bounds) into dst of the same size. YUV_* flags.
+function void yuv_convert_rect(YuvImage *dst, FrameView *src, FrameRect rect, u32 flags, WorkQueue *queue)
+{
+    Assert(dst->width == src->width && dst->height == src->height);
+
+    rect = frame_rect_clip(rect, dst->width, dst->height);
+    if (!rect.width || !rect.height)
+        return;
+
+    YuvJob job = {};
+    job.dst = dst;
+    job.src = src;
+    job.flags = flags;
+    job.c = yuv_coefficients(flags, src->format);
+    job.x0 = rect.x & ~1u;
+    job.x1 = rect.x + rect.width;
+    job.y0 = rect.y & ~1u;
+    job.y1 = rect.y + rect.height;
+
+    u32 pairs = (job.y1 - job.y0 + 1) / 2;
+    parallel_for(queue, pairs, parallel_row_grain(queue, pairs), yuv_convert_rows, &job);
+}
+
+function void yuv_convert(YuvImage *dst, FrameView *src, u32 flags, WorkQueue *queue)
+{
+    FrameRect all = {};
+    yuv_convert_rect(dst, src, all, flags, queue);
+}
+
+//
+// NOTE: sRGB <-> linear
+//
+// Averaging, blending and scaling are only right on linear light; the
+// frames are sRGB encoded. Decoding is a 256 entry table per output type,
+// encoding a 64K entry table indexed by 16 bit linear light, so neither
+// direction calls powf. With AVX2 the lookups are gathers, 8 channels at a
+// time. Alpha is not gamma encoded and is only widened or narrowed.
+//
+
+struct SrgbTables {
+    u32 to_linear[256];        // 16 bit linear, u32 so AVX2 can gather it
+    float to_linear_float[256];
+    u8 from_linear[65536 + 4]; // padded, AVX2 gathers read 4 bytes
+};
+
+function bool srgb_tables_build(SrgbTables *tables)
+{
+    for (u32 i = 0; i < 256; ++i)
+    {
+        double c = i / 255.0;
+        double linear = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+        tables->to_linear[i] = (u32)(linear * 65535.0 + 0.5);
+        tables->to_linear_float[i] = (float)linear;
+    }
+    for (u32 i = 0; i < 65536; ++i)
+    {
+        double linear = i / 65535.0;
+        double c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+        tables->from_linear[i] = (u8)(c * 255.0 + 0.5);
+    }
+    return true;
+}
+
+// built on first use, thread safe (function local static)
+function SrgbTables *srgb_tables()
+{
+    static SrgbTables tables;
+    static bool built = srgb_tables_build(&tables);
+    (void)built;
+    return &tables;
+}
+
+// pixels 4 byte sRGB pixels to 4 u16 linear channels each (alpha * 257)
+function void srgb_to_linear_row(u16 *dst, u8 *src, u32 pixels)
+{
+    u32 *table = srgb_tables()->to_linear;
+    u32 i = 0;
+#if IMAGE_AVX2
+    __m256i alpha_mask = _mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1);
+    for (; i + 2 <= pixels; i += 2)
+    {
+        __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i * 4)));
+        __m256i linear = _mm256_i32gather_epi32((int*)table, bytes, 4);
+        __m256i alpha = _mm256_mullo_epi32(bytes, _mm256_set1_epi32(257));
+        linear = _mm256_blendv_epi8(linear, alpha, alpha_mask);
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(linear), _mm256_extracti128_si256(linear, 1));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), packed);
+    }
+#endif
+    for (; i < pixels; ++i)
+    {
+        u8 *p = src + i * 4;
+        u16 *out = dst + i * 4;
+        out[0] = (u16)table[p[0]];
+        out[1] = (u16)table[p[1]];
+        out[2] = (u16)table[p[2]];
+        out[3] = (u16)(p[3] * 257);
+    }
+}
+
+// 4 u16 linear channels per pixel back to 4 byte sRGB pixels
+function void linear_to_srgb_row(u8 *dst, u16 *src, u32 pixels)
+{
+    u8 *table = srgb_tables()->from_linear;
+    u32 i = 0;
+#if IMAGE_AVX2
+    __m256i alpha_mask = _mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1);
+    for (; i + 2 <= pixels; i += 2)
+    {
+        __m256i linear = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i*)(src + i * 4)));
+        __m256i srgb = _mm256_and_si256(_mm256_i32gather_epi32((int*)table, linear, 1), _mm256_set1_epi32(0xFF));
+        __m256i alpha = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(linear, _mm256_set1_epi32(255)), _mm256_set1_epi32(32768)), 16);
+        srgb = _mm256_blendv_epi8(srgb, alpha, alpha_mask);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(srgb), _mm256_extracti128_si256(srgb, 1));
+        _mm_storel_epi64((__m128i*)(dst + i * 4), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < pixels; ++i)
+    {
+        u16 *p = src + i * 4;
+        u8 *out = dst + i * 4;
+        out[0] = table[p[0]];
+        out[1] = table[p[1]];
+        out[2] = table[p[2]];
+        out[3] = (u8)((p[3] * 255u + 32768u) >> 16);
+    }
+}
+
+// 4 byte sRGB pixels to 4 floats each, 0..1 linear (alpha / 255)
+function void srgb_to_linear_float_row(float *dst, u8 *src, u32 pixels)
+{
+    float *table = srgb_tables()->to_linear_float;
+    for (u32 i = 0; i < pixels; ++i)
+    {
+        u8 *p = src + i * 4;
+        float *out = dst + i * 4;
+        out[0] = table[p[0]];
+        out[1] = table[p[1]];
+        out[2] = table[p[2]];
+        out[3] = p[3] * (1.0f / 255.0f);
+    }
+}
+
+// 4 floats of 0..1 linear (clamped) per pixel back to 4 byte sRGB pixels
+function void linear_float_to_srgb_row(u8 *dst, float *src, u32 pixels)
+{
+    u8 *table = srgb_tables()->from_linear;
+    u32 i = 0;
+#if IMAGE_SSE2
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 scale = _mm_setr_ps(65535.0f, 65535.0f, 65535.0f, 255.0f);
+    for (; i < pixels; ++i)
+    {
+        __m128 p = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i * 4), zero), one);
+        __m128i q = _mm_cvtps_epi32(_mm_mul_ps(p, scale));
+        u32 index[4];
+        _mm_storeu_si128((__m128i*)index, q);
+        u8 *out = dst + i * 4;
+        out[0] = table[index[0]];
+        out[1] = table[index[1]];
+        out[2] = table[index[2]];
+        out[3] = (u8)index[3];
+    }
+#endif
+    for (; i < pixels; ++i)
+    {
+        u8 *out = dst + i * 4;
+        for (u32 c = 0; c < 4; ++c)
+        {
+            float v = src[i * 4 + c];
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            out[c] = c < 3 ? table[(u32)(v * 65535.0f + 0.5f)] : (u8)(v * 255.0f + 0.5f);
         }
     }
 }
+
+//
+// NOTE: gamma correct downscaling
+//
+// downscale with DOWNSCALE_LINEAR: the same box then bilinear steps, but on
+// 16 bit linear light. The box step decodes each source row with
+// srgb_to_linear_row and averages in 32 bits; the intermediate is kept
+// linear (8 bytes per pixel) and only the last step encodes back to sRGB.
+//
+
+struct LinearImage {
+    u16 *pixels; // 4 channels per pixel
+    u32 width;
+    u32 height;
+};
+
+struct LinearDownscaleJob {
+    FrameView *src;
+    u32 factor;
+    LinearImage *linear; // box output when a bilinear step follows
+    FrameView *dst;      // otherwise, and the output of the bilinear step
+
+    u32 *x0; // bilinear columns
+    u16 *wx;
+};
+
+function void downscale_linear_area_rows(void *data, u32 begin, u32 end)
+{
+    LinearDownscaleJob *job = (LinearDownscaleJob*)data;
+    FrameView *src = job->src;
+    u32 f = job->factor;
+    u32 n = f * f;
+    u32 width = src->width / f;
+    u32 channels = width * f * 4;
+    u64 recip = (((u64)1 << 32) + n - 1) / n;
+
+    u16 *decoded = (u16*)malloc((u64)channels * sizeof(u16) + (u64)width * 4 * sizeof(u16));
+    u16 *out = decoded + channels;
+    u32 *sums = (u32*)malloc((u64)channels * sizeof(u32));
+
+    for (u32 dy = begin; dy < end; ++dy)
+    {
+        for (u32 k = 0; k < f; ++k)
+        {
+            srgb_to_linear_row(decoded, src->pixels + (u64)(dy * f + k) * src->stride, width * f);
+            u32 i = 0;
+#if IMAGE_SSE2
+            __m128i zero = _mm_setzero_si128();
+            for (; i + 8 <= channels; i += 8)
+            {
+                __m128i d = _mm_loadu_si128((__m128i*)(decoded + i));
+                __m128i lo = _mm_unpacklo_epi16(d, zero), hi = _mm_unpackhi_epi16(d, zero);
+                if (k)
+                {
+                    lo = _mm_add_epi32(lo, _mm_loadu_si128((__m128i*)(sums + i)));
+                    hi = _mm_add_epi32(hi, _mm_loadu_si128((__m128i*)(sums + i + 4)));
+                }
+                _mm_storeu_si128((__m128i*)(sums + i), lo);
+                _mm_storeu_si128((__m128i*)(sums + i + 4), hi);
+            }
+#endif
+            for (; i < channels; ++i)
+                sums[i] = (k ? sums[i] : 0) + decoded[i];
+        }
+
+        u32 x = 0;
+#if IMAGE_SSE2
+        // a pixel's 4 sums per vector; at most 15 * 15 * 65535 < 2^24, exact in float
+        __m128 scale = _mm_set1_ps(1.0f / n);
+        for (; x < width; ++x)
+        {
+            __m128i sum = _mm_loadu_si128((__m128i*)(sums + x * f * 4));
+            for (u32 k = 1; k < f; ++k)
+                sum = _mm_add_epi32(sum, _mm_loadu_si128((__m128i*)(sums + (x * f + k) * 4)));
+            __m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+            v = _mm_sub_epi32(v, _mm_set1_epi32(32768));
+            v = _mm_add_epi16(_mm_packs_epi32(v, v), _mm_set1_epi16(-32768));
+            _mm_storel_epi64((__m128i*)(out + x * 4), v);
+        }
+#endif
+        for (; x < width; ++x)
+        {
+            for (u32 c = 0; c < 4; ++c)
+            {
+                u64 sum = n / 2;
+                for (u32 k = 0; k < f; ++k)
+                    sum += sums[(x * f + k) * 4 + c];
+                out[x * 4 + c] = (u16)((sum * recip) >> 32);
+            }
+        }
+
+        if (job->linear)
+            memcpy(job->linear->pixels + (u64)dy * width * 4, out, (u64)width * 4 * sizeof(u16));
+        else
+            linear_to_srgb_row(job->dst->pixels + (u64)dy * job->dst->stride, out, width);
+    }
+
+    free(decoded);
+    free(sums);
+}
+
+function void downscale_linear_bilinear_rows(void *data, u32 begin, u32 end)
+{
+    LinearDownscaleJob *job = (LinearDownscaleJob*)data;
+    LinearImage *src = job->linear;
+    FrameView *dst = job->dst;
+    u32 one = 1 << DOWNSCALE_WEIGHT_BITS;
+    u32 shift = 2 * DOWNSCALE_WEIGHT_BITS;
+
+    u16 *out = (u16*)malloc((u64)dst->width * 4 * sizeof(u16));
+
+    for (u32 dy = begin; dy < end; ++dy)
+    {
+        u32 y0;
+        u16 wy;
+        downscale_sample(dy, dst->height, src->height, &y0, &wy);
+        u16 *top = src->pixels + (u64)y0 * src->width * 4;
+        u16 *bottom = src->height >= 2 ? top + (u64)src->width * 4 : top;
+
+        u32 right = src->width >= 2 ? 4 : 0;
+        u32 x = 0;
+#if IMAGE_SSE2
+        // one pixel's 4 channels per vector, in float: the u16 products overflow 16 bit lanes
+        __m128i zero = _mm_setzero_si128();
+        __m128 fy = _mm_set1_ps(wy * (1.0f / one));
+        for (; x < dst->width; ++x)
+        {
+            u16 *a = top + (u64)job->x0[x] * 4, *b = bottom + (u64)job->x0[x] * 4;
+            __m128 fx = _mm_set1_ps(job->wx[x] * (1.0f / one));
+            __m128 a0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)a), zero));
+            __m128 a1 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)(a + right)), zero));
+            __m128 b0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)b), zero));
+            __m128 b1 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)(b + right)), zero));
+            __m128 t = _mm_add_ps(a0, _mm_mul_ps(_mm_sub_ps(a1, a0), fx));
+            __m128 u = _mm_add_ps(b0, _mm_mul_ps(_mm_sub_ps(b1, b0), fx));
+            __m128i v = _mm_cvtps_epi32(_mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(u, t), fy)));
+            // back to u16 without packus_epi32 (SSE4.1): bias into signed range
+            v = _mm_sub_epi32(v, _mm_set1_epi32(32768));
+            v = _mm_add_epi16(_mm_packs_epi32(v, v), _mm_set1_epi16(-32768));
+            _mm_storel_epi64((__m128i*)(out + x * 4), v);
+        }
+#endif
+        for (; x < dst->width; ++x)
+        {
+            u16 *a = top + (u64)job->x0[x] * 4, *b = bottom + (u64)job->x0[x] * 4;
+            u32 w = job->wx[x];
+            for (u32 c = 0; c < 4; ++c)
+            {
+                u64 t = (u64)a[c] * (one - w) + (u64)a[c + right] * w;
+                u64 s = (u64)b[c] * (one - w) + (u64)b[c + right] * w;
+                out[x * 4 + c] = (u16)((t * (one - wy) + s * wy + (1u << (shift - 1))) >> shift);
+            }
+        }
+
+        linear_to_srgb_row(dst->pixels + (u64)dy * dst->stride, out, dst->width);
+    }
+
+    free(out);
+}
+
+// downscale on linear light, scratch of downscale_scratch_size(..., DOWNSCALE_LINEAR)
+function void downscale_linear(FrameView *dst, FrameView *src, u8 *scratch, WorkQueue *queue)
+{
+    u32 factor = downscale_area_factor(src->width, src->height, dst->width, dst->height);
+    if (factor < 1)
+        factor = 1;
+    LinearImage linear = { (u16*)scratch, src->width / factor, src->height / factor };
+
+    LinearDownscaleJob job = {};
+    job.src = src;
+    job.factor = factor;
+    job.dst = dst;
+    bool exact = linear.width == dst->width && linear.height == dst->height;
+    job.linear = exact ? 0 : &linear;
+    parallel_for(queue, linear.height, parallel_row_grain(queue, linear.height), downscale_linear_area_rows, &job);
+    if (exact)
+        return;
+
+    job.x0 = (u32*)malloc((u64)dst->width * sizeof(u32));
+    job.wx = (u16*)malloc((u64)dst->width * sizeof(u16));
+    for (u32 x = 0; x < dst->width; ++x)
+        downscale_sample(x, dst->width, linear.width, &job.x0[x], &job.wx[x]);
+    parallel_for(queue, dst->height, parallel_row_grain(queue, dst->height), downscale_linear_bilinear_rows, &job);
+    free(job.x0);
+    free(job.wx);
+}
+
+//
+// NOTE: downscale entry point
+//
+
+enum DownscaleFlags {
+    DOWNSCALE_LINEAR = 1 << 0, // average linear light instead of sRGB values
+};
+
+// bytes of scratch downscale needs for the intermediate frame, 0 if none
+function u64 downscale_scratch_size(FrameView *dst, FrameView *src, u32 flags)
+{
+    u32 factor = downscale_area_factor(src->width, src->height, dst->width, dst->height);
+    if (flags & DOWNSCALE_LINEAR)
+    {
+        factor = factor ? factor : 1;
+        u32 width = src->width / factor, height = src->height / factor;
+        if (width == dst->width && height == dst->height)
+            return 0;
+        return (u64)width * height * 4 * sizeof(u16);
+    }
+
+    if (factor < 2)
+        return 0;
+    u32 width = src->width / factor, height = src->height / factor;
+    if (width == dst->width && height == dst->height)
+        return 0;
+    return (u64)width * height * 4;
+}
+
+// src into dst (any size up to src), scratch of downscale_scratch_size bytes,
+// DOWNSCALE_* flags
+function void downscale(FrameView *dst, FrameView *src, u8 *scratch, u32 flags, WorkQueue *queue)
+{
+    dst->format = src->format;
+
+    if (flags & DOWNSCALE_LINEAR)
+    {
+        downscale_linear(dst, src, scratch, queue);
+        return;
+    }
+
+    u32 factor = downscale_area_factor(src->width, src->height, dst->width, dst->height);
+    if (factor < 2)
+    {
+        downscale_bilinear(dst, src, queue);
+        return;
+    }
+
+    u32 width = src->width / factor, height = src->height / factor;
+    if (width == dst->width && height == dst->height)
+    {
+        downscale_area(dst, src, factor, queue);
+        return;
+    }
+
+    FrameView area = frame_view(scratch, width, height, width * 4, src->format);
+    downscale_area(&area, src, factor, queue);
+    downscale_bilinear(dst, &area, queue);
+}
+
+//
+// NOTE: blur and sharpen
+//
+// The Gaussian is separable and runs one output row at a time: the 2r+1
+// source rows it covers are weighed into one 16-bit row (8.7 fixed point),
+// then the taps along that row give the output. Weights are 8-bit with a
+// sum of 256, so both passes multiply and add in 16-bit lanes, and no
+// intermediate frame is written. Neighbouring output rows read mostly the
+// same source rows, which stay in cache.
+//
+// The box blur keeps a running sum per column and one along the row, each
+// output pixel is an add and a subtract whatever the radius. Gaussian
+// radii above BLUR_GAUSSIAN_MAX_RADIUS are three box passes of the same
+// variance. Edges repeat the outermost row and column.
+//
+
+#define BLUR_GAUSSIAN_MAX_RADIUS 8 // past it three box passes are cheaper
+#define BLUR_BOX_MAX_RADIUS 127 // 255 * (2r + 1)^2 stays exact in a float
+
+enum BlurFlags {
+    BLUR_BOX = 1 << 0, // one box pass of the radius instead of a Gaussian
+};
+
+struct BlurKernel {
+    u32 radius;
+    s16 weights[2 * BLUR_GAUSSIAN_MAX_RADIUS + 1]; // sum 256
+    u32 amount;    // unsharp mask: 256 = add the detail once (up to 16383), 0 = only blur
+    u32 threshold; // unsharp mask: leave differences up to this alone
+};
+
+// sigma is radius / 2, the taps reach two sigmas out
+function void blur_kernel_init(BlurKernel *kernel, u32 radius)
+{
+    memset(kernel, 0, sizeof(BlurKernel));
+    radius = radius < BLUR_GAUSSIAN_MAX_RADIUS ? radius : BLUR_GAUSSIAN_MAX_RADIUS;
+    kernel->radius = radius;
+
+    float sigma = radius * 0.5f;
+    float weights[2 * BLUR_GAUSSIAN_MAX_RADIUS + 1];
+    float sum = 0;
+    for (u32 k = 0; k <= 2 * radius; ++k)
+    {
+        float d = (float)k - (float)radius;
+        weights[k] = radius ? expf(-d * d / (2 * sigma * sigma)) : 1;
+        sum += weights[k];
+    }
+    s32 total = 0;
+    for (u32 k = 0; k <= 2 * radius; ++k)
+    {
+        kernel->weights[k] = (s16)(weights[k] * 256 / sum + 0.5f);
+        total += kernel->weights[k];
+    }
+    // rounding goes to the centre tap, it stays below 256 for radius 1 and up
+    kernel->weights[radius] = (s16)(kernel->weights[radius] + 256 - total);
+}
+
+// radius of each of three box passes with the variance of the Gaussian
+function u32 blur_box_radius(u32 radius)
+{
+    float sigma = radius * 0.5f;
+    u32 box = (u32)((sqrtf(4 * sigma * sigma + 1) - 1) * 0.5f + 0.5f);
+    box = box ? box : 1;
+    return box < BLUR_BOX_MAX_RADIUS ? box : BLUR_BOX_MAX_RADIUS;
+}
+
+// rows of input above and below an output row it reads, for the ROI and the filter graph
+function u32 blur_halo(u32 radius, u32 flags)
+{
+    if (flags & BLUR_BOX)
+        return radius < BLUR_BOX_MAX_RADIUS ? radius : BLUR_BOX_MAX_RADIUS;
+    if (radius <= BLUR_GAUSSIAN_MAX_RADIUS)
+        return radius;
+    return blur_box_radius(radius) * 3;
+}
+
+// one 8.7 row of the 2r + 1 source rows weighed. The taps are symmetric,
+// mirrored rows are added before the multiply. Products may wrap 16 bits
+// but the sum (weights add up to 256) does not, so it comes out right.
+function void blur_gaussian_column(u16 *out, u8 **rows, s16 *weights, u32 radius, u32 channels)
+{
+    u8 *centre = rows[radius];
+    u32 i = 0;
+#if IMAGE_AVX2
+    {
+        __m256i w[BLUR_GAUSSIAN_MAX_RADIUS + 1];
+        for (u32 k = 0; k <= radius; ++k)
+            w[k] = _mm256_set1_epi16(weights[k]);
+        __m256i one = _mm256_set1_epi16(1);
+        for (; i + 16 <= channels; i += 16)
+        {
+            __m256i acc = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(centre + i))), w[radius]);
+            for (u32 k = 0; k < radius; ++k)
+            {
+                __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(rows[k] + i)));
+                __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(rows[2 * radius - k] + i)));
+                acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(_mm256_add_epi16(a, b), w[k]));
+            }
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_srli_epi16(_mm256_add_epi16(acc, one), 1));
+        }
+    }
+#endif
+#if IMAGE_SSE2
+    {
+        __m128i w[BLUR_GAUSSIAN_MAX_RADIUS + 1];
+        for (u32 k = 0; k <= radius; ++k)
+            w[k] = _mm_set1_epi16(weights[k]);
+        __m128i zero = _mm_setzero_si128();
+        __m128i one = _mm_set1_epi16(1);
+        for (; i + 16 <= channels; i += 16)
+        {
+            __m128i c = _mm_loadu_si128((__m128i*)(centre + i));
+            __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), w[radius]);
+            __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), w[radius]);
+            for (u32 k = 0; k < radius; ++k)
+            {
+                __m128i a = _mm_loadu_si128((__m128i*)(rows[k] + i));
+                __m128i b = _mm_loadu_si128((__m128i*)(rows[2 * radius - k] + i));
+                __m128i sum_lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+                __m128i sum_hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+                lo = _mm_add_epi16(lo, _mm_mullo_epi16(sum_lo, w[k]));
+                hi = _mm_add_epi16(hi, _mm_mullo_epi16(sum_hi, w[k]));
+            }
+            _mm_storeu_si128((__m128i*)(out + i), _mm_srli_epi16(_mm_add_epi16(lo, one), 1));
+            _mm_storeu_si128((__m128i*)(out + i + 8), _mm_srli_epi16(_mm_add_epi16(hi, one), 1));
+        }
+    }
+#endif
+    for (; i < channels; ++i)
+    {
+        u32 sum = weights[radius] * centre[i];
+        for (u32 k = 0; k < radius; ++k)
+            sum += weights[k] * (rows[k][i] + rows[2 * radius - k][i]);
+        out[i] = (u16)((sum + 1) >> 1);
+    }
+}
+
+// the taps along a column-weighed row padded by radius pixels each side,
+// into 8-bit pixels. Mirrored 8.7 values add up to at most 16 bits, the
+// high half of that times weight << 8 is its 8.7 share.
+function void blur_gaussian_row(u8 *out, u16 *padded, s16 *weights, u32 radius, u32 width)
+{
+    u16 *centre = padded + (u64)radius * 4;
+    u32 channels = width * 4, i = 0;
+#if IMAGE_AVX2
+    {
+        __m256i w[BLUR_GAUSSIAN_MAX_RADIUS + 1];
+        for (u32 k = 0; k <= radius; ++k)
+            w[k] = _mm256_set1_epi16((s16)(weights[k] << 8));
+        __m256i round = _mm256_set1_epi16(64);
+        for (; i + 16 <= channels; i += 16)
+        {
+            __m256i acc = _mm256_mulhi_epu16(_mm256_loadu_si256((__m256i*)(centre + i)), w[radius]);
+            for (u32 k = 0; k < radius; ++k)
+            {
+                __m256i a = _mm256_loadu_si256((__m256i*)(padded + i + k * 4));
+                __m256i b = _mm256_loadu_si256((__m256i*)(padded + i + (2 * radius - k) * 4));
+                acc = _mm256_add_epi16(acc, _mm256_mulhi_epu16(_mm256_add_epi16(a, b), w[k]));
+            }
+            acc = _mm256_srli_epi16(_mm256_add_epi16(acc, round), 7);
+            __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+            _mm_storeu_si128((__m128i*)(out + i), packed);
+        }
+    }
+#endif
+#if IMAGE_SSE2
+    {
+        __m128i w[BLUR_GAUSSIAN_MAX_RADIUS + 1];
+        for (u32 k = 0; k <= radius; ++k)
+            w[k] = _mm_set1_epi16((s16)(weights[k] << 8));
+        __m128i round = _mm_set1_epi16(64);
+        for (; i + 8 <= channels; i += 8)
+        {
+            __m128i acc = _mm_mulhi_epu16(_mm_loadu_si128((__m128i*)(centre + i)), w[radius]);
+            for (u32 k = 0; k < radius; ++k)
+            {
+                __m128i a = _mm_loadu_si128((__m128i*)(padded + i + k * 4));
+                __m128i b = _mm_loadu_si128((__m128i*)(padded + i + (2 * radius - k) * 4));
+                acc = _mm_add_epi16(acc, _mm_mulhi_epu16(_mm_add_epi16(a, b), w[k]));
+            }
+            acc = _mm_srli_epi16(_mm_add_epi16(acc, round), 7);
+            _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(acc, acc));
+        }
+    }
+#endif
+    for (; i < channels; ++i)
+    {
+        u32 sum = (centre[i] * ((u32)weights[radius] << 8)) >> 16;
+        for (u32 k = 0; k < radius; ++k)
+            sum += ((padded[i + k * 4] + padded[i + (2 * radius - k) * 4]) * ((u32)weights[k] << 8)) >> 16;
+        out[i] = (u8)((sum + 64) >> 7);
+    }
+}
+
+// out (holding the blurred row) = src + (src - out) * amount / 256 where the
+// difference is over threshold, alpha left as it was
+function void sharpen_row(u8 *out, u8 *src, u32 width, u32 amount, u32 threshold)
+{
+    u32 channels = width * 4;
+    u32 i = 0;
+#if IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i colour = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    __m128i limit = _mm_set1_epi16((s16)threshold);
+    __m128i scale = _mm_set1_epi16((s16)(amount * 2)); // (diff << 7) * (amount << 1) >> 16
+    for (; i + 8 <= channels; i += 8)
+    {
+        __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(src + i)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(out + i)), zero);
+        __m128i diff = _mm_and_si128(_mm_sub_epi16(s, b), colour);
+        __m128i magnitude = _mm_max_epi16(diff, _mm_sub_epi16(zero, diff));
+        diff = _mm_and_si128(diff, _mm_cmpgt_epi16(magnitude, limit));
+        __m128i result = _mm_adds_epi16(s, _mm_mulhi_epi16(_mm_slli_epi16(diff, 7), scale));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(result, result));
+    }
+#endif
+    for (; i < channels; ++i)
+    {
+        s32 diff = (i & 3) == 3 ? 0 : (s32)src[i] - (s32)out[i];
+        if (diff <= (s32)threshold && -diff <= (s32)threshold)
+            diff = 0;
+        s32 value = src[i] + ((diff * (s32)amount) >> 8);
+        out[i] = (u8)(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+}
+
+function u64 blur_gaussian_temp_size(u32 width, u32 radius)
+{
+    return ((u64)width + 2 * radius) * 4 * sizeof(u16);
+}
+
+// output rows starting at r0 (of height rows in all) into out, from input
+// rows starting at i0 in in; temp of blur_gaussian_temp_size bytes
+function void blur_gaussian_band(BlurKernel *kernel, FrameView *out, u32 r0, FrameView *in, u32 i0, u32 height, u16 *temp)
+{
+    u32 radius = kernel->radius, taps = 2 * radius + 1;
+    u32 width = out->width;
+    u16 *row = temp + (u64)radius * 4;
+    u8 *rows[2 * BLUR_GAUSSIAN_MAX_RADIUS + 1];
+
+    for (u32 y = 0; y < out->height; ++y)
+    {
+        for (u32 k = 0; k < taps; ++k)
+        {
+            s64 source = (s64)r0 + y + k - radius;
+            source = source < 0 ? 0 : source >= height ? height - 1 : source;
+            rows[k] = in->pixels + (u64)(source - i0) * in->stride;
+        }
+        blur_gaussian_column(row, rows, kernel->weights, radius, width * 4);
+
+        u64 *pixels = (u64*)row;
+        for (u32 k = 1; k <= radius; ++k)
+        {
+            pixels[-(s64)k] = pixels[0];
+            pixels[width - 1 + k] = pixels[width - 1];
+        }
+
+        u8 *to = out->pixels + (u64)y * out->stride;
+        blur_gaussian_row(to, temp, kernel->weights, radius, width);
+        if (kernel->amount)
+            sharpen_row(to, in->pixels + (u64)(r0 + y - i0) * in->stride, width, kernel->amount, kernel->threshold);
+    }
+}
+
+// column sums with radius + 1 pixels of padding on either side
+function u64 blur_box_temp_size(u32 width, u32 radius)
+{
+    return ((u64)width + 2 * radius + 2) * 4 * sizeof(s32);
+}
+
+// column sums += row enter - row leave
+function void blur_box_slide(s32 *sums, u8 *enter, u8 *leave, u32 channels)
+{
+    u32 i = 0;
+#if IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= channels; i += 16)
+    {
+        __m128i e = _mm_loadu_si128((__m128i*)(enter + i));
+        __m128i l = _mm_loadu_si128((__m128i*)(leave + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(e, zero), _mm_unpacklo_epi8(l, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(e, zero), _mm_unpackhi_epi8(l, zero));
+        __m128i d0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16);
+        __m128i d1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16);
+        __m128i d2 = _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16);
+        __m128i d3 = _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16);
+        __m128i *s = (__m128i*)(sums + i);
+        _mm_storeu_si128(s + 0, _mm_add_epi32(_mm_loadu_si128(s + 0), d0));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), d1));
+        _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), d2));
+        _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), d3));
+    }
+#endif
+    for (; i < channels; ++i)
+        sums[i] += (s32)enter[i] - (s32)leave[i];
+}
+
+// the running sum along the padded column sums, divided by the box area;
+// padded starts radius + 1 pixels before the first column
+function void blur_box_row(u8 *out, s32 *padded, u32 width, u32 radius)
+{
+    s32 *sums = padded + (u64)(radius + 1) * 4;
+    for (u32 k = 1; k <= radius + 1; ++k)
+    {
+        memcpy(sums - (u64)k * 4, sums, 4 * sizeof(s32));
+        memcpy(sums + (u64)(width - 1 + k) * 4, sums + (u64)(width - 1) * 4, 4 * sizeof(s32));
+    }
+    // the sum for pixel x covers x - radius .. x + radius, moving on adds
+    // x + radius + 1 and drops x - radius
+    s32 *enter = sums + (u64)(radius + 1) * 4;
+    s32 *leave = sums - (u64)radius * 4;
+    u32 x = 0;
+#if IMAGE_SSE2
+    __m128 scale = _mm_set1_ps(1.0f / ((float)(2 * radius + 1) * (float)(2 * radius + 1)));
+    __m128i acc = _mm_setzero_si128();
+    for (u32 k = 0; k <= 2 * radius; ++k)
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((__m128i*)(leave + k * 4)));
+    for (; x + 4 <= width; x += 4)
+    {
+        // four pixels packed and stored at once
+        __m128i values[4];
+        for (u32 j = 0; j < 4; ++j)
+        {
+            u64 at = (u64)(x + j) * 4;
+            values[j] = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(acc), scale));
+            acc = _mm_add_epi32(acc, _mm_sub_epi32(_mm_loadu_si128((__m128i*)(enter + at)),
+                                                   _mm_loadu_si128((__m128i*)(leave + at))));
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(values[0], values[1]), _mm_packs_epi32(values[2], values[3]));
+        _mm_storeu_si128((__m128i*)(out + (u64)x * 4), packed);
+    }
+    s32 rest[4];
+    _mm_storeu_si128((__m128i*)rest, acc);
+#else
+    s32 rest[4] = {};
+    for (u32 k = 0; k <= 2 * radius; ++k)
+        for (u32 c = 0; c < 4; ++c)
+            rest[c] += leave[k * 4 + c];
+#endif
+    float area = (float)(2 * radius + 1) * (float)(2 * radius + 1);
+    for (; x < width; ++x)
+    {
+        for (u32 c = 0; c < 4; ++c)
+        {
+            u64 at = (u64)x * 4 + c;
+            out[at] = (u8)(rest[c] / area + 0.5f);
+            rest[c] += enter[at] - leave[at];
+        }
+    }
+}
+
+// blur_gaussian_band for one box pass; temp of blur_box_temp_size bytes
+function void blur_box_band(u32 radius, FrameView *out, u32 r0, FrameView *in, u32 i0, u32 height, s32 *temp)
+{
+    u32 channels = out->width * 4;
+    s64 last = (s64)height - 1;
+    s32 *sums = temp + (u64)(radius + 1) * 4;
+    memset(sums, 0, (u64)channels * sizeof(s32));
+    for (s64 k = (s64)r0 - radius; k <= (s64)r0 + radius; ++k)
+    {
+        s64 source = k < 0 ? 0 : k > last ? last : k;
+        u8 *row = in->pixels + (u64)(source - i0) * in->stride;
+        for (u32 i = 0; i < channels; ++i)
+            sums[i] += row[i];
+    }
+
+    for (u32 y = 0; y < out->height; ++y)
+    {
+        blur_box_row(out->pixels + (u64)y * out->stride, temp, out->width, radius);
+        if (y + 1 == out->height)
+            break;
+        s64 enter = (s64)r0 + y + radius + 1, leave = (s64)r0 + y - radius;
+        enter = enter > last ? last : enter;
+        leave = leave < 0 ? 0 : leave;
+        blur_box_slide(sums, in->pixels + (u64)(enter - i0) * in->stride,
+                       in->pixels + (u64)(leave - i0) * in->stride, channels);
+    }
+}
+
+struct BlurJob {
+    FrameView *dst; // rows first_row.. of the blur of src
+    FrameView *src;
+    u32 first_row;
+    BlurKernel *kernel; // 0 for a box pass
+    u32 box_radius;
+};
+
+function void blur_rows(void *data, u32 begin, u32 end)
+{
+    BlurJob *job = (BlurJob*)data;
+    FrameView *src = job->src;
+    FrameRect rows = { 0, begin, job->dst->width, end - begin };
+    FrameView out = frame_view_sub(*job->dst, rows);
+
+    if (job->kernel)
+    {
+        u16 *temp = (u16*)malloc(blur_gaussian_temp_size(src->width, job->kernel->radius));
+        blur_gaussian_band(job->kernel, &out, job->first_row + begin, src, 0, src->height, temp);
+        free(temp);
+    }
+    else
+    {
+        s32 *temp = (s32*)malloc(blur_box_temp_size(src->width, job->box_radius));
+        blur_box_band(job->box_radius, &out, job->first_row + begin, src, 0, src->height, temp);
+        free(temp);
+    }
+}
+
+function void blur_pass(FrameView *dst, FrameView *src, u32 first_row, BlurKernel *kernel, u32 box_radius, WorkQueue *queue)
+{
+    BlurJob job = {};
+    job.dst = dst;
+    job.src = src;
+    job.first_row = first_row;
+    job.kernel = kernel;
+    job.box_radius = box_radius;
+    parallel_for(queue, dst->height, parallel_row_grain(queue, dst->height), blur_rows, &job);
+}
+
+// bytes of scratch blur needs for the passes between the box blurs, 0 if none
+function u64 blur_scratch_size(FrameView *src, u32 radius, u32 flags)
+{
+    if ((flags & BLUR_BOX) || radius <= BLUR_GAUSSIAN_MAX_RADIUS)
+        return 0;
+    return (u64)src->width * src->height * 4;
+}
+
+// src into dst (same size, not the same pixels), scratch of
+// blur_scratch_size bytes, BLUR_* flags; radius 0 copies
+function void blur(FrameView *dst, FrameView *src, u8 *scratch, u32 radius, u32 flags, WorkQueue *queue)
+{
+    Assert(dst->width == src->width && dst->height == src->height);
+    dst->format = src->format;
+
+    if (!radius)
+    {
+        frame_view_copy(dst, src, 0);
+    }
+    else if (flags & BLUR_BOX)
+    {
+        blur_pass(dst, src, 0, 0, blur_halo(radius, flags), queue);
+    }
+    else if (radius <= BLUR_GAUSSIAN_MAX_RADIUS)
+    {
+        BlurKernel kernel;
+        blur_kernel_init(&kernel, radius);
+        blur_pass(dst, src, 0, &kernel, 0, queue);
+    }
+    else
+    {
+        u32 box = blur_box_radius(radius);
+        FrameView temp = frame_view(scratch, src->width, src->height, src->width * 4, src->format);
+        blur_pass(dst, src, 0, 0, box, queue);
+        blur_pass(&temp, dst, 0, 0, box, queue);
+        blur_pass(dst, &temp, 0, 0, box, queue);
+    }
+}
+
+// unsharp mask: src plus amount (256 = 1.0, up to 16383) times its difference from a
+// Gaussian blur of radius (up to BLUR_GAUSSIAN_MAX_RADIUS) where that
+// exceeds threshold; one pass, the blur never reaches memory
+function void sharpen(FrameView *dst, FrameView *src, u32 radius, u32 amount, u32 threshold, WorkQueue *queue)
+{
+    Assert(dst->width == src->width && dst->height == src->height);
+    dst->format = src->format;
+
+    BlurKernel kernel;
+    blur_kernel_init(&kernel, radius);
+    kernel.amount = amount < 16383 ? amount : 16383;
+    kernel.threshold = threshold < 255 ? threshold : 255;
+    if (!kernel.radius || !amount)
+        frame_view_copy(dst, src, 0);
+    else
+        blur_pass(dst, src, 0, &kernel, 0, queue);
+}
+
+// rect and the pixels around it within halo, clipped to the frame
+function FrameRect blur_reach(FrameRect rect, u32 halo, u32 width, u32 height)
+{
+    FrameRect reach;
+    reach.x = rect.x > halo ? rect.x - halo : 0;
+    reach.y = rect.y > halo ? rect.y - halo : 0;
+    reach.width = (rect.x + rect.width + halo < width ? rect.x + rect.width + halo : width) - reach.x;
+    reach.height = (rect.y + rect.height + halo < height ? rect.y + rect.height + halo : height) - reach.y;
+    return reach;
+}
+
+// bytes of scratch blur_rects needs: the largest rect with the blur's reach
+// around it, twice for the box passes
+function u64 blur_rects_scratch_size(FrameView *frame, FrameRect *rects, u32 count, u32 radius, u32 flags)
+{
+    u32 halo = blur_halo(radius, flags);
+    u64 largest = 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        FrameRect rect = frame_rect_clip(rects[i], frame->width, frame->height);
+        FrameRect reach = blur_reach(rect, halo, frame->width, frame->height);
+        u64 bytes = (u64)reach.width * reach.height * 4;
+        largest = bytes > largest ? bytes : largest;
+    }
+    bool boxes = !(flags & BLUR_BOX) && radius > BLUR_GAUSSIAN_MAX_RADIUS;
+    return boxes ? largest * 2 : largest;
+}
+
+// blur only the rects of frame, in place (redacting a window, a face);
+// pixels around a rect feed its blur but are left as they were. Rects go
+// in order, one near an earlier rect sees that one already blurred.
+function void blur_rects(FrameView *frame, FrameRect *rects, u32 count, u8 *scratch, u32 radius, u32 flags, WorkQueue *queue)
+{
+    if (!radius)
+        return;
+    u32 halo = blur_halo(radius, flags);
+    bool boxes = !(flags & BLUR_BOX) && radius > BLUR_GAUSSIAN_MAX_RADIUS;
+    BlurKernel kernel;
+    blur_kernel_init(&kernel, radius);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        FrameRect rect = frame_rect_clip(rects[i], frame->width, frame->height);
+        if (!rect.width || !rect.height)
+            continue;
+        FrameRect reach_rect = blur_reach(rect, halo, frame->width, frame->height);
+        FrameView reach = frame_view_sub(*frame, reach_rect);
+        FrameRect inner = { rect.x - reach_rect.x, rect.y - reach_rect.y, rect.width, rect.height };
+
+        FrameView blurred;
+        if (boxes)
+        {
+            // every pass reads the whole reach of the one before
+            blurred = frame_view(scratch, reach.width, reach.height, reach.width * 4, frame->format);
+            blur(&blurred, &reach, scratch + (u64)reach.width * reach.height * 4, radius, flags, queue);
+        }
+        else
+        {
+            // a single pass only needs the rect's rows
+            blurred = frame_view(scratch, reach.width, rect.height, reach.width * 4, frame->format);
+            blur_pass(&blurred, &reach, inner.y, (flags & BLUR_BOX) ? 0 : &kernel, halo, queue);
+            inner.y = 0;
+        }
+        FrameView from = frame_view_sub(blurred, inner);
+        FrameView to = frame_view_sub(*frame, rect);
+        frame_view_copy(&to, &from, 0);
+    }
+}
+
+//
+// NOTE: filter graph
+//
+// A chain of stages run as one pass instead of one pass over the whole
+// frame each. The output is cut into bands of rows. For each band, every
+// stage computes only the rows the next stage reads, into two scratch
+// buffers small enough to stay in L2, and the last stage writes straight
+// into dst. Bands are split across the work queue. A stage that reads
+// neighbouring rows (bilinear, blur) recomputes the few rows two bands share.
+//
+// Adding a stage kind means adding a rule for which input rows an output
+// row range needs, plus a band kernel. Consecutive conversions merge into
+// one stage, and a leading crop only narrows the source view.
+//
+
+#define FILTER_GRAPH_MAX_STAGES 8
+#define FILTER_GRAPH_BAND_BYTES (256 * 1024) // per scratch buffer, two per band in flight
+#define FILTER_GRAPH_MAX_BAND_ROWS 64
+
+enum FilterStageKind {
+    FILTER_CROP,
+    FILTER_CONVERT,  // CONVERT_* flags, the flip included
+    FILTER_AREA,     // factor x factor box average
+    FILTER_BILINEAR,
+    FILTER_GAUSSIAN, // blur or unsharp mask
+    FILTER_BOX,      // one box blur pass
+};
+
+struct FilterStage {
+    FilterStageKind kind;
+    u32 in_width;
+    u32 in_height;
+    u32 width; // output
+    u32 height;
+
+    FrameRect crop;
+    u32 flags;
+    u32 factor;
+    u32 *x0; // bilinear: per output column the left source pixel
+    u16 *wx; // and the weight of the right one
+    BlurKernel kernel; // box: only the radius
+};
+
+struct FilterGraph {
+    FilterStage stages[FILTER_GRAPH_MAX_STAGES];
+    u32 stage_count;
+    u32 in_width;
+    u32 in_height;
+    u32 width; // output of the chain so far
+    u32 height;
+    PixelFormat format;
+    bool failed; // too many stages, filter_graph_run does nothing
+};
+
+function void filter_graph_begin(FilterGraph *graph, u32 width, u32 height, PixelFormat format)
+{
+    memset(graph, 0, sizeof(FilterGraph));
+    graph->in_width = graph->width = width;
+    graph->in_height = graph->height = height;
+    graph->format = format;
+}
+
+function void filter_graph_destroy(FilterGraph *graph)
+{
+    for (u32 i = 0; i < graph->stage_count; ++i)
+    {
+        free(graph->stages[i].x0);
+        free(graph->stages[i].wx);
+    }
+    graph->stage_count = 0;
+}
+
+function FilterStage *filter_graph_push(FilterGraph *graph, FilterStageKind kind, u32 width, u32 height)
+{
+    if (graph->stage_count >= FILTER_GRAPH_MAX_STAGES)
+    {
+        printf("Error: filter graph has more than %u stages.\n", FILTER_GRAPH_MAX_STAGES);
+        graph->failed = true;
+        return 0;
+    }
+    FilterStage *stage = &graph->stages[graph->stage_count++];
+    memset(stage, 0, sizeof(FilterStage));
+    stage->kind = kind;
+    stage->in_width = graph->width;
+    stage->in_height = graph->height;
+    stage->width = graph->width = width;
+    stage->height = graph->height = height;
+    return stage;
+}
+
+// keep rect (clipped) of the frame so far
+function void filter_graph_crop(FilterGraph *graph, FrameRect rect)
+{
+    rect = frame_rect_clip(rect, graph->width, graph->height);
+    if (rect.x == 0 && rect.y == 0 && rect.width == graph->width && rect.height == graph->height)
+        return;
+    FilterStage *stage = filter_graph_push(graph, FILTER_CROP, rect.width, rect.height);
+    if (stage)
+        stage->crop = rect;
+}
+
+// CONVERT_* flags, merged into the previous stage if that converts too
+function void filter_graph_convert(FilterGraph *graph, u32 flags)
+{
+    if (!flags)
+        return;
+    if (flags & CONVERT_SWIZZLE_RB)
+        graph->format = graph->format == PIXEL_FORMAT_BGRA8 ? PIXEL_FORMAT_RGBA8 : PIXEL_FORMAT_BGRA8;
+
+    FilterStage *last = graph->stage_count ? &graph->stages[graph->stage_count - 1] : 0;
+    if (last && last->kind == FILTER_CONVERT)
+    {
+        // a second flip or swizzle undoes the first
+        last->flags = (last->flags ^ (flags & (CONVERT_FLIP_Y | CONVERT_SWIZZLE_RB))) | (flags & CONVERT_FORCE_OPAQUE);
+        if (!last->flags)
+            graph->stage_count--;
+        return;
+    }
+    FilterStage *stage = filter_graph_push(graph, FILTER_CONVERT, graph->width, graph->height);
+    if (stage)
+        stage->flags = flags;
+}
+
+function void filter_graph_flip(FilterGraph *graph)
+{
+    filter_graph_convert(graph, CONVERT_FLIP_Y);
+}
+
+// resize to width x height like downscale: the largest box factor that
+// keeps at least that size, then bilinear for the rest (also enlarges)
+function void filter_graph_scale(FilterGraph *graph, u32 width, u32 height)
+{
+    if (!width || !height || (width == graph->width && height == graph->height))
+        return;
+
+    u32 factor = downscale_area_factor(graph->width, graph->height, width, height);
+    if (factor >= 2)
+    {
+        FilterStage *stage = filter_graph_push(graph, FILTER_AREA, graph->width / factor, graph->height / factor);
+        if (!stage)
+            return;
+        stage->factor = factor;
+    }
+    if (width == graph->width && height == graph->height)
+        return;
+
+    FilterStage *stage = filter_graph_push(graph, FILTER_BILINEAR, width, height);
+    if (!stage)
+        return;
+    stage->x0 = (u32*)malloc((u64)width * sizeof(u32));
+    stage->wx = (u16*)malloc((u64)width * sizeof(u16));
+    for (u32 x = 0; x < width; ++x)
+        downscale_sample(x, width, stage->in_width, &stage->x0[x], &stage->wx[x]);
+}
+
+// blur the frame so far, BLUR_* flags as for blur
+function void filter_graph_blur(FilterGraph *graph, u32 radius, u32 flags)
+{
+    if (!radius)
+        return;
+    if (!(flags & BLUR_BOX) && radius <= BLUR_GAUSSIAN_MAX_RADIUS)
+    {
+        FilterStage *stage = filter_graph_push(graph, FILTER_GAUSSIAN, graph->width, graph->height);
+        if (stage)
+            blur_kernel_init(&stage->kernel, radius);
+        return;
+    }
+
+    u32 passes = (flags & BLUR_BOX) ? 1 : 3;
+    u32 box = (flags & BLUR_BOX) ? blur_halo(radius, flags) : blur_box_radius(radius);
+    for (u32 i = 0; i < passes; ++i)
+    {
+        FilterStage *stage = filter_graph_push(graph, FILTER_BOX, graph->width, graph->height);
+        if (stage)
+            stage->kernel.radius = box;
+    }
+}
+
+// unsharp mask the frame so far, arguments as for sharpen
+function void filter_graph_sharpen(FilterGraph *graph, u32 radius, u32 amount, u32 threshold)
+{
+    if (!radius || !amount)
+        return;
+    FilterStage *stage = filter_graph_push(graph, FILTER_GAUSSIAN, graph->width, graph->height);
+    if (!stage)
+        return;
+    blur_kernel_init(&stage->kernel, radius);
+    stage->kernel.amount = amount < 16383 ? amount : 16383;
+    stage->kernel.threshold = threshold < 255 ? threshold : 255;
+}
+
+// the input rows [*i0, *i1) that output rows [r0, r1) are computed from
+function void filter_stage_input_rows(FilterStage *stage, u32 r0, u32 r1, u32 *i0, u32 *i1)
+{
+    switch (stage->kind)
+    {
+        case FILTER_CROP:
+        {
+            *i0 = r0 + stage->crop.y;
+            *i1 = r1 + stage->crop.y;
+        } break;
+        case FILTER_CONVERT:
+        {
+            bool flip = (stage->flags & CONVERT_FLIP_Y) != 0;
+            *i0 = flip ? stage->in_height - r1 : r0;
+            *i1 = flip ? stage->in_height - r0 : r1;
+        } break;
+        case FILTER_AREA:
+        {
+            *i0 = r0 * stage->factor;
+            *i1 = r1 * stage->factor;
+        } break;
+        case FILTER_BILINEAR:
+        {
+            u32 first, last;
+            u16 w;
+            downscale_sample(r0, stage->height, stage->in_height, &first, &w);
+            downscale_sample(r1 - 1, stage->height, stage->in_height, &last, &w);
+            *i0 = first;
+            *i1 = last + (stage->in_height >= 2 ? 2 : 1);
+        } break;
+        case FILTER_GAUSSIAN:
+        case FILTER_BOX:
+        {
+            u32 halo = stage->kernel.radius;
+            *i0 = r0 > halo ? r0 - halo : 0;
+            *i1 = r1 + halo < stage->in_height ? r1 + halo : stage->in_height;
+        } break;
+    }
+}
+
+// most input rows any range of rows output rows needs
+function u32 filter_stage_input_rows_bound(FilterStage *stage, u32 rows)
+{
+    u64 bound = rows;
+    if (stage->kind == FILTER_AREA)
+        bound = (u64)rows * stage->factor;
+    else if (stage->kind == FILTER_BILINEAR)
+        bound = ((u64)rows * stage->in_height + stage->height - 1) / stage->height + 2;
+    else if (stage->kind == FILTER_GAUSSIAN || stage->kind == FILTER_BOX)
+        bound = (u64)rows + 2 * stage->kernel.radius;
+    return bound < stage->in_height ? (u32)bound : stage->in_height;
+}
+
+// output rows starting at r0 into out, from input rows starting at i0 in in
+function void filter_stage_run(FilterStage *stage, FrameView *out, u32 r0, FrameView *in, u32 i0, u16 *temp)
+{
+    switch (stage->kind)
+    {
+        case FILTER_CROP:
+        {
+            for (u32 y = 0; y < out->height; ++y)
+                memcpy(out->pixels + (u64)y * out->stride,
+                       in->pixels + (u64)(r0 + y + stage->crop.y - i0) * in->stride + (u64)stage->crop.x * 4,
+                       (u64)out->width * 4);
+        } break;
+        case FILTER_CONVERT:
+        {
+            bool flip = (stage->flags & CONVERT_FLIP_Y) != 0;
+            u32 flags = stage->flags & ~CONVERT_FLIP_Y;
+            for (u32 y = 0; y < out->height; ++y)
+            {
+                u32 row = flip ? stage->in_height - 1 - (r0 + y) : r0 + y;
+                u8 *from = in->pixels + (u64)(row - i0) * in->stride;
+                u8 *to = out->pixels + (u64)y * out->stride;
+                if (flags)
+                    convert_row((u32*)to, (u32*)from, out->width, flags);
+                else
+                    memcpy(to, from, (u64)out->width * 4);
+            }
+        } break;
+        case FILTER_AREA:
+        {
+            // the band starts on a whole box, in row 0 is out row 0's first source row
+            DownscaleJob job = {};
+            job.dst = out;
+            job.src = in;
+            job.factor = stage->factor;
+            downscale_area_rows(&job, 0, out->height);
+        } break;
+        case FILTER_BILINEAR:
+        {
+            DownscaleJob job = {};
+            job.dst = out;
+            job.src = in;
+            job.x0 = stage->x0;
+            job.wx = stage->wx;
+            u32 channels = out->width * 4;
+            u16 *top = temp, *bottom = temp + channels;
+            // neighbouring output rows mostly share a source row, keep the resampled ones
+            u32 top_row = ~0u, bottom_row = ~0u;
+            for (u32 y = 0; y < out->height; ++y)
+            {
+                u32 y0;
+                u16 wy;
+                downscale_sample(r0 + y, stage->height, stage->in_height, &y0, &wy);
+                u32 y1 = stage->in_height >= 2 ? y0 + 1 : y0;
+                if (y0 == bottom_row)
+                {
+                    u16 *swap = top;
+                    top = bottom;
+                    bottom = swap;
+                    top_row = bottom_row;
+                    bottom_row = ~0u;
+                }
+                if (y0 != top_row)
+                    downscale_bilinear_row(top, in->pixels + (u64)(y0 - i0) * in->stride, &job, stage->in_width);
+                if (y1 != bottom_row)
+                    downscale_bilinear_row(bottom, in->pixels + (u64)(y1 - i0) * in->stride, &job, stage->in_width);
+                top_row = y0;
+                bottom_row = y1;
+                downscale_bilinear_blend(out->pixels + (u64)y * out->stride, top, bottom, channels, wy);
+            }
+        } break;
+        case FILTER_GAUSSIAN:
+        {
+            blur_gaussian_band(&stage->kernel, out, r0, in, i0, stage->in_height, temp);
+        } break;
+        case FILTER_BOX:
+        {
+            blur_box_band(stage->kernel.radius, out, r0, in, i0, stage->in_height, (s32*)temp);
+        } break;
+    }
+}
+
+struct FilterGraphJob {
+    FilterGraph *graph;
+    FrameView *dst;
+    FrameView src;
+    u32 first; // stages before it were folded into src
+    u32 band_rows;
+    u64 scratch_size; // each of the two
+    u64 temp_size;
+};
+
+function void filter_graph_bands(void *data, u32 begin, u32 end)
+{
+    FilterGraphJob *job = (FilterGraphJob*)data;
+    FilterGraph *graph = job->graph;
+    FrameView *dst = job->dst;
+    u32 count = graph->stage_count;
+
+    u8 *scratch = (u8*)malloc(job->scratch_size * 2 + job->temp_size + 16);
+    u16 *temp = (u16*)(scratch + job->scratch_size * 2);
+
+    for (u32 band = begin; band < end; ++band)
+    {
+        // rows[s] .. rows_end[s]: what stage s reads, rows[count] the band of dst
+        u32 rows[FILTER_GRAPH_MAX_STAGES + 1], rows_end[FILTER_GRAPH_MAX_STAGES + 1];
+        rows[count] = band * job->band_rows;
+        rows_end[count] = rows[count] + job->band_rows < dst->height ? rows[count] + job->band_rows : dst->height;
+        for (u32 s = count; s-- > job->first;)
+            filter_stage_input_rows(&graph->stages[s], rows[s + 1], rows_end[s + 1], &rows[s], &rows_end[s]);
+
+        FrameRect first_rows = { 0, rows[job->first], job->src.width, rows_end[job->first] - rows[job->first] };
+        FrameView in = frame_view_sub(job->src, first_rows);
+        for (u32 s = job->first; s < count; ++s)
+        {
+            FilterStage *stage = &graph->stages[s];
+            FrameView out;
+            if (s == count - 1)
+            {
+                FrameRect band_rect = { 0, rows[count], dst->width, rows_end[count] - rows[count] };
+                out = frame_view_sub(*dst, band_rect);
+            }
+            else
+            {
+                u8 *buffer = scratch + ((s - job->first) & 1) * job->scratch_size;
+                out = frame_view(buffer, stage->width, rows_end[s + 1] - rows[s + 1], stage->width * 4, in.format);
+            }
+            filter_stage_run(stage, &out, rows[s + 1], &in, rows[s], temp);
+            in = out;
+        }
+    }
+
+    free(scratch);
+}
+
+// src (filter_graph_begin's size) through the chain into dst (the chain's
+// output size); false if building the graph failed
+function bool filter_graph_run(FilterGraph *graph, FrameView *dst, FrameView *src, WorkQueue *queue)
+{
+    if (graph->failed)
+        return false;
+    Assert(src->width == graph->in_width && src->height == graph->in_height);
+    Assert(dst->width == graph->width && dst->height == graph->height);
+
+    FilterGraphJob job = {};
+    job.graph = graph;
+    job.dst = dst;
+    job.src = *src;
+    if (graph->stage_count && graph->stages[0].kind == FILTER_CROP)
+    {
+        job.src = frame_view_sub(job.src, graph->stages[0].crop);
+        job.first = 1;
+    }
+    if (job.first == graph->stage_count)
+    {
+        frame_view_copy(dst, &job.src, 0);
+        dst->format = graph->format;
+        return true;
+    }
+
+    // as many rows per band as keep every intermediate band in the budget
+    u32 band_rows = FILTER_GRAPH_MAX_BAND_ROWS;
+    while (true)
+    {
+        u64 largest = 0, rows = band_rows;
+        for (u32 s = graph->stage_count - 1; s > job.first; --s)
+        {
+            rows = filter_stage_input_rows_bound(&graph->stages[s], (u32)rows);
+            u64 bytes = rows * graph->stages[s - 1].width * 4;
+            largest = bytes > largest ? bytes : largest;
+        }
+        job.scratch_size = largest;
+        if (band_rows == 1 || largest <= FILTER_GRAPH_BAND_BYTES)
+            break;
+        band_rows /= 2;
+    }
+    job.band_rows = band_rows;
+
+    for (u32 s = job.first; s < graph->stage_count; ++s)
+    {
+        FilterStage *stage = &graph->stages[s];
+        u64 size = 0;
+        if (stage->kind == FILTER_BILINEAR)
+            size = (u64)stage->width * 4 * 2 * sizeof(u16);
+        else if (stage->kind == FILTER_GAUSSIAN)
+            size = blur_gaussian_temp_size(stage->width, stage->kernel.radius);
+        else if (stage->kind == FILTER_BOX)
+            size = blur_box_temp_size(stage->width, stage->kernel.radius);
+        job.temp_size = size > job.temp_size ? size : job.temp_size;
+    }
+
+    u32 band_count = (dst->height + band_rows - 1) / band_rows;
+    parallel_for(queue, band_count, 1, filter_graph_bands, &job);
+    dst->format = graph->format;
+    return true;
+}
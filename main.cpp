@@ -3,17 +3,28 @@
 #include <gl/gl.h>
 #include <stdio.h>
 
-#define u8 unsigned char
-#define u16 unsigned short
-#define u32 unsigned int
-#define u64 unsigned long long
-
-#define function static
-#define Assert(e) {if(!(e)) {*((void**)(0)) = 0;}}
-#define ArrayCount(arr) (sizeof(arr)/sizeof(arr[0]))
+#include "base.h"
 
+#include "platform.cpp"
+#include "profiler.cpp"
+#include "work_queue.cpp"
 #include "image_processing.cpp"
 #include "dx_capture_screen.cpp"
+#include "frame_buffer_pool.cpp"
+#include "tile_diff.cpp"
+#include "frame_handoff.cpp"
+#include "tile_codec.cpp"
+#include "frame_recording.cpp"
+#include "frame_pacing.cpp"
+#include "frame_stats.cpp"
+#include "frame_ring.cpp"
+#include "image_export.cpp"
+#include "tile_pyramid.cpp"
+#include "frame_pipeline.cpp"
+#include "compositor.cpp"
+#include "gl_extensions.cpp"
+#include "opengl_sink.cpp"
+#include "opengl_tiles.cpp"
 
 #ifdef UNICODE
 #define _T(str) L##str
@@ -26,77 +37,26 @@
 #define GL_SRGB8                          0x8C41
 #define GL_SRGB8_ALPHA8                   0x8C43
 
-struct PerfCounter {
-    LARGE_INTEGER frequency, start_time, end_time;
-    
-    void begin()
-    {
-        QueryPerformanceFrequency(&frequency);
-        QueryPerformanceCounter(&start_time);
-    }
-    
-    // return elapsed time in seconds
-    double end()
-    {
-        QueryPerformanceCounter(&end_time);
-        
-        return (double)(end_time.QuadPart - start_time.QuadPart) / frequency.QuadPart;
-    }
-};
-
 static u32 opengl_internal_image_format = GL_RGBA8;
 
-struct opengl_extension_opt {
-    char *extension_strings;
-    bool GL_ARB_framebuffer_sRGB;
-    bool WGL_EXT_swap_control;
-};
+// client size from WM_SIZE, frames bigger than this are downscaled before the upload
+static u32 viewport_width;
+static u32 viewport_height;
+
+static GlExtensions gl_extensions;
 
-function void get_opengl_extension_options(opengl_extension_opt *options)
+typedef BOOL WINAPI wglSwapIntervalEXT_func(int interval);
+typedef const char * WINAPI wglGetExtensionsStringARB_func(HDC hdc);
+typedef const char * WINAPI wglGetExtensionsStringEXT_func(void);
+
+function void *win32_gl_proc_loader(const char *name)
 {
-    char *gl_extensions = (char*)glGetString(GL_EXTENSIONS);
-    
-    
-    FILE *f = fopen("opengl_extensions.txt", "wb");
-    if (f) {
-        fwrite(gl_extensions, 1, strlen(gl_extensions), f);
-        fclose(f);
-    }
-    
-    char *start = gl_extensions;
-    char *end = start;
-    while (true)
-    {
-        if (*end == ' ' || *end == 0) {
-            if (end > start)
-            {
-                u64 length = end - start - 1;
-                if (strncmp(start, "GL_ARB_framebuffer_sRGB", length) == 0)
-                {
-                    options->GL_ARB_framebuffer_sRGB = true;
-                } 
-                else if (strncmp(start, "WGL_EXT_swap_control", length) == 0)
-                {
-                    options->WGL_EXT_swap_control = true;
-                }
-            }
-            
-            if (*end == 0)
-                break;
-            
-            start = end + 1;
-            end = start;
-        }
-        
-        end++;
-    }
-    
-    options->extension_strings = gl_extensions;
-    
+    return (void*)wglGetProcAddress(name);
 }
 
+// dump_extensions writes every extension string to opengl_extensions.txt
 function void
-win32_opengl_init(HWND Window, HDC WindowDC)
+win32_opengl_init(HWND Window, HDC WindowDC, bool dump_extensions)
 {
     PIXELFORMATDESCRIPTOR DesiredPixelFormat = {};
     DesiredPixelFormat.nSize = sizeof(DesiredPixelFormat);
@@ -118,22 +78,40 @@ win32_opengl_init(HWND Window, HDC WindowDC)
     if(wglMakeCurrent(WindowDC, OpenGLRC))        
     {
         
-        opengl_extension_opt gl_options = {};
-        get_opengl_extension_options(&gl_options);
+        gl_extensions.loader = win32_gl_proc_loader;
+        gl_extensions_parse_version(&gl_extensions, (const char*)glGetString(GL_VERSION));
+        gl_extensions_parse(&gl_extensions, (const char*)glGetString(GL_EXTENSIONS));
+        // WGL_* are usually only in the WGL string, which needs the entry point first
+        wglGetExtensionsStringARB_func *wglGetExtensionsStringARB = GL_PROC(&gl_extensions, wglGetExtensionsStringARB);
+        wglGetExtensionsStringEXT_func *wglGetExtensionsStringEXT = GL_PROC(&gl_extensions, wglGetExtensionsStringEXT);
+        if (wglGetExtensionsStringARB)
+            gl_extensions_parse(&gl_extensions, wglGetExtensionsStringARB(WindowDC));
+        else if (wglGetExtensionsStringEXT)
+            gl_extensions_parse(&gl_extensions, wglGetExtensionsStringEXT());
+        
+        if (dump_extensions)
+        {
+            FILE *f = fopen("opengl_extensions.txt", "wb");
+            if (f)
+            {
+                gl_extensions_dump(&gl_extensions, f);
+                fclose(f);
+            }
+        }
         
         //glGenTextures(1, &TextureHandle);
 #if 1
         // vsync
-        if (gl_options.WGL_EXT_swap_control)
+        if (gl_extension_supported(&gl_extensions, GL_EXTENSION_WGL_EXT_swap_control))
         {
-            typedef BOOL WINAPI wglSwapIntervalEXT_func(int interval);
-            wglSwapIntervalEXT_func* wglSwapIntervalEXT = (wglSwapIntervalEXT_func*)wglGetProcAddress("wglSwapIntervalEXT");
+            wglSwapIntervalEXT_func *wglSwapIntervalEXT = GL_PROC(&gl_extensions, wglSwapIntervalEXT);
             if (wglSwapIntervalEXT)
                 wglSwapIntervalEXT(1); 
         }
         
         // srgb
-        if (gl_options.GL_ARB_framebuffer_sRGB)
+        if (gl_extension_supported(&gl_extensions, GL_EXTENSION_ARB_framebuffer_sRGB) ||
+            gl_extension_supported(&gl_extensions, GL_EXTENSION_EXT_framebuffer_sRGB))
         {
             opengl_internal_image_format = GL_SRGB8_ALPHA8;
             //opengl_internal_image_format = GL_SRGB8;
@@ -183,6 +161,8 @@ function LRESULT CALLBACK WindowProc(HWND   hwnd,
             u32 WindowWidth = LOWORD(lParam);
             u32 WindowHeight = HIWORD(lParam);
             glViewport(0, 0, (GLsizei)WindowWidth, (GLsizei)WindowHeight);
+            viewport_width = WindowWidth;
+            viewport_height = WindowHeight;
             break;
         }
         default: {
@@ -229,32 +209,92 @@ function HWND create_main_window(HINSTANCE hInst, float WindowWidth, float Windo
     return hwnd;
 }
 
-function void opengl_draw_triangle() {
-    glBegin(GL_TRIANGLES);
-    float p = 1.0f;
-    glTexCoord2f(0.0f, 0.0f);
-    glVertex2f(-p, -p);
-    glTexCoord2f(1.0f, 0.0f);
-    glVertex2f(p, -p);
-    glTexCoord2f(1.0f, 1.0f);
-    glVertex2f(p, p);
+//
+// NOTE: win32 frame sources and the OpenGL window sink for the frame pipeline
+//
+
+function bool blt_source_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    u32 width = 0, height = 0;
+    if (!blt_capture_screen(buffer, (u32)buffer_size, source->roi, &width, &height))
+    {
+        frame->required_size = (u64)width * height * 4;
+        return false;
+    }
     
-    glTexCoord2f(0.0f, 0.0f);
-    glVertex2f(-p, -p);
-    glTexCoord2f(1.0f, 1.0f);
-    glVertex2f(p, p);
-    glTexCoord2f(0.0f, 1.0f);
-    glVertex2f(-p, p);
+    // bottom-up DIB, already the GL orientation
+    frame->view = frame_view(buffer, width, height, width * 4, PIXEL_FORMAT_BGRA8);
+    return true;
+}
+
+function FrameSource blt_source()
+{
+    FrameSource source = {};
+    source.name = "capture_blt";
+    source.acquire = blt_source_acquire;
+    return source;
+}
+
+function bool dx_source_begin(FrameSource *source)
+{
+    CaptureContext *context = (CaptureContext*)source->user;
+    if (!context->factory)
+        dx_init(context);
+    return true;
+}
+
+function bool dx_source_acquire(FrameSource *source, Frame *frame, u8 *buffer, u64 buffer_size)
+{
+    CaptureContext *context = (CaptureContext*)source->user;
     
-    glEnd();
+    // rows are top-down, the sink flips when drawing; alpha is undefined in the
+    // duplicated desktop but the window draws without blending
+    frame->flip_vertical = true;
     
-#if 0
-    glBegin(GL_POLYGON);
-    glColor3f(1, 0, 0); glVertex3f(-0.6f, -0.75f, 0.5f);
-    glColor3f(0, 1, 0); glVertex3f(0.6f, -0.75f, 0);
-    glColor3f(0, 0, 1); glVertex3f(0, 0.75f, 0);
-    glEnd();
-#endif
+    // read the mapped staging texture in place until release
+    if (source->allow_borrow && !source->convert_flags)
+    {
+        bool mapped = dx_map_frame(context, source->roi, &frame->view);
+        source->lost = context->access_lost;
+        frame->borrowed = mapped;
+        return mapped;
+    }
+    
+    FrameRect roi = frame_rect_clip(source->roi, context->tex_desc.Width, context->tex_desc.Height);
+    u64 required_size = (u64)roi.width * roi.height * 4;
+    if (buffer_size < required_size && !context->access_lost)
+    {
+        frame->required_size = required_size;
+        return false;
+    }
+    bool captured = dx_capture(context, source->roi, buffer, buffer_size, &frame->view, source->convert_flags);
+    source->lost = context->access_lost;
+    if (!captured)
+        return false;
+    
+    frame->applied_flags = source->convert_flags;
+    return true;
+}
+
+function void dx_source_release(FrameSource *source, Frame *frame)
+{
+    dx_unmap_frame((CaptureContext*)source->user);
+}
+
+function FrameSource dx_source(CaptureContext *context)
+{
+    FrameSource source = {};
+    source.name = "capture_dx";
+    source.user = context;
+    source.begin = dx_source_begin;
+    source.acquire = dx_source_acquire;
+    source.release = dx_source_release;
+    return source;
+}
+
+function void win32_swap_buffers(void *user)
+{
+    SwapBuffers((HDC)user);
 }
 
 int CALLBACK  WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cmdshow)
@@ -267,26 +307,8 @@ int CALLBACK  WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cm
     {
         HDC hdc = GetDC(hwnd);
         
-        win32_opengl_init(hwnd, hdc);
-        
-        CaptureContext context = {};
-        u32 width = 256;
-        u32 height = 256;
-        u32 image_buffer_size = 2048 * 2048 * 4;
-        u8* image_buffer = (u8*)malloc(image_buffer_size);
-        u32 channels = 4; // rgba
-        
-        enum TestImageType {
-            TEST_IMAGE_COLOR_GEN,
-            TEST_IMAGE_FILE,
-            TEST_IMAGE_CAPTURE_BLT,
-            TEST_IMAGE_CAPTURE_DX,
-            
-            TEST_IMAGE_TYPE_COUNT, // count value
-        };
-        
-        TestImageType test_image_type = TEST_IMAGE_COLOR_GEN;
-        bool test_init = false;
+        // main.exe -gl_extensions writes the driver's extension list to opengl_extensions.txt
+        win32_opengl_init(hwnd, hdc, cmdline && strstr(cmdline, "-gl_extensions") != 0);
         
         ShowWindow(hwnd, SW_SHOWNORMAL);
         
@@ -296,146 +318,280 @@ int CALLBACK  WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cm
         GetClientRect(hwnd, &rect);
         glViewport(rect.left, rect.top, (GLsizei)rect.right - rect.left, (GLsizei)rect.bottom - rect.top);
         
-        GLuint TextureHandle = 0;
-        glGenTextures(1, &TextureHandle);
-        int opengl_image_buffer_format = GL_BGRA_EXT;
+        // PBO streaming into a texture allocated once per size, see opengl_sink.cpp
+        OpenGLSink gl = {};
+        gl.extensions = &gl_extensions;
+        gl.internal_format = opengl_internal_image_format;
+        gl.swap = win32_swap_buffers;
+        gl.swap_user = hdc;
+        FrameSink sink = opengl_sink(&gl);
+        
+        // F7: the large image viewer instead, a tile pyramid drawn at any zoom, see opengl_tiles.cpp
+        OpenGLTileSink tiles = {};
+        tiles.extensions = &gl_extensions;
+        tiles.internal_format = opengl_internal_image_format;
+        tiles.swap = win32_swap_buffers;
+        tiles.swap_user = hdc;
+        tiles.upload_budget = 16;
+        FrameSink tile_sink = opengl_tile_sink(&tiles);
+        bool tiled = false;
+        bool dragging = false;
+        s32 drag_x = 0, drag_y = 0;
+        
+        profile_thread_name("render");
+        profiler_enable(true);
         
-        u64 frame_number = 0;
-        u64 fps_frame_count = 0;
-        double fps_spent_time = 0;
+        WorkQueue queue;
+        work_queue_init(&queue, 0);
+        tiles.queue = &queue;
+        
+        // main.exe -capture_fps N captures N times a second, default is on change:
+        // DXGI returns when the desktop changed, the timeout only bounds how long
+        // switching sources waits for the capture thread
+        const char *capture_fps_arg = cmdline ? strstr(cmdline, "-capture_fps ") : 0;
+        double capture_fps = capture_fps_arg ? atof(capture_fps_arg + strlen("-capture_fps ")) : 0;
+        u32 acquire_timeout_ms = capture_fps > 0 ? 1 : 100;
+        
+        CaptureContext context = {};
+        context.acquire_timeout_ms = acquire_timeout_ms;
+        
+        // every monitor as a layer of one canvas, each duplicated on its own worker;
+        // monitor 0 shares the single monitor source's context, an output can only
+        // be duplicated once per process
+        RECT monitor_rects[COMPOSITOR_MAX_LAYERS] = {};
+        u32 monitor_count = dx_enumerate_outputs(monitor_rects, COMPOSITOR_MAX_LAYERS);
+        CaptureContext monitor_contexts[COMPOSITOR_MAX_LAYERS] = {};
+        FrameSource monitor_sources[COMPOSITOR_MAX_LAYERS] = {};
+        Compositor compositor = {};
+        for (u32 i = 0; i < monitor_count; ++i)
+        {
+            CaptureContext *monitor = i == 0 ? &context : &monitor_contexts[i];
+            monitor->monitor = i;
+            monitor->acquire_timeout_ms = acquire_timeout_ms;
+            monitor_sources[i] = dx_source(monitor);
+            RECT *r = &monitor_rects[i];
+            compositor_add_layer(&compositor, &monitor_sources[i], r->left, r->top, r->right - r->left, r->bottom - r->top);
+        }
+        
+        ColorGenSource color_gen = {};
+        color_gen.queue = &queue;
+        // main.exe -image path shows another file than desktop.png (e.g. a stitched capture in the viewer)
+        char image_path[260] = "desktop.png";
+        const char *image_arg = cmdline ? strstr(cmdline, "-image ") : 0;
+        if (image_arg)
+            sscanf(image_arg + strlen("-image "), "%259s", image_path);
+        FileSource file = {};
+        ReplaySource replay = {};
+        replay.realtime = true;
+        replay.loop = true;
+        replay.queue = &queue;
+        FrameSource sources[TEST_IMAGE_TYPE_COUNT] = {
+            color_gen_source(&color_gen),
+            file_source(&file, image_path),
+            blt_source(),
+            dx_source(&context),
+            replay_source(&replay, "capture.frames"),
+            compositor_source(&compositor),
+        };
+        
+        FrameBufferPool pool = {};
+        pool.use_huge_pages = true;
+        
+        FramePipeline pipeline = {};
+        frame_pipeline_init(&pipeline, &sink, &pool);
+        pipeline.tile_diff_enabled = true;
+        pipeline.downscale_enabled = true;
+        // main.exe -linear scales on linear light like an sRGB texture is filtered;
+        // opt-in, it costs ~8x the plain area average (~40 ms a 4K frame in bench)
+        pipeline.downscale_linear = cmdline && strstr(cmdline, "-linear") != 0 &&
+                                    opengl_internal_image_format == GL_SRGB8_ALPHA8;
+        pipeline.queue = &queue;
+        frame_pipeline_enable_capture_thread(&pipeline);
+        frame_pipeline_set_capture_rate(&pipeline, capture_fps);
+        // only new frames and resizes are drawn, between them the loop sleeps
+        pipeline.present_on_demand = true;
+        // black / blank / frozen / lost capture in the title, from a 1/16 sample
+        pipeline.stats_enabled = true;
+        pipeline.stats_step = 4;
+        for (u32 i = 0; i < TEST_IMAGE_TYPE_COUNT; ++i)
+            pipeline.sources[i] = &sources[i];
+        if (monitor_count < 2)
+            pipeline.sources[TEST_IMAGE_COMPOSITE] = 0;
+        frame_pipeline_set_source(&pipeline, TEST_IMAGE_COLOR_GEN);
+        
+        FrameRecorder recorder = {};
+        FrameRing ring = {};
+        SnapshotWriter snapshot;
+        snapshot_writer_init(&snapshot, &queue);
+        pipeline.snapshot = &snapshot;
+        u32 snapshot_count = 0;
+        u32 presented_width = 0, presented_height = 0;
         
         // Start the message loop. 
-        PerfCounter perf = {};
         MSG msg = {};
         while(WM_QUIT != msg.message)
         { 
-            perf.begin();
-            
-            ++frame_number;
-            
             if(PeekMessage( &msg, NULL, 0, 0, PM_REMOVE))
             {
                 if (msg.message == WM_KEYDOWN)
                 {
                     if (msg.wParam == VK_SPACE)
                     {
-                        test_image_type = (TestImageType)((test_image_type + 1) % TEST_IMAGE_TYPE_COUNT);
-                        test_init = false;
+                        frame_pipeline_next_source(&pipeline);
+                    }
+                    else if (msg.wParam == VK_F5 && pipeline.test_image_type != TEST_IMAGE_REPLAY)
+                    {
+                        // start/stop recording what is shown (tile-delta compressed), replayed by the last source
+                        if (pipeline.recorder)
+                        {
+                            pipeline.recorder = 0;
+                            frame_recorder_close(&recorder);
+                        }
+                        else if (frame_recorder_open(&recorder, "capture.frames", FRAME_CODEC_TILE, &queue))
+                        {
+                            pipeline.recorder = &recorder;
+                        }
+                    }
+                    else if (msg.wParam == VK_F6)
+                    {
+                        // start/stop sharing frames with other processes, sized for the whole virtual screen
+                        if (pipeline.ring)
+                        {
+                            pipeline.ring = 0;
+                            frame_ring_close(&ring);
+                        }
+                        else
+                        {
+                            u64 max_bytes = (u64)GetSystemMetrics(SM_CXVIRTUALSCREEN) * GetSystemMetrics(SM_CYVIRTUALSCREEN) * 4;
+                            if (frame_ring_create(&ring, "opengl_template_frames", 4, max_bytes))
+                            {
+                                ring.queue = &queue;
+                                pipeline.ring = &ring;
+                            }
+                        }
+                    }
+                    else if (msg.wParam == VK_F7)
+                    {
+                        // window sink <-> tile viewer; the viewer draws frames at any size, no downscale
+                        // (after the capture thread stopped, it reads downscale_enabled)
+                        tiled = !tiled;
+                        tiles.view.zoom = 0;
+                        frame_pipeline_set_sink(&pipeline, tiled ? &tile_sink : &sink);
+                        pipeline.downscale_enabled = !tiled;
+                    }
+                    else if (msg.wParam == VK_HOME && tiled)
+                    {
+                        tiles.view.zoom = 0;
+                        frame_pipeline_invalidate(&pipeline);
+                    }
+                    else if (msg.wParam == VK_F8)
+                    {
+                        // snapshot of what is shown, written on the snapshot thread; shift for QOI
+                        char path[64];
+                        sprintf(path, "snapshot_%03u.%s", snapshot_count++, GetKeyState(VK_SHIFT) < 0 ? "qoi" : "png");
+                        snapshot_writer_request(&snapshot, path, IMAGE_EXPORT_OPAQUE);
+                    }
+                    else if (msg.wParam == VK_F9)
+                    {
+                        // per-stage percentiles and the last zones of every thread, then start over
+                        FILE *report = fopen("profile.txt", "wb");
+                        if (report)
+                        {
+                            profiler_report(report);
+                            fclose(report);
+                        }
+                        profiler_export_chrome_trace("trace.json");
+                        profiler_reset();
                     }
                 }
-                TranslateMessage(&msg); 
-                DispatchMessage(&msg); 
-            }
-            
-            if (!test_init)
-            {
-                test_init = true;
-                
-                if (test_image_type == TEST_IMAGE_COLOR_GEN)
+                else if (tiled && msg.message == WM_MOUSEWHEEL)
                 {
-                    width = height = 256;
-                    u8 *p = image_buffer;
-                    u32 x, y;
-                    for (y = 0; y < width; y++)
-                        for (x = 0; x < height; x++) {
-                        *p++ = (unsigned char)x;                /* R */
-                        *p++ = (unsigned char)y;                /* G */
-                        *p++ = 128;                             /* B */
-                        *p++ = (unsigned char)((x + y) / 2);    /* A */
-                    }
+                    // zoom by 2^(1/4) a notch around the cursor
+                    POINT cursor = { (s16)LOWORD(msg.lParam), (s16)HIWORD(msg.lParam) };
+                    ScreenToClient(hwnd, &cursor);
+                    double notches = (double)GET_WHEEL_DELTA_WPARAM(msg.wParam) / WHEEL_DELTA;
+                    tile_view_zoom(&tiles.view, &tiles.pyramid, pow(2.0, notches / 4), cursor.x, cursor.y);
+                    frame_pipeline_invalidate(&pipeline);
+                }
+                else if (tiled && msg.message == WM_LBUTTONDOWN)
+                {
+                    dragging = true;
+                    drag_x = (s16)LOWORD(msg.lParam);
+                    drag_y = (s16)HIWORD(msg.lParam);
+                    SetCapture(hwnd);
                 }
-                else if (test_image_type == TEST_IMAGE_FILE)
+                else if (msg.message == WM_LBUTTONUP && dragging)
                 {
-                    int png_channels = 0;
-                    stbi_set_flip_vertically_on_load(true); 
-                    image_buffer = stbi_load("desktop.png", (int*)&width, (int*)&height, &png_channels, channels);
-                    
-                    opengl_image_buffer_format = GL_RGBA;
+                    dragging = false;
+                    ReleaseCapture();
                 }
-                if (test_image_type == TEST_IMAGE_CAPTURE_DX)
+                else if (tiled && msg.message == WM_MOUSEMOVE && dragging)
                 {
-                    if (!context.factory)
-                        dx_init(&context);
+                    s32 x = (s16)LOWORD(msg.lParam), y = (s16)HIWORD(msg.lParam);
+                    tile_view_pan(&tiles.view, &tiles.pyramid, x - drag_x, y - drag_y);
+                    drag_x = x;
+                    drag_y = y;
+                    frame_pipeline_invalidate(&pipeline);
                 }
+                TranslateMessage(&msg); 
+                DispatchMessage(&msg); 
             }
-            
-            
-            if (test_image_type == TEST_IMAGE_CAPTURE_DX)
+            else if (!(tiled && tiles.pending))
             {
-                dx_capture(&context, image_buffer, image_buffer_size, &width, &height);
-                stbi__vertical_flip(image_buffer, width, height, 4);
-            } 
-            else if (test_image_type == TEST_IMAGE_CAPTURE_BLT)
-            {
-                blt_capture_screen(image_buffer, image_buffer_size, &width, &height);
+                // nothing to do until a message arrives or the capture thread has a frame
+                MsgWaitForMultipleObjects(1, &pipeline.capture.frame_ready.handle, FALSE, 250, QS_ALLINPUT);
             }
             
-            glBindTexture(GL_TEXTURE_2D, TextureHandle);
-            glTexImage2D(GL_TEXTURE_2D,
-                         0,
-                         opengl_internal_image_format,
-                         width,
-                         height,
-                         0,
-                         opengl_image_buffer_format,
-                         GL_UNSIGNED_BYTE,
-                         image_buffer);
-            
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR  /*GL_NEAREST*/ );
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR /*GL_NEAREST*/ );
-            //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-            //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-            
-            glTexEnvi(GL_TEXTURE_ENV,
-                      GL_TEXTURE_ENV_MODE,
-                      GL_MODULATE);
-            
-            glEnable(GL_TEXTURE_2D);
-            
-            //glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-            //glClear(GL_COLOR_BUFFER_BIT);
-            
-            // Any point will transform by multiply  vertext * modelview * projection
-            // we make it look like multiply by 1
-            glMatrixMode(GL_TEXTURE);
-            glLoadIdentity();
-            
-            glMatrixMode(GL_MODELVIEW);
-            glLoadIdentity();
-            
-            glMatrixMode(GL_PROJECTION);
-            glLoadIdentity();
-            
-            opengl_draw_triangle();
-            
-            
-            SwapBuffers(hdc);
+            if (viewport_width != presented_width || viewport_height != presented_height)
+            {
+                presented_width = viewport_width;
+                presented_height = viewport_height;
+                frame_pipeline_invalidate(&pipeline);
+            }
+            frame_pipeline_set_viewport(&pipeline, viewport_width, viewport_height);
+            tiles.view.width = viewport_width;
+            tiles.view.height = viewport_height;
+            // tiles over the upload budget come in on the next presents
+            if (tiled && tiles.pending)
+                frame_pipeline_invalidate(&pipeline);
+            frame_pipeline_step(&pipeline);
             
 #if 1
-            double elapsed = perf.end();
-            
-            fps_frame_count++;
-            fps_spent_time += elapsed;
-            if (fps_frame_count > 10) {
+            if (pipeline.sum_frame_count > 10) {
                 
+                ProfileStats frame_stats = profiler_stage_stats(PROFILE_FRAME);
                 TCHAR window_title[256] = {};
-                sprintf_s(window_title, _T("FrameTime: %f s fps: %d"), elapsed, (int)(fps_frame_count / fps_spent_time));
+                char health[32];
+                sprintf_s(window_title, _T("FrameTime: %f s p99: %.2f ms fps: %d dropped: %d missed: %d latency: %.1f ms capture: %s"), pipeline.last.total, frame_stats.p99 * 1000.0,
+                          (int)(pipeline.sum_frame_count / pipeline.sum.total),
+                          (int)pipeline.capture.handoff.dropped.load(),
+                          (int)pipeline.capture_pacer.missed.load(),
+                          pipeline.latency_count ? 1000.0 * pipeline.latency_sum / pipeline.latency_count : 0.0,
+                          frame_health_text(pipeline.health.flags, health));
                 SetWindowText(hwnd, window_title);
                 
-                fps_frame_count = 0;
-                fps_spent_time = 0.0f;
+                frame_pipeline_reset_stats(&pipeline);
             }
 #endif 
             
             
         } 
         
+        frame_pipeline_destroy(&pipeline);
+        snapshot_writer_destroy(&snapshot);
+        opengl_sink_destroy(&gl);
+        opengl_tiles_destroy(&tiles);
+        frame_recorder_close(&recorder);
+        frame_ring_close(&ring);
+        frame_buffer_pool_destroy(&pool);
+        work_queue_destroy(&queue);
         dx_destroy(&context);
+        for (u32 i = 1; i < monitor_count; ++i)
+            dx_destroy(&monitor_contexts[i]);
+        compositor_destroy(&compositor);
         
         ReleaseDC(hwnd, hdc);
     }
     
     return 0; 
-}
\ No newline at end of file
+}
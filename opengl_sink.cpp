@@ -0,0 +1,418 @@
+/*
+
+  OpenGL sink
+  -----------
+  Frames go into one texture that is drawn as a full window quad. The
+  texture storage is allocated once per size change (glTexStorage2D when
+  there is texture_storage) and frames, whole or only their dirty tiles,
+  always go in with glTexSubImage2D.
+
+  With pixel buffer objects (GL 2.1) and map_buffer_range (3.0) the
+  pixels are first packed into one of OPENGL_SINK_UNPACK_COUNT rotating
+  unpack buffers and the texture is updated from there, so the driver
+  can copy into the texture asynchronously while the CPU goes on with
+  the next frame. A fence after each update guards the buffer's next use
+  (sync, 3.2); without sync objects the buffer is invalidated on map so
+  the driver hands out fresh memory instead of stalling. The quad is a
+  vertex buffer made once. Anything missing falls back to uploading
+  from client memory and immediate mode draws.
+
+  No window system here: main.cpp drives it through WGL, headless
+  (./build.sh gl) through EGL on Mesa (llvmpipe). The includer provides
+  the GL headers, makes the context current and fills in the registry.
+
+ */
+#include <stddef.h>
+
+#ifndef GL_BGRA_EXT
+#define GL_BGRA_EXT                       0x80E1
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER                   0x8892
+#define GL_STREAM_DRAW                    0x88E0
+#define GL_STATIC_DRAW                    0x88E4
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER            0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT                  0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT      0x0008
+#define GL_MAP_UNSYNCHRONIZED_BIT         0x0020
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE     0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT        0x00000001
+#define GL_ALREADY_SIGNALED               0x911A
+#define GL_TIMEOUT_EXPIRED                0x911B
+#define GL_CONDITION_SATISFIED            0x911C
+#define GL_WAIT_FAILED                    0x911D
+#endif
+
+typedef struct GlSyncObject *GlSync; // GLsync, not in the 1.1 headers
+
+typedef void APIENTRY glGenBuffers_func(GLsizei n, GLuint *buffers);
+typedef void APIENTRY glDeleteBuffers_func(GLsizei n, const GLuint *buffers);
+typedef void APIENTRY glBindBuffer_func(GLenum target, GLuint buffer);
+typedef void APIENTRY glBufferData_func(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void * APIENTRY glMapBufferRange_func(GLenum target, ptrdiff_t offset, ptrdiff_t length, GLbitfield access);
+typedef GLboolean APIENTRY glUnmapBuffer_func(GLenum target);
+typedef GlSync APIENTRY glFenceSync_func(GLenum condition, GLbitfield flags);
+typedef GLenum APIENTRY glClientWaitSync_func(GlSync sync, GLbitfield flags, u64 timeout);
+typedef void APIENTRY glDeleteSync_func(GlSync sync);
+typedef void APIENTRY glTexStorage2D_func(GLenum target, GLsizei levels, GLenum internal_format, GLsizei width, GLsizei height);
+
+#define OPENGL_SINK_UNPACK_COUNT 2
+#define OPENGL_SINK_FENCE_TIMEOUT (100ull * 1000 * 1000) // ns, then map synchronized
+
+struct OpenGLUnpackBuffer {
+    GLuint handle;
+    u64 size;
+    GlSync fence; // set after the texture update that reads it, 0 when idle
+};
+
+struct OpenGLSink {
+    GlExtensions *extensions;
+    u32 internal_format;   // GL_RGBA8, GL_SRGB8_ALPHA8 for an sRGB framebuffer
+    bool disable_streaming; // always upload from client memory (to compare)
+    void (*swap)(void *user);
+    void *swap_user;
+
+    bool initialized;
+    bool streaming;       // unpack buffer uploads
+    bool fenced;          // sync objects guard the unpack buffers
+    bool texture_storage; // immutable storage, recreated on size changes
+
+    GLuint texture_handle;
+    u32 texture_width;
+    u32 texture_height;
+    u32 texture_internal_format;
+    bool flip_vertical;
+
+    OpenGLUnpackBuffer unpack[OPENGL_SINK_UNPACK_COUNT];
+    u32 next_unpack;
+    GLuint quad_buffer; // 0: immediate mode
+
+    u64 texture_allocations;
+    u64 streamed_uploads;
+    u64 client_uploads;
+    u64 fence_stalls; // maps that had to wait for the GPU
+};
+
+// flip_vertical: the texture rows are top-down, swap the v texcoords instead of the rows
+function void opengl_draw_triangle(bool flip_vertical) {
+    glBegin(GL_TRIANGLES);
+    float p = 1.0f;
+    float v0 = flip_vertical ? 1.0f : 0.0f;
+    float v1 = flip_vertical ? 0.0f : 1.0f;
+    glTexCoord2f(0.0f, v0);
+    glVertex2f(-p, -p);
+    glTexCoord2f(1.0f, v0);
+    glVertex2f(p, -p);
+    glTexCoord2f(1.0f, v1);
+    glVertex2f(p, p);
+
+    glTexCoord2f(0.0f, v0);
+    glVertex2f(-p, -p);
+    glTexCoord2f(1.0f, v1);
+    glVertex2f(p, p);
+    glTexCoord2f(0.0f, v1);
+    glVertex2f(-p, p);
+
+    glEnd();
+}
+
+// picks the paths the context supports and sets the state that never changes
+function void opengl_sink_init(OpenGLSink *gl)
+{
+    GlExtensions *ext = gl->extensions;
+    gl->initialized = true;
+
+    bool buffers = ext->version >= 15 &&
+        GL_PROC(ext, glGenBuffers) && GL_PROC(ext, glDeleteBuffers) &&
+        GL_PROC(ext, glBindBuffer) && GL_PROC(ext, glBufferData);
+    gl->streaming = buffers && !gl->disable_streaming &&
+        gl_extension_available(ext, GL_EXTENSION_ARB_pixel_buffer_object, 21) &&
+        gl_extension_available(ext, GL_EXTENSION_ARB_map_buffer_range, 30) &&
+        GL_PROC(ext, glMapBufferRange) && GL_PROC(ext, glUnmapBuffer);
+    gl->fenced = gl->streaming &&
+        gl_extension_available(ext, GL_EXTENSION_ARB_sync, 32) &&
+        GL_PROC(ext, glFenceSync) && GL_PROC(ext, glClientWaitSync) && GL_PROC(ext, glDeleteSync);
+    gl->texture_storage = gl_extension_available(ext, GL_EXTENSION_ARB_texture_storage, 42) &&
+        GL_PROC(ext, glTexStorage2D);
+
+    if (gl->streaming)
+    {
+        GLuint handles[OPENGL_SINK_UNPACK_COUNT];
+        GL_PROC(ext, glGenBuffers)(OPENGL_SINK_UNPACK_COUNT, handles);
+        for (u32 i = 0; i < OPENGL_SINK_UNPACK_COUNT; ++i)
+            gl->unpack[i].handle = handles[i];
+    }
+
+    if (buffers)
+    {
+        // x, y, u, v; the second triangle pair has the v texcoords flipped
+        float quad[] = {
+            -1, -1, 0, 0,   1, -1, 1, 0,   1, 1, 1, 1,
+            -1, -1, 0, 0,   1,  1, 1, 1,  -1, 1, 0, 1,
+            -1, -1, 0, 1,   1, -1, 1, 1,   1, 1, 1, 0,
+            -1, -1, 0, 1,   1,  1, 1, 0,  -1, 1, 0, 0,
+        };
+        GL_PROC(ext, glGenBuffers)(1, &gl->quad_buffer);
+        GL_PROC(ext, glBindBuffer)(GL_ARRAY_BUFFER, gl->quad_buffer);
+        GL_PROC(ext, glBufferData)(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+        GL_PROC(ext, glBindBuffer)(GL_ARRAY_BUFFER, 0);
+    }
+
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_TEXTURE_2D);
+
+    // Any point will transform by multiply  vertext * modelview * projection
+    // we make it look like multiply by 1
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+
+    glGenTextures(1, &gl->texture_handle);
+}
+
+// storage and sampling state, once per size (or format) change; the texture is bound
+function void opengl_sink_allocate_texture(OpenGLSink *gl, u32 width, u32 height)
+{
+    if (gl->texture_storage && gl->texture_width)
+    {
+        // immutable storage cannot be respecified, start with a new texture
+        glDeleteTextures(1, &gl->texture_handle);
+        glGenTextures(1, &gl->texture_handle);
+        glBindTexture(GL_TEXTURE_2D, gl->texture_handle);
+    }
+
+    if (gl->texture_storage)
+        GL_PROC(gl->extensions, glTexStorage2D)(GL_TEXTURE_2D, 1, gl->internal_format, width, height);
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, gl->internal_format, width, height, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, 0);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR  /*GL_NEAREST*/ );
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR /*GL_NEAREST*/ );
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+
+    gl->texture_width = width;
+    gl->texture_height = height;
+    gl->texture_internal_format = gl->internal_format;
+    gl->texture_allocations++;
+}
+
+// the rects straight from the frame, GL reads the view with its pitch
+function void opengl_sink_upload_client(OpenGLSink *gl, FrameView *view, FrameRect *rects, u32 rect_count, GLenum format)
+{
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, view->stride / 4);
+    for (u32 i = 0; i < rect_count; ++i)
+    {
+        FrameRect *rect = &rects[i];
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        rect->x, rect->y, rect->width, rect->height,
+                        format, GL_UNSIGNED_BYTE,
+                        frame_view_sub(*view, *rect).pixels);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    gl->client_uploads++;
+}
+
+// the rects packed one after the other into the next unpack buffer, the
+// texture updated from it; false if the buffer could not be mapped
+function bool opengl_sink_upload_streaming(OpenGLSink *gl, FrameView *view, FrameRect *rects, u32 rect_count, GLenum format)
+{
+    GlExtensions *ext = gl->extensions;
+    OpenGLUnpackBuffer *buffer = &gl->unpack[gl->next_unpack];
+    gl->next_unpack = (gl->next_unpack + 1) % OPENGL_SINK_UNPACK_COUNT;
+
+    u64 size = 0;
+    for (u32 i = 0; i < rect_count; ++i)
+        size += (u64)rects[i].width * rects[i].height * 4;
+
+    GLbitfield access = GL_MAP_WRITE_BIT;
+    if (gl->fenced)
+    {
+        // the texture update from this buffer's last use must be done before it is overwritten
+        bool idle = true;
+        if (buffer->fence)
+        {
+            GLenum status = GL_PROC(ext, glClientWaitSync)(buffer->fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED)
+            {
+                gl->fence_stalls++;
+                status = GL_PROC(ext, glClientWaitSync)(buffer->fence, GL_SYNC_FLUSH_COMMANDS_BIT, OPENGL_SINK_FENCE_TIMEOUT);
+            }
+            idle = status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+            GL_PROC(ext, glDeleteSync)(buffer->fence);
+            buffer->fence = 0;
+        }
+        // a timed out fence leaves the synchronization to the driver
+        access |= idle ? GL_MAP_UNSYNCHRONIZED_BIT : GL_MAP_INVALIDATE_BUFFER_BIT;
+    }
+    else
+    {
+        access |= GL_MAP_INVALIDATE_BUFFER_BIT;
+    }
+
+    GL_PROC(ext, glBindBuffer)(GL_PIXEL_UNPACK_BUFFER, buffer->handle);
+    if (buffer->size < size)
+    {
+        GL_PROC(ext, glBufferData)(GL_PIXEL_UNPACK_BUFFER, (ptrdiff_t)size, 0, GL_STREAM_DRAW);
+        buffer->size = size;
+    }
+
+    u8 *mapped = (u8*)GL_PROC(ext, glMapBufferRange)(GL_PIXEL_UNPACK_BUFFER, 0, (ptrdiff_t)size, access);
+    if (!mapped)
+    {
+        GL_PROC(ext, glBindBuffer)(GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+    }
+
+    u64 offset = 0;
+    for (u32 i = 0; i < rect_count; ++i)
+    {
+        FrameRect *rect = &rects[i];
+        FrameView src = frame_view_sub(*view, *rect);
+        FrameView dst = frame_view(mapped + offset, rect->width, rect->height, rect->width * 4, view->format);
+        frame_view_copy(&dst, &src, 0);
+        offset += (u64)rect->width * rect->height * 4;
+    }
+
+    // false: the contents were lost (e.g. a mode switch), nothing to update from
+    if (!GL_PROC(ext, glUnmapBuffer)(GL_PIXEL_UNPACK_BUFFER))
+    {
+        GL_PROC(ext, glBindBuffer)(GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+    }
+
+    offset = 0;
+    for (u32 i = 0; i < rect_count; ++i)
+    {
+        FrameRect *rect = &rects[i];
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        rect->x, rect->y, rect->width, rect->height,
+                        format, GL_UNSIGNED_BYTE,
+                        (void*)(size_t)offset);
+        offset += (u64)rect->width * rect->height * 4;
+    }
+    GL_PROC(ext, glBindBuffer)(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (gl->fenced)
+        buffer->fence = GL_PROC(ext, glFenceSync)(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    gl->streamed_uploads++;
+    return true;
+}
+
+function bool opengl_sink_upload(FrameSink *sink, Frame *frame)
+{
+    OpenGLSink *gl = (OpenGLSink*)sink->user;
+    FrameView *view = &frame->view;
+
+    if (!gl->initialized)
+        opengl_sink_init(gl);
+
+    GLenum format = view->format == PIXEL_FORMAT_BGRA8 ? GL_BGRA_EXT : GL_RGBA;
+
+    glBindTexture(GL_TEXTURE_2D, gl->texture_handle);
+    gl->flip_vertical = frame->flip_vertical;
+
+    // only the dirty tiles when the texture already holds the previous frame
+    FrameRect whole = { 0, 0, view->width, view->height };
+    FrameRect *rects = &whole;
+    u32 rect_count = 1;
+    if (gl->texture_width != view->width || gl->texture_height != view->height ||
+        gl->texture_internal_format != gl->internal_format)
+    {
+        opengl_sink_allocate_texture(gl, view->width, view->height);
+    }
+    else if (frame->dirty_rects)
+    {
+        rects = frame->dirty_rects;
+        rect_count = frame->dirty_count;
+    }
+
+    if (rect_count == 0)
+        return true;
+    if (!gl->streaming || !opengl_sink_upload_streaming(gl, view, rects, rect_count, format))
+        opengl_sink_upload_client(gl, view, rects, rect_count, format);
+    return true;
+}
+
+function void opengl_sink_present(FrameSink *sink)
+{
+    OpenGLSink *gl = (OpenGLSink*)sink->user;
+    if (!gl->initialized)
+        return;
+
+    //glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+    //glClear(GL_COLOR_BUFFER_BIT);
+
+    {
+        PROFILE_SCOPE(PROFILE_DRAW);
+        glBindTexture(GL_TEXTURE_2D, gl->texture_handle);
+        if (gl->quad_buffer)
+        {
+            GL_PROC(gl->extensions, glBindBuffer)(GL_ARRAY_BUFFER, gl->quad_buffer);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), (void*)0);
+            glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+            glDrawArrays(GL_TRIANGLES, gl->flip_vertical ? 6 : 0, 6);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+            GL_PROC(gl->extensions, glBindBuffer)(GL_ARRAY_BUFFER, 0);
+        }
+        else
+        {
+            opengl_draw_triangle(gl->flip_vertical);
+        }
+    }
+
+    if (gl->swap)
+    {
+        PROFILE_SCOPE(PROFILE_SWAP);
+        gl->swap(gl->swap_user);
+    }
+}
+
+// the context must still be current
+function void opengl_sink_destroy(OpenGLSink *gl)
+{
+    if (!gl->initialized)
+        return;
+    GlExtensions *ext = gl->extensions;
+    for (u32 i = 0; i < OPENGL_SINK_UNPACK_COUNT; ++i)
+    {
+        OpenGLUnpackBuffer *buffer = &gl->unpack[i];
+        if (buffer->fence)
+            GL_PROC(ext, glDeleteSync)(buffer->fence);
+        if (buffer->handle)
+            GL_PROC(ext, glDeleteBuffers)(1, &buffer->handle);
+    }
+    if (gl->quad_buffer)
+        GL_PROC(ext, glDeleteBuffers)(1, &gl->quad_buffer);
+    glDeleteTextures(1, &gl->texture_handle);
+
+    OpenGLSink cleared = {};
+    cleared.extensions = gl->extensions;
+    cleared.internal_format = gl->internal_format;
+    cleared.disable_streaming = gl->disable_streaming;
+    cleared.swap = gl->swap;
+    cleared.swap_user = gl->swap_user;
+    *gl = cleared;
+}
+
+function FrameSink opengl_sink(OpenGLSink *gl)
+{
+    FrameSink sink = {};
+    sink.name = "opengl";
+    sink.user = gl;
+    sink.upload = opengl_sink_upload;
+    sink.present = opengl_sink_present;
+    return sink;
+}
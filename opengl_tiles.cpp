@@ -0,0 +1,351 @@
+/*
+
+  OpenGL tile sink
+  ----------------
+  The large image viewer: frames go into a tile pyramid (tile_pyramid.cpp)
+  instead of one texture, so neither the maximum texture size nor video
+  memory limit the image size. Every present draws the tiles of the level
+  that matches the zoom which are inside the window; tiles that are not
+  in the cache are uploaded into one of cache_tiles textures of
+  TILE_TEXELS square, at most upload_budget of them per present so panning
+  across a 16K image never stalls a frame. Until a tile is there its
+  nearest cached ancestor is drawn in its place, the top level is always
+  kept, and pending asks the owner to present again.
+
+  Drawing is in window pixels through TileView (zoom, center and the
+  window size), which the owner changes for zoom and pan and sets to the
+  window size; zoom 0 fits the image on the next present.
+
+  Shares the includer's setup with opengl_sink.cpp: a current context and
+  the extension registry. The pipeline must not downscale frames for it.
+
+ */
+
+#define OPENGL_TILES_DEFAULT_CACHE 192 // tiles of ~1 MB each
+#define OPENGL_TILES_MAX_FALLBACKS 64
+
+struct OpenGLTileSink {
+    GlExtensions *extensions;
+    u32 internal_format; // like OpenGLSink
+    void (*swap)(void *user);
+    void *swap_user;
+    WorkQueue *queue;    // pyramid builds, may be 0
+    u32 cache_tiles;     // texture slots, 0 = OPENGL_TILES_DEFAULT_CACHE
+    u32 upload_budget;   // tiles uploaded per present, 0 = all that are missing
+    TileView view;
+
+    bool initialized;
+    bool texture_storage;
+    TilePyramid pyramid;
+    TileCache cache;
+    GLuint *textures; // per cache slot, 0 until the slot is first filled
+    u32 texture_format; // internal format of the textures
+    u8 *staging;        // one tile with its border
+
+    bool pending; // tiles were missing at the last present, present again
+    u32 level;    // drawn at the last present
+    u32 visible;  // tiles of it in the window
+    u64 uploads;
+    u64 fallbacks; // tiles drawn from a coarser level while missing
+};
+
+// false when out of memory, the sink stays uninitialized and draws nothing
+function bool opengl_tiles_init(OpenGLTileSink *tiles)
+{
+    u32 capacity = tiles->cache_tiles ? tiles->cache_tiles : OPENGL_TILES_DEFAULT_CACHE;
+    tile_cache_init(&tiles->cache, capacity);
+    tiles->textures = (GLuint*)calloc(capacity, sizeof(GLuint));
+    tiles->staging = (u8*)malloc((u64)TILE_TEXELS * TILE_TEXELS * 4);
+    if (!tiles->cache.slots || !tiles->textures || !tiles->staging)
+    {
+        printf("Error: out of memory for a %u tile cache.\n", capacity);
+        tile_cache_destroy(&tiles->cache);
+        free(tiles->textures);
+        free(tiles->staging);
+        tiles->textures = 0;
+        tiles->staging = 0;
+        return false;
+    }
+
+    tiles->initialized = true;
+    tiles->texture_storage = gl_extension_available(tiles->extensions, GL_EXTENSION_ARB_texture_storage, 42) &&
+        GL_PROC(tiles->extensions, glTexStorage2D);
+    tiles->texture_format = tiles->internal_format;
+
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_TEXTURE_2D);
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    return true;
+}
+
+function void opengl_tiles_delete_textures(OpenGLTileSink *tiles)
+{
+    for (u32 i = 0; i < tiles->cache.capacity; ++i)
+    {
+        if (tiles->textures[i])
+            glDeleteTextures(1, &tiles->textures[i]);
+        tiles->textures[i] = 0;
+    }
+    tile_cache_clear(&tiles->cache);
+}
+
+function bool opengl_tiles_upload(FrameSink *sink, Frame *frame)
+{
+    OpenGLTileSink *tiles = (OpenGLTileSink*)sink->user;
+    if (!tiles->initialized && !opengl_tiles_init(tiles))
+        return false;
+
+    FrameView *image = &tiles->pyramid.levels[0];
+    bool resized = !tiles->pyramid.level_count || image->width != frame->view.width || image->height != frame->view.height;
+    if (!tile_pyramid_update(&tiles->pyramid, &frame->view, frame->flip_vertical,
+                             frame->dirty_rects, frame->dirty_count, tiles->queue))
+        return false;
+
+    // stale tiles are told apart by their versions, only a new size starts over
+    if (resized)
+    {
+        tile_cache_clear(&tiles->cache);
+        tiles->view.zoom = 0;
+    }
+    if (tiles->texture_format != tiles->internal_format)
+    {
+        opengl_tiles_delete_textures(tiles);
+        tiles->texture_format = tiles->internal_format;
+    }
+    return true;
+}
+
+// a tile with its border into the texture of slot
+function void opengl_tiles_fill(OpenGLTileSink *tiles, s32 slot, u32 level, u32 x, u32 y, u32 version)
+{
+    TilePyramid *pyramid = &tiles->pyramid;
+    GLuint *texture = &tiles->textures[slot];
+    if (!*texture)
+    {
+        glGenTextures(1, texture);
+        glBindTexture(GL_TEXTURE_2D, *texture);
+        if (tiles->texture_storage)
+            GL_PROC(tiles->extensions, glTexStorage2D)(GL_TEXTURE_2D, 1, tiles->texture_format, TILE_TEXELS, TILE_TEXELS);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, tiles->texture_format, TILE_TEXELS, TILE_TEXELS, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    }
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D, *texture);
+    }
+
+    FrameView staging = frame_view(tiles->staging, TILE_TEXELS, TILE_TEXELS, TILE_TEXELS * 4, pyramid->levels[level].format);
+    FrameRect rect = tile_pyramid_read(pyramid, level, x, y, &staging);
+    GLenum format = staging.format == PIXEL_FORMAT_BGRA8 ? GL_BGRA_EXT : GL_RGBA;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, TILE_TEXELS);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, rect.width + 2 * TILE_BORDER, rect.height + 2 * TILE_BORDER,
+                    format, GL_UNSIGNED_BYTE, tiles->staging);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    tile_cache_fill(&tiles->cache, slot, version);
+    tiles->uploads++;
+}
+
+// the slot of a tile this frame, uploaded if the budget allows; -1 if it is not there
+function s32 opengl_tiles_need(OpenGLTileSink *tiles, u32 level, u32 x, u32 y, u32 *budget)
+{
+    u64 key = tile_key(level, x, y);
+    u32 version = *tile_version(&tiles->pyramid, level, x, y);
+    s32 slot = tile_cache_lookup(&tiles->cache, key, version);
+    if (slot >= 0 || !*budget)
+        return slot;
+
+    slot = tile_cache_claim(&tiles->cache, key);
+    if (slot < 0)
+        return -1;
+    opengl_tiles_fill(tiles, slot, level, x, y, version);
+    --*budget;
+    return slot;
+}
+
+// a tile's texture over its place in the window
+function void opengl_tiles_draw(OpenGLTileSink *tiles, s32 slot, u32 level, u32 x, u32 y)
+{
+    TileView *view = &tiles->view;
+    FrameRect rect = tile_rect(&tiles->pyramid, level, x, y);
+    float place[4];
+    tile_view_place(view, &tiles->pyramid, level, rect, place);
+
+    // window pixels to clip space, the window's top row is at +1
+    float x0 = place[0] * 2.0f / view->width - 1.0f, x1 = place[2] * 2.0f / view->width - 1.0f;
+    float y0 = 1.0f - place[1] * 2.0f / view->height, y1 = 1.0f - place[3] * 2.0f / view->height;
+    float u0 = (float)TILE_BORDER / TILE_TEXELS, u1 = (float)(TILE_BORDER + rect.width) / TILE_TEXELS;
+    float v0 = (float)TILE_BORDER / TILE_TEXELS, v1 = (float)(TILE_BORDER + rect.height) / TILE_TEXELS;
+    float quad[] = {
+        x0, y1, u0, v1,   x1, y1, u1, v1,   x1, y0, u1, v0,
+        x0, y1, u0, v1,   x1, y0, u1, v0,   x0, y0, u0, v0,
+    };
+
+    glBindTexture(GL_TEXTURE_2D, tiles->textures[slot]);
+    glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), quad);
+    glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), quad + 2);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+}
+
+function void opengl_tiles_present(FrameSink *sink)
+{
+    OpenGLTileSink *tiles = (OpenGLTileSink*)sink->user;
+    TilePyramid *pyramid = &tiles->pyramid;
+    TileView *view = &tiles->view;
+    if (!tiles->initialized)
+        return;
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (pyramid->level_count && view->width && view->height)
+    {
+        PROFILE_SCOPE(PROFILE_DRAW);
+        if (view->zoom <= 0)
+            tile_view_fit(view, pyramid);
+        tile_cache_begin_frame(&tiles->cache);
+
+        u32 budget = tiles->upload_budget ? tiles->upload_budget : 0xFFFFFFFF;
+        u32 top = pyramid->level_count - 1;
+        u32 level = tile_view_level(view, pyramid);
+        FrameRect visible = tile_view_visible(view, pyramid, level);
+        FrameRect visible_top = tile_view_visible(view, pyramid, top);
+        tiles->level = level;
+        tiles->visible = visible.width * visible.height;
+        tiles->pending = false;
+
+        // the slot of every visible tile of the level, -1 while it is missing
+        s32 *drawn = (s32*)malloc((u64)visible.width * visible.height * sizeof(s32) + 1);
+        if (!drawn)
+        {
+            printf("Error: out of memory for %u visible tiles, present skipped.\n", tiles->visible);
+            return;
+        }
+
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+        // the top level first, under everything and the last resort for missing tiles
+        if (level != top)
+        {
+            for (u32 y = visible_top.y; y < visible_top.y + visible_top.height; ++y)
+            {
+                for (u32 x = visible_top.x; x < visible_top.x + visible_top.width; ++x)
+                {
+                    s32 slot = opengl_tiles_need(tiles, top, x, y, &budget);
+                    if (slot >= 0)
+                        opengl_tiles_draw(tiles, slot, top, x, y);
+                    else
+                        tiles->pending = true;
+                }
+            }
+        }
+
+        // then the missing tiles' nearest cached ancestors in between, coarse to fine
+        u64 fallbacks[OPENGL_TILES_MAX_FALLBACKS];
+        s32 fallback_slots[OPENGL_TILES_MAX_FALLBACKS];
+        u32 fallback_count = 0;
+        for (u32 y = visible.y; y < visible.y + visible.height; ++y)
+        {
+            for (u32 x = visible.x; x < visible.x + visible.width; ++x)
+            {
+                u32 i = (y - visible.y) * visible.width + (x - visible.x);
+                s32 slot = opengl_tiles_need(tiles, level, x, y, &budget);
+                drawn[i] = slot;
+                if (slot >= 0)
+                    continue;
+
+                tiles->pending = true;
+                tiles->fallbacks++;
+                for (u32 up = level + 1; up < top; ++up)
+                {
+                    u32 ax = x >> (up - level), ay = y >> (up - level);
+                    u64 key = tile_key(up, ax, ay);
+                    bool known = false;
+                    for (u32 k = 0; k < fallback_count && !known; ++k)
+                        known = fallbacks[k] == key;
+                    if (known)
+                        break;
+                    s32 ancestor = tile_cache_lookup(&tiles->cache, key, *tile_version(pyramid, up, ax, ay));
+                    if (ancestor < 0 || fallback_count == OPENGL_TILES_MAX_FALLBACKS)
+                        continue;
+
+                    // insertion by level, coarser first
+                    u32 k = fallback_count++;
+                    for (; k > 0 && (fallbacks[k - 1] >> 48) < (key >> 48); --k)
+                    {
+                        fallbacks[k] = fallbacks[k - 1];
+                        fallback_slots[k] = fallback_slots[k - 1];
+                    }
+                    fallbacks[k] = key;
+                    fallback_slots[k] = ancestor;
+                    break;
+                }
+            }
+        }
+        for (u32 k = 0; k < fallback_count; ++k)
+        {
+            u64 key = fallbacks[k];
+            opengl_tiles_draw(tiles, fallback_slots[k], (u32)(key >> 48) - 1, (u32)(key & 0xFFFFFF), (u32)((key >> 24) & 0xFFFFFF));
+        }
+        for (u32 y = visible.y; y < visible.y + visible.height; ++y)
+        {
+            for (u32 x = visible.x; x < visible.x + visible.width; ++x)
+            {
+                s32 slot = drawn[(y - visible.y) * visible.width + (x - visible.x)];
+                if (slot >= 0)
+                    opengl_tiles_draw(tiles, slot, level, x, y);
+            }
+        }
+        free(drawn);
+
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+
+    if (tiles->swap)
+    {
+        PROFILE_SCOPE(PROFILE_SWAP);
+        tiles->swap(tiles->swap_user);
+    }
+}
+
+// the context must still be current
+function void opengl_tiles_destroy(OpenGLTileSink *tiles)
+{
+    if (tiles->initialized)
+        opengl_tiles_delete_textures(tiles);
+    tile_cache_destroy(&tiles->cache);
+    tile_pyramid_destroy(&tiles->pyramid);
+    free(tiles->textures);
+    free(tiles->staging);
+
+    OpenGLTileSink cleared = {};
+    cleared.extensions = tiles->extensions;
+    cleared.internal_format = tiles->internal_format;
+    cleared.swap = tiles->swap;
+    cleared.swap_user = tiles->swap_user;
+    cleared.queue = tiles->queue;
+    cleared.cache_tiles = tiles->cache_tiles;
+    cleared.upload_budget = tiles->upload_budget;
+    *tiles = cleared;
+}
+
+function FrameSink opengl_tile_sink(OpenGLTileSink *tiles)
+{
+    FrameSink sink = {};
+    sink.name = "opengl_tiles";
+    sink.user = tiles;
+    sink.upload = opengl_tiles_upload;
+    sink.present = opengl_tiles_present;
+    return sink;
+}
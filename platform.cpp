@@ -0,0 +1,590 @@
+// NOTE: the small part of the OS layer that the platform-neutral code
+// (frame pipeline, headless driver) needs. Everything window/GL specific
+// stays in main.cpp.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+struct PerfCounter {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, start_time, end_time;
+#else
+    timespec start_time, end_time;
+#endif
+
+    void begin()
+    {
+#ifdef _WIN32
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start_time);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+#endif
+    }
+
+    // return elapsed time in seconds
+    double end()
+    {
+#ifdef _WIN32
+        QueryPerformanceCounter(&end_time);
+
+        return (double)(end_time.QuadPart - start_time.QuadPart) / frequency.QuadPart;
+#else
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        return (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+#endif
+    }
+};
+
+// monotonic clock in nanoseconds, for timestamps that are stored and compared
+function u64 platform_time_ns()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    u64 ticks = counter.QuadPart, hz = frequency.QuadPart;
+    return (ticks / hz) * 1000000000ull + (ticks % hz) * 1000000000ull / hz;
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+function u32 platform_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info = {};
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (u32)count : 1;
+#endif
+}
+
+function u32 platform_process_id()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return (u32)getpid();
+#endif
+}
+
+function void platform_sleep_ms(u32 ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+// CPU time of the whole process (every thread, user + kernel) in nanoseconds
+function u64 platform_process_cpu_ns()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    u64 k = ((u64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    u64 u = ((u64)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) * 100;
+#else
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (u64)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+// without a high resolution timer the wait ends up to a scheduler tick
+// late, wake this much early and spin the rest
+#define PLATFORM_TIMER_SPIN_NS 2000000
+#endif
+
+// Sleeps to an absolute deadline. Sleep(ms) rounds up to the scheduler
+// tick (15.6 ms on Windows unless someone raised the timer resolution),
+// which is a whole frame at 60 fps.
+struct PlatformTimer {
+#ifdef _WIN32
+    HANDLE handle;
+    bool high_resolution; // Windows 10 1803+
+#else
+    bool unused;
+#endif
+};
+
+function void platform_timer_init(PlatformTimer *timer)
+{
+#ifdef _WIN32
+    timer->handle = CreateWaitableTimerExW(0, 0, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    timer->high_resolution = timer->handle != 0;
+    if (!timer->handle)
+        timer->handle = CreateWaitableTimerW(0, FALSE, 0);
+#else
+    timer->unused = false;
+#endif
+}
+
+function void platform_timer_destroy(PlatformTimer *timer)
+{
+#ifdef _WIN32
+    if (timer->handle)
+        CloseHandle(timer->handle);
+    timer->handle = 0;
+#else
+    timer->unused = false;
+#endif
+}
+
+// deadline in platform_time_ns, returns right away if it has passed
+function void platform_sleep_until(PlatformTimer *timer, u64 deadline)
+{
+#ifdef _WIN32
+    u64 now = platform_time_ns();
+    if (now >= deadline)
+        return;
+    u64 spin = timer->high_resolution ? 0 : PLATFORM_TIMER_SPIN_NS;
+    if (timer->handle && deadline - now > spin)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)((deadline - now - spin) / 100); // relative, 100 ns units
+        if (SetWaitableTimer(timer->handle, &due, 0, 0, 0, FALSE))
+            WaitForSingleObject(timer->handle, INFINITE);
+    }
+    while (platform_time_ns() < deadline)
+        SwitchToThread();
+#else
+    timespec at;
+    at.tv_sec = (time_t)(deadline / 1000000000ull);
+    at.tv_nsec = (long)(deadline % 1000000000ull);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, 0) == EINTR) {}
+#endif
+}
+
+// Auto-reset event: a wait returns after a signal and consumes it. On
+// Windows the handle can be waited for together with window messages
+// (MsgWaitForMultipleObjects).
+struct PlatformEvent {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool signaled;
+#endif
+    bool initialized;
+};
+
+function void platform_event_init(PlatformEvent *event)
+{
+#ifdef _WIN32
+    event->handle = CreateEventW(0, FALSE, FALSE, 0);
+#else
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&event->mutex, 0);
+    pthread_cond_init(&event->cond, &attributes);
+    pthread_condattr_destroy(&attributes);
+    event->signaled = false;
+#endif
+    event->initialized = true;
+}
+
+function void platform_event_destroy(PlatformEvent *event)
+{
+    if (!event->initialized)
+        return;
+#ifdef _WIN32
+    CloseHandle(event->handle);
+#else
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+#endif
+    event->initialized = false;
+}
+
+function void platform_event_signal(PlatformEvent *event)
+{
+#ifdef _WIN32
+    SetEvent(event->handle);
+#else
+    pthread_mutex_lock(&event->mutex);
+    event->signaled = true;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+#endif
+}
+
+// false on timeout
+function bool platform_event_wait(PlatformEvent *event, u32 timeout_ms)
+{
+#ifdef _WIN32
+    return WaitForSingleObject(event->handle, timeout_ms) == WAIT_OBJECT_0;
+#else
+    u64 deadline = platform_time_ns() + (u64)timeout_ms * 1000000ull;
+    timespec at;
+    at.tv_sec = (time_t)(deadline / 1000000000ull);
+    at.tv_nsec = (long)(deadline % 1000000000ull);
+
+    pthread_mutex_lock(&event->mutex);
+    while (!event->signaled)
+    {
+        if (pthread_cond_timedwait(&event->cond, &event->mutex, &at) == ETIMEDOUT)
+            break;
+    }
+    bool signaled = event->signaled;
+    event->signaled = false;
+    pthread_mutex_unlock(&event->mutex);
+    return signaled;
+#endif
+}
+
+typedef void PlatformThreadProc(void *data);
+
+struct PlatformThread {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    PlatformThreadProc *proc;
+    void *data;
+    bool started;
+};
+
+#ifdef _WIN32
+function DWORD WINAPI platform_thread_entry(LPVOID param)
+#else
+function void *platform_thread_entry(void *param)
+#endif
+{
+    PlatformThread *thread = (PlatformThread*)param;
+    thread->proc(thread->data);
+    return 0;
+}
+
+// thread must stay valid until platform_thread_join
+function bool platform_thread_start(PlatformThread *thread, PlatformThreadProc *proc, void *data)
+{
+    thread->proc = proc;
+    thread->data = data;
+#ifdef _WIN32
+    thread->handle = CreateThread(0, 0, platform_thread_entry, thread, 0, 0);
+    thread->started = thread->handle != 0;
+#else
+    thread->started = pthread_create(&thread->handle, 0, platform_thread_entry, thread) == 0;
+#endif
+    return thread->started;
+}
+
+function void platform_thread_join(PlatformThread *thread)
+{
+    if (!thread->started)
+        return;
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, 0);
+#endif
+    thread->started = false;
+}
+
+#define PLATFORM_PAGE_SIZE 4096
+#define PLATFORM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Page aligned, zeroed memory straight from the OS. With huge_pages the
+// size is rounded to 2MB and large pages are requested, falling back to
+// normal pages when the OS refuses (no privilege / no hugetlb pool).
+// *allocated_size receives what has to be passed to platform_free_pages.
+function void *platform_alloc_pages(u64 size, bool huge_pages, u64 *allocated_size)
+{
+    void *result = 0;
+    u64 page_size = huge_pages ? PLATFORM_HUGE_PAGE_SIZE : PLATFORM_PAGE_SIZE;
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+#ifdef _WIN32
+    if (huge_pages)
+    {
+        SIZE_T large_page = GetLargePageMinimum();
+        if (large_page)
+        {
+            u64 large_size = (size + large_page - 1) & ~((u64)large_page - 1);
+            result = VirtualAlloc(0, large_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (result)
+                size = large_size;
+        }
+    }
+    if (!result)
+        result = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    if (huge_pages)
+    {
+        result = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (result == MAP_FAILED)
+            result = 0;
+    }
+    if (!result)
+    {
+        result = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (result == MAP_FAILED)
+            result = 0;
+#ifdef MADV_HUGEPAGE
+        // transparent huge pages as the fallback
+        else if (huge_pages)
+            madvise(result, size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+
+    *allocated_size = result ? size : 0;
+    return result;
+}
+
+function void platform_free_pages(void *memory, u64 allocated_size)
+{
+    if (!memory)
+        return;
+#ifdef _WIN32
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, allocated_size);
+#endif
+}
+
+// a whole file mapped read-only
+struct PlatformFileMapping {
+    u8 *data;
+    u64 size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+function bool platform_map_file(PlatformFileMapping *mapping, const char *path)
+{
+    memset(mapping, 0, sizeof(PlatformFileMapping));
+#ifdef _WIN32
+    mapping->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (mapping->file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapping->file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(mapping->file);
+        return false;
+    }
+    mapping->size = size.QuadPart;
+
+    mapping->mapping = CreateFileMappingA(mapping->file, 0, PAGE_READONLY, 0, 0, 0);
+    if (mapping->mapping)
+        mapping->data = (u8*)MapViewOfFile(mapping->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapping->data)
+    {
+        if (mapping->mapping)
+            CloseHandle(mapping->mapping);
+        CloseHandle(mapping->file);
+        return false;
+    }
+#else
+    mapping->fd = open(path, O_RDONLY);
+    if (mapping->fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(mapping->fd, &info) != 0 || info.st_size == 0)
+    {
+        close(mapping->fd);
+        return false;
+    }
+    mapping->size = info.st_size;
+
+    void *data = mmap(0, mapping->size, PROT_READ, MAP_SHARED, mapping->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(mapping->fd);
+        return false;
+    }
+    mapping->data = (u8*)data;
+#endif
+    return true;
+}
+
+function void platform_unmap_file(PlatformFileMapping *mapping)
+{
+    if (!mapping->data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(mapping->data);
+    CloseHandle(mapping->mapping);
+    CloseHandle(mapping->file);
+#else
+    munmap(mapping->data, mapping->size);
+    close(mapping->fd);
+#endif
+    mapping->data = 0;
+    mapping->size = 0;
+}
+
+// named memory other processes map by the same name: POSIX shm on Linux,
+// a pagefile backed file mapping on Windows
+struct PlatformSharedMemory {
+    u8 *data;
+    u64 size;
+    bool owner; // created it, the name goes away on close
+    char name[64];
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+function void platform_shared_memory_name(PlatformSharedMemory *shm, const char *name)
+{
+#ifdef _WIN32
+    snprintf(shm->name, sizeof(shm->name), "Local\\%s", name);
+#else
+    snprintf(shm->name, sizeof(shm->name), "/%s", name);
+#endif
+}
+
+// new zeroed memory of size bytes, false if the name exists (it may be in
+// use, platform_shared_memory_remove it once it is known to be stale)
+function bool platform_shared_memory_create(PlatformSharedMemory *shm, const char *name, u64 size)
+{
+    memset(shm, 0, sizeof(PlatformSharedMemory));
+    platform_shared_memory_name(shm, name);
+#ifdef _WIN32
+    shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, shm->name);
+    if (!shm->mapping)
+        return false;
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        // still open in another process, two owners would fight over it
+        CloseHandle(shm->mapping);
+        return false;
+    }
+    shm->data = (u8*)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!shm->data)
+    {
+        CloseHandle(shm->mapping);
+        return false;
+    }
+#else
+    shm->fd = shm_open(shm->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shm->fd < 0)
+        return false;
+
+    void *data = MAP_FAILED;
+    if (ftruncate(shm->fd, size) == 0)
+        data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(shm->fd);
+        shm_unlink(shm->name);
+        return false;
+    }
+    shm->data = (u8*)data;
+#endif
+    shm->size = size;
+    shm->owner = true;
+    return true;
+}
+
+// map memory another process created, read-write
+function bool platform_shared_memory_open(PlatformSharedMemory *shm, const char *name)
+{
+    memset(shm, 0, sizeof(PlatformSharedMemory));
+    platform_shared_memory_name(shm, name);
+#ifdef _WIN32
+    shm->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, shm->name);
+    if (!shm->mapping)
+        return false;
+    shm->data = (u8*)MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info;
+    if (!shm->data || !VirtualQuery(shm->data, &info, sizeof(info)))
+    {
+        if (shm->data)
+            UnmapViewOfFile(shm->data);
+        CloseHandle(shm->mapping);
+        shm->data = 0;
+        return false;
+    }
+    shm->size = info.RegionSize;
+#else
+    shm->fd = shm_open(shm->name, O_RDWR, 0);
+    if (shm->fd < 0)
+        return false;
+
+    struct stat info;
+    void *data = MAP_FAILED;
+    if (fstat(shm->fd, &info) == 0 && info.st_size > 0)
+        data = mmap(0, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(shm->fd);
+        return false;
+    }
+    shm->data = (u8*)data;
+    shm->size = info.st_size;
+#endif
+    return true;
+}
+
+// drop the name of memory whose owner is gone, processes that have it
+// mapped keep their view; on Windows the name lives as long as a handle
+// to it does, nothing to do
+function void platform_shared_memory_remove(const char *name)
+{
+#ifndef _WIN32
+    PlatformSharedMemory shm;
+    platform_shared_memory_name(&shm, name);
+    shm_unlink(shm.name);
+#endif
+}
+
+// processes that still have it mapped keep their view
+function void platform_shared_memory_close(PlatformSharedMemory *shm)
+{
+    if (!shm->data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(shm->data);
+    CloseHandle(shm->mapping);
+#else
+    munmap(shm->data, shm->size);
+    close(shm->fd);
+    if (shm->owner)
+        shm_unlink(shm->name);
+#endif
+    shm->data = 0;
+    shm->size = 0;
+}
@@ -0,0 +1,461 @@
+/*
+
+  Profiler
+  --------
+  Named zones around the stages of a frame (acquire, convert, diff, upload,
+  present and, inside present, draw and swap), recorded by whatever thread
+  runs them:
+
+      u64 begin = profile_begin(PROFILE_UPLOAD);
+      ...
+      double seconds = profile_end(PROFILE_UPLOAD, begin);
+
+  or PROFILE_SCOPE(PROFILE_UPLOAD) for a whole block. profile_end always
+  returns the duration (the pipeline's FrameTimings come from it); it only
+  records when global_profiler.enabled is set.
+
+  Every thread writes to its own ProfileThread, so recording never takes a
+  lock or touches a shared cache line:
+
+    - a ring of the last PROFILE_RING_SIZE zones (begin, end, nesting
+      depth), exported as Chrome Trace Event JSON (chrome://tracing,
+      ui.perfetto.dev) where nested zones show up as a call tree
+    - a log-linear latency histogram per stage (16 buckets per power of
+      two, so about 6% resolution) for p50/p95/p99 without keeping samples
+
+  A thread's buffers are allocated on its first recorded zone and kept
+  until exit, so a trace still shows threads that have finished.
+
+  Readers (report, export) walk the threads while they keep recording.
+  Histogram counters are single-writer atomics; ring events that were
+  overwritten while being copied are detected with the write index and
+  skipped.
+
+ */
+#include <atomic>
+#include <mutex>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define PROFILE_RING_SIZE     16384 // events per thread, power of two
+#define PROFILE_MAX_THREADS   64
+#define PROFILE_SUB_BUCKETS   16
+#define PROFILE_BUCKET_COUNT  ((40 - 3) * PROFILE_SUB_BUCKETS) // up to 2^40 ns, about 18 minutes
+
+enum ProfileStage {
+    PROFILE_FRAME,   // one frame_pipeline_step
+    PROFILE_ACQUIRE,
+    PROFILE_SCALE,
+    PROFILE_CONVERT,
+    PROFILE_DIFF,
+    PROFILE_UPLOAD,
+    PROFILE_PRESENT,
+    PROFILE_DRAW,    // inside present
+    PROFILE_SWAP,    // inside present
+    PROFILE_ENCODE,  // compressing a recorded frame
+    PROFILE_WORK,    // a parallel_for chunk, on any thread
+    PROFILE_PACE,    // sleeping to the next capture deadline (frame_pacing.cpp)
+    PROFILE_STATS,   // histograms + fingerprint of a new frame (frame_stats.cpp)
+
+    PROFILE_STAGE_COUNT, // count value
+};
+
+static const char *profile_stage_names[PROFILE_STAGE_COUNT] = {
+    "frame",
+    "acquire",
+    "scale",
+    "convert",
+    "diff",
+    "upload",
+    "present",
+    "draw",
+    "swap",
+    "encode",
+    "work",
+    "pace",
+    "stats",
+};
+
+struct ProfileEvent {
+    u64 begin; // ns, platform_time_ns
+    u64 end;
+    u16 stage;
+    u16 depth; // zones open on the thread when this one began
+};
+
+struct ProfileHistogram {
+    std::atomic<u32> buckets[PROFILE_BUCKET_COUNT];
+    std::atomic<u64> count;
+    std::atomic<u64> sum_ns;
+    std::atomic<u64> max_ns;
+};
+
+struct ProfileThread {
+    char name[32];
+    u32 id;
+    u32 depth;
+    bool exited; // the thread is gone, the next new thread takes its slot (under the mutex)
+
+    std::atomic<u64> write_index;
+    ProfileEvent events[PROFILE_RING_SIZE];
+
+    ProfileHistogram histograms[PROFILE_STAGE_COUNT];
+};
+
+struct Profiler {
+    std::atomic<bool> enabled;
+
+    std::mutex mutex; // registration
+    ProfileThread *threads[PROFILE_MAX_THREADS];
+    std::atomic<u32> thread_count;
+    bool full_reported;
+};
+
+struct ProfileStats {
+    u64 count;
+    double mean; // seconds
+    double p50;
+    double p95;
+    double p99;
+    double max;
+};
+
+static Profiler global_profiler;
+static thread_local ProfileThread *profile_current_thread;
+static thread_local const char *profile_current_thread_name;
+
+// gives the slot back when its thread exits, capture threads and compositor
+// layers come and go with every source switch
+struct ProfileThreadExit {
+    ProfileThread *thread;
+    ~ProfileThreadExit()
+    {
+        if (!thread)
+            return;
+        std::lock_guard<std::mutex> lock(global_profiler.mutex);
+        thread->exited = true;
+    }
+};
+static thread_local ProfileThreadExit profile_thread_exit;
+
+// Name the calling thread in reports and traces (name must outlive the
+// thread, a literal). Costs nothing until the thread records a zone.
+function void profile_thread_name(const char *name)
+{
+    profile_current_thread_name = name;
+    if (profile_current_thread)
+        snprintf(profile_current_thread->name, sizeof(profile_current_thread->name), "%s", name);
+}
+
+// the calling thread's buffers, allocated on its first recorded zone
+function ProfileThread *profile_thread()
+{
+    ProfileThread *thread = profile_current_thread;
+    if (thread)
+        return thread;
+
+    std::lock_guard<std::mutex> lock(global_profiler.mutex);
+    u32 count = global_profiler.thread_count.load(std::memory_order_relaxed);
+
+    // the slot of an exited thread, one of the same name first; its zones
+    // and histograms stay, a restarted thread carries on where it left off
+    const char *name = profile_current_thread_name;
+    for (u32 i = 0; i < count; ++i)
+    {
+        ProfileThread *slot = global_profiler.threads[i];
+        if (slot->exited && (!thread || (name && strcmp(slot->name, name) == 0)))
+            thread = slot;
+    }
+    if (thread)
+    {
+        thread->exited = false;
+        thread->depth = 0;
+    }
+    else
+    {
+        if (count >= PROFILE_MAX_THREADS)
+        {
+            if (!global_profiler.full_reported)
+                printf("Error: more than %u threads at once, the new ones are not profiled.\n", PROFILE_MAX_THREADS);
+            global_profiler.full_reported = true;
+            return 0;
+        }
+
+        // calloc: the atomics start at zero like static storage would
+        thread = (ProfileThread*)calloc(1, sizeof(ProfileThread));
+        if (!thread)
+            return 0;
+        thread->id = count + 1;
+        global_profiler.threads[count] = thread;
+        global_profiler.thread_count.store(count + 1, std::memory_order_release);
+    }
+    if (name)
+        snprintf(thread->name, sizeof(thread->name), "%s", name);
+    else
+        snprintf(thread->name, sizeof(thread->name), "thread %u", thread->id);
+
+    profile_thread_exit.thread = thread;
+    profile_current_thread = thread;
+    return thread;
+}
+
+function void profiler_enable(bool enabled)
+{
+    global_profiler.enabled.store(enabled, std::memory_order_relaxed);
+}
+
+function u32 profile_msb(u64 value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (u32)index;
+#else
+    return 63 - (u32)__builtin_clzll(value);
+#endif
+}
+
+function u32 profile_bucket(u64 ns)
+{
+    if (ns < PROFILE_SUB_BUCKETS)
+        return (u32)ns;
+
+    u32 msb = profile_msb(ns);
+    u32 bucket = (msb - 3) * PROFILE_SUB_BUCKETS + (u32)((ns >> (msb - 4)) & (PROFILE_SUB_BUCKETS - 1));
+    return bucket < PROFILE_BUCKET_COUNT ? bucket : PROFILE_BUCKET_COUNT - 1;
+}
+
+// middle of the range of durations that land in bucket, in ns
+function double profile_bucket_value(u32 bucket)
+{
+    if (bucket < PROFILE_SUB_BUCKETS)
+        return (double)bucket;
+
+    u32 msb = bucket / PROFILE_SUB_BUCKETS + 3;
+    u64 width = (u64)1 << (msb - 4);
+    u64 low = (PROFILE_SUB_BUCKETS + bucket % PROFILE_SUB_BUCKETS) * width;
+    return (double)low + (double)width * 0.5;
+}
+
+// only ever written by its own thread, a relaxed load + store is enough
+function void profile_add(std::atomic<u64> *value, u64 amount)
+{
+    value->store(value->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+function u64 profile_begin(ProfileStage stage)
+{
+    if (global_profiler.enabled.load(std::memory_order_relaxed))
+    {
+        ProfileThread *thread = profile_thread();
+        if (thread)
+            thread->depth++;
+    }
+    return platform_time_ns();
+}
+
+// returns the zone's duration in seconds, recorded or not
+function double profile_end(ProfileStage stage, u64 begin)
+{
+    u64 end = platform_time_ns();
+    u64 ns = end - begin;
+
+    ProfileThread *thread = profile_current_thread;
+    if (thread && global_profiler.enabled.load(std::memory_order_relaxed))
+    {
+        if (thread->depth)
+            thread->depth--;
+
+        u64 index = thread->write_index.load(std::memory_order_relaxed);
+        ProfileEvent *event = &thread->events[index & (PROFILE_RING_SIZE - 1)];
+        event->begin = begin;
+        event->end = end;
+        event->stage = (u16)stage;
+        event->depth = (u16)thread->depth;
+        thread->write_index.store(index + 1, std::memory_order_release);
+
+        ProfileHistogram *histogram = &thread->histograms[stage];
+        std::atomic<u32> *bucket = &histogram->buckets[profile_bucket(ns)];
+        bucket->store(bucket->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        profile_add(&histogram->count, 1);
+        profile_add(&histogram->sum_ns, ns);
+        if (ns > histogram->max_ns.load(std::memory_order_relaxed))
+            histogram->max_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    return (double)ns * 1e-9;
+}
+
+struct ProfileScope {
+    ProfileStage stage;
+    u64 begin;
+
+    ProfileScope(ProfileStage scope_stage) : stage(scope_stage), begin(profile_begin(scope_stage)) {}
+    ~ProfileScope() { profile_end(stage, begin); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+
+// latency distribution of stage over all threads since the last reset
+function ProfileStats profiler_stage_stats(ProfileStage stage)
+{
+    u64 buckets[PROFILE_BUCKET_COUNT] = {};
+
+    ProfileStats stats = {};
+    u64 sum_ns = 0, max_ns = 0;
+
+    u32 thread_count = global_profiler.thread_count.load(std::memory_order_acquire);
+    for (u32 t = 0; t < thread_count; ++t)
+    {
+        ProfileHistogram *histogram = &global_profiler.threads[t]->histograms[stage];
+        for (u32 i = 0; i < PROFILE_BUCKET_COUNT; ++i)
+            buckets[i] += histogram->buckets[i].load(std::memory_order_relaxed);
+        stats.count += histogram->count.load(std::memory_order_relaxed);
+        sum_ns += histogram->sum_ns.load(std::memory_order_relaxed);
+        u64 thread_max = histogram->max_ns.load(std::memory_order_relaxed);
+        if (thread_max > max_ns)
+            max_ns = thread_max;
+    }
+
+    if (!stats.count)
+        return stats;
+
+    // the buckets were read one by one while threads kept adding, rank
+    // against their own total rather than count
+    u64 total = 0;
+    for (u32 i = 0; i < PROFILE_BUCKET_COUNT; ++i)
+        total += buckets[i];
+
+    double percentiles[3] = { 0.50, 0.95, 0.99 };
+    double *results[3] = { &stats.p50, &stats.p95, &stats.p99 };
+    for (u32 p = 0; p < 3; ++p)
+    {
+        u64 rank = (u64)(percentiles[p] * (double)(total - 1)) + 1;
+        u64 seen = 0;
+        for (u32 i = 0; i < PROFILE_BUCKET_COUNT; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+            {
+                *results[p] = profile_bucket_value(i) * 1e-9;
+                break;
+            }
+        }
+    }
+
+    stats.mean = (double)sum_ns / (double)stats.count * 1e-9;
+    stats.max = (double)max_ns * 1e-9;
+    return stats;
+}
+
+// clears the histograms, traces keep their ring
+function void profiler_reset()
+{
+    u32 thread_count = global_profiler.thread_count.load(std::memory_order_acquire);
+    for (u32 t = 0; t < thread_count; ++t)
+    {
+        for (u32 s = 0; s < PROFILE_STAGE_COUNT; ++s)
+        {
+            ProfileHistogram *histogram = &global_profiler.threads[t]->histograms[s];
+            for (u32 i = 0; i < PROFILE_BUCKET_COUNT; ++i)
+                histogram->buckets[i].store(0, std::memory_order_relaxed);
+            histogram->count.store(0, std::memory_order_relaxed);
+            histogram->sum_ns.store(0, std::memory_order_relaxed);
+            histogram->max_ns.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+function void profiler_report(FILE *out)
+{
+    fprintf(out, "%-8s %8s %9s %9s %9s %9s %9s\n", "stage", "count", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (u32 s = 0; s < PROFILE_STAGE_COUNT; ++s)
+    {
+        ProfileStats stats = profiler_stage_stats((ProfileStage)s);
+        if (!stats.count)
+            continue;
+        fprintf(out, "%-8s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n", profile_stage_names[s], stats.count,
+                stats.mean * 1000.0, stats.p50 * 1000.0, stats.p95 * 1000.0, stats.p99 * 1000.0, stats.max * 1000.0);
+    }
+}
+
+// Write the zones still in the rings as Chrome Trace Event JSON. Returns
+// false if path cannot be written.
+function bool profiler_export_chrome_trace(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        printf("Error: failed to open %s for the trace.\n", path);
+        return false;
+    }
+
+    ProfileEvent *events = (ProfileEvent*)malloc(PROFILE_RING_SIZE * sizeof(ProfileEvent));
+    if (!events)
+    {
+        printf("Error: out of memory for the trace.\n");
+        fclose(f);
+        return false;
+    }
+    u32 thread_count = global_profiler.thread_count.load(std::memory_order_acquire);
+
+    // timestamps relative to the oldest event so they stay small
+    u64 epoch = ~(u64)0;
+    for (u32 t = 0; t < thread_count; ++t)
+    {
+        ProfileThread *thread = global_profiler.threads[t];
+        u64 end = thread->write_index.load(std::memory_order_acquire);
+        u64 begin = end > PROFILE_RING_SIZE ? end - PROFILE_RING_SIZE : 0;
+        // the oldest slot may be overwritten right now, start one later
+        if (end > begin + 1)
+        {
+            u64 first = thread->events[(begin + 1) & (PROFILE_RING_SIZE - 1)].begin;
+            if (first < epoch)
+                epoch = first;
+        }
+    }
+    if (epoch == ~(u64)0)
+        epoch = 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first_event = true;
+    for (u32 t = 0; t < thread_count; ++t)
+    {
+        ProfileThread *thread = global_profiler.threads[t];
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first_event ? "" : ",\n", thread->id, thread->name);
+        first_event = false;
+
+        u64 end = thread->write_index.load(std::memory_order_acquire);
+        u64 begin = end > PROFILE_RING_SIZE ? end - PROFILE_RING_SIZE : 0;
+        for (u64 i = begin; i < end; ++i)
+            events[i - begin] = thread->events[i & (PROFILE_RING_SIZE - 1)];
+
+        // anything the thread wrote meanwhile replaced the oldest copies, and
+        // the slot of index now (that of now - PROFILE_RING_SIZE) may be half written
+        u64 now = thread->write_index.load(std::memory_order_acquire);
+        u64 valid_from = now >= PROFILE_RING_SIZE ? now - PROFILE_RING_SIZE + 1 : 0;
+        if (valid_from < begin)
+            valid_from = begin;
+
+        for (u64 i = valid_from; i < end; ++i)
+        {
+            ProfileEvent *event = &events[i - begin];
+            if (event->begin < epoch || event->stage >= PROFILE_STAGE_COUNT)
+                continue;
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%u}}",
+                    profile_stage_names[event->stage], thread->id,
+                    (double)(event->begin - epoch) * 1e-3, (double)(event->end - event->begin) * 1e-3, event->depth);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    free(events);
+    bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
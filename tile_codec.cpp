@@ -0,0 +1,588 @@
+/*
+
+  Tile codec
+  ----------
+  Lossless compression of a stream of 4 byte per pixel frames for the
+  recording path. Frames are cut into TILE_CODEC_SIZE tiles; against the
+  previous frame an unchanged tile costs one bit, a changed tile is coded
+  with four pixel ops:
+
+      PREVIOUS n   n pixels as in the previous frame (delta frames only)
+      ABOVE n      n pixels as in the row above, inside the tile
+      RUN n        one pixel value repeated n times
+      LITERAL n    n raw pixels
+
+  An op is one byte (2 bits op, 6 bits length - 1) plus a varint when the
+  length is above 64. Desktop content (flat areas, repeated rows, a few
+  changed glyphs in a tile) mostly turns into a handful of PREVIOUS / ABOVE
+  / RUN ops.
+
+  Encoded frame:
+
+      TileCodecHeader
+      dirty bitmask, one bit per tile in row order (all set on keyframes)
+      u16 encoded size of every dirty tile
+      the dirty tiles' ops back to back
+
+  Tiles only refer to their own pixels and the previous frame, so both
+  sides run one tile per parallel_for index. The decoder decodes in place
+  over the previous frame, PREVIOUS ops and clean tiles cost nothing.
+  A keyframe (every keyframe_interval frames, first frame, size change)
+  decodes without any previous frame; frame_recording.cpp seeks by
+  decoding forward from the last keyframe.
+
+ */
+
+#define TILE_CODEC_SIZE    64
+#define TILE_CODEC_MAGIC   0x43444c54u // "TLDC"
+#define TILE_CODEC_VERSION 1
+#define TILE_CODEC_KEYFRAME 0x1
+
+// worst case for one tile: everything LITERAL, an op per 64 pixels
+#define TILE_CODEC_MAX_TILE_BYTES (TILE_CODEC_SIZE * TILE_CODEC_SIZE * 4 + TILE_CODEC_SIZE * TILE_CODEC_SIZE / 64 * 3 + 16)
+
+enum TileCodecOp {
+    TILE_OP_PREVIOUS,
+    TILE_OP_ABOVE,
+    TILE_OP_RUN,
+    TILE_OP_LITERAL,
+};
+
+struct TileCodecHeader {
+    u32 magic;
+    u16 version;
+    u16 flags; // TILE_CODEC_KEYFRAME
+    u32 width;
+    u32 height;
+    u32 tile_size;
+    u32 dirty_count;
+};
+
+function u32 tile_codec_tiles(u32 size)
+{
+    return (size + TILE_CODEC_SIZE - 1) / TILE_CODEC_SIZE;
+}
+
+//
+// NOTE: encoder
+//
+
+struct TileEncoder {
+    u32 width;
+    u32 height;
+    u32 tiles_x;
+    u32 tiles_y;
+
+    u32 keyframe_interval; // 0 = 60
+    u32 frames_since_keyframe;
+    bool has_previous;
+    u8 *previous; // tightly packed copy of the last encoded frame
+
+    u8 *scratch;       // TILE_CODEC_MAX_TILE_BYTES per tile
+    u16 *tile_sizes;   // encoded bytes per tile, 0 = clean
+    u64 tile_capacity;
+
+    u8 *output;        // the last encoded frame
+    u64 output_size;
+    u64 output_capacity;
+    bool keyframe;     // the last encoded frame is a keyframe
+
+    WorkQueue *queue;
+};
+
+function u8 *tile_codec_put_op(u8 *out, u32 op, u32 length)
+{
+    u32 n = length - 1;
+    if (n < 63)
+    {
+        *out++ = (u8)((op << 6) | n);
+        return out;
+    }
+
+    *out++ = (u8)((op << 6) | 63);
+    n -= 63;
+    while (n >= 0x80)
+    {
+        *out++ = (u8)(n | 0x80);
+        n >>= 7;
+    }
+    *out++ = (u8)n;
+    return out;
+}
+
+function u8 *tile_codec_flush_literal(u8 *out, u32 *pixels, u32 count)
+{
+    if (!count)
+        return out;
+    out = tile_codec_put_op(out, TILE_OP_LITERAL, count);
+    memcpy(out, pixels, count * 4);
+    return out + count * 4;
+}
+
+struct TileEncodeJob {
+    TileEncoder *encoder;
+    u8 *pixels;
+    u32 stride;
+};
+
+// the tile's pixels gathered row after row, so ops can run across rows
+struct TilePixels {
+    u32 current[TILE_CODEC_SIZE * TILE_CODEC_SIZE];
+    u32 previous[TILE_CODEC_SIZE * TILE_CODEC_SIZE];
+};
+
+// returns the encoded size, 0 when the tile equals the previous frame, and
+// leaves the tile in encoder->previous for the next frame
+function u32 tile_encode(TileEncoder *encoder, u8 *pixels, u32 stride, u32 tx, u32 ty, u8 *out, TilePixels *tile)
+{
+    u32 x0 = tx * TILE_CODEC_SIZE, y0 = ty * TILE_CODEC_SIZE;
+    u32 tile_w = encoder->width - x0 < TILE_CODEC_SIZE ? encoder->width - x0 : TILE_CODEC_SIZE;
+    u32 tile_h = encoder->height - y0 < TILE_CODEC_SIZE ? encoder->height - y0 : TILE_CODEC_SIZE;
+    u32 previous_stride = encoder->width * 4;
+    bool delta = encoder->has_previous && !encoder->keyframe;
+
+    // rows above the first difference stay in the previous frame as they are
+    u32 first_changed = 0;
+    if (delta)
+    {
+        while (first_changed < tile_h &&
+               tile_rows_equal(pixels + (u64)(y0 + first_changed) * stride + x0 * 4,
+                               encoder->previous + (u64)(y0 + first_changed) * previous_stride + x0 * 4, tile_w * 4))
+            ++first_changed;
+        if (first_changed == tile_h)
+            return 0;
+    }
+
+    for (u32 y = 0; y < tile_h; ++y)
+    {
+        u8 *row = pixels + (u64)(y0 + y) * stride + x0 * 4;
+        u8 *previous_row = encoder->previous + (u64)(y0 + y) * previous_stride + x0 * 4;
+        memcpy(tile->current + y * tile_w, row, tile_w * 4);
+        if (delta)
+            memcpy(tile->previous + y * tile_w, previous_row, tile_w * 4);
+        if (y >= first_changed)
+            memcpy(previous_row, row, tile_w * 4);
+    }
+
+    u32 *cur = tile->current;
+    u32 *prev = tile->previous;
+    u32 count = tile_w * tile_h;
+    u8 *start = out;
+    u32 literal_start = 0, literal_count = 0;
+
+    u32 i = 0;
+    while (i < count)
+    {
+        u32 op = TILE_OP_LITERAL, length = 1;
+
+        u32 prev_len = 0;
+        if (delta)
+            while (i + prev_len < count && cur[i + prev_len] == prev[i + prev_len])
+                ++prev_len;
+
+        if (prev_len)
+        {
+            op = TILE_OP_PREVIOUS;
+            length = prev_len;
+        }
+        else
+        {
+            u32 above_len = 0;
+            if (i >= tile_w)
+                while (i + above_len < count && cur[i + above_len] == cur[i + above_len - tile_w])
+                    ++above_len;
+
+            u32 run_len = 1;
+            while (i + run_len < count && cur[i + run_len] == cur[i])
+                ++run_len;
+
+            // ABOVE costs an op byte, RUN an op byte plus the pixel
+            if (above_len >= 2 && above_len >= run_len)
+            {
+                op = TILE_OP_ABOVE;
+                length = above_len;
+            }
+            else if (run_len >= 2)
+            {
+                op = TILE_OP_RUN;
+                length = run_len;
+            }
+        }
+
+        if (op == TILE_OP_LITERAL)
+        {
+            if (!literal_count)
+                literal_start = i;
+            ++literal_count;
+            ++i;
+            continue;
+        }
+
+        out = tile_codec_flush_literal(out, cur + literal_start, literal_count);
+        literal_count = 0;
+
+        out = tile_codec_put_op(out, op, length);
+        if (op == TILE_OP_RUN)
+        {
+            memcpy(out, &cur[i], 4);
+            out += 4;
+        }
+        i += length;
+    }
+    out = tile_codec_flush_literal(out, cur + literal_start, literal_count);
+
+    return (u32)(out - start);
+}
+
+function void tile_encode_rows(void *data, u32 begin, u32 end)
+{
+    TileEncodeJob *job = (TileEncodeJob*)data;
+    TileEncoder *encoder = job->encoder;
+    TilePixels *tile = (TilePixels*)malloc(sizeof(TilePixels));
+
+    for (u32 ty = begin; ty < end; ++ty)
+    {
+        for (u32 tx = 0; tx < encoder->tiles_x; ++tx)
+        {
+            u32 index = ty * encoder->tiles_x + tx;
+            u8 *out = encoder->scratch + (u64)index * TILE_CODEC_MAX_TILE_BYTES;
+            encoder->tile_sizes[index] = (u16)tile_encode(encoder, job->pixels, job->stride, tx, ty, out, tile);
+        }
+    }
+
+    free(tile);
+}
+
+function void tile_encoder_destroy(TileEncoder *encoder)
+{
+    free(encoder->previous);
+    free(encoder->scratch);
+    free(encoder->tile_sizes);
+    free(encoder->output);
+    encoder->previous = 0;
+    encoder->scratch = 0;
+    encoder->tile_sizes = 0;
+    encoder->output = 0;
+    encoder->tile_capacity = 0;
+    encoder->output_capacity = 0;
+    encoder->has_previous = false;
+}
+
+// Encode view into encoder->output / output_size. Returns false when out of memory.
+function bool tile_encoder_encode(TileEncoder *encoder, FrameView *view, bool force_keyframe)
+{
+    u32 interval = encoder->keyframe_interval ? encoder->keyframe_interval : 60;
+    bool resized = encoder->width != view->width || encoder->height != view->height;
+
+    if (resized || !encoder->previous)
+    {
+        free(encoder->previous);
+        encoder->width = view->width;
+        encoder->height = view->height;
+        encoder->tiles_x = tile_codec_tiles(view->width);
+        encoder->tiles_y = tile_codec_tiles(view->height);
+        encoder->previous = (u8*)malloc((u64)view->width * view->height * 4);
+        encoder->has_previous = false;
+    }
+
+    u64 tile_count = (u64)encoder->tiles_x * encoder->tiles_y;
+    if (encoder->tile_capacity < tile_count)
+    {
+        free(encoder->scratch);
+        free(encoder->tile_sizes);
+        encoder->scratch = (u8*)malloc(tile_count * TILE_CODEC_MAX_TILE_BYTES);
+        encoder->tile_sizes = (u16*)malloc(tile_count * sizeof(u16));
+        encoder->tile_capacity = tile_count;
+    }
+    if (!encoder->previous || !encoder->scratch || !encoder->tile_sizes)
+    {
+        printf("Error: out of memory in the tile encoder.\n");
+        tile_encoder_destroy(encoder);
+        return false;
+    }
+
+    encoder->keyframe = force_keyframe || !encoder->has_previous || encoder->frames_since_keyframe + 1 >= interval;
+    encoder->frames_since_keyframe = encoder->keyframe ? 0 : encoder->frames_since_keyframe + 1;
+
+    TileEncodeJob job = { encoder, view->pixels, view->stride };
+    parallel_for(encoder->queue, encoder->tiles_y, 1, tile_encode_rows, &job);
+    encoder->has_previous = true;
+
+    // gather: header, dirty bits, sizes, tiles
+    u32 dirty_count = 0;
+    u64 payload = 0;
+    for (u64 i = 0; i < tile_count; ++i)
+    {
+        if (encoder->tile_sizes[i])
+        {
+            ++dirty_count;
+            payload += encoder->tile_sizes[i];
+        }
+    }
+
+    u64 mask_bytes = (tile_count + 7) / 8;
+    u64 size = sizeof(TileCodecHeader) + mask_bytes + (u64)dirty_count * sizeof(u16) + payload;
+    if (encoder->output_capacity < size)
+    {
+        free(encoder->output);
+        encoder->output_capacity = size + size / 4;
+        encoder->output = (u8*)malloc(encoder->output_capacity);
+        if (!encoder->output)
+        {
+            printf("Error: out of memory in the tile encoder.\n");
+            tile_encoder_destroy(encoder);
+            return false;
+        }
+    }
+
+    TileCodecHeader *header = (TileCodecHeader*)encoder->output;
+    header->magic = TILE_CODEC_MAGIC;
+    header->version = TILE_CODEC_VERSION;
+    header->flags = encoder->keyframe ? TILE_CODEC_KEYFRAME : 0;
+    header->width = encoder->width;
+    header->height = encoder->height;
+    header->tile_size = TILE_CODEC_SIZE;
+    header->dirty_count = dirty_count;
+
+    u8 *mask = encoder->output + sizeof(TileCodecHeader);
+    u8 *sizes = mask + mask_bytes;
+    u8 *out = sizes + (u64)dirty_count * sizeof(u16);
+    memset(mask, 0, mask_bytes);
+    for (u64 i = 0; i < tile_count; ++i)
+    {
+        u16 tile_size = encoder->tile_sizes[i];
+        if (!tile_size)
+            continue;
+        mask[i / 8] |= (u8)(1 << (i % 8));
+        memcpy(sizes, &tile_size, sizeof(u16));
+        sizes += sizeof(u16);
+        memcpy(out, encoder->scratch + i * TILE_CODEC_MAX_TILE_BYTES, tile_size);
+        out += tile_size;
+    }
+
+    encoder->output_size = size;
+    return true;
+}
+
+//
+// NOTE: decoder
+//
+
+struct TileDecoder {
+    u32 width;
+    u32 height;
+    u8 *frame; // the last decoded frame, tightly packed
+    u64 frame_capacity;
+    bool valid; // frame holds a decoded frame to apply deltas to
+
+    u64 *tile_offsets; // per tile into the frame data, 0 = clean
+    u32 *tile_sizes;
+    u64 tile_capacity;
+
+    WorkQueue *queue;
+};
+
+struct TileDecodeJob {
+    TileDecoder *decoder;
+    u8 *data;
+    u32 tiles_x;
+    std::atomic<bool> failed;
+};
+
+function u8 *tile_codec_get_length(u8 *in, u8 *end, u32 *length)
+{
+    u32 n = in[0] & 63;
+    ++in;
+    if (n == 63)
+    {
+        u32 extra = 0, shift = 0;
+        while (in < end && shift < 28)
+        {
+            u8 byte = *in++;
+            extra |= (u32)(byte & 0x7F) << shift;
+            shift += 7;
+            if (!(byte & 0x80))
+                break;
+        }
+        n += extra;
+    }
+    *length = n + 1;
+    return in;
+}
+
+function bool tile_decode(TileDecoder *decoder, u8 *in, u8 *end, u32 tx, u32 ty)
+{
+    u32 x0 = tx * TILE_CODEC_SIZE, y0 = ty * TILE_CODEC_SIZE;
+    u32 tile_w = decoder->width - x0 < TILE_CODEC_SIZE ? decoder->width - x0 : TILE_CODEC_SIZE;
+    u32 tile_h = decoder->height - y0 < TILE_CODEC_SIZE ? decoder->height - y0 : TILE_CODEC_SIZE;
+    u32 count = tile_w * tile_h;
+    u32 stride = decoder->width;
+    u32 *base = (u32*)decoder->frame + (u64)y0 * stride + x0;
+
+    u32 i = 0, x = 0, y = 0;
+    while (in < end)
+    {
+        u32 op = in[0] >> 6, length;
+        in = tile_codec_get_length(in, end, &length);
+        if (length > count - i || (op == TILE_OP_ABOVE && i < tile_w))
+            return false;
+
+        u32 value = 0;
+        if (op == TILE_OP_RUN)
+        {
+            if (end - in < 4)
+                return false;
+            memcpy(&value, in, 4);
+            in += 4;
+        }
+        else if (op == TILE_OP_LITERAL && (u64)(end - in) < (u64)length * 4)
+        {
+            return false;
+        }
+
+        // ops run across the tile's rows, split them at the row ends
+        while (length)
+        {
+            u32 n = tile_w - x < length ? tile_w - x : length;
+            u32 *dst = base + (u64)y * stride + x;
+            switch (op)
+            {
+                case TILE_OP_PREVIOUS: break; // decoded in place over the previous frame
+                case TILE_OP_ABOVE: memcpy(dst, dst - stride, n * 4); break;
+                case TILE_OP_RUN: for (u32 k = 0; k < n; ++k) dst[k] = value; break;
+                case TILE_OP_LITERAL: memcpy(dst, in, n * 4); in += n * 4; break;
+            }
+            length -= n;
+            i += n;
+            x += n;
+            if (x == tile_w)
+            {
+                x = 0;
+                ++y;
+            }
+        }
+    }
+
+    return i == count;
+}
+
+function void tile_decode_rows(void *data, u32 begin, u32 end)
+{
+    TileDecodeJob *job = (TileDecodeJob*)data;
+    TileDecoder *decoder = job->decoder;
+
+    for (u32 ty = begin; ty < end; ++ty)
+    {
+        for (u32 tx = 0; tx < job->tiles_x; ++tx)
+        {
+            u32 index = ty * job->tiles_x + tx;
+            if (!decoder->tile_sizes[index])
+                continue;
+            u8 *in = job->data + decoder->tile_offsets[index];
+            if (!tile_decode(decoder, in, in + decoder->tile_sizes[index], tx, ty))
+                job->failed = true;
+        }
+    }
+}
+
+function void tile_decoder_destroy(TileDecoder *decoder)
+{
+    free(decoder->frame);
+    free(decoder->tile_offsets);
+    free(decoder->tile_sizes);
+    decoder->frame = 0;
+    decoder->tile_offsets = 0;
+    decoder->tile_sizes = 0;
+    decoder->frame_capacity = 0;
+    decoder->tile_capacity = 0;
+    decoder->valid = false;
+}
+
+function bool tile_codec_is_keyframe(u8 *data, u64 size)
+{
+    TileCodecHeader *header = (TileCodecHeader*)data;
+    return size >= sizeof(TileCodecHeader) && header->magic == TILE_CODEC_MAGIC && (header->flags & TILE_CODEC_KEYFRAME);
+}
+
+// Decode one encoded frame into decoder->frame (width * 4 stride). A delta
+// frame needs the frame before it decoded last; returns false for a delta
+// without one and for broken data, the decoder then waits for a keyframe.
+function bool tile_decoder_decode(TileDecoder *decoder, u8 *data, u64 size)
+{
+    TileCodecHeader *header = (TileCodecHeader*)data;
+    if (size < sizeof(TileCodecHeader) || header->magic != TILE_CODEC_MAGIC ||
+        header->version != TILE_CODEC_VERSION || header->tile_size != TILE_CODEC_SIZE)
+    {
+        printf("Error: not a tile codec frame.\n");
+        decoder->valid = false;
+        return false;
+    }
+
+    bool keyframe = (header->flags & TILE_CODEC_KEYFRAME) != 0;
+    if (!keyframe && (!decoder->valid || decoder->width != header->width || decoder->height != header->height))
+    {
+        decoder->valid = false;
+        return false;
+    }
+
+    u64 frame_size = (u64)header->width * header->height * 4;
+    u32 tiles_x = tile_codec_tiles(header->width);
+    u64 tile_count = (u64)tiles_x * tile_codec_tiles(header->height);
+    if (decoder->frame_capacity < frame_size)
+    {
+        free(decoder->frame);
+        decoder->frame = (u8*)malloc(frame_size);
+        decoder->frame_capacity = decoder->frame ? frame_size : 0;
+    }
+    if (decoder->tile_capacity < tile_count)
+    {
+        free(decoder->tile_offsets);
+        free(decoder->tile_sizes);
+        decoder->tile_offsets = (u64*)malloc(tile_count * sizeof(u64));
+        decoder->tile_sizes = (u32*)malloc(tile_count * sizeof(u32));
+        decoder->tile_capacity = tile_count;
+    }
+    if (!decoder->frame || !decoder->tile_offsets || !decoder->tile_sizes)
+    {
+        printf("Error: out of memory in the tile decoder.\n");
+        tile_decoder_destroy(decoder);
+        return false;
+    }
+    decoder->width = header->width;
+    decoder->height = header->height;
+    decoder->valid = false;
+
+    // tile offsets from the dirty bits and sizes
+    u64 mask_bytes = (tile_count + 7) / 8;
+    u64 offset = sizeof(TileCodecHeader) + mask_bytes + (u64)header->dirty_count * sizeof(u16);
+    if (offset > size)
+        return false;
+    u8 *mask = data + sizeof(TileCodecHeader);
+    u8 *sizes = mask + mask_bytes;
+    u32 dirty = 0;
+    for (u64 i = 0; i < tile_count; ++i)
+    {
+        decoder->tile_sizes[i] = 0;
+        if (!(mask[i / 8] & (1 << (i % 8))))
+            continue;
+        if (dirty == header->dirty_count)
+            return false;
+        u16 tile_size;
+        memcpy(&tile_size, sizes + dirty++ * sizeof(u16), sizeof(u16));
+        decoder->tile_offsets[i] = offset;
+        decoder->tile_sizes[i] = tile_size;
+        offset += tile_size;
+    }
+    if (offset > size || dirty != header->dirty_count || (keyframe && dirty != tile_count))
+        return false;
+
+    TileDecodeJob job;
+    job.decoder = decoder;
+    job.data = data;
+    job.tiles_x = tiles_x;
+    job.failed = false;
+    parallel_for(decoder->queue, tile_codec_tiles(header->height), 1, tile_decode_rows, &job);
+
+    decoder->valid = !job.failed;
+    return decoder->valid;
+}
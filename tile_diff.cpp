@@ -0,0 +1,219 @@
+/*
+
+  Tile diff
+  ---------
+  Splits the frame into TILE_DIFF_SIZE x TILE_DIFF_SIZE tiles and compares
+  each tile against a copy of the previous frame. The result is a list of
+  dirty rectangles (one per dirty tile) so the upload only has to send what
+  changed, and nothing at all when the frame is identical.
+
+  Only tiles that differ are copied into the previous-frame buffer, and a
+  tile stops comparing at its first differing row, so a static desktop costs
+  one read of the frame plus one read of the copy.
+
+  Bands of tiles are independent and compared in parallel when queue is
+  set, each band writes its dirty rectangles into its own part of the
+  list, which is compacted afterwards.
+
+ */
+
+#define TILE_DIFF_SIZE 64
+
+struct TileDiff {
+    u32 width;
+    u32 height;
+    u32 tiles_x;
+    u32 tiles_y;
+
+    u8 *previous; // last frame, tightly packed 4 bytes per pixel
+    u64 previous_size;
+    bool valid;   // previous holds a frame of width x height
+
+    FrameRect *dirty; // room for every tile, band ty starts at ty * tiles_x until compacted
+    u32 dirty_count;
+    u32 dirty_capacity;
+
+    u32 *band_dirty; // dirty tiles per band
+    u32 band_dirty_capacity;
+
+    WorkQueue *queue; // compare bands in parallel, may be 0
+};
+
+function void tile_diff_destroy(TileDiff *diff)
+{
+    free(diff->previous);
+    free(diff->dirty);
+    free(diff->band_dirty);
+    memset(diff, 0, sizeof(TileDiff));
+}
+
+// forget the previous frame, the next update reports everything dirty
+function void tile_diff_reset(TileDiff *diff)
+{
+    diff->valid = false;
+}
+
+function bool tile_rows_equal(u8 *a, u8 *b, u32 bytes)
+{
+    u32 i = 0;
+#if IMAGE_SSE2
+    for (; i + 64 <= bytes; i += 64)
+    {
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i +  0)), _mm_loadu_si128((__m128i*)(b + i +  0)));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 16)), _mm_loadu_si128((__m128i*)(b + i + 16)));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 32)), _mm_loadu_si128((__m128i*)(b + i + 32)));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 48)), _mm_loadu_si128((__m128i*)(b + i + 48)));
+        __m128i x = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+#endif
+    if (i < bytes)
+        return memcmp(a + i, b + i, bytes - i) == 0;
+    return true;
+}
+
+struct TileDiffJob {
+    TileDiff *diff;
+    u8 *pixels;
+    u32 stride;
+};
+
+// walk each band of tiles row by row so both frames are read sequentially,
+// a tile drops out of the compare at its first differing row
+function void tile_diff_bands(void *data, u32 begin, u32 end)
+{
+    TileDiffJob *job = (TileDiffJob*)data;
+    TileDiff *diff = job->diff;
+    u8 *pixels = job->pixels;
+    u32 stride = job->stride;
+    u32 width = diff->width;
+    u32 height = diff->height;
+    u32 row_bytes = width * 4;
+
+    // per tile column, the first row that differs
+    u32 *first_dirty_row = (u32*)malloc(diff->tiles_x * sizeof(u32));
+
+    for (u32 ty = begin; ty < end; ++ty)
+    {
+        u32 y0 = ty * TILE_DIFF_SIZE;
+        u32 tile_h = height - y0 < TILE_DIFF_SIZE ? height - y0 : TILE_DIFF_SIZE;
+        FrameRect *band = diff->dirty + (u64)ty * diff->tiles_x;
+        u32 band_dirty = 0;
+
+        u32 clean_tiles = diff->tiles_x;
+        for (u32 tx = 0; tx < diff->tiles_x; ++tx)
+            first_dirty_row[tx] = tile_h;
+
+        for (u32 row = 0; row < tile_h && clean_tiles; ++row)
+        {
+            u8 *cur = pixels + (u64)(y0 + row) * stride;
+            u8 *prev = diff->previous + (u64)(y0 + row) * row_bytes;
+
+            for (u32 tx = 0; tx < diff->tiles_x; ++tx)
+            {
+                if (first_dirty_row[tx] != tile_h)
+                    continue;
+
+                u32 x0 = tx * TILE_DIFF_SIZE;
+                u32 tile_w = width - x0 < TILE_DIFF_SIZE ? width - x0 : TILE_DIFF_SIZE;
+                if (!tile_rows_equal(cur + x0 * 4, prev + x0 * 4, tile_w * 4))
+                {
+                    first_dirty_row[tx] = row;
+                    --clean_tiles;
+                }
+            }
+        }
+
+        for (u32 tx = 0; tx < diff->tiles_x; ++tx)
+        {
+            if (first_dirty_row[tx] == tile_h)
+                continue;
+
+            u32 x0 = tx * TILE_DIFF_SIZE;
+            u32 tile_w = width - x0 < TILE_DIFF_SIZE ? width - x0 : TILE_DIFF_SIZE;
+
+            // rows above the first difference are already equal
+            for (u32 row = first_dirty_row[tx]; row < tile_h; ++row)
+            {
+                u8 *cur = pixels + (u64)(y0 + row) * stride + x0 * 4;
+                u8 *prev = diff->previous + (u64)(y0 + row) * row_bytes + x0 * 4;
+                memcpy(prev, cur, tile_w * 4);
+            }
+
+            FrameRect *rect = &band[band_dirty++];
+            rect->x = x0;
+            rect->y = y0;
+            rect->width = tile_w;
+            rect->height = tile_h;
+        }
+        diff->band_dirty[ty] = band_dirty;
+    }
+
+    free(first_dirty_row);
+}
+
+// Compare pixels (stride in bytes) against the previous frame and rebuild
+// the dirty list. Returns the number of dirty tiles. A size change or the
+// first frame marks the whole frame dirty as a single rectangle.
+function u32 tile_diff_update(TileDiff *diff, u8 *pixels, u32 width, u32 height, u32 stride)
+{
+    u32 row_bytes = width * 4;
+    u64 size = (u64)row_bytes * height;
+
+    diff->dirty_count = 0;
+
+    if (!diff->valid || diff->width != width || diff->height != height)
+    {
+        if (diff->previous_size < size)
+        {
+            free(diff->previous);
+            diff->previous = (u8*)malloc(size);
+            diff->previous_size = size;
+        }
+
+        diff->width = width;
+        diff->height = height;
+        diff->tiles_x = (width + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE;
+        diff->tiles_y = (height + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE;
+
+        u32 capacity = diff->tiles_x * diff->tiles_y;
+        if (diff->dirty_capacity < capacity)
+        {
+            free(diff->dirty);
+            diff->dirty = (FrameRect*)malloc(capacity * sizeof(FrameRect));
+            diff->dirty_capacity = capacity;
+        }
+
+        if (diff->band_dirty_capacity < diff->tiles_y)
+        {
+            free(diff->band_dirty);
+            diff->band_dirty = (u32*)malloc(diff->tiles_y * sizeof(u32));
+            diff->band_dirty_capacity = diff->tiles_y;
+        }
+
+        for (u32 y = 0; y < height; ++y)
+            memcpy(diff->previous + (u64)y * row_bytes, pixels + (u64)y * stride, row_bytes);
+        diff->valid = true;
+
+        FrameRect *rect = &diff->dirty[diff->dirty_count++];
+        rect->x = 0;
+        rect->y = 0;
+        rect->width = width;
+        rect->height = height;
+        return diff->tiles_x * diff->tiles_y;
+    }
+
+    TileDiffJob job = { diff, pixels, stride };
+    parallel_for(diff->queue, diff->tiles_y, 1, tile_diff_bands, &job);
+
+    // bands in order, each band's tiles left to right as before
+    for (u32 ty = 0; ty < diff->tiles_y; ++ty)
+    {
+        FrameRect *band = diff->dirty + (u64)ty * diff->tiles_x;
+        for (u32 i = 0; i < diff->band_dirty[ty]; ++i)
+            diff->dirty[diff->dirty_count++] = band[i];
+    }
+
+    return diff->dirty_count;
+}
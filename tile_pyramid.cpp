@@ -0,0 +1,488 @@
+/*
+
+  Tile pyramid
+  ------------
+  Images bigger than one texture (stitched multi monitor captures, 16K
+  composites) are viewed through a mip pyramid cut into fixed
+  TILE_SIZE x TILE_SIZE tiles. Level 0 is a top-down copy of the image,
+  every level above it half the size of the one below (2x2 box), up to
+  the first level that fits in one tile. Levels are built bottom up, the
+  tiles of a level in parallel. A frame with dirty rects (tile_diff.cpp)
+  only copies those and rebuilds the tiles above them; every tile has a
+  version so a cache can tell which of its copies went stale.
+
+  A TileView (zoom and the image point at the center of the window) picks
+  the level closest to screen resolution that is not coarser than it, and
+  the range of that level's tiles on screen.
+
+  A TileCache is the bookkeeping for a fixed number of tile slots (GPU
+  textures in opengl_tiles.cpp): a visible tile that is cached costs
+  nothing, a missing one takes the least recently used slot that is not
+  needed this frame, so memory stays bounded whatever the image size.
+
+  Nothing in this file may depend on Win32 or GL.
+
+ */
+
+#define TILE_SIZE 512
+#define TILE_BORDER 1 // neighbour pixels around a tile so linear filtering has no seams
+#define TILE_TEXELS (TILE_SIZE + 2 * TILE_BORDER)
+#define TILE_PYRAMID_MAX_LEVELS 16
+
+struct TilePyramid {
+    FrameView levels[TILE_PYRAMID_MAX_LEVELS]; // top-down, level 0 is the image
+    u32 level_count;
+    u32 tiles_x[TILE_PYRAMID_MAX_LEVELS];
+    u32 tiles_y[TILE_PYRAMID_MAX_LEVELS];
+    u32 first_tile[TILE_PYRAMID_MAX_LEVELS]; // of the level in versions
+    bool flip_vertical; // of the frames level 0 came from
+
+    u8 *memory;
+    u64 capacity;
+
+    u32 *versions; // per tile of every level, the generation it last changed in
+    u32 *rebuild;  // as many, the tiles of a level tile_pyramid_propagate rebuilds
+    u32 tile_count;
+    u32 tile_capacity;
+    u32 generation;
+
+    u64 builds;        // whole images
+    u64 updates;       // only dirty rects
+    u64 tiles_rebuilt; // above level 0
+};
+
+function u32 *tile_version(TilePyramid *pyramid, u32 level, u32 x, u32 y)
+{
+    return &pyramid->versions[pyramid->first_tile[level] + y * pyramid->tiles_x[level] + x];
+}
+
+// pixels of a tile of a level, the last row and column of tiles may be smaller
+function FrameRect tile_rect(TilePyramid *pyramid, u32 level, u32 x, u32 y)
+{
+    FrameRect rect = { x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE };
+    return frame_rect_clip(rect, pyramid->levels[level].width, pyramid->levels[level].height);
+}
+
+// level sizes, memory and tile grids for an image; false when out of memory
+function bool tile_pyramid_layout(TilePyramid *pyramid, u32 width, u32 height, PixelFormat format)
+{
+    u64 size = 0;
+    u32 tiles = 0;
+    u32 count = 0;
+    u64 offsets[TILE_PYRAMID_MAX_LEVELS];
+    for (;;)
+    {
+        offsets[count] = size;
+        pyramid->levels[count] = frame_view(0, width, height, width * 4, format);
+        pyramid->tiles_x[count] = (width + TILE_SIZE - 1) / TILE_SIZE;
+        pyramid->tiles_y[count] = (height + TILE_SIZE - 1) / TILE_SIZE;
+        pyramid->first_tile[count] = tiles;
+        size += (u64)width * height * 4;
+        tiles += pyramid->tiles_x[count] * pyramid->tiles_y[count];
+        ++count;
+
+        // a 20000x3 strip stops at one row, its top level is several tiles wide
+        if ((width <= TILE_SIZE && height <= TILE_SIZE) || width < 2 || height < 2 || count == TILE_PYRAMID_MAX_LEVELS)
+            break;
+        width /= 2;
+        height /= 2;
+    }
+    pyramid->level_count = count;
+
+    if (pyramid->capacity < size)
+    {
+        free(pyramid->memory);
+        pyramid->memory = (u8*)malloc(size);
+        pyramid->capacity = pyramid->memory ? size : 0;
+        if (!pyramid->memory)
+        {
+            printf("Error: out of memory for a %.1f MB tile pyramid.\n", size / (1024.0 * 1024.0));
+            pyramid->level_count = 0;
+            return false;
+        }
+    }
+    if (pyramid->tile_capacity < tiles)
+    {
+        free(pyramid->versions);
+        free(pyramid->rebuild);
+        pyramid->versions = (u32*)malloc((u64)tiles * sizeof(u32));
+        pyramid->rebuild = (u32*)malloc((u64)tiles * sizeof(u32));
+        pyramid->tile_capacity = pyramid->versions && pyramid->rebuild ? tiles : 0;
+        if (!pyramid->tile_capacity)
+        {
+            printf("Error: out of memory for the %u tiles of a tile pyramid.\n", tiles);
+            pyramid->level_count = 0;
+            return false;
+        }
+    }
+    pyramid->tile_count = tiles;
+    for (u32 i = 0; i < count; ++i)
+        pyramid->levels[i].pixels = pyramid->memory + offsets[i];
+    return true;
+}
+
+function void tile_pyramid_destroy(TilePyramid *pyramid)
+{
+    free(pyramid->memory);
+    free(pyramid->versions);
+    free(pyramid->rebuild);
+    memset(pyramid, 0, sizeof(TilePyramid));
+}
+
+struct TilePyramidJob {
+    TilePyramid *pyramid;
+    u32 level;
+    u32 *tiles; // x | y << 16 of the tiles to rebuild
+};
+
+function void tile_pyramid_tiles(void *data, u32 begin, u32 end)
+{
+    TilePyramidJob *job = (TilePyramidJob*)data;
+    TilePyramid *pyramid = job->pyramid;
+    FrameView *below = &pyramid->levels[job->level - 1];
+    for (u32 i = begin; i < end; ++i)
+    {
+        FrameRect rect = tile_rect(pyramid, job->level, job->tiles[i] & 0xFFFF, job->tiles[i] >> 16);
+        FrameRect source = { rect.x * 2, rect.y * 2, rect.width * 2, rect.height * 2 };
+        FrameView dst = frame_view_sub(pyramid->levels[job->level], rect);
+        FrameView src = frame_view_sub(*below, source);
+        downscale_area(&dst, &src, 2, 0);
+    }
+}
+
+// rebuild every tile above level 0 that covers a tile of the generation below it
+function void tile_pyramid_propagate(TilePyramid *pyramid, WorkQueue *queue)
+{
+    u32 generation = pyramid->generation;
+    u32 *tiles = pyramid->rebuild;
+    for (u32 level = 1; level < pyramid->level_count; ++level)
+    {
+        // a tile is made of at most the 2x2 tiles below it
+        u32 count = 0;
+        for (u32 y = 0; y < pyramid->tiles_y[level]; ++y)
+        {
+            for (u32 x = 0; x < pyramid->tiles_x[level]; ++x)
+            {
+                bool dirty = false;
+                for (u32 k = 0; k < 4 && !dirty; ++k)
+                {
+                    u32 cx = x * 2 + (k & 1), cy = y * 2 + (k >> 1);
+                    if (cx < pyramid->tiles_x[level - 1] && cy < pyramid->tiles_y[level - 1])
+                        dirty = *tile_version(pyramid, level - 1, cx, cy) == generation;
+                }
+                if (dirty)
+                {
+                    *tile_version(pyramid, level, x, y) = generation;
+                    tiles[count++] = x | (y << 16);
+                }
+            }
+        }
+
+        TilePyramidJob job = { pyramid, level, tiles };
+        parallel_for(queue, count, 1, tile_pyramid_tiles, &job);
+        pyramid->tiles_rebuilt += count;
+    }
+}
+
+// Take a new image. Rows are flipped to top-down unless flip_vertical says
+// they already are. With rects (in the frame's rows) only those changed
+// since the last call with the same size, else the whole image is copied.
+function bool tile_pyramid_update(TilePyramid *pyramid, FrameView *view, bool flip_vertical,
+                                  FrameRect *rects, u32 rect_count, WorkQueue *queue)
+{
+    FrameView *image = &pyramid->levels[0];
+    bool same = pyramid->level_count && image->width == view->width && image->height == view->height &&
+        image->format == view->format && pyramid->flip_vertical == flip_vertical;
+    u64 dirty_pixels = 0;
+    for (u32 i = 0; i < rect_count; ++i)
+        dirty_pixels += (u64)rects[i].width * rects[i].height;
+
+    ++pyramid->generation;
+    u32 generation = pyramid->generation;
+
+    // most of the image changed, one parallel copy beats many small ones
+    if (!same || !rects || dirty_pixels * 2 > (u64)view->width * view->height)
+    {
+        if (!same && !tile_pyramid_layout(pyramid, view->width, view->height, view->format))
+            return false;
+        frame_view_copy_parallel(image, view, flip_vertical ? 0 : CONVERT_FLIP_Y, queue);
+        pyramid->flip_vertical = flip_vertical;
+        for (u32 i = 0; i < pyramid->tiles_x[0] * pyramid->tiles_y[0]; ++i)
+            pyramid->versions[i] = generation;
+        pyramid->builds++;
+    }
+    else
+    {
+        for (u32 i = 0; i < rect_count; ++i)
+        {
+            FrameRect rect = frame_rect_clip(rects[i], view->width, view->height);
+            if (!rect.width || !rect.height)
+                continue;
+            FrameView src = frame_view_sub(*view, rect);
+            if (!flip_vertical)
+                rect.y = view->height - rect.y - rect.height;
+            FrameView dst = frame_view_sub(*image, rect);
+            frame_view_copy(&dst, &src, flip_vertical ? 0 : CONVERT_FLIP_Y);
+
+            for (u32 y = rect.y / TILE_SIZE; y <= (rect.y + rect.height - 1) / TILE_SIZE; ++y)
+            {
+                for (u32 x = rect.x / TILE_SIZE; x <= (rect.x + rect.width - 1) / TILE_SIZE; ++x)
+                    *tile_version(pyramid, 0, x, y) = generation;
+            }
+        }
+        pyramid->updates++;
+    }
+
+    tile_pyramid_propagate(pyramid, queue);
+    return true;
+}
+
+// A tile with TILE_BORDER pixels of its neighbours around it (its own edge
+// pixels repeated at the image border) into dst, at least TILE_TEXELS
+// square. Returns the tile's rect in its level.
+function FrameRect tile_pyramid_read(TilePyramid *pyramid, u32 level, u32 x, u32 y, FrameView *dst)
+{
+    FrameView *src = &pyramid->levels[level];
+    FrameRect rect = tile_rect(pyramid, level, x, y);
+
+    // columns of the level that are there, the rest is the edge repeated
+    s32 first = (s32)rect.x - TILE_BORDER, last = (s32)(rect.x + rect.width) + TILE_BORDER; // [first, last)
+    u32 left = first < 0 ? (u32)-first : 0;
+    u32 right = last > (s32)src->width ? (u32)(last - (s32)src->width) : 0;
+    u32 inner = (u32)(last - first) - left - right;
+
+    for (s32 r = -TILE_BORDER; r < (s32)rect.height + TILE_BORDER; ++r)
+    {
+        s32 row = (s32)rect.y + r;
+        row = row < 0 ? 0 : (row >= (s32)src->height ? (s32)src->height - 1 : row);
+        u32 *in = (u32*)(src->pixels + (u64)row * src->stride) + first + left;
+        u32 *out = (u32*)(dst->pixels + (u64)(r + TILE_BORDER) * dst->stride);
+        for (u32 i = 0; i < left; ++i)
+            out[i] = in[0];
+        memcpy(out + left, in, (u64)inner * 4);
+        for (u32 i = 0; i < right; ++i)
+            out[left + inner + i] = in[inner - 1];
+    }
+    return rect;
+}
+
+//
+// NOTE: view
+//
+
+struct TileView {
+    double zoom;     // screen pixels per image pixel, 0 = fit the image on the next draw
+    double center_x; // image point (level 0 pixels, top-down) at the center of the window
+    double center_y;
+    u32 width;       // window size
+    u32 height;
+};
+
+function void tile_view_fit(TileView *view, TilePyramid *pyramid)
+{
+    FrameView *image = &pyramid->levels[0];
+    if (!view->width || !view->height || !pyramid->level_count)
+        return;
+    double zoom_x = (double)view->width / image->width;
+    double zoom_y = (double)view->height / image->height;
+    view->zoom = zoom_x < zoom_y ? zoom_x : zoom_y;
+    view->center_x = image->width * 0.5;
+    view->center_y = image->height * 0.5;
+}
+
+// keep the center inside the image and the zoom between a pixel per screen and 32 screens per pixel
+function void tile_view_clamp(TileView *view, TilePyramid *pyramid)
+{
+    FrameView *image = &pyramid->levels[0];
+    if (!pyramid->level_count)
+        return;
+    double min_zoom = 1.0 / ((u64)image->width > image->height ? image->width : image->height);
+    view->zoom = view->zoom < min_zoom ? min_zoom : (view->zoom > 32.0 ? 32.0 : view->zoom);
+    view->center_x = view->center_x < 0 ? 0 : (view->center_x > image->width ? image->width : view->center_x);
+    view->center_y = view->center_y < 0 ? 0 : (view->center_y > image->height ? image->height : view->center_y);
+}
+
+// zoom by factor keeping the image point under window pixel x, y where it is
+function void tile_view_zoom(TileView *view, TilePyramid *pyramid, double factor, double x, double y)
+{
+    if (view->zoom <= 0)
+        tile_view_fit(view, pyramid);
+    double image_x = view->center_x + (x - view->width * 0.5) / view->zoom;
+    double image_y = view->center_y + (y - view->height * 0.5) / view->zoom;
+    view->zoom *= factor;
+    tile_view_clamp(view, pyramid);
+    view->center_x = image_x - (x - view->width * 0.5) / view->zoom;
+    view->center_y = image_y - (y - view->height * 0.5) / view->zoom;
+    tile_view_clamp(view, pyramid);
+}
+
+// move the image by dx, dy window pixels (a mouse drag)
+function void tile_view_pan(TileView *view, TilePyramid *pyramid, double dx, double dy)
+{
+    if (view->zoom <= 0)
+        tile_view_fit(view, pyramid);
+    view->center_x -= dx / view->zoom;
+    view->center_y -= dy / view->zoom;
+    tile_view_clamp(view, pyramid);
+}
+
+// the coarsest level that still has at least one pixel per screen pixel
+// (give or take the one a halving of an odd size dropped)
+function u32 tile_view_level(TileView *view, TilePyramid *pyramid)
+{
+    u32 level = 0;
+    while (level + 1 < pyramid->level_count &&
+           (double)pyramid->levels[level + 1].width + 1 >= view->zoom * pyramid->levels[0].width)
+        ++level;
+    return level;
+}
+
+// level pixels per image pixel, not exactly a power of two when a size was odd
+function void tile_view_level_scale(TilePyramid *pyramid, u32 level, double *scale_x, double *scale_y)
+{
+    *scale_x = (double)pyramid->levels[level].width / pyramid->levels[0].width;
+    *scale_y = (double)pyramid->levels[level].height / pyramid->levels[0].height;
+}
+
+// the tiles of level inside the window, as a rect of tile coordinates
+function FrameRect tile_view_visible(TileView *view, TilePyramid *pyramid, u32 level)
+{
+    FrameRect tiles = {};
+    FrameView *image = &pyramid->levels[level];
+    double scale_x, scale_y;
+    tile_view_level_scale(pyramid, level, &scale_x, &scale_y);
+
+    double x0 = (view->center_x - view->width * 0.5 / view->zoom) * scale_x;
+    double y0 = (view->center_y - view->height * 0.5 / view->zoom) * scale_y;
+    double x1 = (view->center_x + view->width * 0.5 / view->zoom) * scale_x;
+    double y1 = (view->center_y + view->height * 0.5 / view->zoom) * scale_y;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > image->width ? image->width : x1;
+    y1 = y1 > image->height ? image->height : y1;
+    if (x1 <= x0 || y1 <= y0)
+        return tiles;
+
+    tiles.x = (u32)(x0 / TILE_SIZE);
+    tiles.y = (u32)(y0 / TILE_SIZE);
+    tiles.width = (u32)ceil(x1 / TILE_SIZE) - tiles.x;
+    tiles.height = (u32)ceil(y1 / TILE_SIZE) - tiles.y;
+    return tiles;
+}
+
+// where a tile's pixels land in the window: x0, y0, x1, y1 in window pixels, top-down
+function void tile_view_place(TileView *view, TilePyramid *pyramid, u32 level, FrameRect rect, float *place)
+{
+    double scale_x, scale_y;
+    tile_view_level_scale(pyramid, level, &scale_x, &scale_y);
+    place[0] = (float)((rect.x / scale_x - view->center_x) * view->zoom + view->width * 0.5);
+    place[1] = (float)((rect.y / scale_y - view->center_y) * view->zoom + view->height * 0.5);
+    place[2] = (float)(((rect.x + rect.width) / scale_x - view->center_x) * view->zoom + view->width * 0.5);
+    place[3] = (float)(((rect.y + rect.height) / scale_y - view->center_y) * view->zoom + view->height * 0.5);
+}
+
+//
+// NOTE: cache
+//
+
+struct TileCacheSlot {
+    u64 key;     // tile_key, 0 = empty
+    u32 version; // of the pixels in the slot, 0 until filled
+    u64 used;    // frame the slot was last needed in
+};
+
+// A few hundred slots at most and a few dozen tiles a frame, the lookups
+// are linear scans.
+struct TileCache {
+    TileCacheSlot *slots;
+    u32 capacity;
+    u64 frame;
+
+    u64 hits;
+    u64 fills;
+    u64 evictions;
+};
+
+function u64 tile_key(u32 level, u32 x, u32 y)
+{
+    return ((u64)(level + 1) << 48) | ((u64)y << 24) | x;
+}
+
+function void tile_cache_init(TileCache *cache, u32 capacity)
+{
+    memset(cache, 0, sizeof(TileCache));
+    cache->slots = (TileCacheSlot*)calloc(capacity, sizeof(TileCacheSlot));
+    cache->capacity = cache->slots ? capacity : 0;
+}
+
+function void tile_cache_destroy(TileCache *cache)
+{
+    free(cache->slots);
+    memset(cache, 0, sizeof(TileCache));
+}
+
+// forget every tile (a new image), the slots stay
+function void tile_cache_clear(TileCache *cache)
+{
+    for (u32 i = 0; i < cache->capacity; ++i)
+        cache->slots[i].key = 0;
+}
+
+// slots used in the frame before stay used until they are needed again
+function void tile_cache_begin_frame(TileCache *cache)
+{
+    cache->frame++;
+}
+
+// the slot holding version of a tile, kept for this frame; -1 if it is not cached
+function s32 tile_cache_lookup(TileCache *cache, u64 key, u32 version)
+{
+    for (u32 i = 0; i < cache->capacity; ++i)
+    {
+        TileCacheSlot *slot = &cache->slots[i];
+        if (slot->key == key && slot->version == version)
+        {
+            slot->used = cache->frame;
+            cache->hits++;
+            return (s32)i;
+        }
+    }
+    return -1;
+}
+
+// A slot to fill with a tile: its stale copy, an empty slot or the least
+// recently used one not needed this frame. -1 when all are needed.
+function s32 tile_cache_claim(TileCache *cache, u64 key)
+{
+    s32 best = -1;
+    for (u32 i = 0; i < cache->capacity; ++i)
+    {
+        TileCacheSlot *slot = &cache->slots[i];
+        if (slot->key == key)
+        {
+            best = (s32)i;
+            break;
+        }
+        if (slot->used == cache->frame && slot->key)
+            continue;
+        if (best < 0 || !slot->key || (cache->slots[best].key && slot->used < cache->slots[best].used))
+            best = (s32)i;
+    }
+    if (best < 0)
+        return -1;
+
+    TileCacheSlot *slot = &cache->slots[best];
+    if (slot->key && slot->key != key)
+        cache->evictions++;
+    slot->key = key;
+    slot->version = 0;
+    slot->used = cache->frame;
+    return best;
+}
+
+// the slot now holds version of its tile
+function void tile_cache_fill(TileCache *cache, s32 slot, u32 version)
+{
+    cache->slots[slot].version = version;
+    cache->fills++;
+}
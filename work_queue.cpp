@@ -0,0 +1,455 @@
+/*
+
+  Work queue
+  ----------
+  A fixed set of worker threads shared by every kernel and pipeline stage,
+  so features split their work across cores instead of each starting
+  threads of its own.
+
+  A job runs a WorkProc over [0, count) in [begin, end) chunks of grain
+  (usually rows). Its chunks go onto the deque of the thread that
+  submitted it: every worker has one, all other threads share one. A
+  thread runs chunks from the back of its own deque and, when that is
+  empty, steals from the front of the others. Waiting for a job runs
+  chunks of any job in the meantime, so a chunk may run a parallel_for of
+  its own and the capture and render threads can both have jobs in
+  flight.
+
+  work_submit starts a job without waiting for it and may name up to
+  WORK_JOB_MAX_AFTER jobs that have to finish first; its chunks are only
+  queued once they have. parallel_for is submit + wait. Every job records
+  when it was submitted, queued, started and finished, on how many
+  threads it ran and how many of its chunks were stolen; the queue sums
+  them up in WorkQueueStats.
+
+  Kernels take a WorkQueue pointer and run single-threaded when it is 0.
+
+ */
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#define WORK_QUEUE_MAX_THREADS 64
+#define WORK_DEQUE_SIZE 1024 // chunks per deque, power of two
+#define WORK_JOB_MAX_AFTER 4  // prerequisites of one job
+
+typedef void WorkProc(void *data, u32 begin, u32 end);
+
+struct WorkJob;
+
+// a job waiting for another, lives in the waiting job
+struct WorkJobLink {
+    WorkJob *job;
+    WorkJobLink *next;
+};
+
+// Owned by the caller (parallel_for keeps it on the stack), must stay
+// alive until work_wait returned for it.
+struct WorkJob {
+    WorkProc *proc;
+    void *data;
+    u32 count;
+    u32 grain;
+    u32 chunk_count;
+
+    std::atomic<u32> chunks_done;
+    std::atomic<u32> waiting_for; // prerequisites not done yet, +1 while submitting
+    std::atomic<bool> done;       // work_wait may return, nobody touches the job after
+
+    // under the queue's mutex
+    bool finished;
+    WorkJobLink *dependents;
+    WorkJobLink links[WORK_JOB_MAX_AFTER];
+
+    // stats, platform_time_ns
+    u64 submit_ns;
+    u64 queued_ns; // prerequisites done, chunks on a deque
+    std::atomic<u64> start_ns; // first chunk started
+    u64 end_ns;                // last chunk finished
+    std::atomic<u32> stolen;   // chunks run by another thread than the one that queued them
+    std::atomic<u64> thread_mask; // deques of the threads that ran chunks
+};
+
+struct WorkTask {
+    WorkJob *job;
+    u32 chunk;
+};
+
+// one thread's chunks: the owner pushes and pops at the back, thieves take
+// from the front; front and back run freely, index & (WORK_DEQUE_SIZE - 1)
+struct WorkDeque {
+    std::mutex mutex;
+    WorkTask tasks[WORK_DEQUE_SIZE];
+    std::atomic<u32> front;
+    std::atomic<u32> back;
+};
+
+struct WorkQueueStats {
+    std::atomic<u64> jobs;
+    std::atomic<u64> chunks;
+    std::atomic<u64> stolen;
+    std::atomic<u64> busy_ns; // in chunks, summed over all threads
+};
+
+struct WorkQueue;
+
+struct WorkWorker {
+    WorkQueue *queue;
+    u32 index; // its deque
+};
+
+struct WorkQueue {
+    PlatformThread threads[WORK_QUEUE_MAX_THREADS];
+    WorkWorker workers[WORK_QUEUE_MAX_THREADS];
+    u32 thread_count;
+
+    WorkDeque *deques;       // thread_count for the workers, then the shared one
+    std::atomic<u32> queued; // chunks on all deques
+
+    std::mutex mutex; // sleeping workers, job dependencies
+    std::condition_variable wake;
+    bool quit;
+
+    WorkQueueStats stats;
+};
+
+static thread_local WorkQueue *work_current_queue; // the queue this thread is a worker of
+static thread_local u32 work_current_index;
+
+// the deque the calling thread pushes to and pops from first
+function u32 work_queue_home(WorkQueue *queue)
+{
+    return work_current_queue == queue ? work_current_index : queue->thread_count;
+}
+
+function bool work_deque_push(WorkDeque *deque, WorkTask task)
+{
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    u32 back = deque->back.load(std::memory_order_relaxed);
+    if (back - deque->front.load(std::memory_order_relaxed) == WORK_DEQUE_SIZE)
+        return false;
+    deque->tasks[back & (WORK_DEQUE_SIZE - 1)] = task;
+    deque->back.store(back + 1, std::memory_order_relaxed);
+    return true;
+}
+
+// the newest chunk for the owner, the oldest for a thief
+function bool work_deque_pop(WorkDeque *deque, WorkTask *task, bool steal)
+{
+    if (deque->front.load(std::memory_order_relaxed) == deque->back.load(std::memory_order_relaxed))
+        return false;
+
+    std::lock_guard<std::mutex> lock(deque->mutex);
+    u32 front = deque->front.load(std::memory_order_relaxed);
+    u32 back = deque->back.load(std::memory_order_relaxed);
+    if (front == back)
+        return false;
+    if (steal)
+    {
+        *task = deque->tasks[front & (WORK_DEQUE_SIZE - 1)];
+        deque->front.store(front + 1, std::memory_order_relaxed);
+    }
+    else
+    {
+        *task = deque->tasks[(back - 1) & (WORK_DEQUE_SIZE - 1)];
+        deque->back.store(back - 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+function void work_task_run(WorkQueue *queue, WorkTask task, bool stolen);
+function void work_job_finish(WorkQueue *queue, WorkJob *job);
+
+// the last prerequisite is done (or there were none): queue the chunks on
+// the calling thread's deque and wake the workers
+function void work_job_release(WorkQueue *queue, WorkJob *job)
+{
+    if (job->waiting_for.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    job->queued_ns = platform_time_ns();
+    if (!job->chunk_count)
+    {
+        // nothing to run, only something to wait for
+        work_job_finish(queue, job);
+        return;
+    }
+
+    WorkDeque *deque = &queue->deques[work_queue_home(queue)];
+    u32 pushed = 0;
+    // last chunk first, the owner pops from the back and starts at the top rows
+    for (u32 i = job->chunk_count; i-- > 0;)
+    {
+        WorkTask task = { job, i };
+        if (work_deque_push(deque, task))
+            ++pushed;
+        else
+            work_task_run(queue, task, false); // deque full, run it right here
+    }
+
+    if (pushed)
+    {
+        queue->queued.fetch_add(pushed);
+        // taking the lock orders this against a worker checking queued before it sleeps
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+        }
+        queue->wake.notify_all();
+    }
+}
+
+// after the last chunk: let work_wait return, then release the jobs
+// waiting for this one (job may be gone by then, the links are theirs)
+function void work_job_finish(WorkQueue *queue, WorkJob *job)
+{
+    job->end_ns = platform_time_ns();
+    if (!job->start_ns.load(std::memory_order_relaxed))
+        job->start_ns.store(job->end_ns, std::memory_order_relaxed);
+
+    WorkJobLink *link;
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        job->finished = true;
+        link = job->dependents;
+    }
+
+    WorkQueueStats *stats = &queue->stats;
+    stats->jobs.fetch_add(1, std::memory_order_relaxed);
+    stats->chunks.fetch_add(job->chunk_count, std::memory_order_relaxed);
+    stats->stolen.fetch_add(job->stolen.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    job->done.store(true, std::memory_order_release);
+
+    while (link)
+    {
+        // the link lives in the dependent, which may be done and gone once released
+        WorkJobLink *next = link->next;
+        work_job_release(queue, link->job);
+        link = next;
+    }
+}
+
+function void work_task_run(WorkQueue *queue, WorkTask task, bool stolen)
+{
+    WorkJob *job = task.job;
+    u32 begin = task.chunk * job->grain;
+    u32 end = job->count - begin > job->grain ? begin + job->grain : job->count;
+
+    job->thread_mask.fetch_or(1ull << work_queue_home(queue), std::memory_order_relaxed);
+    if (stolen)
+        job->stolen.fetch_add(1, std::memory_order_relaxed);
+
+    u64 zone = profile_begin(PROFILE_WORK);
+    u64 not_started = 0;
+    job->start_ns.compare_exchange_strong(not_started, zone, std::memory_order_relaxed);
+    job->proc(job->data, begin, end);
+    double seconds = profile_end(PROFILE_WORK, zone);
+    queue->stats.busy_ns.fetch_add((u64)(seconds * 1e9), std::memory_order_relaxed);
+
+    // only the thread finishing the last chunk may touch job after the add
+    u32 chunk_count = job->chunk_count;
+    if (job->chunks_done.fetch_add(1, std::memory_order_acq_rel) + 1 == chunk_count)
+        work_job_finish(queue, job);
+}
+
+// run one chunk: the calling thread's newest, else one stolen from the
+// next deque that has any. False when there was nothing to run.
+function bool work_queue_run_one(WorkQueue *queue)
+{
+    if (!queue->queued.load(std::memory_order_relaxed))
+        return false;
+
+    u32 home = work_queue_home(queue);
+    u32 deque_count = queue->thread_count + 1;
+    for (u32 i = 0; i < deque_count; ++i)
+    {
+        u32 victim = (home + i) % deque_count;
+        WorkTask task;
+        if (work_deque_pop(&queue->deques[victim], &task, i != 0))
+        {
+            queue->queued.fetch_sub(1, std::memory_order_relaxed);
+            work_task_run(queue, task, i != 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+function void work_queue_thread_proc(void *data)
+{
+    WorkWorker *worker = (WorkWorker*)data;
+    WorkQueue *queue = worker->queue;
+    work_current_queue = queue;
+    work_current_index = worker->index;
+
+    profile_thread_name("worker");
+
+    while (true)
+    {
+        if (work_queue_run_one(queue))
+            continue;
+
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        queue->wake.wait(lock, [&] { return queue->quit || queue->queued.load() > 0; });
+        if (queue->quit)
+            return;
+    }
+}
+
+// thread_count 0 = one per core, the calling thread counts as one of them
+function void work_queue_init(WorkQueue *queue, u32 thread_count)
+{
+    if (thread_count == 0)
+        thread_count = platform_cpu_count();
+    if (thread_count > WORK_QUEUE_MAX_THREADS)
+        thread_count = WORK_QUEUE_MAX_THREADS;
+
+    queue->thread_count = thread_count - 1;
+    queue->deques = new WorkDeque[thread_count];
+    for (u32 i = 0; i < thread_count; ++i)
+    {
+        queue->deques[i].front.store(0);
+        queue->deques[i].back.store(0);
+    }
+    queue->queued.store(0);
+    queue->quit = false;
+    queue->stats.jobs.store(0);
+    queue->stats.chunks.store(0);
+    queue->stats.stolen.store(0);
+    queue->stats.busy_ns.store(0);
+    for (u32 i = 0; i < queue->thread_count; ++i)
+    {
+        queue->workers[i].queue = queue;
+        queue->workers[i].index = i;
+        platform_thread_start(&queue->threads[i], work_queue_thread_proc, &queue->workers[i]);
+    }
+}
+
+// once nothing is submitted any more
+function void work_queue_destroy(WorkQueue *queue)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->quit = true;
+    }
+    queue->wake.notify_all();
+
+    for (u32 i = 0; i < queue->thread_count; ++i)
+        platform_thread_join(&queue->threads[i]);
+    queue->thread_count = 0;
+    delete[] queue->deques;
+    queue->deques = 0;
+}
+
+// Start proc over [0, count) in chunks of grain and return right away.
+// The chunks are queued once every job in after (0 entries are skipped)
+// is done; those must not have been waited for and gone out of scope.
+// With queue 0 the job runs right here.
+function void work_submit(WorkQueue *queue, WorkJob *job, u32 count, u32 grain, WorkProc *proc, void *data,
+                          WorkJob **after = 0, u32 after_count = 0)
+{
+    if (grain == 0)
+        grain = 1;
+    Assert(after_count <= WORK_JOB_MAX_AFTER);
+
+    job->proc = proc;
+    job->data = data;
+    job->count = count;
+    job->grain = grain;
+    job->chunk_count = (u32)(((u64)count + grain - 1) / grain);
+    job->chunks_done.store(0);
+    job->done.store(false);
+    job->finished = false;
+    job->dependents = 0;
+    job->submit_ns = platform_time_ns();
+    job->queued_ns = 0;
+    job->start_ns.store(0);
+    job->end_ns = 0;
+    job->stolen.store(0);
+    job->thread_mask.store(0);
+
+    if (!queue)
+    {
+        job->queued_ns = job->submit_ns;
+        job->start_ns.store(job->submit_ns);
+        if (count)
+            proc(data, 0, count);
+        job->end_ns = platform_time_ns();
+        job->done.store(true);
+        return;
+    }
+
+    job->waiting_for.store(after_count + 1);
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        for (u32 i = 0; i < after_count; ++i)
+        {
+            WorkJob *before = after[i];
+            if (!before || before->finished)
+            {
+                job->waiting_for.fetch_sub(1);
+                continue;
+            }
+            WorkJobLink *link = &job->links[i];
+            link->job = job;
+            link->next = before->dependents;
+            before->dependents = link;
+        }
+    }
+    work_job_release(queue, job);
+}
+
+// Wait until job is done, running queued chunks (of any job) meanwhile.
+function void work_wait(WorkQueue *queue, WorkJob *job)
+{
+    while (!job->done.load(std::memory_order_acquire))
+    {
+        if (!queue || !work_queue_run_one(queue))
+            std::this_thread::yield();
+    }
+}
+
+// Run proc over [0, count) in chunks of grain and wait for all of them.
+// Runs inline when queue is 0 or has no workers.
+function void parallel_for(WorkQueue *queue, u32 count, u32 grain, WorkProc *proc, void *data)
+{
+    if (count == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    if (!queue || queue->thread_count == 0 || count <= grain)
+    {
+        proc(data, 0, count);
+        return;
+    }
+
+    WorkJob job;
+    work_submit(queue, &job, count, grain, proc, data);
+    work_wait(queue, &job);
+}
+
+// rows per chunk so every thread gets a few bands to balance
+function u32 parallel_row_grain(WorkQueue *queue, u32 rows)
+{
+    u32 threads = queue ? queue->thread_count + 1 : 1;
+    u32 grain = rows / (threads * 4);
+    return grain < 16 ? 16 : grain;
+}
+
+// threads a finished job ran on, every thread outside the queue counts as one
+function u32 work_job_threads(WorkJob *job)
+{
+    u32 threads = 0;
+    for (u64 mask = job->thread_mask.load(std::memory_order_relaxed); mask; mask &= mask - 1)
+        ++threads;
+    return threads;
+}
+
+function void work_queue_reset_stats(WorkQueue *queue)
+{
+    queue->stats.jobs.store(0);
+    queue->stats.chunks.store(0);
+    queue->stats.stolen.store(0);
+    queue->stats.busy_ns.store(0);
+}